@@ -24,5 +24,7 @@ $LIONSOS/ci/webserver.sh $LIONSOS $MICROKIT_SDK
 # $LIONSOS/ci/vmm.sh $LIONSOS $MICROKIT_SDK
 $LIONSOS/ci/fileio.sh $LIONSOS $MICROKIT_SDK
 $LIONSOS/ci/firewall.sh $LIONSOS $MICROKIT_SDK
+$LIONSOS/ci/firewall_bench.sh $LIONSOS
+$LIONSOS/ci/firewall_checksum.sh $LIONSOS
 $LIONSOS/ci/posix_test.sh $LIONSOS $MICROKIT_SDK
 $LIONSOS/ci/wasm_test.sh $LIONSOS $MICROKIT_SDK
@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Copyright 2026, UNSW
+# SPDX-License-Identifier: BSD-2-Clause
+
+#
+# This script builds and runs the host benchmark of the firewall data plane
+# from an already checked out version of LionsOS.
+#
+
+set -e
+
+if [ "$#" -ne 1 ]; then
+    echo "usage: firewall_bench.sh /path/to/lionsos"
+    exit 1
+fi
+
+LIONSOS=$1
+BUILD_DIR=$LIONSOS/ci_build/firewall_bench
+
+# The benchmark fails if the filter and routing pipeline forwards fewer packets
+# per second than this. The default is set well below the rate of a typical CI
+# runner, so that only a substantial regression fails, and may be overridden
+# for slower or dedicated runners.
+MIN_PPS=${FW_BENCH_MIN_PPS:-500000}
+rm -rf $BUILD_DIR
+
+echo "CI|INFO: building firewall benchmark"
+
+export BUILD_DIR=$BUILD_DIR
+export LIONSOS=$LIONSOS
+
+cd $LIONSOS/examples/firewall/bench
+make
+
+echo "CI|INFO: running firewall benchmark"
+
+$BUILD_DIR/checksum_test
+$BUILD_DIR/fw_bench --packets 65536 --iterations 2 --min-pps $MIN_PPS
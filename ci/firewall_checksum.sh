@@ -0,0 +1,46 @@
+#!/bin/bash
+
+# Copyright 2026, UNSW
+# SPDX-License-Identifier: BSD-2-Clause
+
+#
+# This script cross compiles the firewall checksum test for AArch64 from an
+# already checked out version of LionsOS, and runs it under QEMU user mode
+# emulation so that the NEON checksum is tested on hosts of any architecture.
+#
+
+set -e
+
+if [ "$#" -ne 1 ]; then
+    echo "usage: firewall_checksum.sh /path/to/lionsos"
+    exit 1
+fi
+
+LIONSOS=$1
+BUILD_DIR=$LIONSOS/ci_build/firewall_checksum_aarch64
+rm -rf $BUILD_DIR
+
+# Toolchain and emulator, along with the AArch64 C library the test is
+# dynamically linked against
+CROSS_COMPILE=${CROSS_COMPILE:-aarch64-linux-gnu-}
+QEMU_AARCH64=${QEMU_AARCH64:-qemu-aarch64}
+AARCH64_SYSROOT=${AARCH64_SYSROOT:-/usr/aarch64-linux-gnu}
+
+echo "CI|INFO: building firewall checksum test for AArch64"
+
+export BUILD_DIR=$BUILD_DIR
+export LIONSOS=$LIONSOS
+
+cd $LIONSOS/examples/firewall/bench
+make CC=${CROSS_COMPILE}gcc checksum_test
+
+echo "CI|INFO: running firewall checksum test under QEMU"
+
+OUTPUT=$($QEMU_AARCH64 -L $AARCH64_SYSROOT $BUILD_DIR/checksum_test)
+echo "$OUTPUT"
+
+# The test reports which implementation it ran, make sure it was NEON
+case "$OUTPUT" in
+    *"(neon)"*) ;;
+    *) echo "CI|ERROR: checksum test did not run the NEON checksum"; exit 1 ;;
+esac
@@ -87,6 +87,26 @@ static fw_os_err_t filter_err_to_os_err(fw_filter_err_t filter_err)
         return OS_ERR_INVALID_RULE_ID;
     case FILTER_ERR_UNSUPPORTED_ACTION:
         return OS_ERR_UNSUPPORTED_ACTION;
+    case FILTER_ERR_INVALID_PORTS:
+    case FILTER_ERR_INVALID_IP_SET:
+    case FILTER_ERR_INVALID_RATE_LIMIT:
+        return OS_ERR_INVALID_ARGUMENTS;
+    default:
+        return OS_ERR_INTERNAL_ERROR;
+    }
+}
+
+/* Convert an IP set error to OS error */
+static fw_os_err_t ip_set_err_to_os_err(fw_ip_set_err_t ip_set_err)
+{
+    switch (ip_set_err) {
+    case IP_SET_ERR_OKAY:
+        return OS_ERR_OKAY;
+    case IP_SET_ERR_FULL:
+        return OS_ERR_OUT_OF_MEMORY;
+    case IP_SET_ERR_INVALID_SET:
+    case IP_SET_ERR_INVALID_PREFIX:
+        return OS_ERR_INVALID_ARGUMENTS;
     default:
         return OS_ERR_INTERNAL_ERROR;
     }
@@ -193,10 +213,11 @@ static mp_obj_t interface_get_ip(mp_obj_t interface_idx_in)
 
 static MP_DEFINE_CONST_FUN_OBJ_1(interface_get_ip_obj, interface_get_ip);
 
-/* Add a route to the routing table for a network interface */
+/* Add a route to the routing table for a network interface. An optional weight
+sets the route's share of flows when its subnet has multiple paths. */
 static mp_obj_t route_add(mp_uint_t n_args, const mp_obj_t *args)
 {
-    if (n_args != 4) {
+    if (n_args != 4 && n_args != 5) {
         raise_error(OS_ERR_INVALID_ARGUMENTS);
         return mp_const_none;
     }
@@ -208,10 +229,16 @@ static mp_obj_t route_add(mp_uint_t n_args, const mp_obj_t *args)
     uint32_t ip = mp_obj_get_int(args[1]);
     uint8_t subnet = mp_obj_get_int(args[2]);
     uint32_t next_hop = mp_obj_get_int(args[3]);
+    mp_int_t weight = (n_args == 5) ? mp_obj_get_int(args[4]) : 1;
+    if (weight < 1 || weight > UINT8_MAX) {
+        raise_error(OS_ERR_INVALID_ROUTE_ARGS);
+        return mp_const_none;
+    }
     microkit_mr_set(ROUTER_ADD_ARG_IP, ip);
     microkit_mr_set(ROUTER_ADD_ARG_SUBNET, subnet);
     microkit_mr_set(ROUTER_ADD_ARG_NEXT_HOP, next_hop);
     microkit_mr_set(ROUTER_ADD_ARG_INTERFACE, interface_idx);
+    microkit_mr_set(ROUTER_ADD_ARG_WEIGHT, weight);
 
     (void)microkit_ppcall(fw_config.router.routing_ch, microkit_msginfo_new(ROUTER_ADD_ROUTE, ROUTER_ADD_NUM_ARGS));
     fw_os_err_t os_err = fw_routing_err_to_os_err(microkit_mr_get(ROUTER_RET_ERR));
@@ -223,7 +250,7 @@ static mp_obj_t route_add(mp_uint_t n_args, const mp_obj_t *args)
     return mp_obj_new_int_from_uint(os_err);
 }
 
-static MP_DEFINE_CONST_FUN_OBJ_VAR(route_add_obj, 4, route_add);
+static MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(route_add_obj, 4, 5, route_add);
 
 /* Delete a route from the interface routing table */
 static mp_obj_t route_delete(mp_obj_t route_id_in)
@@ -301,21 +328,40 @@ static mp_obj_t route_get_nth(mp_obj_t route_idx_in)
 
     fw_routing_entry_t *entry = (fw_routing_entry_t *)(fw_routing_table->entries + route_idx);
 
-    mp_obj_t tuple[5];
+    mp_obj_t tuple[6];
     tuple[0] = mp_obj_new_int_from_uint(route_idx);
     tuple[1] = mp_obj_new_int_from_uint(entry->ip);
     tuple[2] = mp_obj_new_int_from_uint(entry->subnet);
     tuple[3] = mp_obj_new_int_from_uint(entry->next_hop);
     tuple[4] = mp_obj_new_int_from_uint(entry->interface);
-    return mp_obj_new_tuple(5, tuple);
+    tuple[5] = mp_obj_new_int_from_uint(entry->weight);
+    return mp_obj_new_tuple(6, tuple);
 }
 
 static MP_DEFINE_CONST_FUN_OBJ_1(route_get_nth_obj, route_get_nth);
 
+/* Copy a sequence of ports into a destination port set */
+static bool get_port_set(mp_obj_t ports_in, fw_port_set_t *set)
+{
+    size_t num_ports;
+    mp_obj_t *ports;
+    mp_obj_get_array(ports_in, &num_ports, &ports);
+    if (num_ports > FW_RULE_MAX_PORT_SET) {
+        raise_error(OS_ERR_INVALID_ARGUMENTS);
+        return false;
+    }
+
+    for (size_t i = 0; i < num_ports; i++) {
+        set->ports[i] = mp_obj_get_int(ports[i]);
+    }
+    set->size = num_ports;
+    return true;
+}
+
 /* Add a rule to a filter on an interface */
 static mp_obj_t rule_add(mp_uint_t n_args, const mp_obj_t *args)
 {
-    if (n_args != 11) {
+    if (n_args != 19) {
         mp_raise_OSError(OS_ERR_INVALID_ARGUMENTS);
         return mp_const_none;
     }
@@ -335,6 +381,17 @@ static mp_obj_t rule_add(mp_uint_t n_args, const mp_obj_t *args)
     bool dst_port_any = mp_obj_get_int(args[8]);
     uint8_t dst_subnet = mp_obj_get_int(args[9]);
     uint8_t action = mp_obj_get_int(args[10]);
+    uint16_t src_port_max = mp_obj_get_int(args[11]);
+    uint16_t dst_port_max = mp_obj_get_int(args[12]);
+    fw_port_set_t port_set;
+    if (!get_port_set(args[13], &port_set)) {
+        return mp_const_none;
+    }
+    uint8_t src_ip_set = mp_obj_get_int(args[14]);
+    uint8_t dst_ip_set = mp_obj_get_int(args[15]);
+    uint32_t rate_pps = mp_obj_get_int(args[16]);
+    uint32_t rate_bps = mp_obj_get_int(args[17]);
+    bool rate_per_source = mp_obj_is_true(args[18]);
 
     int8_t protocol_match = find_filter_index(interface_idx, protocol);
     if (protocol_match == FW_MAX_FILTERS) {
@@ -354,6 +411,24 @@ static mp_obj_t rule_add(mp_uint_t n_args, const mp_obj_t *args)
     microkit_mr_set(FILTER_ADD_ARG_DST_SUBNET, dst_subnet);
     microkit_mr_set(FILTER_ADD_ARG_DST_PORT, dst_port);
     microkit_mr_set(FILTER_ADD_ARG_DST_ANY_PORT, dst_port_any);
+    microkit_mr_set(FILTER_ADD_ARG_SRC_PORT_MAX, src_port_max);
+    microkit_mr_set(FILTER_ADD_ARG_DST_PORT_MAX, dst_port_max);
+    microkit_mr_set(FILTER_ADD_ARG_SRC_IP_SET, src_ip_set);
+    microkit_mr_set(FILTER_ADD_ARG_DST_IP_SET, dst_ip_set);
+    microkit_mr_set(FILTER_ADD_ARG_RATE_PPS, rate_pps);
+    microkit_mr_set(FILTER_ADD_ARG_RATE_BPS, rate_bps);
+    microkit_mr_set(FILTER_ADD_ARG_RATE_PER_SOURCE, rate_per_source);
+    microkit_mr_set(FILTER_ADD_ARG_DST_PORT_SET_SIZE, port_set.size);
+    for (uint8_t mr = 0; mr < FW_RULE_PORT_SET_MRS; mr++) {
+        seL4_Word ports = 0;
+        for (uint8_t i = 0; i < FW_RULE_PORTS_PER_MR; i++) {
+            uint8_t port_idx = mr * FW_RULE_PORTS_PER_MR + i;
+            if (port_idx < port_set.size) {
+                ports |= (seL4_Word)port_set.ports[port_idx] << (16 * i);
+            }
+        }
+        microkit_mr_set(FILTER_ADD_ARG_DST_PORT_SET + mr, ports);
+    }
 
     (void)microkit_ppcall(fw_config.interfaces[interface_idx].filters[protocol_match].ch,
                           microkit_msginfo_new(FILTER_ADD_RULE, FILTER_ADD_NUM_ARGS));
@@ -367,7 +442,7 @@ static mp_obj_t rule_add(mp_uint_t n_args, const mp_obj_t *args)
     return mp_obj_new_int_from_uint(rule_id);
 }
 
-static MP_DEFINE_CONST_FUN_OBJ_VAR(rule_add_obj, 11, rule_add);
+static MP_DEFINE_CONST_FUN_OBJ_VAR(rule_add_obj, 19, rule_add);
 
 /* Delete a filter on an interface */
 static mp_obj_t rule_delete(mp_obj_t interface_idx_in, mp_obj_t rule_id_in, mp_obj_t protocol_in)
@@ -491,9 +566,16 @@ static mp_obj_t rule_get_nth(mp_obj_t interface_idx_in, mp_obj_t protocol_in, mp
         return mp_const_none;
     }
 
-    fw_rule_t *rule = (fw_rule_t *)(fw_interface_state[interface_idx].filter_states[protocol_match].rule_table->rules
-                                    + rule_idx);
-    mp_obj_t tuple[10];
+    fw_rule_table_t *rule_table = fw_interface_state[interface_idx].filter_states[protocol_match].rule_table;
+    fw_rule_t *rule = (fw_rule_t *)(rule_table->rules + rule_idx);
+    fw_port_set_t *set = fw_rule_port_set(rule_table, rule);
+    uint8_t num_ports = (set != NULL) ? set->size : 0;
+    mp_obj_t port_set[FW_RULE_MAX_PORT_SET];
+    for (uint8_t i = 0; i < num_ports; i++) {
+        port_set[i] = mp_obj_new_int_from_uint(set->ports[i]);
+    }
+
+    mp_obj_t tuple[18];
     tuple[0] = mp_obj_new_int_from_uint(rule->rule_id);
     tuple[1] = mp_obj_new_int_from_uint(rule->src_ip);
     tuple[2] = mp_obj_new_int_from_uint(rule->src_port);
@@ -504,11 +586,386 @@ static mp_obj_t rule_get_nth(mp_obj_t interface_idx_in, mp_obj_t protocol_in, mp
     tuple[7] = mp_obj_new_int_from_uint(rule->src_subnet);
     tuple[8] = mp_obj_new_int_from_uint(rule->dst_subnet);
     tuple[9] = mp_obj_new_int_from_uint(rule->action);
-    return mp_obj_new_tuple(10, tuple);
+    tuple[10] = mp_obj_new_int_from_uint(rule->src_port_max);
+    tuple[11] = mp_obj_new_int_from_uint(rule->dst_port_max);
+    tuple[12] = mp_obj_new_tuple(num_ports, port_set);
+    tuple[13] = mp_obj_new_int_from_uint(rule->src_ip_set);
+    tuple[14] = mp_obj_new_int_from_uint(rule->dst_ip_set);
+    tuple[15] = mp_obj_new_int_from_uint(rule->rate_pps);
+    tuple[16] = mp_obj_new_int_from_uint(rule->rate_bps);
+    tuple[17] = mp_obj_new_bool(rule->rate_per_source);
+    return mp_obj_new_tuple(18, tuple);
 }
 
 static MP_DEFINE_CONST_FUN_OBJ_3(rule_get_nth_obj, rule_get_nth);
 
+/* Get the traffic counters of an interface filter. Returns the packet and byte
+counts of established traffic and the number of TCP packets dropped for being
+out of state, followed by a list of (rule id, packets, bytes, limited) for every
+rule including the default rule */
+static mp_obj_t rule_stats(mp_obj_t interface_idx_in, mp_obj_t protocol_in)
+{
+    uint8_t interface_idx = mp_obj_get_int(interface_idx_in);
+    if (!check_interface_index(interface_idx)) {
+        return mp_const_none;
+    }
+
+    uint16_t protocol = mp_obj_get_int(protocol_in);
+    int8_t protocol_match = find_filter_index(interface_idx, protocol);
+    if (protocol_match == FW_MAX_FILTERS) {
+        return mp_const_none;
+    }
+
+    fw_filter_state_t *filter_state = &fw_interface_state[interface_idx].filter_states[protocol_match];
+    mp_obj_t rules = mp_obj_new_list(0, NULL);
+    for (uint16_t i = 0; i < filter_state->rule_table->size; i++) {
+        uint16_t rule_id = filter_state->rule_table->rules[i].rule_id;
+        fw_rule_stats_t *stats = filter_state->stats->rules + rule_id;
+
+        mp_obj_t rule_tuple[4];
+        rule_tuple[0] = mp_obj_new_int_from_uint(rule_id);
+        rule_tuple[1] = mp_obj_new_int_from_ull(stats->packets);
+        rule_tuple[2] = mp_obj_new_int_from_ull(stats->bytes);
+        rule_tuple[3] = mp_obj_new_int_from_ull(stats->limited);
+        mp_obj_list_append(rules, mp_obj_new_tuple(4, rule_tuple));
+    }
+
+    mp_obj_t tuple[4];
+    tuple[0] = mp_obj_new_int_from_ull(filter_state->stats->established.packets);
+    tuple[1] = mp_obj_new_int_from_ull(filter_state->stats->established.bytes);
+    tuple[2] = mp_obj_new_int_from_ull(filter_state->stats->out_of_state);
+    tuple[3] = rules;
+    return mp_obj_new_tuple(4, tuple);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_2(rule_stats_obj, rule_stats);
+
+/* Begin staging a new rule set for an interface filter. Rules are added to the
+rule set with rule_set_add, and applied together by rule_set_commit */
+static mp_obj_t rule_set_begin(mp_obj_t interface_idx_in, mp_obj_t protocol_in)
+{
+    uint8_t interface_idx = mp_obj_get_int(interface_idx_in);
+    if (!check_interface_index(interface_idx)) {
+        return mp_const_none;
+    }
+
+    uint16_t protocol = mp_obj_get_int(protocol_in);
+    int8_t protocol_match = find_filter_index(interface_idx, protocol);
+    if (protocol_match == FW_MAX_FILTERS) {
+        return mp_const_none;
+    }
+
+    fw_rule_table_t *shadow_rules =
+        (fw_rule_table_t *)fw_config.interfaces[interface_idx].filters[protocol_match].shadow_rules.vaddr;
+    shadow_rules->size = 0;
+    memset(shadow_rules->port_sets, 0, sizeof(shadow_rules->port_sets));
+
+    return mp_obj_new_int_from_uint(OS_ERR_OKAY);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_2(rule_set_begin_obj, rule_set_begin);
+
+/* Add a rule to the rule set being staged for an interface filter */
+static mp_obj_t rule_set_add(mp_uint_t n_args, const mp_obj_t *args)
+{
+    if (n_args != 19) {
+        mp_raise_OSError(OS_ERR_INVALID_ARGUMENTS);
+        return mp_const_none;
+    }
+
+    uint8_t interface_idx = mp_obj_get_int(args[0]);
+    if (!check_interface_index(interface_idx)) {
+        return mp_const_none;
+    }
+
+    uint16_t protocol = mp_obj_get_int(args[1]);
+    int8_t protocol_match = find_filter_index(interface_idx, protocol);
+    if (protocol_match == FW_MAX_FILTERS) {
+        return mp_const_none;
+    }
+
+    fw_webserver_filter_config_t *filter = &fw_config.interfaces[interface_idx].filters[protocol_match];
+    uint8_t action = mp_obj_get_int(args[10]);
+    if (!is_action_supported_for_filter(filter, action)) {
+        return mp_const_none;
+    }
+
+    /* Staged rules must fit in the rule table along with the default rule */
+    fw_rule_table_t *shadow_rules = (fw_rule_table_t *)filter->shadow_rules.vaddr;
+    if (shadow_rules->size + 1 >= filter->rules_capacity) {
+        raise_error(OS_ERR_OUT_OF_MEMORY);
+        return mp_const_none;
+    }
+
+    fw_rule_t *rule = shadow_rules->rules + shadow_rules->size;
+    rule->src_ip = mp_obj_get_int(args[2]);
+    rule->src_port = mp_obj_get_int(args[3]);
+    rule->src_port_any = mp_obj_get_int(args[4]);
+    rule->src_subnet = mp_obj_get_int(args[5]);
+    rule->dst_ip = mp_obj_get_int(args[6]);
+    rule->dst_port = mp_obj_get_int(args[7]);
+    rule->dst_port_any = mp_obj_get_int(args[8]);
+    rule->dst_subnet = mp_obj_get_int(args[9]);
+    rule->action = action;
+    rule->src_port_max = mp_obj_get_int(args[11]);
+    rule->dst_port_max = mp_obj_get_int(args[12]);
+    rule->src_ip_set = mp_obj_get_int(args[14]);
+    rule->dst_ip_set = mp_obj_get_int(args[15]);
+    rule->rate_pps = mp_obj_get_int(args[16]);
+    rule->rate_bps = mp_obj_get_int(args[17]);
+    rule->rate_per_source = mp_obj_is_true(args[18]);
+    rule->rule_id = DEFAULT_ACTION_RULE_ID;
+
+    /* Port sets are stored out of line, a set is only allocated to rules that
+    have one */
+    fw_port_set_t port_set;
+    if (!get_port_set(args[13], &port_set)) {
+        return mp_const_none;
+    }
+
+    rule->dst_port_set = 0;
+    if (port_set.size != 0) {
+        rule->dst_port_set = fw_rule_table_free_port_set(shadow_rules);
+        if (rule->dst_port_set == 0) {
+            raise_error(OS_ERR_OUT_OF_MEMORY);
+            return mp_const_none;
+        }
+        *fw_rule_port_set(shadow_rules, rule) = port_set;
+    }
+
+    return mp_obj_new_int_from_uint(shadow_rules->size++);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_VAR(rule_set_add_obj, 19, rule_set_add);
+
+/* Atomically replace the rules and default action of an interface filter with
+the staged rule set. Either the whole rule set is applied, or none of it is */
+static mp_obj_t rule_set_commit(mp_obj_t interface_idx_in, mp_obj_t protocol_in, mp_obj_t default_action_in)
+{
+    uint8_t interface_idx = mp_obj_get_int(interface_idx_in);
+    if (!check_interface_index(interface_idx)) {
+        return mp_const_none;
+    }
+
+    uint16_t protocol = mp_obj_get_int(protocol_in);
+    uint8_t default_action = mp_obj_get_int(default_action_in);
+    int8_t protocol_match = find_filter_index(interface_idx, protocol);
+    if (protocol_match == FW_MAX_FILTERS) {
+        return mp_const_none;
+    }
+
+    if (!is_action_supported_for_filter(&fw_config.interfaces[interface_idx].filters[protocol_match],
+                                        default_action)) {
+        return mp_const_none;
+    }
+
+    microkit_mr_set(FILTER_COMMIT_ARG_DEFAULT_ACTION, default_action);
+    (void)microkit_ppcall(fw_config.interfaces[interface_idx].filters[protocol_match].ch,
+                          microkit_msginfo_new(FILTER_COMMIT_RULES, FILTER_COMMIT_NUM_ARGS));
+    fw_os_err_t os_err = filter_err_to_os_err(microkit_mr_get(FILTER_COMMIT_RET_ERR));
+    if (os_err != OS_ERR_OKAY) {
+        sddf_printf("WEBSERVER|LOG: Rule set rejected at rule %lu.\n", microkit_mr_get(FILTER_COMMIT_RET_RULE_IDX));
+        raise_error(os_err);
+        return mp_obj_new_int_from_uint(os_err);
+    }
+
+    return mp_obj_new_int_from_uint(os_err);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_3(rule_set_commit_obj, rule_set_commit);
+
+/* Parse the next line of an IP set list. Lines hold an IPv4 address with an
+optional prefix length, "a.b.c.d[/len]", and may be blank or a '#' comment.
+Returns whether the line was valid, with prefix length set to 0xff if the line
+holds no prefix */
+static bool parse_ip_set_line(const char **pos, const char *end, uint32_t *ip, uint8_t *prefix_len)
+{
+    const char *c = *pos;
+    bool valid = true;
+    *prefix_len = 0xff;
+
+    while (c < end && (*c == ' ' || *c == '\t' || *c == '\r')) {
+        c++;
+    }
+
+    if (c < end && *c != '\n' && *c != '#') {
+        uint8_t *octets = (uint8_t *)ip;
+        for (uint8_t i = 0; i < 4 && valid; i++) {
+            uint16_t octet = 0;
+            uint8_t digits = 0;
+            while (c < end && *c >= '0' && *c <= '9' && digits < 4) {
+                octet = octet * 10 + (*c++ - '0');
+                digits++;
+            }
+            valid = digits > 0 && octet <= 255 && (i == 3 || (c < end && *c++ == '.'));
+            octets[i] = octet;
+        }
+
+        *prefix_len = 32;
+        if (valid && c < end && *c == '/') {
+            c++;
+            uint16_t len = 0;
+            uint8_t digits = 0;
+            while (c < end && *c >= '0' && *c <= '9' && digits < 3) {
+                len = len * 10 + (*c++ - '0');
+                digits++;
+            }
+            valid = digits > 0 && len <= 32;
+            *prefix_len = len;
+        }
+
+        while (valid && c < end && (*c == ' ' || *c == '\t' || *c == '\r')) {
+            c++;
+        }
+        valid = valid && (c == end || *c == '\n' || *c == '#');
+    }
+
+    /* Skip the rest of the line */
+    while (c < end && *c != '\n') {
+        c++;
+    }
+    *pos = (c < end) ? c + 1 : c;
+    return valid;
+}
+
+/* Switch every filter over to the staged copy of the IP sets. Filters switch
+one at a time, and none reads the old copy once all have switched */
+static void ip_sets_swap(void)
+{
+    for (uint8_t i = 0; i < fw_config.num_interfaces; i++) {
+        for (uint8_t j = 0; j < fw_config.interfaces[i].num_filters; j++) {
+            (void)microkit_ppcall(fw_config.interfaces[i].filters[j].ch,
+                                  microkit_msginfo_new(FILTER_SWAP_IP_SETS, 0));
+        }
+    }
+
+    fw_ip_set_table_t ip_sets = fw_ip_sets;
+    fw_ip_sets = fw_shadow_ip_sets;
+    fw_shadow_ip_sets = ip_sets;
+}
+
+/* Line of the IP set list being loaded, used to report invalid entries */
+static uint32_t ip_set_load_line;
+
+/* Begin loading a list of addresses and prefixes into an IP set, optionally
+replacing the set's contents. Lines are added with ip_set_load_lines, and the
+set is only changed once ip_set_load_commit is called, so a failed load leaves
+the set unchanged */
+static mp_obj_t ip_set_load_begin(mp_obj_t set_in, mp_obj_t replace_in)
+{
+    uint8_t set = mp_obj_get_int(set_in);
+    bool replace = mp_obj_is_true(replace_in);
+    if (set == 0 || set > FW_MAX_IP_SETS) {
+        raise_error(OS_ERR_INVALID_ARGUMENTS);
+        return mp_const_none;
+    }
+
+    /* Stage the change in the copy of the IP sets not in use by filters */
+    fw_ip_set_copy(&fw_shadow_ip_sets, &fw_ip_sets);
+    fw_os_err_t os_err = ip_set_err_to_os_err(replace ? fw_ip_set_clear(&fw_shadow_ip_sets, set)
+                                                      : IP_SET_ERR_OKAY);
+    if (os_err != OS_ERR_OKAY) {
+        raise_error(os_err);
+        return mp_obj_new_int_from_uint(os_err);
+    }
+
+    ip_set_load_line = 0;
+    return mp_obj_new_int_from_uint(os_err);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_2(ip_set_load_begin_obj, ip_set_load_begin);
+
+/* Add whole lines of a list to the IP set being loaded, one "a.b.c.d[/len]"
+per line. Lists may be passed in any number of parts, as long as no line is
+split between parts. Returns the number of prefixes added */
+static mp_obj_t ip_set_load_lines(mp_obj_t set_in, mp_obj_t list_in)
+{
+    uint8_t set = mp_obj_get_int(set_in);
+    mp_buffer_info_t list;
+    mp_get_buffer_raise(list_in, &list, MP_BUFFER_READ);
+
+    const char *pos = list.buf;
+    const char *end = pos + list.len;
+    uint32_t added = 0;
+    fw_ip_set_err_t err = IP_SET_ERR_OKAY;
+    while (err == IP_SET_ERR_OKAY && pos < end) {
+        uint32_t ip = 0;
+        uint8_t prefix_len;
+        ip_set_load_line++;
+        if (!parse_ip_set_line(&pos, end, &ip, &prefix_len)) {
+            sddf_printf("WEBSERVER|LOG: Invalid IP set entry on line %u.\n", ip_set_load_line);
+            err = IP_SET_ERR_INVALID_PREFIX;
+        } else if (prefix_len != 0xff) {
+            err = fw_ip_set_add(&fw_shadow_ip_sets, set, ip, prefix_len);
+            if (err == IP_SET_ERR_OKAY) {
+                added++;
+            }
+        }
+    }
+
+    fw_os_err_t os_err = ip_set_err_to_os_err(err);
+    if (os_err != OS_ERR_OKAY) {
+        raise_error(os_err);
+        return mp_obj_new_int_from_uint(os_err);
+    }
+
+    return mp_obj_new_int_from_uint(added);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_2(ip_set_load_lines_obj, ip_set_load_lines);
+
+/* Sort the loaded IP set and switch filters over to it */
+static mp_obj_t ip_set_load_commit(mp_obj_t set_in)
+{
+    uint8_t set = mp_obj_get_int(set_in);
+    fw_os_err_t os_err = ip_set_err_to_os_err(fw_ip_set_finish(&fw_shadow_ip_sets, set));
+    if (os_err != OS_ERR_OKAY) {
+        raise_error(os_err);
+        return mp_obj_new_int_from_uint(os_err);
+    }
+
+    ip_sets_swap();
+    return mp_obj_new_int_from_uint(os_err);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_1(ip_set_load_commit_obj, ip_set_load_commit);
+
+/* Remove every prefix from an IP set */
+static mp_obj_t ip_set_clear(mp_obj_t set_in)
+{
+    uint8_t set = mp_obj_get_int(set_in);
+
+    fw_ip_set_copy(&fw_shadow_ip_sets, &fw_ip_sets);
+    fw_os_err_t os_err = ip_set_err_to_os_err(fw_ip_set_clear(&fw_shadow_ip_sets, set));
+    if (os_err != OS_ERR_OKAY) {
+        raise_error(os_err);
+        return mp_obj_new_int_from_uint(os_err);
+    }
+
+    ip_sets_swap();
+    return mp_obj_new_int_from_uint(os_err);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_1(ip_set_clear_obj, ip_set_clear);
+
+/* Get the number of prefixes added to each IP set, followed by the number of
+address ranges in use out of the pool's capacity */
+static mp_obj_t ip_set_stats(void)
+{
+    mp_obj_t sizes[FW_MAX_IP_SETS];
+    for (uint8_t i = 0; i < FW_MAX_IP_SETS; i++) {
+        sizes[i] = mp_obj_new_int_from_uint(fw_ip_sets.sets->sizes[i]);
+    }
+
+    mp_obj_t tuple[3];
+    tuple[0] = mp_obj_new_tuple(FW_MAX_IP_SETS, sizes);
+    tuple[1] = mp_obj_new_int_from_uint(fw_ip_sets.sets->num_ranges);
+    tuple[2] = mp_obj_new_int_from_uint(fw_ip_sets.capacity);
+    return mp_obj_new_tuple(3, tuple);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_0(ip_set_stats_obj, ip_set_stats);
+
 static const mp_rom_map_elem_t lions_firewall_module_globals_table[] = {
     { MP_OBJ_NEW_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_lions_firewall) },
     { MP_ROM_QSTR(MP_QSTR_interface_ip_get), MP_ROM_PTR(&interface_get_ip_obj) },
@@ -525,8 +982,17 @@ static const mp_rom_map_elem_t lions_firewall_module_globals_table[] = {
     { MP_ROM_QSTR(MP_QSTR_route_count), MP_ROM_PTR(&route_count_obj) },
     { MP_ROM_QSTR(MP_QSTR_rule_add), MP_ROM_PTR(&rule_add_obj) },
     { MP_ROM_QSTR(MP_QSTR_rule_count), MP_ROM_PTR(&rule_count_obj) },
+    { MP_ROM_QSTR(MP_QSTR_rule_stats), MP_ROM_PTR(&rule_stats_obj) },
+    { MP_ROM_QSTR(MP_QSTR_rule_set_begin), MP_ROM_PTR(&rule_set_begin_obj) },
+    { MP_ROM_QSTR(MP_QSTR_rule_set_add), MP_ROM_PTR(&rule_set_add_obj) },
+    { MP_ROM_QSTR(MP_QSTR_rule_set_commit), MP_ROM_PTR(&rule_set_commit_obj) },
     { MP_ROM_QSTR(MP_QSTR_filter_get_default_action), MP_ROM_PTR(&filter_get_default_action_obj) },
     { MP_ROM_QSTR(MP_QSTR_filter_set_default_action), MP_ROM_PTR(&filter_set_default_action_obj) },
+    { MP_ROM_QSTR(MP_QSTR_ip_set_load_begin), MP_ROM_PTR(&ip_set_load_begin_obj) },
+    { MP_ROM_QSTR(MP_QSTR_ip_set_load_lines), MP_ROM_PTR(&ip_set_load_lines_obj) },
+    { MP_ROM_QSTR(MP_QSTR_ip_set_load_commit), MP_ROM_PTR(&ip_set_load_commit_obj) },
+    { MP_ROM_QSTR(MP_QSTR_ip_set_clear), MP_ROM_PTR(&ip_set_clear_obj) },
+    { MP_ROM_QSTR(MP_QSTR_ip_set_stats), MP_ROM_PTR(&ip_set_stats_obj) },
 };
 
 static MP_DEFINE_CONST_DICT(lions_firewall_module_globals, lions_firewall_module_globals_table);
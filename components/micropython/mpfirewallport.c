@@ -29,6 +29,8 @@
 
 fw_webserver_interface_state_t fw_interface_state[FW_MAX_INTERFACES];
 fw_routing_table_t *fw_routing_table;
+fw_ip_set_table_t fw_ip_sets;
+fw_ip_set_table_t fw_shadow_ip_sets;
 
 extern fw_queue_t rx_active;
 extern fw_queue_t rx_free[FW_MAX_INTERFACES];
@@ -238,10 +240,13 @@ void mpfirewall_handle_notify(void)
 void init_firewall_webserver(void)
 {
     fw_routing_table = fw_config.router.routing_table.vaddr;
+    fw_ip_set_table_init(&fw_ip_sets, fw_config.ip_sets.ip_sets.vaddr, fw_config.ip_sets.capacity);
+    fw_ip_set_table_init(&fw_shadow_ip_sets, fw_config.ip_sets.shadow_ip_sets.vaddr, fw_config.ip_sets.capacity);
     for (uint8_t i = 0; i < fw_config.num_interfaces; i++) {
         fw_interface_state[i].ping_enabled = true;
         for (uint8_t j = 0; j < fw_config.interfaces[i].num_filters; j++) {
             fw_interface_state[i].filter_states[j].rule_table = fw_config.interfaces[i].filters[j].rules.vaddr;
+            fw_interface_state[i].filter_states[j].stats = fw_config.interfaces[i].filters[j].stats.vaddr;
         }
     }
 }
@@ -35,6 +35,14 @@ extern fw_webserver_interface_state_t fw_interface_state[FW_MAX_INTERFACES];
  */
 extern fw_routing_table_t *fw_routing_table;
 
+/**
+ * Copies of the IP sets shared with filters. Filters read from fw_ip_sets,
+ * while changes are staged in fw_shadow_ip_sets before filters are switched
+ * over to it.
+ */
+extern fw_ip_set_table_t fw_ip_sets;
+extern fw_ip_set_table_t fw_shadow_ip_sets;
+
 /**
  * Checks whether the pbuf contains an ARP request. All ARP requests and
  * responses in the firewall are handled by the ARP components, thus the
@@ -19,6 +19,7 @@
 #include <lions/firewall/config.h>
 #include <lions/firewall/ethernet.h>
 #include <lions/firewall/queue.h>
+#include <lions/firewall/trace.h>
 #include <string.h>
 
 __attribute__((__section__(".net_client_config"))) net_client_config_t net_config;
@@ -38,6 +39,9 @@ fw_queue_t arp_resp_queue[FW_MAX_ARP_REQUESTER_CLIENTS];
 /* ARP table caches ARP request responses */
 fw_arp_table_t arp_table;
 
+/* Packet path event trace */
+fw_trace_t trace;
+
 /* Keep track of whether the tx virt requires notification */
 static bool transmitted;
 
@@ -47,20 +51,114 @@ static bool notify_client[FW_MAX_ARP_REQUESTER_CLIENTS] = { false };
 #define ARP_MAX_RETRIES 5               /* How many times the ARP requester will send out an ARP request. */
 #define ARP_RETRY_TIMER_S 1             /* How often to retry an ARP request, in seconds. */
 #define ARP_RETRY_TIMER_NS (ARP_RETRY_TIMER_S * NS_IN_S)
-#define ARP_CACHE_LIFE_M 5              /* The lifetime of the ARP cache in minutes. After this time elapses, the cache is flushed. */
+#define ARP_CACHE_LIFE_M 5              /* The mean lifetime of an ARP cache entry in minutes. */
 #define ARP_CACHE_LIFE_NS ((ARP_CACHE_LIFE_M * 60) * NS_IN_S)
-#define ARP_TICKS_PER_FLUSH (ARP_CACHE_LIFE_NS / ARP_RETRY_TIMER_NS) /* Number of arp ticks per arp cache flushing. */
+#define ARP_REFRESH_S 30                /* Time before expiry that a reachable entry becomes stale, in seconds. */
+#define ARP_REFRESH_NS (ARP_REFRESH_S * NS_IN_S)
+#define ARP_UNREACHABLE_LIFE_S 10       /* Lifetime of an unreachable entry on its first failure, in seconds. */
+#define ARP_UNREACHABLE_LIFE_NS (ARP_UNREACHABLE_LIFE_S * NS_IN_S)
+#define ARP_MAX_BACKOFF 5               /* Number of consecutive failures over which unreachable lifetimes double. */
+#define ARP_BACKOFF_HISTORY 64          /* Number of IPs whose failures are remembered after their entry expires. */
+#define ARP_TX_PER_TICK 32              /* ARP requests that may be sent per retry timer tick. */
+#define ARP_TX_SUBNET_PER_TICK 8        /* ARP requests that may be sent to each subnet per retry timer tick. */
+#define ARP_TX_FIRST_RESERVE 16         /* ARP requests per tick that only the first request for an IP may use. */
+#define ARP_TX_SUBNET_FIRST_RESERVE 4   /* As above, for the ARP requests of each subnet. */
+#define ARP_RATE_SUBNET_BITS 24         /* Prefix length of subnets that are rate limited separately. */
+#define ARP_RATE_SUBNETS 16             /* Number of subnet rate limiters, subnets are hashed onto them. */
+
+/* ARP requests that may still be sent this tick, in total and to the subnets
+of each rate limiter. A scan across one subnet can not use up the requests
+available to others. */
+static uint16_t tx_budget;
+static uint8_t subnet_tx_budget[ARP_RATE_SUBNETS];
+
+/* Number of pending entries, at most a quarter of the cache may be pending so
+a scan can not fill the cache with requests that will never be answered */
+static uint16_t num_pending;
+
+/* Cache index retries are resumed from on the next tick, so that entries late
+in the cache are not starved when the rate limits defer some retries */
+static uint16_t retry_cursor;
+
+/* Cache index the search for a pending entry to evict continues from */
+static uint16_t evict_cursor;
+
+/* Consecutive failures of an IP, kept after its unreachable entry expires so
+repeatedly unreachable IPs are cached as unreachable for longer each time */
+typedef struct arp_backoff {
+    uint32_t ip;
+    uint8_t failures;
+    /* time the failures are forgotten */
+    uint64_t expiry;
+} arp_backoff_t;
+
+static arp_backoff_t backoff_history[ARP_BACKOFF_HISTORY];
+
+/* State of the generator entry lifetimes are drawn from */
+static uint64_t lifetime_rng;
+
+/* Expiry of an entry created or confirmed now. Lifetimes are drawn uniformly
+from half to one and a half times the mean lifetime, so entries created
+together do not all expire, and need to be requested again, together. */
+static uint64_t arp_entry_expiry(uint64_t now)
+{
+    /* xorshift64 */
+    lifetime_rng ^= lifetime_rng << 13;
+    lifetime_rng ^= lifetime_rng >> 7;
+    lifetime_rng ^= lifetime_rng << 17;
+    return now + ARP_CACHE_LIFE_NS / 2 + lifetime_rng % ARP_CACHE_LIFE_NS;
+}
+
+/* Expiry of an entry that has just become unreachable. Its lifetime doubles
+with each consecutive failure, up to ARP_MAX_BACKOFF failures. */
+static uint64_t arp_unreachable_expiry(uint32_t ip, uint64_t now)
+{
+    arp_backoff_t *backoff = backoff_history + (fw_flow_hash(ip, 0, 0, 0) % ARP_BACKOFF_HISTORY);
+    if (backoff->ip != ip || now >= backoff->expiry) {
+        backoff->ip = ip;
+        backoff->failures = 0;
+    }
+
+    uint64_t lifetime = ARP_UNREACHABLE_LIFE_NS << backoff->failures;
+    if (backoff->failures < ARP_MAX_BACKOFF) {
+        backoff->failures++;
+    }
+
+    /* Failures are forgotten if the IP is not found unreachable again within
+    twice the lifetime of its entry */
+    backoff->expiry = now + 2 * lifetime;
+    return now + lifetime;
+}
+
+/* Forget the failures of an IP that has been found reachable */
+static void arp_backoff_reset(uint32_t ip)
+{
+    arp_backoff_t *backoff = backoff_history + (fw_flow_hash(ip, 0, 0, 0) % ARP_BACKOFF_HISTORY);
+    if (backoff->ip == ip) {
+        backoff->expiry = 0;
+    }
+}
 
-/* Time that we will flush the arp queue (to the closest arp retry timer tick). */
-uint64_t ticks_to_flush = ARP_TICKS_PER_FLUSH;
+/* Restore the ARP request budgets at the start of each tick */
+static void arp_tx_refill(void)
+{
+    tx_budget = ARP_TX_PER_TICK;
+    memset(subnet_tx_budget, ARP_TX_SUBNET_PER_TICK, sizeof(subnet_tx_budget));
+}
 
-static void generate_arp(net_buff_desc_t *buffer, uint32_t ip)
+/* Generate an ARP request for an IP address. Requests are broadcast unless the
+MAC address of the IP is already known, as when refreshing a cache entry. */
+static void generate_arp(net_buff_desc_t *buffer, uint32_t ip, uint8_t *mac_addr)
 {
     uintptr_t pkt_vaddr = (uintptr_t)(net_config.tx_data.vaddr + buffer->io_or_offset);
     eth_hdr_t *eth_hdr = (eth_hdr_t *)pkt_vaddr;
 
-    /* Set the destination MAC address as the broadcast MAC address */
-    memset(&eth_hdr->ethdst_addr, 0xFF, ETH_HWADDR_LEN);
+    if (mac_addr == NULL) {
+        /* Set the destination MAC address as the broadcast MAC address */
+        memset(&eth_hdr->ethdst_addr, 0xFF, ETH_HWADDR_LEN);
+    } else {
+        memcpy(&eth_hdr->ethdst_addr, mac_addr, ETH_HWADDR_LEN);
+    }
     memcpy(&eth_hdr->ethsrc_addr, arp_config.mac_addr, ETH_HWADDR_LEN);
     eth_hdr->ethtype = htons(ETH_TYPE_ARP);
 
@@ -81,10 +179,88 @@ static void generate_arp(net_buff_desc_t *buffer, uint32_t ip)
     buffer->len = ARP_PKT_LEN;
 }
 
+/* Send an ARP request for an entry if a transmit buffer is available and the
+rate limits allow. Requests are sent to the MAC address given, or broadcast if
+it is NULL. Retries may not use the requests reserved for first requests, so
+new neighbours are still resolved while the retries of a scan are outstanding.
+Returns whether the request was sent. */
+static bool send_request(fw_arp_entry_t *entry, uint8_t *mac_addr)
+{
+    uint8_t *subnet_budget = subnet_tx_budget
+                           + (fw_flow_hash(entry->ip & subnet_mask(ARP_RATE_SUBNET_BITS), 0, 0, 0) % ARP_RATE_SUBNETS);
+    uint16_t reserve = (entry->num_retries > 0) ? ARP_TX_FIRST_RESERVE : 0;
+    uint8_t subnet_reserve = (entry->num_retries > 0) ? ARP_TX_SUBNET_FIRST_RESERVE : 0;
+    if (tx_budget <= reserve || *subnet_budget <= subnet_reserve || net_queue_empty_free(&tx_queue)) {
+        return false;
+    }
+
+    net_buff_desc_t buffer = { 0 };
+    int err = net_dequeue_free(&tx_queue, &buffer);
+    assert(!err);
+
+    generate_arp(&buffer, entry->ip, mac_addr);
+    err = net_enqueue_active(&tx_queue, buffer);
+    assert(!err);
+
+    tx_budget--;
+    (*subnet_budget)--;
+    entry->num_retries++;
+    transmitted = true;
+    return true;
+}
+
+/* Reply to a client that the IP it requested can not be resolved */
+static void reply_unreachable(uint8_t client, uint32_t ip)
+{
+    fw_arp_request_t response = { ip, { 0 }, ARP_STATE_UNREACHABLE };
+    fw_enqueue(&arp_resp_queue[client], &response);
+    notify_client[client] = true;
+}
+
+/* Make room for a new pending entry by removing the pending entry which has
+sent the most requests, and so is the oldest or the closest to being found
+unreachable. Its clients are told it is unreachable, but it is not cached as
+unreachable as it was not given all its retries. The search stops early at an
+entry which has sent all its requests. Returns whether an entry was evicted. */
+static bool evict_pending(void)
+{
+    uint16_t mask = arp_table.capacity - 1;
+    fw_arp_entry_t *victim = NULL;
+    for (uint16_t i = 0; i < arp_table.capacity; i++) {
+        fw_arp_entry_t *entry = arp_table.entries + ((evict_cursor + i) & mask);
+        if (entry->state != ARP_STATE_PENDING) {
+            continue;
+        }
+
+        if (victim == NULL || entry->num_retries > victim->num_retries) {
+            victim = entry;
+        }
+
+        if (victim->num_retries >= ARP_MAX_RETRIES) {
+            break;
+        }
+    }
+
+    if (victim == NULL) {
+        return false;
+    }
+
+    for (uint8_t client = 0; client < arp_config.num_arp_clients; client++) {
+        if (BIT(client) & victim->client) {
+            reply_unreachable(client, victim->ip);
+        }
+    }
+
+    evict_cursor = (victim - arp_table.entries + 1) & mask;
+    fw_arp_table_remove_entry(&arp_table, victim);
+    num_pending--;
+    return true;
+}
+
 static void process_requests()
 {
     for (uint8_t client = 0; client < arp_config.num_arp_clients; client++) {
-        while (!fw_queue_empty(&arp_req_queue[client]) && !net_queue_empty_free(&tx_queue)) {
+        while (!fw_queue_empty(&arp_req_queue[client])) {
             fw_arp_request_t request;
             int err = fw_dequeue(&arp_req_queue[client], &request);
             assert(!err);
@@ -96,6 +272,12 @@ static void process_requests()
                 fw_arp_request_t response = fw_arp_response_from_entry(entry);
                 fw_enqueue(&arp_resp_queue[client], &response);
                 notify_client[client] = true;
+
+                /* Client is still using a stale entry, so it is probed by
+                process_aging until it is refreshed */
+                if (entry->state == ARP_STATE_REACHABLE && entry->stale) {
+                    entry->refresh = true;
+                }
                 continue;
             } else if (entry != NULL && entry->state == ARP_STATE_PENDING) {
                 /* Notify client upon response for existing ARP request */
@@ -103,28 +285,31 @@ static void process_requests()
                 continue;
             }
 
-            /* Generate ARP request */
-            net_buff_desc_t buffer = {};
-            err = net_dequeue_free(&tx_queue, &buffer);
-            assert(!err);
-
-            generate_arp(&buffer, request.ip);
-            err = net_enqueue_active(&tx_queue, buffer);
-            assert(!err);
-
-            if (FW_DEBUG_OUTPUT) {
-                sddf_printf("ARP REQUESTER LOG: processing client %u request for ip %s on interface %u\n", client,
-                            ipaddr_to_string(request.ip, ip_addr_buf0), arp_config.interface);
+            /* Too many requests are outstanding to track another, as during a
+            scan of unused addresses, so the most retried gives way */
+            if (num_pending >= arp_table.capacity / 4 && !evict_pending()) {
+                reply_unreachable(client, request.ip);
+                continue;
             }
 
             /* Create arp entry for request to store associated client */
-            fw_arp_error_t arp_err = fw_arp_table_add_entry(&arp_table, ARP_STATE_PENDING, request.ip, NULL, client);
+            fw_arp_error_t arp_err = fw_arp_table_add_entry(&arp_table, ARP_STATE_PENDING, request.ip, NULL, client,
+                                                            0);
             if (arp_err == ARP_ERR_FULL) {
                 sddf_dprintf("ARP REQUESTER LOG: Arp cache full, cannot enqueue entry on interface %u!\n",
                              arp_config.interface);
+                reply_unreachable(client, request.ip);
+                continue;
+            }
+            num_pending++;
+
+            /* Generate ARP request, or leave it to the next tick if the rate
+            limits have been reached */
+            entry = fw_arp_table_find_entry(&arp_table, request.ip);
+            bool sent = send_request(entry, NULL);
+            if (FW_DEBUG_OUTPUT && sent) {
+                fw_trace_event(&trace, FW_TRACE_ARP_REQUEST, arp_config.interface, 0, 0, 0, request.ip, 0, 0, client);
             }
-
-            transmitted = true;
         }
     }
 }
@@ -149,10 +334,22 @@ static void process_responses()
                 if (arp_resp->opcode == htons(ARP_ETH_OPCODE_REPLY)) {
                     /* Find the arp entry */
                     fw_arp_entry_t *entry = fw_arp_table_find_entry(&arp_table, arp_resp->ipsrc_addr);
+                    uint64_t now = sddf_timer_time_now(timer_config.driver_id);
                     if (entry != NULL) {
-                        /* This was a response to a request we sent, update entry */
-                        entry->state = ARP_STATE_REACHABLE;
+                        /* This was a response to a request we sent, update
+                        entry. Clients may read the entry concurrently, so it
+                        is only made reachable once its MAC address is written */
+                        if (entry->state == ARP_STATE_PENDING) {
+                            num_pending--;
+                        }
                         memcpy(&entry->mac_addr, &arp_resp->hwsrc_addr, ETH_HWADDR_LEN);
+                        entry->expiry = arp_entry_expiry(now);
+                        entry->stale = false;
+                        entry->refresh = false;
+                        entry->num_retries = 0;
+                        THREAD_MEMORY_RELEASE();
+                        entry->state = ARP_STATE_REACHABLE;
+                        arp_backoff_reset(entry->ip);
 
                         /* Send to clients */
                         for (uint8_t client = 0; entry->client && client < arp_config.num_arp_clients; client++) {
@@ -161,18 +358,16 @@ static void process_responses()
                                 fw_enqueue(&arp_resp_queue[client], &response);
                                 notify_client[client] = true;
                                 if (FW_DEBUG_OUTPUT) {
-                                    sddf_printf(
-                                        "ARP REQUESTER LOG: received response for client %u, ip %s. MAC[0] = %x, "
-                                        "MAC[5] = %x on interface %u\n",
-                                        client, ipaddr_to_string(arp_resp->ipsrc_addr, ip_addr_buf0),
-                                        arp_resp->hwsrc_addr[0], arp_resp->hwsrc_addr[5], arp_config.interface);
+                                    fw_trace_event(&trace, FW_TRACE_ARP_RESPONSE, arp_config.interface, 0, 0, 0,
+                                                   arp_resp->ipsrc_addr, 0, 0, client);
                                 }
                             }
                         }
                     } else {
                         /* Create a new entry */
                         fw_arp_error_t arp_err = fw_arp_table_add_entry(&arp_table, ARP_STATE_REACHABLE,
-                                                                        arp_resp->ipsrc_addr, arp_resp->hwsrc_addr, 0);
+                                                                        arp_resp->ipsrc_addr, arp_resp->hwsrc_addr, 0,
+                                                                        arp_entry_expiry(now));
                         if (arp_err == ARP_ERR_FULL) {
                             sddf_dprintf("ARP REQUESTER LOG: Arp cache full, cannot enqueue entry on interface %u!\n",
                                          arp_config.interface);
@@ -201,18 +396,29 @@ static void process_responses()
     }
 }
 
-/* Returns the number of ARP entry retries. */
-static uint16_t process_retries(void)
+/* Resend requests for pending entries until ARP_MAX_RETRIES have been sent,
+then send the first requests deferred by the rate limits. Retries are served
+from where the previous tick's were cut short by the rate limits. Returns the
+number of ARP entry retries. */
+static uint16_t process_retries(uint64_t now)
 {
+    uint16_t mask = arp_table.capacity - 1;
     uint16_t pending_requests = 0;
+    uint16_t deferred_first = 0;
+    uint16_t next_cursor = retry_cursor;
+    bool cut_short = false;
+    num_pending = 0;
     for (uint16_t i = 0; i < arp_table.capacity; i++) {
-        fw_arp_entry_t *entry = arp_table.entries + i;
+        uint16_t idx = (retry_cursor + i) & mask;
+        fw_arp_entry_t *entry = arp_table.entries + idx;
         if (entry->state != ARP_STATE_PENDING) {
             continue;
         }
 
         if (entry->num_retries >= ARP_MAX_RETRIES) {
-            /* Node is now considered unreachable */
+            /* Node is now considered unreachable, cache it as unreachable for
+            longer the more often it has been unreachable */
+            entry->expiry = arp_unreachable_expiry(entry->ip, now);
             entry->state = ARP_STATE_UNREACHABLE;
 
             /* Generate ARP responses */
@@ -223,54 +429,88 @@ static uint16_t process_retries(void)
                     notify_client[client] = true;
                 }
             }
-        } else {
-            /* Resend the ARP request out to the network */
+            continue;
+        }
 
-            if (FW_DEBUG_OUTPUT) {
-                sddf_printf("ARP REQUESTER LOG: attempting to resend request for ip %s on interface %u\n",
-                            ipaddr_to_string(entry->ip, ip_addr_buf0), arp_config.interface);
-            }
+        num_pending++;
 
-            if (!net_queue_empty_free(&tx_queue)) {
-                net_buff_desc_t buffer = { 0 };
-                int err = net_dequeue_free(&tx_queue, &buffer);
-                assert(!err);
+        /* First requests are sent once the retries have been served */
+        if (entry->num_retries == 0) {
+            deferred_first++;
+            continue;
+        }
 
-                generate_arp(&buffer, entry->ip);
-                err = net_enqueue_active(&tx_queue, buffer);
-                assert(!err);
-                transmitted = true;
+        /* Resend the ARP request out to the network */
+        if (FW_DEBUG_OUTPUT) {
+            fw_trace_event(&trace, FW_TRACE_ARP_RETRY, arp_config.interface, 0, 0, 0, entry->ip, 0, 0,
+                           entry->num_retries);
+        }
 
-                if (FW_DEBUG_OUTPUT) {
-                    sddf_printf("ARP REQUESTER LOG: resent request for ip %s on interface %u\n",
-                                ipaddr_to_string(entry->ip, ip_addr_buf0), arp_config.interface);
-                }
+        if (send_request(entry, NULL)) {
+            pending_requests++;
+            if (FW_DEBUG_OUTPUT) {
+                fw_trace_event(&trace, FW_TRACE_ARP_RESENT, arp_config.interface, 0, 0, 0, entry->ip, 0, 0,
+                               entry->num_retries);
             }
+        } else if (!cut_short) {
+            next_cursor = idx;
+            cut_short = true;
+        }
+    }
+    retry_cursor = next_cursor;
 
-            /* Increment the number of retries */
-            entry->num_retries++;
-            pending_requests++;
+    /* Retries can not use the requests reserved for first requests, which
+    remain for those deferred and those made before the next tick */
+    for (uint16_t i = 0; deferred_first > 0 && i < arp_table.capacity; i++) {
+        fw_arp_entry_t *entry = arp_table.entries + i;
+        if (entry->state != ARP_STATE_PENDING || entry->num_retries != 0) {
+            continue;
+        }
+
+        deferred_first--;
+        if (send_request(entry, NULL) && FW_DEBUG_OUTPUT) {
+            fw_trace_event(&trace, FW_TRACE_ARP_REQUEST, arp_config.interface, 0, 0, 0, entry->ip, 0, 0,
+                           entry->client);
         }
     }
 
     return pending_requests;
 }
 
-/* Flush all non pending cache entries */
-static uint16_t arp_table_flush(void)
+/* Age reachable and unreachable entries. Reachable entries become stale
+shortly before they expire, and stale entries a client has requested again are
+probed until they are refreshed. Returns the number of expired entries. */
+static uint16_t process_aging(uint64_t now)
 {
-    uint16_t flushed = 0;
+    uint16_t expired = 0;
     for (uint16_t i = 0; i < arp_table.capacity; i++) {
         fw_arp_entry_t *entry = arp_table.entries + i;
-        if (entry->state == ARP_STATE_INVALID || entry->state == ARP_STATE_PENDING) {
+        if (entry->state != ARP_STATE_REACHABLE && entry->state != ARP_STATE_UNREACHABLE) {
+            continue;
+        }
+
+        if (now >= entry->expiry) {
+            fw_arp_table_remove_entry(&arp_table, entry);
+            expired++;
+            continue;
+        }
+
+        if (entry->state != ARP_STATE_REACHABLE) {
             continue;
         }
 
-        entry->state = ARP_STATE_INVALID;
-        flushed++;
+        if (!entry->stale) {
+            entry->stale = (entry->expiry - now <= ARP_REFRESH_NS);
+        } else if (entry->refresh && entry->num_retries < ARP_MAX_RETRIES
+                   && send_request(entry, entry->mac_addr)) {
+            if (FW_DEBUG_OUTPUT) {
+                fw_trace_event(&trace, FW_TRACE_ARP_RESENT, arp_config.interface, 0, 0, 0, entry->ip, 0, 0,
+                               entry->num_retries);
+            }
+        }
     }
 
-    return flushed;
+    return expired;
 }
 
 void init(void)
@@ -295,6 +535,10 @@ void init(void)
     }
 
     fw_arp_table_init(&arp_table, (fw_arp_entry_t *)arp_config.arp_cache.vaddr, arp_config.arp_cache_capacity);
+    lifetime_rng = ((uint64_t)arp_config.ip << 32) | arp_config.interface | 1;
+    arp_tx_refill();
+
+    fw_trace_init(&trace, arp_config.trace.ring.vaddr, arp_config.trace.capacity, FW_TRACE_ARP_REQUESTER);
 
     /* Set the first tick */
     sddf_timer_set_timeout(timer_config.driver_id, ARP_RETRY_TIMER_NS);
@@ -302,30 +546,27 @@ void init(void)
 
 void notified(microkit_channel ch)
 {
+    if (fw_trace_enabled(&trace)) {
+        fw_trace_set_time(&trace, sddf_timer_time_now(timer_config.driver_id));
+    }
+
     if (ch == arp_config.arp_clients[0].ch || (arp_config.num_arp_clients == 2 && ch == arp_config.arp_clients[1].ch)) {
         process_requests();
     }
     if (ch == net_config.rx.id) {
         process_responses();
     } else if (ch == timer_config.driver_id) {
-        ticks_to_flush--;
-        if (ticks_to_flush != 0) {
-            uint16_t retries = process_retries();
-
-            if (FW_DEBUG_OUTPUT && retries > 0) {
-                sddf_printf("ARP REQUESTER LOG: processed %u retries for tick %lu on interface %u\n", retries,
-                            ticks_to_flush, arp_config.interface);
-            }
-
-        } else {
-            uint16_t flushed = arp_table_flush();
-
-            if (FW_DEBUG_OUTPUT && flushed > 0) {
-                sddf_printf("ARP REQUESTER LOG: flushed %u entries from cache on interface %u\n", flushed,
-                            arp_config.interface);
-            }
+        uint64_t now = sddf_timer_time_now(timer_config.driver_id);
+        arp_tx_refill();
+        uint16_t retries = process_retries(now);
+        if (FW_DEBUG_OUTPUT && retries > 0) {
+            sddf_printf("ARP REQUESTER LOG: processed %u retries on interface %u\n", retries, arp_config.interface);
+        }
 
-            ticks_to_flush = ARP_TICKS_PER_FLUSH;
+        uint16_t expired = process_aging(now);
+        if (FW_DEBUG_OUTPUT && expired > 0) {
+            sddf_printf("ARP REQUESTER LOG: expired %u entries from cache on interface %u\n", expired,
+                        arp_config.interface);
         }
 
         sddf_timer_set_timeout(timer_config.driver_id, ARP_RETRY_TIMER_NS);
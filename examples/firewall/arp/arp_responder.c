@@ -19,6 +19,7 @@
 #include <lions/firewall/config.h>
 #include <lions/firewall/common.h>
 #include <lions/firewall/ethernet.h>
+#include <lions/firewall/trace.h>
 
 __attribute__((__section__(".net_client_config"))) net_client_config_t net_config;
 __attribute__((__section__(".serial_client_config"))) serial_client_config_t serial_config;
@@ -30,6 +31,9 @@ net_queue_handle_t tx_queue;
 
 serial_queue_handle_t serial_tx_queue_handle;
 
+/* Packet path event trace */
+fw_trace_t trace;
+
 static int arp_reply(const uint8_t ethsrc_addr[ETH_HWADDR_LEN], const uint8_t ethdst_addr[ETH_HWADDR_LEN],
                      const uint8_t hwsrc_addr[ETH_HWADDR_LEN], const uint32_t ipsrc_addr,
                      const uint8_t hwdst_addr[ETH_HWADDR_LEN], const uint32_t ipdst_addr)
@@ -93,8 +97,8 @@ static void receive(void)
                     if (arp_pkt->ipdst_addr == arp_config.ip) {
 
                         if (FW_DEBUG_OUTPUT) {
-                            sddf_printf("ARP RESPONDER LOG: replying for ip %s on interface %u\n",
-                                        ipaddr_to_string(arp_pkt->ipdst_addr, ip_addr_buf0), arp_config.interface);
+                            fw_trace_event(&trace, FW_TRACE_ARP_REPLY, arp_config.interface, 0, arp_pkt->ipsrc_addr,
+                                           0, arp_pkt->ipdst_addr, 0, 0, 0);
                         }
 
                         /* Reply with the MAC of the firewall */
@@ -144,11 +148,16 @@ void init(void)
     net_queue_init(&tx_queue, net_config.tx.free_queue.vaddr, net_config.tx.active_queue.vaddr,
                    net_config.tx.num_buffers);
     net_buffers_init(&tx_queue, 0);
+
+    fw_trace_init(&trace, arp_config.trace.ring.vaddr, arp_config.trace.capacity, FW_TRACE_ARP_RESPONDER);
 }
 
 void notified(microkit_channel ch)
 {
     if (ch == net_config.rx.id) {
+        if (fw_trace_enabled(&trace)) {
+            fw_trace_set_time(&trace, sddf_timer_time_now(timer_config.driver_id));
+        }
         receive();
     }
 }
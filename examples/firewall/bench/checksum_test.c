@@ -0,0 +1,182 @@
+/*
+ * Copyright 2026, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Standalone test of the internet checksum against its portable reference.
+ * Small enough to run under user mode emulation, so that the NEON path taken
+ * on AArch64 is exercised by CI on hosts of other architectures. Covers every
+ * length around the widths the sum is accumulated over at every alignment,
+ * buffers of all ones whose carries must be folded back in, buffers summing to
+ * exactly 0xffff, sums accumulated over several buffers and the incremental
+ * checksum updates.
+ *
+ * usage: checksum_test
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lions/firewall/checksum.h>
+
+/* Ensure AArch64 builds test the NEON path rather than the portable one */
+#if defined(__aarch64__) && !defined(__ARM_NEON)
+#error "checksum_test must be built with NEON on AArch64"
+#endif
+
+/* Lengths up to this are tested at every alignment */
+#define TEST_SHORT_LEN 300
+/* Alignments tested, relative to a 16 byte aligned buffer */
+#define TEST_ALIGNMENTS 16
+#define TEST_RANDOM_CASES 2000
+
+/* Buffer large enough for the longest checksummed length at any alignment */
+static uint8_t test_buf[UINT16_MAX + TEST_ALIGNMENTS] __attribute__((aligned(16)));
+static uint8_t test_ref_buf[UINT16_MAX] __attribute__((aligned(16)));
+static uint64_t test_rng = 1;
+static uint32_t test_cases;
+
+static uint64_t test_rand(void)
+{
+    test_rng ^= test_rng << 13;
+    test_rng ^= test_rng >> 7;
+    test_rng ^= test_rng << 17;
+    return test_rng;
+}
+
+/* Fill the reference buffer with a byte, or random bytes if fill is negative */
+static void test_fill(uint16_t len, int fill)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        test_ref_buf[i] = (fill < 0) ? (uint8_t)test_rand() : (uint8_t)fill;
+    }
+}
+
+/* Checksum the reference buffer copied to an alignment, and compare it to the
+reference checksum */
+static void test_check(const char *name, uint16_t len, uint8_t align)
+{
+    uint8_t *buf = test_buf + align;
+    memcpy(buf, test_ref_buf, len);
+    uint16_t expected = fw_internet_checksum_ref(test_ref_buf, len);
+    uint16_t check = fw_internet_checksum(buf, len);
+    test_cases++;
+    if (check != expected) {
+        fprintf(stderr, "checksum_test: %s: %u bytes at alignment %u is 0x%04x, reference is 0x%04x\n", name, len,
+                align, check, expected);
+        exit(1);
+    }
+
+    /* A sum accumulated over two buffers must match, as long as only the last
+    may have an odd length */
+    uint16_t split = (uint16_t)(test_rand() % (len + 1)) & ~1;
+    uint64_t sum = fw_checksum_add(buf, split, 0);
+    sum = fw_checksum_add(buf + split, len - split, sum);
+    check = (uint16_t)~fw_checksum_fold(sum);
+    if (check != expected) {
+        fprintf(stderr, "checksum_test: %s: %u bytes at alignment %u split at %u is 0x%04x, reference is 0x%04x\n",
+                name, len, align, split, check, expected);
+        exit(1);
+    }
+}
+
+static void test_expect(const char *name, uint16_t check, uint16_t expected)
+{
+    test_cases++;
+    if (check != expected) {
+        fprintf(stderr, "checksum_test: %s is 0x%04x, expected 0x%04x\n", name, check, expected);
+        exit(1);
+    }
+}
+
+static void test_lengths(void)
+{
+    for (uint16_t len = 0; len <= TEST_SHORT_LEN; len++) {
+        for (uint8_t align = 0; align < TEST_ALIGNMENTS; align++) {
+            test_fill(len, -1);
+            test_check("random", len, align);
+            test_fill(len, 0xff);
+            test_check("all ones", len, align);
+            test_fill(len, 0);
+            test_check("all zeros", len, align);
+        }
+    }
+
+    for (uint32_t i = 0; i < TEST_RANDOM_CASES; i++) {
+        uint16_t len = (uint16_t)test_rand();
+        test_fill(len, (i % 2) ? 0xff : -1);
+        test_check("long", len, test_rand() % TEST_ALIGNMENTS);
+    }
+
+    /* The longest buffers carry the most into the upper bits of the sum */
+    for (uint16_t len = UINT16_MAX - 3; len != 0; len++) {
+        for (uint8_t align = 0; align < TEST_ALIGNMENTS; align++) {
+            test_fill(len, 0xff);
+            test_check("longest all ones", len, align);
+            test_fill(len, 0xfe);
+            test_check("longest", len, align);
+        }
+    }
+}
+
+static void test_carries(void)
+{
+    /* Words summing to exactly 0xffff, before and after folding a carry */
+    uint8_t *buf = test_buf + 1;
+    uint16_t words[] = { 0x8000, 0x7fff, 0x0000 };
+    memcpy(buf, words, sizeof(words));
+    test_expect("0x8000 + 0x7fff", fw_internet_checksum(buf, sizeof(words)), 0x0000);
+
+    uint16_t carry_words[] = { 0xffff, 0x0001, 0xfffe };
+    memcpy(buf, carry_words, sizeof(carry_words));
+    test_expect("0xffff + 0x0001 + 0xfffe", fw_internet_checksum(buf, sizeof(carry_words)), 0x0000);
+
+    /* A trailing odd byte is the low-order byte of its word in memory */
+    uint8_t odd[] = { 0xff, 0xff, 0xff };
+    memcpy(buf, odd, sizeof(odd));
+    test_expect("odd trailing byte", fw_internet_checksum(buf, sizeof(odd)),
+                fw_internet_checksum_ref(odd, sizeof(odd)));
+}
+
+static void test_updates(void)
+{
+    for (uint32_t i = 0; i < TEST_RANDOM_CASES; i++) {
+        uint16_t len = 8 + 4 * (test_rand() % 16);
+        test_fill(len, (i % 4 == 0) ? 0xff : -1);
+        uint16_t check = fw_internet_checksum_ref(test_ref_buf, len);
+
+        /* Replace an aligned 16-bit word */
+        uint16_t offset = 2 * (test_rand() % (len / 2));
+        uint16_t old_word, new_word = (i % 8 == 0) ? 0xffff : (uint16_t)test_rand();
+        memcpy(&old_word, test_ref_buf + offset, sizeof(old_word));
+        memcpy(test_ref_buf + offset, &new_word, sizeof(new_word));
+        check = fw_checksum_update16(check, old_word, new_word);
+        test_expect("16-bit update", check, fw_internet_checksum_ref(test_ref_buf, len));
+
+        /* Replace an aligned 32-bit field */
+        offset = 4 * (test_rand() % (len / 4));
+        uint32_t old_field, new_field = (i % 8 == 1) ? 0xffffffff : (uint32_t)test_rand();
+        memcpy(&old_field, test_ref_buf + offset, sizeof(old_field));
+        memcpy(test_ref_buf + offset, &new_field, sizeof(new_field));
+        check = fw_checksum_update32(check, old_field, new_field);
+        test_expect("32-bit update", check, fw_internet_checksum_ref(test_ref_buf, len));
+    }
+}
+
+int main(void)
+{
+    test_lengths();
+    test_carries();
+    test_updates();
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    const char *path = "neon";
+#else
+    const char *path = "portable";
+#endif
+    printf("checksum_test: %u cases passed (%s)\n", test_cases, path);
+    return 0;
+}
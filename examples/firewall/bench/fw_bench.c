@@ -0,0 +1,1189 @@
+/*
+ * Copyright 2026, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Host benchmark of the firewall data plane. Packets are replayed from a pcap
+ * file, or from a synthetic trace of TCP and UDP flows, through the same filter,
+ * routing table, packet waiting queue, ARP table and checksum functions used by
+ * the filter and routing components. Throughput is reported for the filter
+ * stage, the routing stage and the two combined, along with the latency
+ * percentiles of individual packets through both stages. The internet checksum
+ * is cross-checked against its portable reference on random buffers, then both
+ * are timed over full sized packets.
+ *
+ * The benchmark models a firewall with an internal interface 0 and an external
+ * interface 1, each with a TCP and a UDP filter. Filters on opposite interfaces
+ * share their instance tables as they would in the firewall, so return traffic
+ * of a connection is matched as established. Packets initiating a flow are
+ * received on the internal interface.
+ *
+ * usage: fw_bench [options]
+ *   --pcap FILE        replay IPv4 TCP and UDP packets from an Ethernet pcap
+ *   --flows N          flows in the synthetic trace (default 1024)
+ *   --packets N        packets in the synthetic trace (default 262144)
+ *   --rules N          rules added to each filter (default 256)
+ *   --routes N         routes added to the routing table (default 256)
+ *   --arp-entries N    capacity of each ARP table, rounded up to a power of 2 (default 1024)
+ *   --instances N      capacity of each instance table, a power of 2 (default 4096)
+ *   --iterations N     timed passes over the trace (default 5)
+ *   --seed N           seed of the synthetic trace, rules and routes (default 1)
+ *   --min-pps N        fail if the pipeline forwards fewer packets per second
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <lions/firewall/adjacency.h>
+#include <lions/firewall/arp.h>
+#include <lions/firewall/checksum.h>
+#include <lions/firewall/common.h>
+#include <lions/firewall/config.h>
+#include <lions/firewall/filter.h>
+#include <lions/firewall/ip.h>
+#include <lions/firewall/queue.h>
+#include <lions/firewall/routing.h>
+#include <lions/firewall/tcp.h>
+#include <lions/firewall/udp.h>
+
+#define BENCH_INTERFACES 2
+#define BENCH_INTERNAL 0
+#define BENCH_EXTERNAL 1
+
+#define BENCH_FILTER_TCP 0
+#define BENCH_FILTER_UDP 1
+#define BENCH_FILTERS 2
+
+/* Bytes of each packet kept, enough for an IPv4 header with options followed by
+a TCP header without options */
+#define BENCH_SNAPLEN 96
+
+/* Packets processed by each stage before the next stage runs, as components
+process the packets available when they are notified */
+#define BENCH_BATCH 32
+
+#define BENCH_QUEUE_CAPACITY 512
+#define BENCH_PKT_WAITING_CAPACITY 128
+#define BENCH_PKT_WAITING_DEST_CAPACITY 16
+#define BENCH_IP_SET_RANGES 16
+
+/* Directly connected networks and the two paths of the default route */
+#define BENCH_FIXED_ROUTES 4
+/* Number of gateways routes are sent through */
+#define BENCH_GATEWAYS 64
+/* Number of internal hosts flows originate from */
+#define BENCH_HOSTS 256
+
+#define BENCH_MAX_REGIONS 64
+
+/* Buffers the checksum is cross-checked on, and full sized packets it is
+timed over. Packets are checksummed from a ring small enough to stay cached,
+as received packets are checksummed after being inspected */
+#define BENCH_CHECKSUM_TESTS 20000
+#define BENCH_CHECKSUM_PACKETS 16384
+#define BENCH_CHECKSUM_RING 128
+#define BENCH_CHECKSUM_LEN 1500
+#define BENCH_CHECKSUM_STRIDE 2048
+
+#define BENCH_NS_IN_S 1000000000ULL
+
+typedef struct bench_pkt {
+    uint8_t data[BENCH_SNAPLEN];
+    /* length of the packet on the wire */
+    uint16_t len;
+    /* interface the packet is received on */
+    uint8_t interface;
+} bench_pkt_t;
+
+typedef struct bench_flow {
+    /* addresses and ports in network byte order */
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t protocol;
+    /* next packet of the flow's TCP exchange */
+    uint8_t stage;
+    /* data packets left before the TCP connection is closed */
+    uint8_t remaining;
+} bench_flow_t;
+
+typedef struct bench_filter {
+    fw_filter_state_t state;
+    fw_verdict_t verdict_cache[FW_VERDICT_CACHE_SIZE];
+    fw_rate_source_t rate_sources[FW_RATE_SOURCES];
+    uint16_t half_open_sources[FW_TCP_HALF_OPEN_SOURCES];
+    region_resource_t external_instances[1];
+    region_resource_t return_seen[1];
+    region_resource_t neighbour_return_seen[1];
+    void *internal_instances;
+} bench_filter_t;
+
+typedef struct bench_counts {
+    uint64_t filtered;
+    uint64_t forwarded;
+    uint64_t no_route;
+    uint64_t ttl_expired;
+    uint64_t waiting;
+    uint64_t waiting_dropped;
+} bench_counts_t;
+
+typedef struct bench_config {
+    const char *pcap;
+    uint32_t flows;
+    uint32_t packets;
+    uint16_t rules;
+    uint16_t routes;
+    uint16_t arp_entries;
+    uint16_t instances;
+    uint32_t iterations;
+    uint64_t seed;
+    uint64_t min_pps;
+} bench_config_t;
+
+typedef struct bench {
+    bench_config_t config;
+
+    /* trace as captured, and the copy modified by a pass */
+    bench_pkt_t *trace;
+    bench_pkt_t *work;
+    uint32_t num_packets;
+    /* whether each packet was forwarded by its filter */
+    bool *forwarded;
+
+    fw_rule_t *rules[BENCH_INTERFACES][BENCH_FILTERS];
+    uint16_t num_rules[BENCH_INTERFACES][BENCH_FILTERS];
+    fw_routing_entry_t *routes;
+    uint16_t num_routes;
+
+    bench_filter_t filters[BENCH_INTERFACES][BENCH_FILTERS];
+    fw_queue_t router_queue;
+    fw_queue_t tx_queue[BENCH_INTERFACES];
+    fw_routing_table_t *routing_table;
+    fw_arp_table_t arp_table[BENCH_INTERFACES];
+    fw_adjacency_table_t adjacency_table;
+    pkts_waiting_t pkt_waiting[BENCH_INTERFACES];
+
+    /* regions allocated for a pass */
+    void *regions[BENCH_MAX_REGIONS];
+    uint16_t num_regions;
+
+    bench_counts_t counts;
+    uint64_t rng;
+} bench_t;
+
+/* Addresses of the firewall's interfaces in host byte order */
+static const uint32_t bench_interface_ip[BENCH_INTERFACES] = { 0x0a000001, 0xc0a80002 };
+static const uint16_t bench_common_ports[] = { 22, 25, 53, 80, 123, 443, 993, 3306, 5432, 8080 };
+#define BENCH_NUM_COMMON_PORTS (sizeof(bench_common_ports) / sizeof(bench_common_ports[0]))
+
+void _sddf_putchar(char character)
+{
+    putchar(character);
+}
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * BENCH_NS_IN_S + ts.tv_nsec;
+}
+
+static uint64_t bench_rand(bench_t *bench)
+{
+    /* xorshift64* */
+    bench->rng ^= bench->rng >> 12;
+    bench->rng ^= bench->rng << 25;
+    bench->rng ^= bench->rng >> 27;
+    return bench->rng * 0x2545f4914f6cdd1dULL;
+}
+
+static uint32_t bench_rand_range(bench_t *bench, uint32_t min, uint32_t max)
+{
+    return min + (uint32_t)(bench_rand(bench) % (max - min + 1));
+}
+
+static void *bench_alloc(size_t size)
+{
+    void *region = calloc(1, size);
+    if (region == NULL) {
+        fprintf(stderr, "fw_bench: could not allocate %zu bytes\n", size);
+        exit(1);
+    }
+    return region;
+}
+
+/* Allocate a zeroed region that is released at the end of a pass */
+static void *bench_region(bench_t *bench, size_t size)
+{
+    if (bench->num_regions == BENCH_MAX_REGIONS) {
+        fprintf(stderr, "fw_bench: too many regions\n");
+        exit(1);
+    }
+    void *region = bench_alloc(size);
+    bench->regions[bench->num_regions++] = region;
+    return region;
+}
+
+static uint32_t bench_next_power_of_2(uint32_t n)
+{
+    uint32_t power = 1;
+    while (power < n) {
+        power <<= 1;
+    }
+    return power;
+}
+
+/* Address in network byte order from its octets */
+static uint32_t bench_ip(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+    return htonl(((uint32_t)a << 24) | ((uint32_t)b << 16) | ((uint32_t)c << 8) | d);
+}
+
+/* Address of a random host of the internal network */
+static uint32_t bench_host_ip(bench_t *bench)
+{
+    uint32_t host = bench_rand_range(bench, 0, BENCH_HOSTS - 1);
+    return bench_ip(10, 0, 1 + host / 250, 1 + host % 250);
+}
+
+/* Rules cover the hosts and routed networks traffic is generated for */
+static void bench_generate_rules(bench_t *bench)
+{
+    for (uint8_t interface = 0; interface < BENCH_INTERFACES; interface++) {
+        for (uint8_t f = 0; f < BENCH_FILTERS; f++) {
+            fw_rule_t *rules = bench_alloc((bench->config.rules + 1) * sizeof(fw_rule_t));
+            bench->rules[interface][f] = rules;
+
+            /* Outbound traffic creates connections unless a rule says otherwise,
+            inbound traffic is dropped unless it is return traffic or allowed */
+            rules[DEFAULT_ACTION_IDX].action = (interface == BENCH_INTERNAL) ? FILTER_ACT_CONNECT : FILTER_ACT_DROP;
+            rules[DEFAULT_ACTION_IDX].src_port_any = true;
+            rules[DEFAULT_ACTION_IDX].dst_port_any = true;
+            rules[DEFAULT_ACTION_IDX].rule_id = DEFAULT_ACTION_RULE_ID;
+
+            for (uint16_t r = 1; r <= bench->config.rules; r++) {
+                fw_rule_t *rule = rules + r;
+                uint32_t kind = bench_rand_range(bench, 0, 99);
+                rule->src_port_any = true;
+                if (bench_rand_range(bench, 0, 3) == 0) {
+                    rule->dst_port_any = true;
+                } else {
+                    rule->dst_port = htons(bench_common_ports[bench_rand(bench) % BENCH_NUM_COMMON_PORTS]);
+                }
+
+                if (interface == BENCH_INTERNAL) {
+                    if (kind < 50 && bench->num_routes > BENCH_FIXED_ROUTES) {
+                        /* Part of a routed network */
+                        fw_routing_entry_t *route = bench->routes
+                                                  + bench_rand_range(bench, BENCH_FIXED_ROUTES, bench->num_routes - 1);
+                        rule->dst_ip = route->ip | (htonl((uint32_t)bench_rand(bench)) & ~subnet_mask(route->subnet));
+                        rule->dst_subnet = MIN(route->subnet + bench_rand_range(bench, 0, 4), 32);
+                    } else {
+                        rule->src_ip = bench_host_ip(bench);
+                        rule->src_subnet = bench_rand_range(bench, 24, 32);
+                    }
+                    uint32_t action = bench_rand_range(bench, 0, 99);
+                    rule->action = (action < 70) ? FILTER_ACT_CONNECT
+                                                 : ((action < 90) ? FILTER_ACT_ALLOW : FILTER_ACT_DROP);
+                } else {
+                    /* Services of the internal network exposed externally */
+                    rule->dst_ip = bench_host_ip(bench);
+                    rule->dst_subnet = bench_rand_range(bench, 24, 32);
+                    if (kind < 25) {
+                        rule->src_ip = (uint32_t)bench_rand(bench);
+                        rule->src_subnet = bench_rand_range(bench, 8, 24);
+                    }
+                    rule->action = (bench_rand_range(bench, 0, 1) == 0) ? FILTER_ACT_ALLOW : FILTER_ACT_DROP;
+                }
+                rule->src_ip &= subnet_mask(rule->src_subnet);
+                rule->dst_ip &= subnet_mask(rule->dst_subnet);
+            }
+        }
+    }
+}
+
+static void bench_generate_routes(bench_t *bench)
+{
+    uint16_t capacity = bench->config.routes + BENCH_FIXED_ROUTES;
+    bench->routes = bench_alloc(capacity * sizeof(fw_routing_entry_t));
+
+    /* Directly connected networks and a default route through two uplinks */
+    bench->routes[0] = (fw_routing_entry_t) { .ip = bench_ip(10, 0, 0, 0), .subnet = 8, .interface = BENCH_INTERNAL,
+                                              .weight = 1 };
+    bench->routes[1] = (fw_routing_entry_t) { .ip = bench_ip(192, 168, 0, 0), .subnet = 16,
+                                              .interface = BENCH_EXTERNAL, .weight = 1 };
+    bench->routes[2] = (fw_routing_entry_t) { .ip = 0, .subnet = 0, .interface = BENCH_EXTERNAL, .weight = 1,
+                                              .next_hop = bench_ip(192, 168, 0, 1) };
+    bench->routes[3] = (fw_routing_entry_t) { .ip = 0, .subnet = 0, .interface = BENCH_EXTERNAL, .weight = 1,
+                                              .next_hop = bench_ip(192, 168, 0, 3) };
+    bench->num_routes = BENCH_FIXED_ROUTES;
+
+    /* Networks reached through gateways, or directly on the external network */
+    for (uint16_t r = 0; r < bench->config.routes; r++) {
+        uint8_t subnet = bench_rand_range(bench, 16, 28);
+        uint32_t ip = (bench_ip(172, 16, 0, 0) | htonl(bench_rand(bench) & 0x000fffff)) & subnet_mask(subnet);
+        uint32_t next_hop = FW_ROUTING_NONEXTHOP;
+        if (bench_rand_range(bench, 0, 4) != 0) {
+            next_hop = bench_ip(192, 168, 1, bench_rand_range(bench, 1, BENCH_GATEWAYS));
+        }
+
+        bool clash = false;
+        for (uint16_t i = 0; i < bench->num_routes; i++) {
+            if (bench->routes[i].subnet == subnet && bench->routes[i].ip == ip) {
+                clash = true;
+                break;
+            }
+        }
+        if (clash) {
+            continue;
+        }
+
+        bench->routes[bench->num_routes++] = (fw_routing_entry_t) { .ip = ip, .subnet = subnet,
+                                                                    .interface = BENCH_EXTERNAL, .weight = 1,
+                                                                    .next_hop = next_hop };
+    }
+}
+
+/* Write the headers of a packet of a flow, in the direction of the flow or its
+return traffic */
+static void bench_build_packet(bench_pkt_t *pkt, bench_flow_t *flow, bool reverse, uint8_t flags,
+                               uint16_t payload_len)
+{
+    memset(pkt, 0, sizeof(bench_pkt_t));
+    eth_hdr_t *eth_hdr = (eth_hdr_t *)pkt->data;
+    ipv4_hdr_t *ip_hdr = (ipv4_hdr_t *)(pkt->data + IPV4_HDR_OFFSET);
+
+    eth_hdr->ethtype = htons(ETH_TYPE_IP);
+    eth_hdr->ethsrc_addr[0] = 0x02;
+    eth_hdr->ethdst_addr[0] = 0x02;
+
+    uint16_t transport_len = (flow->protocol == IPV4_PROTO_TCP) ? sizeof(tcp_hdr_t) : sizeof(udp_hdr_t);
+    ip_hdr->version = 4;
+    ip_hdr->ihl = IPV4_HDR_LEN_MIN / 4;
+    ip_hdr->tot_len = htons(IPV4_HDR_LEN_MIN + transport_len + payload_len);
+    ip_hdr->ttl = 64;
+    ip_hdr->protocol = flow->protocol;
+    ip_hdr->src_ip = reverse ? flow->dst_ip : flow->src_ip;
+    ip_hdr->dst_ip = reverse ? flow->src_ip : flow->dst_ip;
+    ip_hdr->check = fw_internet_checksum(ip_hdr, IPV4_HDR_LEN_MIN);
+
+    uint16_t src_port = reverse ? flow->dst_port : flow->src_port;
+    uint16_t dst_port = reverse ? flow->src_port : flow->dst_port;
+    if (flow->protocol == IPV4_PROTO_TCP) {
+        tcp_hdr_t *tcp_hdr = (tcp_hdr_t *)(pkt->data + transport_layer_offset(ip_hdr));
+        tcp_hdr->src_port = src_port;
+        tcp_hdr->dst_port = dst_port;
+        tcp_hdr->doff = sizeof(tcp_hdr_t) / 4;
+        pkt->data[transport_layer_offset(ip_hdr) + TCP_FLAGS_OFFSET] = flags;
+    } else {
+        udp_hdr_t *udp_hdr = (udp_hdr_t *)(pkt->data + transport_layer_offset(ip_hdr));
+        udp_hdr->src_port = src_port;
+        udp_hdr->dst_port = dst_port;
+        udp_hdr->len = htons(sizeof(udp_hdr_t) + payload_len);
+    }
+
+    pkt->len = ETH_HDR_LEN + IPV4_HDR_LEN_MIN + transport_len + payload_len;
+    pkt->interface = reverse ? BENCH_EXTERNAL : BENCH_INTERNAL;
+}
+
+static void bench_new_connection(bench_t *bench, bench_flow_t *flow)
+{
+    flow->src_port = htons(bench_rand_range(bench, 32768, 60999));
+    flow->stage = 0;
+    flow->remaining = bench_rand_range(bench, 2, 32);
+}
+
+/* Generate a trace of interleaved flows. TCP flows run through the handshake,
+data in both directions and the close, then reconnect from a new port */
+static void bench_generate_trace(bench_t *bench)
+{
+    bench_flow_t *flows = bench_alloc(bench->config.flows * sizeof(bench_flow_t));
+    for (uint32_t i = 0; i < bench->config.flows; i++) {
+        bench_flow_t *flow = flows + i;
+        flow->src_ip = bench_host_ip(bench);
+        flow->protocol = (bench_rand_range(bench, 0, 4) == 0) ? IPV4_PROTO_UDP : IPV4_PROTO_TCP;
+        flow->dst_port = htons(bench_common_ports[bench_rand(bench) % BENCH_NUM_COMMON_PORTS]);
+
+        uint32_t dst = bench_rand_range(bench, 0, 99);
+        if (dst < 70 && bench->num_routes > BENCH_FIXED_ROUTES) {
+            /* Destination within a routed network */
+            fw_routing_entry_t *route = bench->routes
+                                      + bench_rand_range(bench, BENCH_FIXED_ROUTES, bench->num_routes - 1);
+            flow->dst_ip = route->ip | (htonl((uint32_t)bench_rand(bench)) & ~subnet_mask(route->subnet));
+        } else if (dst < 80) {
+            flow->dst_ip = bench_ip(192, 168, bench_rand_range(bench, 2, 255), bench_rand_range(bench, 1, 254));
+        } else {
+            /* Destination reached through the default route */
+            flow->dst_ip = bench_ip(bench_rand_range(bench, 11, 223), bench_rand(bench), bench_rand(bench),
+                                    bench_rand(bench));
+        }
+        bench_new_connection(bench, flow);
+    }
+
+    bench->num_packets = bench->config.packets;
+    bench->trace = bench_alloc(bench->num_packets * sizeof(bench_pkt_t));
+    for (uint32_t i = 0; i < bench->num_packets; i++) {
+        bench_flow_t *flow = flows + bench_rand(bench) % bench->config.flows;
+        bench_pkt_t *pkt = bench->trace + i;
+        uint16_t payload_len = bench_rand_range(bench, 0, 1400);
+
+        if (flow->protocol == IPV4_PROTO_UDP) {
+            bench_build_packet(pkt, flow, flow->stage++ > 0 && bench_rand_range(bench, 0, 1), 0, payload_len);
+            continue;
+        }
+
+        switch (flow->stage) {
+        case 0:
+            bench_build_packet(pkt, flow, false, TCP_FLAG_SYN, 0);
+            flow->stage++;
+            break;
+        case 1:
+            bench_build_packet(pkt, flow, true, TCP_FLAG_SYN | TCP_FLAG_ACK, 0);
+            flow->stage++;
+            break;
+        case 2:
+            bench_build_packet(pkt, flow, false, TCP_FLAG_ACK, 0);
+            flow->stage++;
+            break;
+        case 3:
+            bench_build_packet(pkt, flow, bench_rand_range(bench, 0, 1), TCP_FLAG_PSH | TCP_FLAG_ACK, payload_len);
+            if (--flow->remaining == 0) {
+                flow->stage++;
+            }
+            break;
+        case 4:
+            bench_build_packet(pkt, flow, false, TCP_FLAG_FIN | TCP_FLAG_ACK, 0);
+            flow->stage++;
+            break;
+        case 5:
+            bench_build_packet(pkt, flow, true, TCP_FLAG_FIN | TCP_FLAG_ACK, 0);
+            flow->stage++;
+            break;
+        default:
+            bench_build_packet(pkt, flow, false, TCP_FLAG_ACK, 0);
+            bench_new_connection(bench, flow);
+            break;
+        }
+    }
+
+    free(flows);
+}
+
+static uint32_t bench_pcap_u32(uint8_t *bytes, bool swapped)
+{
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return swapped ? __builtin_bswap32(value) : value;
+}
+
+/* Find the interface a pcap packet is received on. The first packet seen of a
+flow is taken to be sent by its initiator on the internal interface */
+static uint8_t bench_pcap_direction(uint32_t *initiators, uint32_t capacity, ipv4_hdr_t *ip_hdr, uint16_t src_port,
+                                    uint16_t dst_port)
+{
+    /* Hash the flow the same way in either direction */
+    uint32_t forward = fw_flow_hash(ip_hdr->src_ip, src_port, ip_hdr->dst_ip, dst_port);
+    uint32_t reverse = fw_flow_hash(ip_hdr->dst_ip, dst_port, ip_hdr->src_ip, src_port);
+    uint32_t key = (forward ^ reverse) | 1;
+    uint32_t initiator = forward | 1;
+
+    for (uint32_t i = 0; i < capacity; i++) {
+        uint32_t *slot = initiators + 2 * ((key + i) & (capacity - 1));
+        if (slot[0] == 0) {
+            slot[0] = key;
+            slot[1] = initiator;
+            return BENCH_INTERNAL;
+        }
+        if (slot[0] == key) {
+            return (slot[1] == initiator) ? BENCH_INTERNAL : BENCH_EXTERNAL;
+        }
+    }
+    return BENCH_INTERNAL;
+}
+
+/* Read the IPv4 TCP and UDP packets of a classic pcap file with Ethernet link
+type. Other packets, and fragments after the first, are skipped */
+static void bench_read_pcap(bench_t *bench)
+{
+    FILE *file = fopen(bench->config.pcap, "rb");
+    if (file == NULL) {
+        perror(bench->config.pcap);
+        exit(1);
+    }
+
+    uint8_t header[24];
+    if (fread(header, sizeof(header), 1, file) != 1) {
+        fprintf(stderr, "fw_bench: %s is not a pcap file\n", bench->config.pcap);
+        exit(1);
+    }
+
+    uint32_t magic;
+    memcpy(&magic, header, sizeof(magic));
+    bool swapped = (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1);
+    if (!swapped && magic != 0xa1b2c3d4 && magic != 0xa1b23c4d) {
+        fprintf(stderr, "fw_bench: %s is not a pcap file\n", bench->config.pcap);
+        exit(1);
+    }
+    if (bench_pcap_u32(header + 20, swapped) != 1) {
+        fprintf(stderr, "fw_bench: %s does not have Ethernet link type\n", bench->config.pcap);
+        exit(1);
+    }
+
+    uint32_t capacity = 1024;
+    bench->trace = bench_alloc(capacity * sizeof(bench_pkt_t));
+    uint32_t flow_capacity = 1 << 16;
+    uint32_t *initiators = bench_alloc(2 * flow_capacity * sizeof(uint32_t));
+
+    uint8_t record[16];
+    uint8_t *data = bench_alloc(UINT16_MAX + 1);
+    while (fread(record, sizeof(record), 1, file) == 1) {
+        uint32_t incl_len = bench_pcap_u32(record + 8, swapped);
+        uint32_t orig_len = bench_pcap_u32(record + 12, swapped);
+        if (incl_len > UINT16_MAX + 1 || fread(data, incl_len, 1, file) != 1) {
+            break;
+        }
+
+        eth_hdr_t *eth_hdr = (eth_hdr_t *)data;
+        ipv4_hdr_t *ip_hdr = (ipv4_hdr_t *)(data + IPV4_HDR_OFFSET);
+        if (incl_len < ETH_HDR_LEN + IPV4_HDR_LEN_MIN || eth_hdr->ethtype != htons(ETH_TYPE_IP)
+            || ip_hdr->version != 4 || (ip_hdr->protocol != IPV4_PROTO_TCP && ip_hdr->protocol != IPV4_PROTO_UDP)
+            || ip_hdr->frag_offset1 != 0 || ip_hdr->frag_offset2 != 0) {
+            continue;
+        }
+
+        uint32_t transport_len = (ip_hdr->protocol == IPV4_PROTO_TCP) ? sizeof(tcp_hdr_t) : sizeof(udp_hdr_t);
+        uint32_t headers_len = transport_layer_offset(ip_hdr) + transport_len;
+        if (headers_len > incl_len || headers_len > BENCH_SNAPLEN) {
+            continue;
+        }
+
+        if (bench->num_packets == capacity) {
+            capacity *= 2;
+            bench->trace = realloc(bench->trace, capacity * sizeof(bench_pkt_t));
+            if (bench->trace == NULL) {
+                fprintf(stderr, "fw_bench: could not allocate trace\n");
+                exit(1);
+            }
+        }
+
+        /* Source and destination ports are at the same offsets for TCP and UDP */
+        udp_hdr_t *udp_hdr = (udp_hdr_t *)(data + transport_layer_offset(ip_hdr));
+        bench_pkt_t *pkt = bench->trace + bench->num_packets++;
+        memset(pkt, 0, sizeof(bench_pkt_t));
+        memcpy(pkt->data, data, MIN(incl_len, BENCH_SNAPLEN));
+        pkt->len = MIN(orig_len, UINT16_MAX);
+        pkt->interface = bench_pcap_direction(initiators, flow_capacity, ip_hdr, udp_hdr->src_port,
+                                              udp_hdr->dst_port);
+    }
+
+    free(data);
+    free(initiators);
+    fclose(file);
+
+    if (bench->num_packets == 0) {
+        fprintf(stderr, "fw_bench: %s has no IPv4 TCP or UDP packets\n", bench->config.pcap);
+        exit(1);
+    }
+}
+
+/* Allocate and initialise the firewall state for a pass */
+static void bench_init_state(bench_t *bench)
+{
+    bench_config_t *config = &bench->config;
+    uint16_t rules_capacity = config->rules + 1;
+    uint32_t classifier_capacity = bench_next_power_of_2(2 * rules_capacity);
+    size_t classifier_size = sizeof(fw_classifier_t)
+                           + classifier_capacity * (sizeof(fw_classifier_entry_t) + sizeof(fw_classifier_tuple_t));
+    uint32_t bitmap_blocks = (rules_capacity + RULE_ID_BITMAP_BLK_SIZE - 1) / RULE_ID_BITMAP_BLK_SIZE;
+    size_t ip_sets_size = sizeof(fw_ip_sets_t) + BENCH_IP_SET_RANGES * sizeof(fw_ip_set_range_t);
+
+    /* Instance tables are shared with the filter of the same protocol on the
+    opposite interface, so all must exist before any filter is initialised */
+    for (uint8_t interface = 0; interface < BENCH_INTERFACES; interface++) {
+        for (uint8_t f = 0; f < BENCH_FILTERS; f++) {
+            bench->filters[interface][f].internal_instances = bench_region(
+                bench, sizeof(fw_instances_table_t) + config->instances * sizeof(fw_instance_t));
+            bench->filters[interface][f].return_seen[0].vaddr = bench_region(bench,
+                                                                             config->instances * sizeof(uint64_t));
+            bench->filters[interface][f].return_seen[0].size = config->instances * sizeof(uint64_t);
+        }
+    }
+
+    for (uint8_t interface = 0; interface < BENCH_INTERFACES; interface++) {
+        for (uint8_t f = 0; f < BENCH_FILTERS; f++) {
+            bench_filter_t *filter = &bench->filters[interface][f];
+            memset(filter->verdict_cache, 0, sizeof(filter->verdict_cache));
+            memset(filter->rate_sources, 0, sizeof(filter->rate_sources));
+            memset(filter->half_open_sources, 0, sizeof(filter->half_open_sources));
+            filter->external_instances[0].vaddr = bench->filters[!interface][f].internal_instances;
+            filter->external_instances[0].size = sizeof(fw_instances_table_t)
+                                               + config->instances * sizeof(fw_instance_t);
+            filter->neighbour_return_seen[0] = bench->filters[!interface][f].return_seen[0];
+
+            /* Rule IDs are written back to the initial rules */
+            fw_rule_t *initial_rules = bench_region(bench, rules_capacity * sizeof(fw_rule_t));
+            memcpy(initial_rules, bench->rules[interface][f], rules_capacity * sizeof(fw_rule_t));
+
+            uint64_t timeout = (f == BENCH_FILTER_TCP) ? FW_CONNTRACK_TCP_TIMEOUT_S : FW_CONNTRACK_UDP_TIMEOUT_S;
+            fw_filter_state_init(
+                &filter->state, bench_region(bench, sizeof(fw_rule_table_t) + rules_capacity * sizeof(fw_rule_t)),
+                bench_region(bench, sizeof(fw_rule_id_bitmap_t) + bitmap_blocks * sizeof(uint64_t)
+                                        + rules_capacity * sizeof(uint16_t)),
+                rules_capacity,
+                bench_region(bench, classifier_size), bench_region(bench, classifier_size),
+                classifier_capacity, filter->verdict_cache,
+                bench_region(bench, sizeof(fw_filter_stats_t) + rules_capacity * sizeof(fw_rule_stats_t)),
+                bench_region(bench, rules_capacity * sizeof(fw_rule_state_t)), filter->rate_sources,
+                filter->internal_instances, filter->external_instances, config->instances, timeout * BENCH_NS_IN_S,
+                initial_rules, 1, 1);
+
+            /* Rules are added one by one, as the webserver would, skipping
+            generated rules that clash */
+            for (uint16_t r = 1; r < rules_capacity; r++) {
+                fw_rule_t rule = initial_rules[r];
+                uint16_t rule_id;
+                fw_filter_add_rule(&filter->state, &rule, NULL, &rule_id);
+            }
+
+            fw_filter_ip_sets_init(&filter->state, bench_region(bench, ip_sets_size),
+                                   bench_region(bench, ip_sets_size), BENCH_IP_SET_RANGES);
+            fw_filter_return_seen_init(&filter->state, filter->return_seen, filter->neighbour_return_seen);
+
+            if (f == BENCH_FILTER_TCP) {
+                fw_filter_tcp_init(&filter->state, filter->half_open_sources,
+                                   bench_region(bench, config->instances * sizeof(fw_half_open_link_t)),
+                                   FW_CONNTRACK_TCP_HALF_OPEN_TIMEOUT_S * BENCH_NS_IN_S,
+                                   FW_CONNTRACK_TCP_FIN_WAIT_TIMEOUT_S * BENCH_NS_IN_S);
+            }
+        }
+    }
+
+    fw_queue_init(&bench->router_queue,
+                  bench_region(bench, sizeof(fw_queue_indeces_t) + BENCH_QUEUE_CAPACITY * sizeof(fw_buff_desc_t)),
+                  sizeof(fw_buff_desc_t), BENCH_QUEUE_CAPACITY);
+
+    uint16_t trie_capacity = 3 * bench->num_routes + 1;
+    fw_routing_table_init(&bench->routing_table,
+                          bench_region(bench, sizeof(fw_routing_table_t)
+                                                  + bench->num_routes * sizeof(fw_routing_entry_t)
+                                                  + trie_capacity * sizeof(fw_routing_trie_node_t)
+                                                  + bench->num_routes * sizeof(uint16_t)),
+                          bench->num_routes, trie_capacity, bench->routes, 0);
+    for (uint16_t r = 0; r < bench->num_routes; r++) {
+        fw_routing_entry_t *route = bench->routes + r;
+        fw_routing_err_t err = fw_routing_table_add_route(bench->routing_table, route->interface, route->ip,
+                                                          route->subnet, route->next_hop, route->weight);
+        if (err != ROUTING_ERR_OKAY) {
+            fprintf(stderr, "fw_bench: could not add route %u: %s\n", r, fw_routing_err_str[err]);
+            exit(1);
+        }
+    }
+
+    /* Room for a next hop in every ARP table entry, rounded to a power of 2 */
+    uint32_t adjacency_capacity = 1;
+    while (adjacency_capacity < BENCH_INTERFACES * config->arp_entries && adjacency_capacity < 0x8000) {
+        adjacency_capacity <<= 1;
+    }
+    fw_adjacency_table_init(&bench->adjacency_table,
+                            bench_region(bench, adjacency_capacity * (sizeof(fw_adjacency_t) + sizeof(uint16_t))
+                                                    + bench->num_routes * sizeof(uint16_t)),
+                            adjacency_capacity, bench->num_routes);
+
+    for (uint8_t interface = 0; interface < BENCH_INTERFACES; interface++) {
+        fw_queue_init(&bench->tx_queue[interface],
+                      bench_region(bench, sizeof(fw_queue_indeces_t) + BENCH_QUEUE_CAPACITY * sizeof(fw_buff_desc_t)),
+                      sizeof(fw_buff_desc_t), BENCH_QUEUE_CAPACITY);
+        uint32_t arp_entries = bench_next_power_of_2(config->arp_entries);
+        fw_arp_table_init(&bench->arp_table[interface], bench_region(bench, arp_entries * sizeof(fw_arp_entry_t)),
+                          arp_entries);
+        memset(&bench->pkt_waiting[interface], 0, sizeof(pkts_waiting_t));
+        pkt_waiting_init(&bench->pkt_waiting[interface],
+                         bench_region(bench, BENCH_PKT_WAITING_CAPACITY
+                                                 * (sizeof(pkt_waiting_node_t) + sizeof(uint16_t))),
+                         BENCH_PKT_WAITING_CAPACITY, BENCH_PKT_WAITING_DEST_CAPACITY);
+    }
+
+    /* Resolve next hops in order of first use until the ARP tables are full,
+    the packets of later next hops wait on ARP requests that are never answered */
+    for (uint32_t i = 0; i < bench->num_packets; i++) {
+        ipv4_hdr_t *ip_hdr = (ipv4_hdr_t *)(bench->trace[i].data + IPV4_HDR_OFFSET);
+        uint32_t next_hop = ip_hdr->dst_ip;
+        uint8_t out_interface = 0;
+        fw_routing_find_route(bench->routing_table, &next_hop, &out_interface,
+                              fw_routing_flow_hash((uintptr_t)bench->trace[i].data, ip_hdr));
+        if (next_hop == FW_ROUTING_NONEXTHOP
+            || fw_arp_table_find_entry(&bench->arp_table[out_interface], next_hop) != NULL) {
+            continue;
+        }
+        uint8_t mac_addr[ETH_HWADDR_LEN] = { 0x02, 0, 0, 0, 0, 0 };
+        memcpy(mac_addr + 2, &next_hop, sizeof(next_hop));
+        fw_arp_table_add_entry(&bench->arp_table[out_interface], ARP_STATE_REACHABLE, next_hop, mac_addr, 0,
+                               UINT64_MAX);
+    }
+
+    memcpy(bench->work, bench->trace, bench->num_packets * sizeof(bench_pkt_t));
+    memset(&bench->counts, 0, sizeof(bench->counts));
+}
+
+static void bench_free_state(bench_t *bench)
+{
+    for (uint16_t i = 0; i < bench->num_regions; i++) {
+        free(bench->regions[i]);
+    }
+    bench->num_regions = 0;
+}
+
+/* Filter a packet as the TCP and UDP filter components do, returning whether
+it is transmitted to the router */
+static bool bench_filter(bench_t *bench, bench_pkt_t *pkt)
+{
+    ipv4_hdr_t *ip_hdr = (ipv4_hdr_t *)(pkt->data + IPV4_HDR_OFFSET);
+    uint16_t rule_id = 0;
+    fw_filter_err_t err;
+    fw_action_t action;
+
+    if (ip_hdr->protocol == IPV4_PROTO_TCP) {
+        tcp_hdr_t *tcp_hdr = (tcp_hdr_t *)(pkt->data + transport_layer_offset(ip_hdr));
+        action = fw_filter_tcp_action(&bench->filters[pkt->interface][BENCH_FILTER_TCP].state, ip_hdr->src_ip,
+                                      tcp_hdr->src_port, ip_hdr->dst_ip, tcp_hdr->dst_port, tcp_flags(tcp_hdr),
+                                      pkt->len, &rule_id, &err);
+    } else {
+        udp_hdr_t *udp_hdr = (udp_hdr_t *)(pkt->data + transport_layer_offset(ip_hdr));
+        action = fw_filter_action(&bench->filters[pkt->interface][BENCH_FILTER_UDP].state, ip_hdr->src_ip,
+                                  udp_hdr->src_port, ip_hdr->dst_ip, udp_hdr->dst_port, pkt->len, &rule_id, &err);
+    }
+
+    return action == FILTER_ACT_CONNECT || action == FILTER_ACT_ESTABLISHED || action == FILTER_ACT_ALLOW;
+}
+
+static void bench_transmit(bench_t *bench, fw_buff_desc_t buffer, fw_adjacency_t *adjacency)
+{
+    bench_pkt_t *pkt = bench->work + buffer.offset;
+    memcpy(pkt->data, &adjacency->eth_hdr, ETH_HDR_LEN);
+
+    fw_enqueue(&bench->tx_queue[adjacency->interface], &buffer);
+    bench->counts.forwarded++;
+}
+
+/* Route a packet as the routing component does */
+static void bench_route(bench_t *bench, fw_buff_desc_t buffer)
+{
+    bench_pkt_t *pkt = bench->work + buffer.offset;
+    ipv4_hdr_t *ip_hdr = (ipv4_hdr_t *)(pkt->data + IPV4_HDR_OFFSET);
+
+    if (ip_hdr->ttl <= 1) {
+        bench->counts.ttl_expired++;
+        return;
+    }
+    fw_ipv4_decrement_ttl(ip_hdr);
+
+    uint32_t flow_hash = fw_routing_flow_hash((uintptr_t)pkt->data, ip_hdr);
+    uint16_t route_id;
+    fw_adjacency_t *adjacency = fw_adjacency_lookup(&bench->adjacency_table, bench->routing_table, ip_hdr->dst_ip,
+                                                    flow_hash, &route_id);
+    if (adjacency != NULL && fw_adjacency_current(adjacency, &bench->arp_table[adjacency->interface])) {
+        bench_transmit(bench, buffer, adjacency);
+        return;
+    }
+
+    uint32_t next_hop = ip_hdr->dst_ip;
+    uint8_t out_interface = 0;
+    fw_routing_find_route(bench->routing_table, &next_hop, &out_interface, flow_hash);
+    if (next_hop == FW_ROUTING_NONEXTHOP || next_hop == htonl(bench_interface_ip[out_interface])) {
+        bench->counts.no_route++;
+        return;
+    }
+
+    fw_arp_entry_t *arp = fw_arp_table_find_entry(&bench->arp_table[out_interface], next_hop);
+    if (arp == NULL || arp->state == ARP_STATE_PENDING) {
+        pkts_waiting_t *waiting = &bench->pkt_waiting[out_interface];
+        /* ARP requests are never answered, so the oldest destination is
+        abandoned to make room as it would be once its request times out */
+        if (pkt_waiting_full(waiting)) {
+            bench->counts.waiting_dropped += waiting->packets[waiting->tail].num_children + 1;
+            pkts_waiting_free_parent(waiting, waiting->packets + waiting->tail);
+        }
+
+        pkt_waiting_node_t *root = pkt_waiting_find_node(waiting, next_hop);
+        if (root) {
+            if (pkt_waiting_push_child(waiting, root, buffer) == ROUTING_ERR_FULL) {
+                bench->counts.waiting_dropped++;
+                return;
+            }
+        } else {
+            pkt_waiting_push(waiting, next_hop, buffer);
+        }
+        bench->counts.waiting++;
+        return;
+    }
+
+    uint8_t src_mac_addr[ETH_HWADDR_LEN];
+    memset(src_mac_addr, out_interface, ETH_HWADDR_LEN);
+    adjacency = fw_adjacency_add(&bench->adjacency_table, out_interface, next_hop, arp->mac_addr, src_mac_addr,
+                                 arp - bench->arp_table[out_interface].entries,
+                                 fw_adjacency_bind_route_id(bench->routing_table, route_id));
+    bench_transmit(bench, buffer, adjacency);
+}
+
+/* Hand a batch of packets to the transmit side, as the tx virtualiser would */
+static void bench_drain_tx(bench_t *bench)
+{
+    for (uint8_t interface = 0; interface < BENCH_INTERFACES; interface++) {
+        fw_buff_desc_t buffer;
+        while (fw_dequeue(&bench->tx_queue[interface], &buffer) == 0) {
+        }
+    }
+}
+
+static void bench_set_time(bench_t *bench)
+{
+    /* The clock is read once per batch, and only if it is needed */
+    for (uint8_t interface = 0; interface < BENCH_INTERFACES; interface++) {
+        for (uint8_t f = 0; f < BENCH_FILTERS; f++) {
+            fw_filter_state_t *state = &bench->filters[interface][f].state;
+            if (fw_filter_rate_limited(state)) {
+                fw_filter_set_time(state, bench_now());
+            }
+        }
+    }
+}
+
+/* Run every packet through the filters, recording which are forwarded */
+static uint64_t bench_filter_pass(bench_t *bench)
+{
+    uint64_t start = bench_now();
+    for (uint32_t i = 0; i < bench->num_packets; i++) {
+        if (i % BENCH_BATCH == 0) {
+            bench_set_time(bench);
+        }
+        bench->forwarded[i] = bench_filter(bench, bench->work + i);
+    }
+    return bench_now() - start;
+}
+
+/* Route the packets forwarded by the filters */
+static uint64_t bench_route_pass(bench_t *bench, uint32_t *routed)
+{
+    *routed = 0;
+    uint64_t start = bench_now();
+    for (uint32_t i = 0; i < bench->num_packets; i++) {
+        if (!bench->forwarded[i]) {
+            continue;
+        }
+        fw_buff_desc_t buffer = { .offset = i, .len = bench->work[i].len, .interface = bench->work[i].interface };
+        bench_route(bench, buffer);
+        (*routed)++;
+        if (*routed % BENCH_BATCH == 0) {
+            bench_drain_tx(bench);
+        }
+    }
+    bench_drain_tx(bench);
+    return bench_now() - start;
+}
+
+/* Run packets through the filters and router in batches, passing them between
+stages through a queue as the components do */
+static uint64_t bench_pipeline_pass(bench_t *bench)
+{
+    uint64_t start = bench_now();
+    for (uint32_t batch = 0; batch < bench->num_packets; batch += BENCH_BATCH) {
+        uint32_t end = MIN(batch + BENCH_BATCH, bench->num_packets);
+
+        bench_set_time(bench);
+        for (uint32_t i = batch; i < end; i++) {
+            bench_pkt_t *pkt = bench->work + i;
+            if (!bench_filter(bench, pkt)) {
+                bench->counts.filtered++;
+                continue;
+            }
+            fw_buff_desc_t buffer = { .offset = i, .len = pkt->len, .interface = pkt->interface };
+            fw_enqueue(&bench->router_queue, &buffer);
+        }
+
+        fw_buff_desc_t buffer;
+        while (fw_dequeue(&bench->router_queue, &buffer) == 0) {
+            bench_route(bench, buffer);
+        }
+        bench_drain_tx(bench);
+    }
+    return bench_now() - start;
+}
+
+/* Time each packet through both stages individually */
+static void bench_latency_pass(bench_t *bench, uint32_t *latencies)
+{
+    for (uint32_t i = 0; i < bench->num_packets; i++) {
+        bench_pkt_t *pkt = bench->work + i;
+        uint64_t start = bench_now();
+        if (bench_filter(bench, pkt)) {
+            fw_buff_desc_t buffer = { .offset = i, .len = pkt->len, .interface = pkt->interface };
+            bench_route(bench, buffer);
+            bench_drain_tx(bench);
+        }
+        latencies[i] = bench_now() - start;
+    }
+}
+
+/* Compare the checksum with its reference over buffers of random length,
+alignment and content, including buffers of all ones to exercise folding */
+static void bench_check_checksum(bench_t *bench)
+{
+    uint8_t *ref_buf = bench_alloc(UINT16_MAX);
+    uint8_t *buf = bench_alloc(UINT16_MAX + sizeof(uint64_t));
+    for (uint32_t i = 0; i < BENCH_CHECKSUM_TESTS; i++) {
+        uint16_t len = (i % 64 == 0) ? UINT16_MAX - bench_rand_range(bench, 0, 3)
+                                     : bench_rand_range(bench, 0, 2 * BENCH_CHECKSUM_LEN);
+        uint32_t align = bench_rand_range(bench, 0, sizeof(uint64_t) - 1);
+        uint32_t fill = bench_rand_range(bench, 0, 3);
+        for (uint32_t j = 0; j < len; j++) {
+            ref_buf[j] = (fill == 0) ? 0xff : (fill == 1) ? 0 : (uint8_t)bench_rand(bench);
+        }
+        memcpy(buf + align, ref_buf, len);
+
+        uint16_t expected = fw_internet_checksum_ref(ref_buf, len);
+        uint16_t check = fw_internet_checksum(buf + align, len);
+        if (check != expected) {
+            fprintf(stderr, "fw_bench: checksum of %u bytes at alignment %u is 0x%04x, reference is 0x%04x\n", len,
+                    align, check, expected);
+            exit(1);
+        }
+    }
+    free(ref_buf);
+    free(buf);
+}
+
+/* Keeps checksums from being optimised away */
+static volatile uint16_t bench_checksum_sink;
+
+/* Checksum the IPv4 datagram of each full sized packet */
+static uint64_t bench_checksum_pass(uint8_t *pkts, bool reference)
+{
+    uint16_t check = 0;
+    uint64_t start = bench_now();
+    for (uint32_t i = 0; i < BENCH_CHECKSUM_PACKETS; i++) {
+        void *datagram = pkts + (i % BENCH_CHECKSUM_RING) * BENCH_CHECKSUM_STRIDE + IPV4_HDR_OFFSET;
+        if (reference) {
+            check ^= fw_internet_checksum_ref(datagram, BENCH_CHECKSUM_LEN);
+        } else {
+            check ^= fw_internet_checksum(datagram, BENCH_CHECKSUM_LEN);
+        }
+    }
+    uint64_t ns = bench_now() - start;
+    bench_checksum_sink = check;
+    return ns;
+}
+
+static int bench_compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int bench_compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t bench_median(uint64_t *times, uint32_t n)
+{
+    qsort(times, n, sizeof(uint64_t), bench_compare_u64);
+    return times[n / 2];
+}
+
+static void bench_report(const char *stage, uint32_t packets, uint64_t ns)
+{
+    double seconds = (double)MAX(ns, 1) / BENCH_NS_IN_S;
+    printf("%-10s %12.0f %12.1f\n", stage, packets / seconds, (double)ns / MAX(packets, 1));
+}
+
+static uint32_t bench_percentile(uint32_t *sorted, uint32_t n, double percentile)
+{
+    uint32_t idx = (uint32_t)(percentile / 100 * n);
+    return sorted[MIN(idx, n - 1)];
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: fw_bench [--pcap FILE] [--flows N] [--packets N] [--rules N] [--routes N]\n"
+                    "                [--arp-entries N] [--instances N] [--iterations N] [--seed N] "
+                    "[--min-pps N]\n");
+    exit(1);
+}
+
+static uint64_t bench_arg(const char *arg, uint64_t min, uint64_t max)
+{
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 0);
+    if (*end != '\0' || value < min || value > max) {
+        fprintf(stderr, "fw_bench: %s must be between %llu and %llu\n", arg, (unsigned long long)min,
+                (unsigned long long)max);
+        exit(1);
+    }
+    return value;
+}
+
+int main(int argc, char **argv)
+{
+    static bench_t bench;
+    bench.config = (bench_config_t) {
+        .flows = 1024,
+        .packets = 262144,
+        .rules = 256,
+        .routes = 256,
+        .arp_entries = 1024,
+        .instances = 4096,
+        .iterations = 5,
+        .seed = 1,
+    };
+
+    static const struct option options[] = {
+        { "pcap", required_argument, NULL, 'p' },
+        { "flows", required_argument, NULL, 'f' },
+        { "packets", required_argument, NULL, 'n' },
+        { "rules", required_argument, NULL, 'r' },
+        { "routes", required_argument, NULL, 'R' },
+        { "arp-entries", required_argument, NULL, 'a' },
+        { "instances", required_argument, NULL, 'i' },
+        { "iterations", required_argument, NULL, 'I' },
+        { "seed", required_argument, NULL, 's' },
+        { "min-pps", required_argument, NULL, 'm' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:f:n:r:R:a:i:I:s:m:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            bench.config.pcap = optarg;
+            break;
+        case 'f':
+            bench.config.flows = bench_arg(optarg, 1, UINT32_MAX);
+            break;
+        case 'n':
+            bench.config.packets = bench_arg(optarg, 1, UINT32_MAX / sizeof(bench_pkt_t));
+            break;
+        case 'r':
+            bench.config.rules = bench_arg(optarg, 0, UINT16_MAX - 1);
+            break;
+        case 'R':
+            bench.config.routes = bench_arg(optarg, 0, UINT16_MAX - 3);
+            break;
+        case 'a':
+            bench.config.arp_entries = bench_arg(optarg, 1, 1 << 15);
+            break;
+        case 'i':
+            bench.config.instances = bench_arg(optarg, 1, 1 << 15);
+            if (bench.config.instances & (bench.config.instances - 1)) {
+                fprintf(stderr, "fw_bench: instances must be a power of 2\n");
+                exit(1);
+            }
+            break;
+        case 'I':
+            bench.config.iterations = bench_arg(optarg, 1, 1000);
+            break;
+        case 's':
+            bench.config.seed = bench_arg(optarg, 1, UINT64_MAX);
+            break;
+        case 'm':
+            bench.config.min_pps = bench_arg(optarg, 0, UINT64_MAX);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc) {
+        usage();
+    }
+
+    bench.rng = bench.config.seed;
+    bench_generate_routes(&bench);
+    bench_generate_rules(&bench);
+    if (bench.config.pcap != NULL) {
+        bench_read_pcap(&bench);
+    } else {
+        bench_generate_trace(&bench);
+    }
+    bench.work = bench_alloc(bench.num_packets * sizeof(bench_pkt_t));
+    bench_check_checksum(&bench);
+    uint8_t *checksum_pkts = bench_alloc(BENCH_CHECKSUM_RING * BENCH_CHECKSUM_STRIDE);
+    for (uint32_t i = 0; i < BENCH_CHECKSUM_RING * BENCH_CHECKSUM_STRIDE; i++) {
+        checksum_pkts[i] = (uint8_t)bench_rand(&bench);
+    }
+    bench.forwarded = bench_alloc(bench.num_packets * sizeof(bool));
+
+    uint32_t iterations = bench.config.iterations;
+    uint64_t *filter_ns = bench_alloc(iterations * sizeof(uint64_t));
+    uint64_t *route_ns = bench_alloc(iterations * sizeof(uint64_t));
+    uint64_t *pipeline_ns = bench_alloc(iterations * sizeof(uint64_t));
+    uint64_t *checksum_ns = bench_alloc(iterations * sizeof(uint64_t));
+    uint64_t *checksum_ref_ns = bench_alloc(iterations * sizeof(uint64_t));
+    uint32_t routed = 0;
+    bench_counts_t counts = { 0 };
+
+    for (uint32_t it = 0; it < iterations; it++) {
+        bench_init_state(&bench);
+        filter_ns[it] = bench_filter_pass(&bench);
+        route_ns[it] = bench_route_pass(&bench, &routed);
+        bench_free_state(&bench);
+
+        bench_init_state(&bench);
+        pipeline_ns[it] = bench_pipeline_pass(&bench);
+        counts = bench.counts;
+        bench_free_state(&bench);
+
+        checksum_ns[it] = bench_checksum_pass(checksum_pkts, false);
+        checksum_ref_ns[it] = bench_checksum_pass(checksum_pkts, true);
+    }
+
+    uint32_t *latencies = bench_alloc(bench.num_packets * sizeof(uint32_t));
+    bench_init_state(&bench);
+    bench_latency_pass(&bench, latencies);
+    bench_free_state(&bench);
+    qsort(latencies, bench.num_packets, sizeof(uint32_t), bench_compare_u32);
+
+    /* Clock read overhead is included in each packet's latency */
+    uint64_t clock_ns[1000];
+    for (uint32_t i = 0; i < 1000; i++) {
+        uint64_t start = bench_now();
+        clock_ns[i] = bench_now() - start;
+    }
+
+    printf("fw_bench: %u packets (%s), %u rules per filter, %u routes, %u iterations\n", bench.num_packets,
+           (bench.config.pcap != NULL) ? bench.config.pcap : "synthetic", bench.config.rules, bench.num_routes,
+           iterations);
+    printf("%-10s %12s %12s\n", "stage", "packets/s", "ns/packet");
+    bench_report("filter", bench.num_packets, bench_median(filter_ns, iterations));
+    bench_report("routing", routed, bench_median(route_ns, iterations));
+    uint64_t pipeline = bench_median(pipeline_ns, iterations);
+    bench_report("pipeline", bench.num_packets, pipeline);
+    bench_report("checksum", BENCH_CHECKSUM_PACKETS, bench_median(checksum_ns, iterations));
+    bench_report("csum ref", BENCH_CHECKSUM_PACKETS, bench_median(checksum_ref_ns, iterations));
+
+    printf("latency ns: p50 %u, p90 %u, p99 %u, p99.9 %u, max %u (clock overhead %lu)\n",
+           bench_percentile(latencies, bench.num_packets, 50), bench_percentile(latencies, bench.num_packets, 90),
+           bench_percentile(latencies, bench.num_packets, 99), bench_percentile(latencies, bench.num_packets, 99.9),
+           latencies[bench.num_packets - 1], (unsigned long)bench_median(clock_ns, 1000));
+    printf("packets: %lu filtered, %lu forwarded, %lu waiting on ARP (%lu abandoned), %lu no route, %lu ttl "
+           "expired\n",
+           (unsigned long)counts.filtered, (unsigned long)counts.forwarded, (unsigned long)counts.waiting,
+           (unsigned long)counts.waiting_dropped, (unsigned long)counts.no_route,
+           (unsigned long)counts.ttl_expired);
+
+    uint64_t pps = (uint64_t)((double)bench.num_packets * BENCH_NS_IN_S / MAX(pipeline, 1));
+    if (pps < bench.config.min_pps) {
+        fprintf(stderr, "fw_bench: pipeline throughput %lu packets/s is below minimum of %lu\n", (unsigned long)pps,
+                (unsigned long)bench.config.min_pps);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,15 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/* Host port of the sDDF OS interface, used by the firewall benchmark in place of
+the Microkit port. The data plane libraries only need the interface types, as
+protection domains and channels do not exist on the host. */
+
+#include <stdint.h>
+
+typedef unsigned int sddf_channel;
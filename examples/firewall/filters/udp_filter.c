@@ -10,6 +10,8 @@
 #include <sddf/util/printf.h>
 #include <sddf/network/queue.h>
 #include <sddf/network/config.h>
+#include <sddf/timer/client.h>
+#include <sddf/timer/config.h>
 #include <lions/firewall/checksum.h>
 #include <lions/firewall/config.h>
 #include <lions/firewall/common.h>
@@ -17,10 +19,12 @@
 #include <lions/firewall/ip.h>
 #include <lions/firewall/udp.h>
 #include <lions/firewall/queue.h>
+#include <lions/firewall/trace.h>
 #include <lions/firewall/icmp.h>
 
 __attribute__((__section__(".fw_filter_config"))) fw_filter_config_t filter_config;
 __attribute__((__section__(".net_client_config"))) net_client_config_t net_config;
+__attribute__((__section__(".timer_client_config"))) timer_client_config_t timer_config;
 
 /* Queues for receiving and transmitting packets */
 net_queue_handle_t rx_queue;
@@ -31,6 +35,15 @@ fw_queue_t icmp_queue;
 /* Holds filtering rules and state */
 fw_filter_state_t filter_state;
 
+/* Actions found for recent flows */
+fw_verdict_t verdict_cache[FW_VERDICT_CACHE_SIZE];
+
+/* Per-source rate limit buckets */
+fw_rate_source_t rate_sources[FW_RATE_SOURCES];
+
+/* Packet path event trace */
+fw_trace_t trace;
+
 /* ICMP request queue to send unreachable messages to ICMP module */
 static bool notify_icmp;
 
@@ -48,6 +61,14 @@ static void filter(void)
     bool transmitted = false;
     bool returned = false;
     bool reprocess = true;
+
+    /* The clock is read once per batch, and only if it is needed */
+    if (fw_trace_enabled(&trace) || fw_filter_rate_limited(&filter_state)) {
+        uint64_t now = sddf_timer_time_now(timer_config.driver_id);
+        fw_trace_set_time(&trace, now);
+        fw_filter_set_time(&filter_state, now);
+    }
+
     while (reprocess) {
         while (!net_queue_empty_active(&rx_queue)) {
             net_buff_desc_t buffer;
@@ -59,30 +80,16 @@ static void filter(void)
             udp_hdr_t *udp_hdr = (udp_hdr_t *)(pkt_vaddr + transport_layer_offset(ip_hdr));
 
             uint16_t rule_id = 0;
-            fw_action_t action = fw_filter_find_action(&filter_state, ip_hdr->src_ip, udp_hdr->src_port, ip_hdr->dst_ip,
-                                                       udp_hdr->dst_port, &rule_id);
+            fw_filter_err_t fw_err = FILTER_ERR_OKAY;
+            fw_action_t action = fw_filter_action(&filter_state, ip_hdr->src_ip, udp_hdr->src_port, ip_hdr->dst_ip,
+                                                  udp_hdr->dst_port, buffer.len, &rule_id, &fw_err);
 
             switch (action) {
             case FILTER_ACT_CONNECT: {
-                /* Add an established connection in shared memory for corresponding filter */
-                fw_filter_err_t fw_err = fw_filter_add_instance(&filter_state, ip_hdr->src_ip, udp_hdr->src_port,
-                                                                ip_hdr->dst_ip, udp_hdr->dst_port, rule_id);
-
-                if ((fw_err == FILTER_ERR_OKAY || fw_err == FILTER_ERR_DUPLICATE) && FW_DEBUG_OUTPUT) {
-                    sddf_printf(
-                        "UDP FILTER LOG: on interface %u establishing connection via rule %u: (ip %s, port %u) -> "
-                        "(ip %s, port %u)\n",
-                        filter_config.interface, rule_id, ipaddr_to_string(ip_hdr->src_ip, ip_addr_buf0),
-                        htons(udp_hdr->src_port), ipaddr_to_string(ip_hdr->dst_ip, ip_addr_buf1),
-                        htons(udp_hdr->dst_port));
-                }
-
-                if (fw_err == FILTER_ERR_FULL) {
-                    sddf_printf("UDP FILTER LOG: on interface %u could not establish connection for rule %u: (ip %s, "
-                                "port %u) -> (ip %s, port %u): %s\n",
-                                filter_config.interface, rule_id, ipaddr_to_string(ip_hdr->src_ip, ip_addr_buf0),
-                                htons(udp_hdr->src_port), ipaddr_to_string(ip_hdr->dst_ip, ip_addr_buf1),
-                                htons(udp_hdr->dst_port), fw_filter_err_str[fw_err]);
+                if (FW_DEBUG_OUTPUT) {
+                    fw_trace_event(&trace, FW_TRACE_FILTER_CONNECT, filter_config.interface, IPV4_PROTO_UDP,
+                                   ip_hdr->src_ip, udp_hdr->src_port, ip_hdr->dst_ip, udp_hdr->dst_port, rule_id,
+                                   action);
                 }
             }
             case FILTER_ACT_ESTABLISHED:
@@ -97,21 +104,10 @@ static void filter(void)
                 transmitted = true;
 
                 if (FW_DEBUG_OUTPUT) {
-                    if (action == FILTER_ACT_ALLOW || action == FILTER_ACT_CONNECT) {
-                        sddf_printf(
-                            "UDP FILTER LOG: on interface %u transmitting via rule %u: (ip %s, port %u) -> (ip %s, "
-                            "port %u)\n",
-                            filter_config.interface, rule_id, ipaddr_to_string(ip_hdr->src_ip, ip_addr_buf0),
-                            htons(udp_hdr->src_port), ipaddr_to_string(ip_hdr->dst_ip, ip_addr_buf1),
-                            htons(udp_hdr->dst_port));
-                    } else if (action == FILTER_ACT_ESTABLISHED) {
-                        sddf_printf(
-                            "UDP FILTER LOG: on interface %u transmitting via external rule %u: (ip %s, port %u) -> "
-                            "(ip %s, port %u)\n",
-                            filter_config.interface, rule_id, ipaddr_to_string(ip_hdr->src_ip, ip_addr_buf0),
-                            htons(udp_hdr->src_port), ipaddr_to_string(ip_hdr->dst_ip, ip_addr_buf1),
-                            htons(udp_hdr->dst_port));
-                    }
+                    fw_trace_event_t event = (action == FILTER_ACT_ESTABLISHED) ? FW_TRACE_FILTER_TRANSMIT_ESTABLISHED
+                                                                                  : FW_TRACE_FILTER_TRANSMIT;
+                    fw_trace_event(&trace, event, filter_config.interface, IPV4_PROTO_UDP, ip_hdr->src_ip,
+                                   udp_hdr->src_port, ip_hdr->dst_ip, udp_hdr->dst_port, rule_id, action);
                 }
                 break;
             }
@@ -120,11 +116,9 @@ static void filter(void)
                 enqueue_icmp_unreachable(buffer);
 
                 if (FW_DEBUG_OUTPUT) {
-                    sddf_printf(
-                        "UDP FILTER LOG: on interface %u rejecting via rule %u: (ip %s, port %u) -> (ip %s, port %u)\n",
-                        filter_config.interface, rule_id, ipaddr_to_string(ip_hdr->src_ip, ip_addr_buf0),
-                        htons(udp_hdr->src_port), ipaddr_to_string(ip_hdr->dst_ip, ip_addr_buf1),
-                        htons(udp_hdr->dst_port));
+                    fw_trace_event(&trace, FW_TRACE_FILTER_REJECT, filter_config.interface, IPV4_PROTO_UDP,
+                                   ip_hdr->src_ip, udp_hdr->src_port, ip_hdr->dst_ip, udp_hdr->dst_port, rule_id,
+                                   action);
                 }
             }
             case FILTER_ACT_DROP:
@@ -135,11 +129,9 @@ static void filter(void)
                 returned = true;
 
                 if (FW_DEBUG_OUTPUT) {
-                    sddf_printf(
-                        "UDP FILTER LOG: on interface %u dropping via rule %u: (ip %s, port %u) -> (ip %s, port %u)\n",
-                        filter_config.interface, rule_id, ipaddr_to_string(ip_hdr->src_ip, ip_addr_buf0),
-                        htons(udp_hdr->src_port), ipaddr_to_string(ip_hdr->dst_ip, ip_addr_buf1),
-                        htons(udp_hdr->dst_port));
+                    fw_trace_event(&trace, FW_TRACE_FILTER_DROP, filter_config.interface, IPV4_PROTO_UDP,
+                                   ip_hdr->src_ip, udp_hdr->src_port, ip_hdr->dst_ip, udp_hdr->dst_port, rule_id,
+                                   action);
                 }
                 break;
             }
@@ -175,39 +167,55 @@ microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo)
         }
 
         fw_filter_err_t err = fw_filter_update_default_action(&filter_state, action);
-        assert(err == FILTER_ERR_OKAY);
 
         microkit_mr_set(FILTER_RET_ERR, err);
         return microkit_msginfo_new(0, 1);
     }
     case FILTER_ADD_RULE: {
-        fw_action_t action = microkit_mr_get(FILTER_ADD_ARG_ACTION);
-        uint32_t src_ip = microkit_mr_get(FILTER_ADD_ARG_SRC_IP);
-        uint16_t src_port = microkit_mr_get(FILTER_ADD_ARG_SRC_PORT);
-        uint32_t dst_ip = microkit_mr_get(FILTER_ADD_ARG_DST_IP);
-        uint16_t dst_port = microkit_mr_get(FILTER_ADD_ARG_DST_PORT);
-        uint8_t src_subnet = microkit_mr_get(FILTER_ADD_ARG_SRC_SUBNET);
-        uint8_t dst_subnet = microkit_mr_get(FILTER_ADD_ARG_DST_SUBNET);
-        bool src_port_any = microkit_mr_get(FILTER_ADD_ARG_SRC_ANY_PORT);
-        bool dst_port_any = microkit_mr_get(FILTER_ADD_ARG_DST_ANY_PORT);
+        fw_rule_t rule = {
+            .action = microkit_mr_get(FILTER_ADD_ARG_ACTION),
+            .src_ip = microkit_mr_get(FILTER_ADD_ARG_SRC_IP),
+            .dst_ip = microkit_mr_get(FILTER_ADD_ARG_DST_IP),
+            .src_port = microkit_mr_get(FILTER_ADD_ARG_SRC_PORT),
+            .dst_port = microkit_mr_get(FILTER_ADD_ARG_DST_PORT),
+            .src_subnet = microkit_mr_get(FILTER_ADD_ARG_SRC_SUBNET),
+            .dst_subnet = microkit_mr_get(FILTER_ADD_ARG_DST_SUBNET),
+            .src_ip_set = microkit_mr_get(FILTER_ADD_ARG_SRC_IP_SET),
+            .dst_ip_set = microkit_mr_get(FILTER_ADD_ARG_DST_IP_SET),
+            .rate_pps = microkit_mr_get(FILTER_ADD_ARG_RATE_PPS),
+            .rate_bps = microkit_mr_get(FILTER_ADD_ARG_RATE_BPS),
+            .rate_per_source = microkit_mr_get(FILTER_ADD_ARG_RATE_PER_SOURCE),
+            .src_port_any = microkit_mr_get(FILTER_ADD_ARG_SRC_ANY_PORT),
+            .dst_port_any = microkit_mr_get(FILTER_ADD_ARG_DST_ANY_PORT),
+            .src_port_max = microkit_mr_get(FILTER_ADD_ARG_SRC_PORT_MAX),
+            .dst_port_max = microkit_mr_get(FILTER_ADD_ARG_DST_PORT_MAX),
+        };
+        fw_port_set_t port_set = { .size = microkit_mr_get(FILTER_ADD_ARG_DST_PORT_SET_SIZE) };
+        for (uint8_t i = 0; i < port_set.size && i < FW_RULE_MAX_PORT_SET; i++) {
+            port_set.ports[i] = microkit_mr_get(FILTER_ADD_ARG_DST_PORT_SET + i / FW_RULE_PORTS_PER_MR)
+                             >> (16 * (i % FW_RULE_PORTS_PER_MR));
+        }
 
         /* UDP filter does not support this action */
-        if (action == 0 || action > FW_FILTER_NUM_ACTIONS || !filter_config.webserver.actions[action - 1]) {
+        if (rule.action == 0 || rule.action > FW_FILTER_NUM_ACTIONS
+            || !filter_config.webserver.actions[rule.action - 1]) {
             microkit_mr_set(FILTER_RET_ERR, FILTER_ERR_UNSUPPORTED_ACTION);
             return microkit_msginfo_new(0, 1);
         }
 
         uint16_t rule_id = 0;
-        fw_filter_err_t err = fw_filter_add_rule(&filter_state, src_ip, src_port, dst_ip, dst_port, src_subnet,
-                                                 dst_subnet, src_port_any, dst_port_any, action, &rule_id);
+        fw_filter_err_t err = fw_filter_add_rule(&filter_state, &rule, port_set.size ? &port_set : NULL, &rule_id);
 
         if (FW_DEBUG_OUTPUT) {
-            sddf_printf(
-                "UDP FILTER LOG: on interface %u create rule %u: (ip %s, mask %u, port %u, any_port %u) - (%s) -> "
-                "(ip %s, mask %u, port %u, any_port %u): %s\n",
-                filter_config.interface, rule_id, ipaddr_to_string(src_ip, ip_addr_buf0), src_subnet, htons(src_port),
-                src_port_any, fw_filter_action_str[action], ipaddr_to_string(dst_ip, ip_addr_buf1), dst_subnet,
-                htons(dst_port), dst_port_any, fw_filter_err_str[err]);
+            sddf_printf("UDP FILTER LOG: on interface %u create rule %u: (ip %s, mask %u, ip set %u, port %u-%u, "
+                        "any_port %u) - (%s, rate %u pps %u Bps, per source %u) -> (ip %s, mask %u, ip set %u, port "
+                        "%u-%u, any_port %u, port set size %u): %s\n",
+                        filter_config.interface, rule_id, ipaddr_to_string(rule.src_ip, ip_addr_buf0), rule.src_subnet,
+                        rule.src_ip_set, htons(rule.src_port), htons(rule.src_port_max), rule.src_port_any,
+                        fw_filter_action_str[rule.action], rule.rate_pps, rule.rate_bps, rule.rate_per_source,
+                        ipaddr_to_string(rule.dst_ip, ip_addr_buf1), rule.dst_subnet, rule.dst_ip_set,
+                        htons(rule.dst_port), htons(rule.dst_port_max), rule.dst_port_any, port_set.size,
+                        fw_filter_err_str[err]);
         }
 
         microkit_mr_set(FILTER_RET_ERR, err);
@@ -226,6 +234,37 @@ microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo)
         microkit_mr_set(FILTER_RET_ERR, err);
         return microkit_msginfo_new(0, 1);
     }
+    case FILTER_COMMIT_RULES: {
+        fw_action_t default_action = microkit_mr_get(FILTER_COMMIT_ARG_DEFAULT_ACTION);
+        fw_rule_table_t *rules = (fw_rule_table_t *)filter_config.webserver.shadow_rules.vaddr;
+
+        uint16_t err_idx = 0;
+        fw_filter_err_t err = fw_filter_commit_rules(&filter_state, rules, default_action,
+                                                     filter_config.webserver.actions, FW_FILTER_NUM_ACTIONS, &err_idx);
+
+        if (FW_DEBUG_OUTPUT) {
+            if (err == FILTER_ERR_OKAY) {
+                sddf_printf("UDP FILTER LOG: on interface %u committed %u rules with default action %u\n",
+                            filter_config.interface, rules->size, default_action);
+            } else {
+                sddf_printf("UDP FILTER LOG: on interface %u rule set rejected at rule %u: %s\n",
+                            filter_config.interface, err_idx, fw_filter_err_str[err]);
+            }
+        }
+
+        microkit_mr_set(FILTER_COMMIT_RET_ERR, err);
+        microkit_mr_set(FILTER_COMMIT_RET_RULE_IDX, err_idx);
+        return microkit_msginfo_new(0, 2);
+    }
+    case FILTER_SWAP_IP_SETS: {
+        fw_filter_swap_ip_sets(&filter_state);
+
+        if (FW_DEBUG_OUTPUT) {
+            sddf_printf("UDP FILTER LOG: on interface %u swapped IP sets\n", filter_config.interface);
+        }
+
+        return microkit_msginfo_new(0, 0);
+    }
     default:
         sddf_printf("UDP FILTER LOG: on interface %u unknown request %lu on channel %u\n", filter_config.interface,
                     microkit_msginfo_get_label(msginfo), ch);
@@ -239,6 +278,20 @@ void notified(microkit_channel ch)
 {
     if (ch == net_config.rx.id) {
         filter();
+    } else if (ch == timer_config.driver_id) {
+        /* Add traffic dropped by the Rx virtualiser to the rule counters, and
+        publish any hard drops rule removals since the last tick allow */
+        fw_filter_count_hard_drops(&filter_state);
+        fw_filter_republish_hard_drops(&filter_state);
+
+        uint16_t reaped = fw_filter_reap_instances(&filter_state, sddf_timer_time_now(timer_config.driver_id));
+
+        if (FW_DEBUG_OUTPUT && reaped > 0) {
+            sddf_printf("UDP FILTER LOG: on interface %u removed %u idle instances\n", filter_config.interface,
+                        reaped);
+        }
+
+        sddf_timer_set_timeout(timer_config.driver_id, FW_CONNTRACK_REAP_INTERVAL_S * NS_IN_S);
     } else {
         sddf_dprintf("UDP FILTER LOG: on interface %u received, notification on unknown channel: %d!\n",
                      filter_config.interface, ch);
@@ -268,8 +321,27 @@ void init(void)
                   filter_config.icmp_module.capacity);
 
     fw_filter_state_init(&filter_state, filter_config.webserver.rules.vaddr, filter_config.rule_id_bitmap.vaddr,
-                         filter_config.webserver.rules_capacity, filter_config.internal_instances.vaddr,
+                         filter_config.webserver.rules_capacity, filter_config.classifier.vaddr,
+                         filter_config.shadow_classifier.vaddr, filter_config.classifier_capacity, verdict_cache,
+                         filter_config.webserver.stats.vaddr, filter_config.rule_state.vaddr, rate_sources,
+                         filter_config.internal_instances.vaddr,
                          filter_config.external_instances, filter_config.instances_capacity,
-                         filter_config.initial_rules, filter_config.num_initial_rules,
-                         filter_config.num_external_instances);
+                         FW_CONNTRACK_UDP_TIMEOUT_S * NS_IN_S, filter_config.initial_rules,
+                         filter_config.num_initial_rules, filter_config.num_external_instances);
+
+    fw_filter_ip_sets_init(&filter_state, filter_config.ip_sets.ip_sets.vaddr,
+                           filter_config.ip_sets.shadow_ip_sets.vaddr, filter_config.ip_sets.capacity);
+
+    assert(filter_config.num_return_seen == filter_config.num_external_instances
+           && filter_config.num_neighbour_return_seen == filter_config.num_external_instances);
+    fw_filter_return_seen_init(&filter_state, filter_config.return_seen, filter_config.neighbour_return_seen);
+
+    /* Publish the traffic dropped by the rules so the Rx virtualiser can drop
+    it without waking the filter */
+    fw_filter_hard_drop_init(&filter_state, filter_config.hard_drop.vaddr);
+
+    fw_trace_init(&trace, filter_config.trace.ring.vaddr, filter_config.trace.capacity, FW_TRACE_FILTER);
+
+    /* Set the first instance reap tick */
+    sddf_timer_set_timeout(timer_config.driver_id, FW_CONNTRACK_REAP_INTERVAL_S * NS_IN_S);
 }
@@ -28,6 +28,7 @@ FIREWALL_FILTERS := $(FIREWALL_SRC_DIR)/filters
 FIREWALL_ICMP := $(FIREWALL_SRC_DIR)/icmp
 FIREWALL_ROUTING := $(FIREWALL_SRC_DIR)/routing
 FIREWALL_ARP := $(FIREWALL_SRC_DIR)/arp
+FIREWALL_TRACE := $(FIREWALL_SRC_DIR)/trace
 
 METAPROGRAM := $(FIREWALL_SRC_DIR)/meta.py
 
@@ -40,6 +41,7 @@ FIREWALL_CONFIG_HEADERS := \
 	$(SDDF)/include/sddf/network/constants.h \
 	$(SDDF)/include/sddf/network/config.h \
 	$(LIONSOS)/include/lions/firewall/common.h \
+	$(LIONSOS)/include/lions/firewall/ip_set.h \
 	$(LIONSOS)/include/lions/firewall/filter.h \
 	$(LIONSOS)/include/lions/firewall/routing.h \
 	$(LIONSOS)/include/lions/firewall/config.h
@@ -50,7 +52,7 @@ IMAGES := arp_requester.elf arp_responder.elf routing.elf micropython.elf \
 		  firewall_network_virt_rx.elf firewall_network_virt_tx.elf \
 		  timer_driver.elf serial_driver.elf serial_virt_tx.elf \
 		  icmp_filter.elf udp_filter.elf tcp_filter.elf icmp_module.elf \
-		  eth_driver0.elf eth_driver1.elf
+		  eth_driver0.elf eth_driver1.elf trace_consumer.elf
 
 DEPS := $(IMAGES:.elf=.d)
 
@@ -72,7 +74,7 @@ LIBS := -lmicrokit -Tmicrokit.ld -lc libsddf_util_debug.a
 
 $(IMAGES): $(LIONS_LIBC)/lib/libc.a libsddf_util_debug.a
 
-vpath %.c $(SDDF) $(FIREWALL_SRC_DIR) $(FIREWALL_NET_COMPONENTS) $(FIREWALL_FILTERS) $(FIREWALL_ICMP) $(FIREWALL_ROUTING) $(FIREWALL_ARP)
+vpath %.c $(SDDF) $(FIREWALL_SRC_DIR) $(FIREWALL_NET_COMPONENTS) $(FIREWALL_FILTERS) $(FIREWALL_ICMP) $(FIREWALL_ROUTING) $(FIREWALL_ARP) $(FIREWALL_TRACE)
 
 MICROPYTHON_LIBMATH := $(LIBMATH)
 MICROPYTHON_EXEC_MODULE := ui_server.py
@@ -103,7 +105,10 @@ arp_requester.elf: arp_requester.o libsddf_util.a
 arp_responder.elf: arp_responder.o libsddf_util.a
 	${LD} ${LDFLAGS} -o $@ $^ ${LIBS}
 
-routing.elf: routing.o packet_queue.o routing_table.o libsddf_util.a
+routing.elf: routing.o packet_queue.o routing_table.o adjacency.o libsddf_util.a
+	${LD} ${LDFLAGS} -o $@ $^ ${LIBS}
+
+trace_consumer.elf: trace_consumer.o libsddf_util.a
 	${LD} ${LDFLAGS} -o $@ $^ ${LIBS}
 
 SDDF_LIBC_INCLUDE := $(LIONS_LIBC)/include
@@ -150,15 +155,28 @@ $(SYSTEM_FILE): $(METAPROGRAM) $(IMAGES) $(DTB) $(CHECK_FLAGS_BOARD_MD5) $(PYFW_
 
 	$(OBJCOPY) --update-section .serial_client_config=serial_client_routing.data routing.elf
 	$(OBJCOPY) --update-section .serial_client_config=serial_client_micropython.data micropython.elf
+	$(OBJCOPY) --update-section .serial_client_config=serial_client_trace_consumer.data trace_consumer.elf
 
 # Timer configs
 	$(OBJCOPY) --update-section .device_resources=timer_driver_device_resources.data timer_driver.elf
 
 	$(OBJCOPY) --update-section .timer_client_config=timer_client_arp_requester0.data arp_requester0.elf
+	$(OBJCOPY) --update-section .timer_client_config=timer_client_arp_responder0.data arp_responder0.elf
 
 	$(OBJCOPY) --update-section .timer_client_config=timer_client_arp_requester1.data arp_requester1.elf
+	$(OBJCOPY) --update-section .timer_client_config=timer_client_arp_responder1.data arp_responder1.elf
+
+	$(OBJCOPY) --update-section .timer_client_config=timer_client_icmp_filter0.data icmp_filter0.elf
+	$(OBJCOPY) --update-section .timer_client_config=timer_client_udp_filter0.data udp_filter0.elf
+	$(OBJCOPY) --update-section .timer_client_config=timer_client_tcp_filter0.data tcp_filter0.elf
+
+	$(OBJCOPY) --update-section .timer_client_config=timer_client_icmp_filter1.data icmp_filter1.elf
+	$(OBJCOPY) --update-section .timer_client_config=timer_client_udp_filter1.data udp_filter1.elf
+	$(OBJCOPY) --update-section .timer_client_config=timer_client_tcp_filter1.data tcp_filter1.elf
 
 	$(OBJCOPY) --update-section .timer_client_config=timer_client_micropython.data micropython.elf
+	$(OBJCOPY) --update-section .timer_client_config=timer_client_routing.data routing.elf
+	$(OBJCOPY) --update-section .timer_client_config=timer_client_trace_consumer.data trace_consumer.elf
 
 # Interface 0 components
 	$(OBJCOPY) --update-section .device_resources=net_data0/ethernet_driver0_device_resources.data eth_driver0.elf
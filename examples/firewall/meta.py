@@ -20,6 +20,7 @@ from pyfw.component_filter import Filter
 from pyfw.component_icmp import IcmpModule
 from pyfw.component_net_virt import NetVirtRx, NetVirtTx
 from pyfw.component_router import Router
+from pyfw.component_trace import TraceConsumer
 from pyfw.component_webserver import Webserver
 from pyfw.constants import (
     BuildConstants,
@@ -93,6 +94,7 @@ def generate(sdf_file: str, dtb: DeviceTree) -> None:
     router = Router()
     webserver = Webserver()
     icmp_module = IcmpModule()
+    trace_consumer = TraceConsumer()
 
     # Create timer and serial subsystems
     serial_node = dtb.node(board.serial)
@@ -105,6 +107,8 @@ def generate(sdf_file: str, dtb: DeviceTree) -> None:
 
     # Add global component timer clients
     timer_system.add_client(webserver.pd)
+    timer_system.add_client(router.pd)
+    timer_system.add_client(trace_consumer.pd)
 
     serial_driver = SDF_ProtectionDomain("serial_driver", "serial_driver.elf", priority=100)
     serial_virt_tx = SDF_ProtectionDomain("serial_virt_tx", "serial_virt_tx.elf", priority=99)
@@ -114,9 +118,10 @@ def generate(sdf_file: str, dtb: DeviceTree) -> None:
     serial_system.add_client(router.pd)
     serial_system.add_client(webserver.pd)
     serial_system.add_client(icmp_module.pd)
+    serial_system.add_client(trace_consumer.pd)
 
     # Register all PDs to the sdf
-    register_pds(timer_driver, serial_driver, serial_virt_tx, router, webserver, icmp_module)
+    register_pds(timer_driver, serial_driver, serial_virt_tx, router, webserver, icmp_module, trace_consumer)
 
     # Wire per-interface connections for traffic forwarding
     wire_interface_connections(router, serial_system, timer_system)
@@ -125,6 +130,7 @@ def generate(sdf_file: str, dtb: DeviceTree) -> None:
     wire_virtualiser_connections()
     wire_icmp_connections(icmp_module, router)
     webserver_lib_sddf_lwip = wire_webserver_connections(webserver, router)
+    wire_trace_connections(trace_consumer, router)
 
     # Connect sDDF systems and serialize subsystems
     for iface in fw_interfaces:
@@ -140,7 +146,7 @@ def generate(sdf_file: str, dtb: DeviceTree) -> None:
     assert webserver_lib_sddf_lwip.serialise_config(BuildConstants.output_dir())
 
     # Serialize firewall configs- this implicitly finalises all configs
-    serialize_all_fw_configs(router, webserver, icmp_module, obj_copy)
+    serialize_all_fw_configs(router, webserver, icmp_module, trace_consumer, obj_copy)
 
     # Render SDF
     with open(f"{BuildConstants.output_dir()}/{sdf_file}", "w+") as f:
@@ -154,9 +160,11 @@ def register_pds(
     router: Router,
     webserver: Webserver,
     icmp_module: IcmpModule,
+    trace_consumer: TraceConsumer,
 ) -> None:
     """Register all PDs with SDF and copy ELFs for per-interface components."""
-    for pd in [timer_driver, serial_driver, serial_virt_tx, webserver.pd, icmp_module.pd, router.pd]:
+    for pd in [timer_driver, serial_driver, serial_virt_tx, webserver.pd, icmp_module.pd, router.pd,
+               trace_consumer.pd]:
         BuildConstants.sdf().add_pd(pd)
 
     for iface in fw_interfaces:
@@ -202,9 +210,11 @@ def wire_interface_connections(
         router.interfaces[iface.index].arp_cache = iface.arp_requester.share_cache(router)
 
         for protocol, ip_filter in iface.filters.items():
-            # Filter receives traffic from the Rx virtualiser
+            # Filter receives traffic from the Rx virtualiser, which drops
+            # traffic the filter's rules drop without waking the filter
             iface.rx_virtualiser.add_active_net_client(
-                ip_filter, eththype_ip, protocol
+                ip_filter, eththype_ip, protocol,
+                hard_drop=ip_filter.connect_rx_virtualiser(iface.rx_virtualiser)
             )
 
             # Filter transmits traffic to the router
@@ -229,6 +239,11 @@ def wire_interface_connections(
 
         # Add timer clients
         timer_system.add_client(iface.arp_requester.pd)
+        timer_system.add_client(iface.arp_responder.pd)
+
+        # Filters reap idle connection instances on timer ticks
+        for ip_filter in iface.filters.values():
+            timer_system.add_client(ip_filter.pd)
 
 
 def wire_virtualiser_connections() -> None:
@@ -294,10 +309,25 @@ def wire_webserver_connections(
 
     return webserver_lib_sddf_lwip
 
+def wire_trace_connections(
+    trace_consumer: TraceConsumer,
+    router: Router,
+) -> None:
+    """Give each packet path component a trace ring read by the trace consumer."""
+    for iface in fw_interfaces:
+        iface.arp_requester.trace = trace_consumer.add_producer(iface.arp_requester)
+        iface.arp_responder.trace = trace_consumer.add_producer(iface.arp_responder)
+
+        for ip_filter in iface.filters.values():
+            ip_filter.trace = trace_consumer.add_producer(ip_filter)
+
+    router.trace = trace_consumer.add_producer(router)
+
 def serialize_all_fw_configs(
     router: Router,
     webserver: Webserver,
     icmp_module: IcmpModule,
+    trace_consumer: TraceConsumer,
     obj_copy_path: str,
 ) -> None:
     """Serialize configs to data files and update ELF sections."""
@@ -326,6 +356,12 @@ def serialize_all_fw_configs(
         f.write(icmp_module.serialise())
     update_elf_section(obj_copy_path, icmp_module.pd.program_image, icmp_module.section_name, data_path)
 
+    # Trace consumer
+    data_path = f"{BuildConstants.output_dir()}/firewall_config_trace_consumer.data"
+    with open(data_path, "wb+") as f:
+        f.write(trace_consumer.serialise())
+    update_elf_section(obj_copy_path, trace_consumer.pd.program_image, trace_consumer.section_name, data_path)
+
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser()
@@ -5,6 +5,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <os/sddf.h>
 #include <sddf/network/constants.h>
 #include <sddf/network/queue.h>
@@ -15,8 +16,10 @@
 #include <lions/firewall/checksum.h>
 #include <lions/firewall/config.h>
 #include <lions/firewall/ethernet.h>
+#include <lions/firewall/filter.h>
 #include <lions/firewall/ip.h>
 #include <lions/firewall/queue.h>
+#include <lions/firewall/udp.h>
 
 __attribute__((__section__(".net_virt_rx_config"))) net_virt_rx_config_t config;
 __attribute__((__section__(".fw_net_virt_rx_config"))) fw_net_virt_rx_config_t fw_config;
@@ -29,33 +32,91 @@ fw_queue_t fw_free_clients[FW_MAX_FW_CLIENTS];
 /* Boolean to indicate whether a packet has been enqueued into the driver's free queue during notification handling */
 static bool notify_drv;
 
+/* Number of ARP opcodes that may be routed to a client */
+#define ARP_NUM_OPCODES (ARP_ETH_OPCODE_REPLY + 1)
+
+/* Net client ID each IPv4 protocol number and ARP opcode is routed to, or -1.
+Built from the client eth-types and sub-types at init, so classifying a packet
+does not depend on the number of clients. */
+static int8_t ip_protocol_clients[UINT8_MAX + 1];
+static int8_t arp_opcode_clients[ARP_NUM_OPCODES];
+
 /* Returns the net client ID of the matching filter if the IP protocol number is
 found. ARP requests and responses are handled as a special case. */
-static int get_protocol_match(uintptr_t pkt)
+static inline int get_protocol_match(uintptr_t pkt)
 {
-    uint16_t ethtype = htons(((eth_hdr_t *)pkt)->ethtype);
-    for (uint8_t client = 0; client < config.num_clients; client++) {
-        /* First check for ethtype match */
-        if (fw_config.active_client_ethtypes[client] != ethtype) {
-            continue;
+    uint16_t ethtype = ((eth_hdr_t *)pkt)->ethtype;
+    if (ethtype == htons(ETH_TYPE_IP)) {
+        ipv4_hdr_t *ip_hdr = (ipv4_hdr_t *)(pkt + IPV4_HDR_OFFSET);
+        return ip_protocol_clients[ip_hdr->protocol];
+    } else if (ethtype == htons(ETH_TYPE_ARP)) {
+        arp_pkt_t *arp = (arp_pkt_t *)(pkt + ARP_PKT_OFFSET);
+        uint16_t opcode = htons(arp->opcode);
+        return (opcode < ARP_NUM_OPCODES) ? arp_opcode_clients[opcode] : -1;
+    }
+
+    return -1;
+}
+
+/* Build the protocol dispatch tables. Where several clients match the same
+traffic, the client with the lowest ID receives it. */
+static void protocol_match_init(void)
+{
+    memset(ip_protocol_clients, -1, sizeof(ip_protocol_clients));
+    memset(arp_opcode_clients, -1, sizeof(arp_opcode_clients));
+    for (int8_t client = config.num_clients - 1; client >= 0; client--) {
+        uint16_t subtype = fw_config.active_client_subtypes[client];
+        if (fw_config.active_client_ethtypes[client] == ETH_TYPE_IP && subtype <= UINT8_MAX) {
+            ip_protocol_clients[subtype] = client;
+        } else if (fw_config.active_client_ethtypes[client] == ETH_TYPE_ARP && subtype < ARP_NUM_OPCODES) {
+            arp_opcode_clients[subtype] = client;
         }
+    }
+}
 
-        if (ethtype == ETH_TYPE_ARP) {
-            /* If ARP traffic, check for opcode match */
-            arp_pkt_t *arp = (arp_pkt_t *)(pkt + ARP_PKT_OFFSET);
-            if (fw_config.active_client_subtypes[client] == htons(arp->opcode)) {
-                return client;
-            }
-        } else if (ethtype == ETH_TYPE_IP) {
-            /* If IPv4 traffic, check for IPv4 protocol match */
-            ipv4_hdr_t *ip_hdr = (ipv4_hdr_t *)(pkt + IPV4_HDR_OFFSET);
-            if (fw_config.active_client_subtypes[client] == ip_hdr->protocol) {
-                return client;
-            }
+/* Returns whether a packet routed to a client is dropped by the client filter's
+rules, in which case it is counted and the filter is not woken to drop it.
+Return traffic of neighbour filters' connections is always forwarded, as the
+filter permits it before searching its rules. */
+static inline bool hard_drop(int client, uintptr_t pkt, uint16_t len)
+{
+    fw_hard_drop_resource_t *resource = fw_config.hard_drops + client;
+    fw_hard_drop_t *summary = (fw_hard_drop_t *)resource->summary.vaddr;
+    if (summary == NULL) {
+        return false;
+    }
+
+    ipv4_hdr_t *ip_hdr = (ipv4_hdr_t *)(pkt + IPV4_HDR_OFFSET);
+    int prefix = fw_hard_drop_match(summary, ip_hdr->src_ip);
+    if (prefix < 0) {
+        return false;
+    }
+
+    /* ICMP connections are tracked without ports, TCP and UDP ports share the
+    same header offsets */
+    uint16_t src_port = ICMP_FILTER_DUMMY_PORT;
+    uint16_t dst_port = ICMP_FILTER_DUMMY_PORT;
+    if (ip_hdr->protocol != IPV4_PROTO_ICMP) {
+        udp_hdr_t *udp_hdr = (udp_hdr_t *)(pkt + transport_layer_offset(ip_hdr));
+        src_port = udp_hdr->src_port;
+        dst_port = udp_hdr->dst_port;
+    }
+
+    /* Return traffic has its addressing reversed with respect to the instance.
+    Traffic is left to the filter if a slot being updated may hold it */
+    fw_instance_t instance;
+    bool torn = false;
+    for (uint8_t i = 0; i < resource->num_external_instances; i++) {
+        if (fw_instances_table_search((fw_instances_table_t *)resource->external_instances[i].vaddr,
+                                      resource->instances_capacity, ip_hdr->dst_ip, dst_port, ip_hdr->src_ip,
+                                      src_port, &instance, NULL, &torn)
+            || torn) {
+            return false;
         }
     }
 
-    return -1;
+    fw_hard_drop_count(summary, prefix, len);
+    return true;
 }
 
 static void rx_return(void)
@@ -87,7 +148,7 @@ static void rx_return(void)
             // [1]: https://developer.arm.com/documentation/ddi0595/2021-06/AArch64-Instructions/DC-IVAC--Data-or-unified-Cache-line-Invalidate-by-VA-to-PoC
             cache_clean_and_invalidate(buffer_vaddr, buffer_vaddr + buffer.len);
             int client = get_protocol_match(buffer_vaddr);
-            if (client >= 0) {
+            if (client >= 0 && !hard_drop(client, buffer_vaddr, buffer.len)) {
                 err = net_enqueue_active(&rx_queue_clients[client], buffer);
                 assert(!err);
                 notify_clients[client] = true;
@@ -201,6 +262,8 @@ void init(void)
                       fw_config.free_clients[i].capacity);
     }
 
+    protocol_match_init();
+
     if (net_require_signal_free(&rx_queue_drv)) {
         net_cancel_signal_free(&rx_queue_drv);
         microkit_deferred_notify(config.driver.id);
@@ -23,29 +23,63 @@ net_queue_handle_t tx_queue_clients[SDDF_NET_MAX_CLIENTS];
 fw_queue_t fw_free_clients[FW_MAX_FW_CLIENTS];
 fw_queue_t fw_active_clients[FW_MAX_FW_CLIENTS];
 
-static int extract_offset_net_client(uintptr_t *phys)
+/* Buffer region of a net client or firewall free client. Buffers returned by the
+driver are owned by the client whose region holds their IO address */
+typedef struct client_region {
+    /* IO address of first buffer */
+    uintptr_t io_addr;
+    /* IO address past the last buffer */
+    uintptr_t io_end;
+    /* index of net client or firewall free client */
+    uint8_t client;
+    /* region belongs to a firewall free client */
+    bool fw_client;
+} client_region_t;
+
+/* Client regions sorted by IO address, so the owner of a buffer is found by a
+binary search regardless of the number of clients and interfaces */
+static client_region_t client_regions[SDDF_NET_MAX_CLIENTS + FW_MAX_FW_CLIENTS];
+static uint8_t num_client_regions;
+
+static void add_client_region(uintptr_t io_addr, uint32_t capacity, uint8_t client, bool fw_client)
 {
-    for (int client = 0; client < config.num_clients; client++) {
-        if (*phys >= config.clients[client].data.io_addr
-            && *phys < config.clients[client].data.io_addr + tx_queue_clients[client].capacity * NET_BUFFER_SIZE) {
-            *phys = *phys - config.clients[client].data.io_addr;
-            return client;
-        }
+    /* Clients without buffers own no addresses */
+    if (capacity == 0) {
+        return;
+    }
+
+    uint8_t idx = num_client_regions;
+    while (idx > 0 && client_regions[idx - 1].io_addr > io_addr) {
+        client_regions[idx] = client_regions[idx - 1];
+        idx--;
     }
-    return -1;
+
+    client_regions[idx].io_addr = io_addr;
+    client_regions[idx].io_end = io_addr + capacity * NET_BUFFER_SIZE;
+    client_regions[idx].client = client;
+    client_regions[idx].fw_client = fw_client;
+    num_client_regions++;
 }
 
-static int extract_offset_fw_client(uintptr_t *phys)
+/* Returns the region holding an IO address, converting the address into an
+offset within the region, or NULL if no client owns the address */
+static client_region_t *extract_offset_client(uintptr_t *phys)
 {
-    for (int client = 0; client < fw_config.num_free_clients; client++) {
-        if (*phys >= fw_config.free_clients[client].data.io_addr
-            && *phys
-                   < fw_config.free_clients[client].data.io_addr + fw_free_clients[client].capacity * NET_BUFFER_SIZE) {
-            *phys = *phys - fw_config.free_clients[client].data.io_addr;
-            return client;
+    uint8_t lo = 0;
+    uint8_t hi = num_client_regions;
+    while (lo < hi) {
+        uint8_t mid = lo + (hi - lo) / 2;
+        client_region_t *region = client_regions + mid;
+        if (*phys < region->io_addr) {
+            hi = mid;
+        } else if (*phys >= region->io_end) {
+            lo = mid + 1;
+        } else {
+            *phys = *phys - region->io_addr;
+            return region;
         }
     }
-    return -1;
+    return NULL;
 }
 
 static void tx_provide(void)
@@ -126,19 +160,19 @@ static void tx_return(void)
             int err = net_dequeue_free(&tx_queue_drv, &buffer);
             assert(!err);
 
-            int client = extract_offset_net_client(&buffer.io_or_offset);
-            if (client >= 0) {
-                err = net_enqueue_free(&tx_queue_clients[client], buffer);
+            client_region_t *region = extract_offset_client(&buffer.io_or_offset);
+            assert(region != NULL);
+
+            if (!region->fw_client) {
+                err = net_enqueue_free(&tx_queue_clients[region->client], buffer);
                 assert(!err);
-                notify_net_clients[client] = true;
+                notify_net_clients[region->client] = true;
                 continue;
             }
-            client = extract_offset_fw_client(&buffer.io_or_offset);
-            assert(client >= 0);
 
-            err = fw_enqueue(&fw_free_clients[client], &buffer);
+            err = fw_enqueue(&fw_free_clients[region->client], &buffer);
             assert(!err);
-            notify_fw_clients[client] = true;
+            notify_fw_clients[region->client] = true;
         }
 
         net_request_signal_free(&tx_queue_drv);
@@ -193,5 +227,19 @@ void init(void)
         fw_queue_init(&fw_free_clients[i], fw_config.free_clients[i].conn.queue.vaddr, sizeof(net_buff_desc_t),
                       fw_config.free_clients[i].conn.capacity);
     }
+
+    /* Build the sorted table of client regions */
+    for (int i = 0; i < config.num_clients; i++) {
+        add_client_region(config.clients[i].data.io_addr, tx_queue_clients[i].capacity, i, false);
+    }
+
+    for (int i = 0; i < fw_config.num_free_clients; i++) {
+        add_client_region(fw_config.free_clients[i].data.io_addr, fw_free_clients[i].capacity, i, true);
+    }
+
+    for (int i = 1; i < num_client_regions; i++) {
+        assert(client_regions[i - 1].io_end <= client_regions[i].io_addr);
+    }
+
     tx_provide();
 }
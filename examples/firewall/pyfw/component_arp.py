@@ -51,6 +51,7 @@ class ArpRequester(Component, FwArpRequesterConfig):
             arp_clients=[],
             arp_cache=self._arp_cache_mr.map(self.pd, "rw"),
             arp_cache_capacity=arp_cache_buffer.capacity,
+            trace=None,
         )
 
 
@@ -119,6 +120,7 @@ class ArpResponder(Component, FwArpResponderConfig):
             interface=net_interface.index,
             mac_addr=net_interface.mac_list,
             ip=net_interface.ip_int,
+            trace=None,
         )
 
     def finalise_config(self) -> None:
@@ -10,9 +10,16 @@ from pyfw.constants import (
     initial_rules,
     filter_instances_buffer,
     filter_instances_region,
+    filter_return_seen_region,
     filter_rules_buffer,
     filter_rules_region,
     filter_rule_bitmap_region,
+    filter_rule_state_region,
+    filter_half_open_links_region,
+    filter_stats_region,
+    filter_classifier_buffer,
+    filter_classifier_region,
+    filter_hard_drop_region,
     dma_buffer_queue,
     dma_buffer_queue_region,
 )
@@ -20,6 +27,7 @@ from pyfw.specs import FirewallMemoryRegion
 from config_structs import (
     FwConnectionResource,
     FwFilterConfig,
+    FwHardDropResource,
     FwWebserverFilterConfig,
 )
 
@@ -28,6 +36,10 @@ SDF_Channel = SystemDescription.Channel
 class Filter(Component, FwFilterConfig):
     """Per-interface protocol filter."""
     instance_regions: dict[int, list[FirewallMemoryRegion]] = {}
+    # Return traffic timestamp regions, keyed on the names of the writing
+    # filter and the filter owning the instance table
+    return_seen_regions: dict[tuple[str, str], FirewallMemoryRegion] = {}
+    filters: dict[int, list["Filter"]] = {}
 
     def __init__(
         self,
@@ -61,8 +73,10 @@ class Filter(Component, FwFilterConfig):
         # Store region to map into filters of the same protocol later
         if protocol in Filter.instance_regions.keys():
             Filter.instance_regions[protocol].append(self._local_instance_mr)
+            Filter.filters[protocol].append(self)
         else:
             Filter.instance_regions[protocol] = [self._local_instance_mr]
+            Filter.filters[protocol] = [self]
 
         # Create filter rule region
         self._filter_rules_mr = FirewallMemoryRegion(
@@ -70,12 +84,56 @@ class Filter(Component, FwFilterConfig):
             filter_rules_region.region_size,
         )
 
+        # Create shadow filter rule region, used by the webserver to stage new
+        # rule sets
+        self._shadow_rules_mr = FirewallMemoryRegion(
+            "filter_rules_shadow_" + self.name,
+            filter_rules_region.region_size,
+        )
+
+        # Create traffic counter region, written by the filter and read by the
+        # webserver
+        self._stats_mr = FirewallMemoryRegion(
+            "filter_stats_" + self.name,
+            filter_stats_region.region_size,
+        )
+
         # Create rule id bitmap region
         rule_id_bitmap_mr = FirewallMemoryRegion(
             "rule_bitmap_" + self.name,
             filter_rule_bitmap_region.region_size,
         )
 
+        # Create rule classifier regions, private to the filter
+        classifier_mr = FirewallMemoryRegion(
+            "classifier_" + self.name,
+            filter_classifier_region.region_size,
+        )
+        shadow_classifier_mr = FirewallMemoryRegion(
+            "classifier_shadow_" + self.name,
+            filter_classifier_region.region_size,
+        )
+
+        # Create rule state region, private to the filter
+        rule_state_mr = FirewallMemoryRegion(
+            "rule_state_" + self.name,
+            filter_rule_state_region.region_size,
+        )
+
+        # Create half-open connection list region, private to the TCP filter
+        half_open_links_mr = None
+        if proto_name == "tcp":
+            half_open_links_mr = FirewallMemoryRegion(
+                "half_open_links_" + self.name,
+                filter_half_open_links_region.region_size,
+            )
+
+        # Create hard drop summary region, shared with the Rx virtualiser
+        self._hard_drop_mr = FirewallMemoryRegion(
+            "hard_drop_" + self.name,
+            filter_hard_drop_region.region_size,
+        )
+
         # Initialise filter config class
         FwFilterConfig.__init__(
             self,
@@ -83,22 +141,39 @@ class Filter(Component, FwFilterConfig):
             router=None,
             internal_instances=self._local_instance_mr.map(self.pd, "rw"),
             external_instances=[],
+            return_seen=[],
+            neighbour_return_seen=[],
             instances_capacity=filter_instances_buffer.capacity,
             webserver=FwWebserverFilterConfig(
                 protocol=protocol,
                 ch=None,
                 rules=self._filter_rules_mr.map(self.pd, "rw"),
+                shadow_rules=self._shadow_rules_mr.map(self.pd, "r"),
+                stats=self._stats_mr.map(self.pd, "rw"),
                 rules_capacity=filter_rules_buffer.capacity,
                 actions=supported_filter_actions[protocol],
             ),
             rule_id_bitmap=rule_id_bitmap_mr.map(self.pd, "rw"),
+            classifier=classifier_mr.map(self.pd, "rw"),
+            shadow_classifier=shadow_classifier_mr.map(self.pd, "rw"),
+            classifier_capacity=filter_classifier_buffer.capacity,
+            rule_state=rule_state_mr.map(self.pd, "rw"),
+            half_open_links=half_open_links_mr.map(self.pd, "rw") if half_open_links_mr is not None else None,
+            ip_sets=None,
             icmp_module=None,
+            hard_drop=self._hard_drop_mr.map(self.pd, "rw"),
             initial_rules=initial_rules[iface_index][protocol],
+            trace=None,
         )
 
     def connect_webserver(self, webserver: Component) -> FwWebserverFilterConfig:
         # Map rules region into webserver
        web_rules_region = self._filter_rules_mr.map(webserver.pd, "r")
+       web_shadow_rules_region = self._shadow_rules_mr.map(webserver.pd, "rw")
+       web_stats_region = self._stats_mr.map(webserver.pd, "r")
+
+       # Map the webserver's IP sets into filter
+       self.ip_sets = webserver.map_ip_sets(self.pd)
 
        # Create filter-webserver channel
        web_update_ch = SDF_Channel(webserver.pd, self.pd, pp_a=True)
@@ -115,10 +190,29 @@ class Filter(Component, FwFilterConfig):
                 protocol=self.webserver.protocol,
                 ch=web_update_ch.pd_a_id,
                 rules=web_rules_region,
+                shadow_rules=web_shadow_rules_region,
+                stats=web_stats_region,
                 rules_capacity=filter_rules_buffer.capacity,
                 actions=self.webserver.actions,
             )
 
+    def connect_rx_virtualiser(self, rx_virtualiser: Component) -> FwHardDropResource:
+        # Rx virtualiser counts the traffic it drops in the hard drop summary
+        summary_region = self._hard_drop_mr.map(rx_virtualiser.pd, "rw")
+
+        # Rx virtualiser searches the same instance tables as the filter for
+        # return traffic
+        assert self.webserver is not None
+        external_mrs = Filter.instance_regions[self.webserver.protocol]
+        return FwHardDropResource(
+            summary=summary_region,
+            external_instances=[
+                instance_mr.map(rx_virtualiser.pd, "r")
+                for instance_mr in external_mrs if instance_mr != self._local_instance_mr
+            ],
+            instances_capacity=filter_instances_buffer.capacity,
+        )
+
     def connect_router(self, router: Component) -> FwConnectionResource:
         # Create tx queue with router
         router_queue_mr = FirewallMemoryRegion(
@@ -146,6 +240,17 @@ class Filter(Component, FwFilterConfig):
 
         )
 
+    @staticmethod
+    def return_seen_region(writer: "Filter", owner: "Filter") -> FirewallMemoryRegion:
+        # Created by whichever of the two filters is finalised first
+        key = (writer.name, owner.name)
+        if key not in Filter.return_seen_regions:
+            Filter.return_seen_regions[key] = FirewallMemoryRegion(
+                "return_seen_" + writer.name + "_" + owner.name,
+                filter_return_seen_region.region_size,
+            )
+        return Filter.return_seen_regions[key]
+
     def finalise_config(self) -> None:
         # Create external instance mappings
         external_mrs = Filter.instance_regions[self.webserver.protocol]
@@ -153,3 +258,14 @@ class Filter(Component, FwFilterConfig):
             instance_mr.map(self.pd, "r") for instance_mr in external_mrs if instance_mr != self._local_instance_mr
         ]
         assert len(self.external_instances) == len(interfaces) - 1
+
+        # Return traffic is timestamped by the filter receiving it, in a region
+        # read by the filter owning the instance. Neighbours are in the same
+        # order as the external instance tables
+        neighbours = [f for f in Filter.filters[self.webserver.protocol] if f is not self]
+        self.return_seen = [
+            Filter.return_seen_region(self, neighbour).map(self.pd, "rw") for neighbour in neighbours
+        ]
+        self.neighbour_return_seen = [
+            Filter.return_seen_region(neighbour, self).map(self.pd, "r") for neighbour in neighbours
+        ]
@@ -1,5 +1,6 @@
 # Copyright 2026, UNSW SPDX-License-Identifier: BSD-2-Clause
 
+from typing import Optional
 from sdfgen import SystemDescription
 from pyfw.component_base import Component
 from pyfw.component_net_interface import NetworkInterface
@@ -13,8 +14,10 @@ from config_structs import (
     DeviceRegionResource,
     FwConnectionResource,
     FwDataConnectionResource,
+    FwHardDropResource,
     FwNetVirtRxConfig,
     FwNetVirtTxConfig,
+    RegionResource,
 )
 
 SDF_Channel = SystemDescription.Channel
@@ -41,6 +44,7 @@ class NetVirtRx(Component, FwNetVirtRxConfig):
             interface=net_interface.index,
             active_client_ethtypes=[],
             active_client_subtypes=[],
+            hard_drops=[],
             free_clients=[],
         )
 
@@ -48,7 +52,8 @@ class NetVirtRx(Component, FwNetVirtRxConfig):
                               client: Component,
                               ethtype: int,
                               subtype: int,
-                              tx: bool = False
+                              tx: bool = False,
+                              hard_drop: Optional[FwHardDropResource] = None
     ) -> None:
 
         # Add sDDF net client
@@ -63,6 +68,16 @@ class NetVirtRx(Component, FwNetVirtRxConfig):
         self.active_client_ethtypes.append(ethtype)
         self.active_client_subtypes.append(subtype)
 
+        # Clients without a hard drop summary receive all of their traffic
+        if hard_drop is None:
+            hard_drop = FwHardDropResource(
+                summary=RegionResource(vaddr=0, size=0),
+                external_instances=[RegionResource(vaddr=0, size=0)],
+                instances_capacity=0,
+            )
+        assert self.hard_drops is not None
+        self.hard_drops.append(hard_drop)
+
     def add_free_fw_client(self, client: Component) -> FwConnectionResource:
         # Create return queue for DMA buffers
         queue = FirewallMemoryRegion(
@@ -91,6 +106,8 @@ class NetVirtRx(Component, FwNetVirtRxConfig):
         assert self.active_client_ethtypes is not None
         assert self.active_client_subtypes is not None
         assert len(self.active_client_ethtypes) == len(self.active_client_subtypes)
+        assert self.hard_drops is not None
+        assert len(self.active_client_ethtypes) == len(self.hard_drops)
 
 
 class NetVirtTx(Component, FwNetVirtTxConfig):
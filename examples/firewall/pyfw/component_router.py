@@ -8,10 +8,14 @@ from pyfw.constants import (
     interfaces,
     supported_protocols,
     arp_packet_queue_buffer,
+    arp_packet_queue_dest_capacity,
     arp_packet_queue_region,
     arp_cache_buffer,
+    adjacency_buffer,
+    adjacency_region,
     routing_table_buffer,
     routing_table_region,
+    routing_trie_buffer,
     dma_buffer_queue,
     dma_buffer_queue_region,
 )
@@ -47,6 +51,12 @@ class Router(Component, FwRouterConfig):
             routing_table_region.region_size,
         )
 
+        # Create the next hop adjacency table
+        adjacency_mr = FirewallMemoryRegion(
+            "adjacency_table_" + self.name,
+            adjacency_region.region_size,
+        )
+
         # Create per-interface resources
         self._interfaces: list[FwRouterInterface] = []
         self._initial_routes: list[FwRoutingEntry] = []
@@ -71,6 +81,7 @@ class Router(Component, FwRouterConfig):
                     filters=[],
                     packet_queue=packet_waiting_mr.map(self.pd, "rw"),
                     packet_queue_capacity=arp_packet_queue_buffer.capacity,
+                    packet_queue_dest_capacity=arp_packet_queue_dest_capacity,
                 )
             )
 
@@ -80,6 +91,7 @@ class Router(Component, FwRouterConfig):
                     ip=iface.ip_int,
                     subnet=iface.subnet_bits,
                     interface=iface.index,
+                    weight=1,
                     next_hop=0,
                 )
             )
@@ -97,8 +109,12 @@ class Router(Component, FwRouterConfig):
                 routing_table_capacity=routing_table_buffer.capacity,
                 rx_active=None,
             ),
+            routing_trie_capacity=routing_trie_buffer.capacity,
+            adjacency_table=adjacency_mr.map(self.pd, "rw"),
+            adjacency_capacity=adjacency_buffer.capacity,
             initial_routes=self._initial_routes,
             icmp_module=None,
+            trace=None,
         )
 
     def connect_webserver(
@@ -0,0 +1,59 @@
+# Copyright 2026, UNSW SPDX-License-Identifier: BSD-2-Clause
+
+from pyfw.component_base import Component
+from pyfw.constants import (
+    trace_ring_buffer,
+    trace_ring_region,
+)
+from pyfw.specs import FirewallMemoryRegion
+from config_structs import (
+    FwMaxTraceRings,
+    FwTraceConsumerConfig,
+    FwTraceResource,
+)
+
+class TraceConsumer(Component, FwTraceConsumerConfig):
+    """Decodes the packet path trace rings of other components to serial."""
+
+    def __init__(
+        self,
+        priority: int = 1,
+        budget: int = 20000,
+    ) -> None:
+        # Initialise base component class
+        super().__init__(
+            "trace_consumer",
+            "trace_consumer.elf",
+            priority,
+            budget,
+        )
+
+        # Initialise trace consumer config class
+        FwTraceConsumerConfig.__init__(
+            self,
+            rings=[],
+        )
+
+    # Create a trace ring written by the producer and read by the consumer.
+    # Returns the producer's trace config.
+    def add_producer(self, producer: Component) -> FwTraceResource:
+        ring_mr = FirewallMemoryRegion(
+            "trace_ring_" + producer.name,
+            trace_ring_region.region_size,
+        )
+
+        assert self.rings is not None
+        self.rings.append(
+            FwTraceResource(
+                ring=ring_mr.map(self.pd, "r"),
+                capacity=trace_ring_buffer.capacity,
+            )
+        )
+
+        return FwTraceResource(
+            ring=ring_mr.map(producer.pd, "rw"),
+            capacity=trace_ring_buffer.capacity,
+        )
+
+    def finalise_config(self) -> None:
+        assert self.rings is not None and 0 < len(self.rings) <= FwMaxTraceRings
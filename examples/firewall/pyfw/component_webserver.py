@@ -6,9 +6,13 @@ from pyfw.constants import (
     interfaces,
     supported_protocols,
     webserver_tx_interface_idx,
+    ip_set_ranges_buffer,
+    ip_sets_region,
 )
+from pyfw.specs import FirewallMemoryRegion
 from config_structs import (
     EthHwaddrLen,
+    FwIpSetsResource,
     FwWebserverConfig,
     FwWebserverInterfaceConfig,
 )
@@ -45,15 +49,35 @@ class Webserver(Component, FwWebserverConfig):
                 )
             )
 
+        # Create the two copies of the IP sets. Filters read one copy while
+        # the webserver stages changes in the other
+        self._ip_sets_mr = FirewallMemoryRegion(
+            "ip_sets",
+            ip_sets_region.region_size,
+        )
+        self._shadow_ip_sets_mr = FirewallMemoryRegion(
+            "ip_sets_shadow",
+            ip_sets_region.region_size,
+        )
+
         # Initialise Webserver config class
         FwWebserverConfig.__init__(
             self,
             interfaces=self._interfaces,
             router=None,
             arp_queue=None,
+            ip_sets=self.map_ip_sets(self.pd, "rw"),
             tx_interface=webserver_tx_interface_idx,
         )
 
+    # Map both copies of the IP sets into a component
+    def map_ip_sets(self, pd: SystemDescription.ProtectionDomain, perms: str = "r") -> FwIpSetsResource:
+        return FwIpSetsResource(
+            ip_sets=self._ip_sets_mr.map(pd, perms),
+            shadow_ip_sets=self._shadow_ip_sets_mr.map(pd, perms),
+            capacity=ip_set_ranges_buffer.capacity,
+        )
+
     def finalise_config(self) -> None:
         assert self.interfaces is not None and len(self.interfaces) == len(interfaces)
         for iface in self.interfaces:
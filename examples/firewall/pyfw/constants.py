@@ -6,6 +6,7 @@ from pyfw.board import Board
 from pyfw.memory_layout import (
     FirewallDataStructure,
     FirewallMemoryRegions,
+    UINT16_BYTES,
     UINT64_BYTES,
 )
 from pyfw.component_net_interface import NetworkInterface
@@ -97,17 +98,34 @@ FILTER_ACTION_ALLOW = 1
 FILTER_ACTION_DROP = 2
 FILTER_ACTION_REJECT = 3
 FILTER_ACTION_CONNECT = 4
+FILTER_ACTION_RATE_LIMIT = 5
+
 
 # If a filter supports action n, index n-1 is set to 1
 supported_filter_actions = {
-    0x01: [1, 1, 1, 1],
-    0x06: [1, 1, 0, 1],
-    0x11: [1, 1, 1, 1]
+    0x01: [1, 1, 1, 1, 1],
+    0x06: [1, 1, 0, 1, 1],
+    0x11: [1, 1, 1, 1, 1]
 }
 
+# Must match FW_MAX_IP_SETS in ip_set.h
+FW_MAX_IP_SETS = 16
+
+# Ports are in network byte order. A non-zero port max makes the rule apply to
+# the range of ports from port to port max. Destination port sets are stored out
+# of line in the rule table, so may only be added through the webserver.
+# A non-zero IP set makes the rule match addresses in the set in place of the IP
+# and subnet of that side. Rate limit rules must limit packets or bytes per
+# second, and may limit each source IP separately
 def construct_rule(action: int, src_ip: int, src_subnet: int, src_port: int, src_port_any: bool,
-                   dst_ip: int, dst_subnet: int, dst_port: int, dst_port_any: bool) -> FwRule:
-    assert action in (FILTER_ACTION_ALLOW, FILTER_ACTION_DROP, FILTER_ACTION_CONNECT, FILTER_ACTION_REJECT)
+                   dst_ip: int, dst_subnet: int, dst_port: int, dst_port_any: bool,
+                   src_port_max: int = 0, dst_port_max: int = 0,
+                   src_ip_set: int = 0, dst_ip_set: int = 0, rate_pps: int = 0, rate_bps: int = 0,
+                   rate_per_source: bool = False) -> FwRule:
+    assert action in (FILTER_ACTION_ALLOW, FILTER_ACTION_DROP, FILTER_ACTION_CONNECT, FILTER_ACTION_REJECT,
+                      FILTER_ACTION_RATE_LIMIT)
+    assert 0 <= src_ip_set <= FW_MAX_IP_SETS and 0 <= dst_ip_set <= FW_MAX_IP_SETS
+    assert action != FILTER_ACTION_RATE_LIMIT or rate_pps > 0 or rate_bps > 0
     return FwRule(
         action=action,
         src_ip=src_ip,
@@ -118,6 +136,14 @@ def construct_rule(action: int, src_ip: int, src_subnet: int, src_port: int, src
         dst_subnet=dst_subnet,
         src_port_any=src_port_any,
         dst_port_any=dst_port_any,
+        src_port_max=src_port_max,
+        dst_port_max=dst_port_max,
+        dst_port_set=0,
+        src_ip_set=src_ip_set,
+        dst_ip_set=dst_ip_set,
+        rate_pps=rate_pps,
+        rate_bps=rate_bps,
+        rate_per_source=rate_per_source,
         rule_id=0,
     )
 
@@ -144,9 +170,13 @@ initial_rules = [
 ### Routing ###
 ### ----------------------------------------------------------------------- ###
 
-def construct_route(ip: int, subnet: int, interface: int, next_hop: int) -> FwRoutingEntry:
+# Routes with the same subnet and different next hops are paths of a multipath
+# route, flows to the subnet are spread across its paths in proportion to their
+# weight
+def construct_route(ip: int, subnet: int, interface: int, next_hop: int, weight: int = 1) -> FwRoutingEntry:
     assert interface < len(interfaces)
-    return FwRoutingEntry(ip=ip, subnet=subnet, interface=interface, next_hop=next_hop)
+    assert 0 < weight <= 255
+    return FwRoutingEntry(ip=ip, subnet=subnet, interface=interface, weight=weight, next_hop=next_hop)
 
 # Initial routes, in addition to the direct routes for hosts on each interface's subnet
 initial_routes: List[FwRoutingEntry] = []
@@ -197,22 +227,31 @@ icmp_queue_region = FirewallMemoryRegions(
 )
 
 # --------------------------------------------- #
-# ARP entry cache table
+# ARP entry cache table, a hash table so capacity must be a power of 2
 arp_cache_buffer = FirewallDataStructure(
     elf_name="arp_requester.elf", c_name="fw_arp_entry", capacity=512
 )
+assert arp_cache_buffer.capacity & (arp_cache_buffer.capacity - 1) == 0
 arp_cache_region = FirewallMemoryRegions(data_structures=[arp_cache_buffer])
 
 # --------------------------------------------- #
-# Router packet waiting linked list node pool
+# Router packet waiting linked list node pool, followed by the hash bucket heads
+# indexing root nodes by next hop
 arp_packet_queue_buffer = FirewallDataStructure(
     elf_name="routing.elf",
     c_name="pkt_waiting_node",
     capacity=dma_buffer_queue.capacity,
 )
+arp_packet_queue_bucket_buffer = FirewallDataStructure(
+    entry_size=UINT16_BYTES, capacity=arp_packet_queue_buffer.capacity
+)
 arp_packet_queue_region = FirewallMemoryRegions(
-    data_structures=[arp_packet_queue_buffer]
+    data_structures=[arp_packet_queue_buffer, arp_packet_queue_bucket_buffer]
 )
+# Packets that may wait on a single next hop, so that one unresolved host can
+# not hold the whole pool
+arp_packet_queue_dest_capacity = 64
+assert arp_packet_queue_dest_capacity <= arp_packet_queue_buffer.capacity
 
 # --------------------------------------------- #
 # Routing table
@@ -220,10 +259,43 @@ routing_table_wrapper = FirewallDataStructure(
     elf_name="routing.elf", c_name="fw_routing_table"
 )
 routing_table_buffer = FirewallDataStructure(
-    elf_name="routing.elf", c_name="fw_routing_entry", capacity=256
+    elf_name="routing.elf", c_name="fw_routing_entry", capacity=4096
+)
+# Longest prefix match trie nodes, stored after the routing table entries. A
+# route needs at most one new node per octet of its prefix after the first, so
+# the pool holds three for every route and the root, and a full table of routes
+# sharing no leading octets still fits. Nodes are 1KiB, so this is 12MiB
+routing_trie_buffer = FirewallDataStructure(
+    elf_name="routing.elf",
+    c_name="fw_routing_trie_node",
+    capacity=3 * routing_table_buffer.capacity + 1,
+)
+# Routes and trie nodes are indexed by 16 bit integers, routes from 1
+assert routing_trie_buffer.capacity < 1 << 16 and routing_table_buffer.capacity < (1 << 16) - 1
+# Links between the paths of multipath routes, stored after the trie nodes
+routing_path_buffer = FirewallDataStructure(
+    entry_size=UINT16_BYTES, capacity=routing_table_buffer.capacity
 )
 routing_table_region = FirewallMemoryRegions(
-    data_structures=[routing_table_wrapper, routing_table_buffer]
+    data_structures=[routing_table_wrapper, routing_table_buffer, routing_trie_buffer, routing_path_buffer]
+)
+
+# --------------------------------------------- #
+# Router next hop adjacencies, followed by their hash bucket heads and the
+# adjacency each route is bound to. Capacity must be a power of 2
+adjacency_buffer = FirewallDataStructure(
+    elf_name="routing.elf",
+    c_name="fw_adjacency",
+    capacity=2 * arp_cache_buffer.capacity,
+)
+adjacency_bucket_buffer = FirewallDataStructure(
+    entry_size=UINT16_BYTES, capacity=adjacency_buffer.capacity
+)
+adjacency_route_buffer = FirewallDataStructure(
+    entry_size=UINT16_BYTES, capacity=routing_table_buffer.capacity
+)
+adjacency_region = FirewallMemoryRegions(
+    data_structures=[adjacency_buffer, adjacency_bucket_buffer, adjacency_route_buffer]
 )
 
 # --------------------------------------------- #
@@ -239,29 +311,144 @@ filter_rules_region = FirewallMemoryRegions(
 )
 
 # --------------------------------------------- #
-# Filter rule ID bitmap
+# Filter traffic counters, indexed by rule ID
+filter_stats_wrapper = FirewallDataStructure(
+    elf_name="icmp_filter.elf", c_name="fw_filter_stats"
+)
+filter_stats_buffer = FirewallDataStructure(
+    elf_name="icmp_filter.elf", c_name="fw_rule_stats", capacity=filter_rules_buffer.capacity
+)
+filter_stats_region = FirewallMemoryRegions(
+    data_structures=[filter_stats_wrapper, filter_stats_buffer]
+)
+
+# --------------------------------------------- #
+# Filter rule state, indexed by rule ID and private to the filter
+filter_rule_state_buffer = FirewallDataStructure(
+    elf_name="icmp_filter.elf", c_name="fw_rule_state", capacity=filter_rules_buffer.capacity
+)
+filter_rule_state_region = FirewallMemoryRegions(
+    data_structures=[filter_rule_state_buffer]
+)
+
+# --------------------------------------------- #
+# Filter rule ID bitmap, followed by the rule ID to rule table slot index
 filter_rule_bitmap_wrapper = FirewallDataStructure(
     elf_name="icmp_filter.elf", c_name="fw_rule_id_bitmap"
 )
 filter_rule_bitmap_buffer = FirewallDataStructure(
     entry_size=UINT64_BYTES, capacity=(filter_rules_buffer.capacity + 63) // 64
 )
+filter_rule_slots_buffer = FirewallDataStructure(
+    entry_size=UINT16_BYTES, capacity=filter_rules_buffer.capacity
+)
 filter_rule_bitmap_region = FirewallMemoryRegions(
-    data_structures=[filter_rule_bitmap_wrapper, filter_rule_bitmap_buffer]
+    data_structures=[filter_rule_bitmap_wrapper, filter_rule_bitmap_buffer, filter_rule_slots_buffer]
 )
 
 # --------------------------------------------- #
-# Filter instance table
+# Filter rule classifier, a hash table of rules followed by the tuple list.
+# Hash table capacity must be a power of 2, and is kept at least twice the rule
+# capacity to keep probe sequences short. Each tuple holds at least one rule, so
+# the tuple list has the capacity of the hash table
+filter_classifier_wrapper = FirewallDataStructure(
+    elf_name="icmp_filter.elf", c_name="fw_classifier"
+)
+filter_classifier_buffer = FirewallDataStructure(
+    elf_name="icmp_filter.elf",
+    c_name="fw_classifier_entry",
+    capacity=1 << (2 * filter_rules_buffer.capacity - 1).bit_length(),
+)
+filter_classifier_tuples_buffer = FirewallDataStructure(
+    elf_name="icmp_filter.elf",
+    c_name="fw_classifier_tuple",
+    capacity=filter_classifier_buffer.capacity,
+)
+filter_classifier_region = FirewallMemoryRegions(
+    data_structures=[filter_classifier_wrapper, filter_classifier_buffer, filter_classifier_tuples_buffer]
+)
+
+# --------------------------------------------- #
+# Filter instance table, a hash table so capacity must be a power of 2. Instances
+# can only be stored within FW_INSTANCE_MAX_PROBE slots of their home slot, so
+# the table is kept at least twice the number of connections tracked by each
+# filter to keep probe windows from filling. Each filter's instance region is
+# then 8192 slots of 40 bytes, and each return traffic timestamp region 64KiB
+filter_max_connections = 4096
 filter_instances_wrapper = FirewallDataStructure(
     elf_name="icmp_filter.elf", c_name="fw_instances_table"
 )
 filter_instances_buffer = FirewallDataStructure(
-    elf_name="icmp_filter.elf", c_name="fw_instance", capacity=256
+    elf_name="icmp_filter.elf",
+    c_name="fw_instance",
+    capacity=1 << (2 * filter_max_connections - 1).bit_length(),
 )
+assert filter_instances_buffer.capacity & (filter_instances_buffer.capacity - 1) == 0
+# Instance table indices are 16 bit
+assert filter_instances_buffer.capacity <= 1 << 15
 filter_instances_region = FirewallMemoryRegions(
     data_structures=[filter_instances_wrapper, filter_instances_buffer]
 )
 
+# Half-open connection list links of the TCP filter's instance table slots,
+# private to the filter
+filter_half_open_links_buffer = FirewallDataStructure(
+    entry_size=2 * UINT16_BYTES, capacity=filter_instances_buffer.capacity
+)
+filter_half_open_links_region = FirewallMemoryRegions(
+    data_structures=[filter_half_open_links_buffer]
+)
+
+# Return traffic timestamps of an instance table's slots, written by one
+# neighbour filter
+filter_return_seen_buffer = FirewallDataStructure(
+    entry_size=UINT64_BYTES, capacity=filter_instances_buffer.capacity
+)
+filter_return_seen_region = FirewallMemoryRegions(
+    data_structures=[filter_return_seen_buffer]
+)
+
+# --------------------------------------------- #
+# Filter hard drop summary, the source prefixes whose traffic a filter's rules
+# drop. Written by the filter, and read by the Rx virtualiser which counts the
+# traffic it drops in place of the filter
+filter_hard_drop_buffer = FirewallDataStructure(
+    elf_name="icmp_filter.elf", c_name="fw_hard_drop"
+)
+filter_hard_drop_region = FirewallMemoryRegions(
+    data_structures=[filter_hard_drop_buffer]
+)
+
+# --------------------------------------------- #
+# IP sets, the set headers followed by the pool of address ranges shared by all
+# sets. Every prefix added takes one range until its list is merged, so the pool
+# must hold the largest blocklists to be loaded across all sets
+ip_set_max_prefixes = 500000
+ip_sets_wrapper = FirewallDataStructure(
+    elf_name="icmp_filter.elf", c_name="fw_ip_sets"
+)
+ip_set_ranges_buffer = FirewallDataStructure(
+    elf_name="icmp_filter.elf", c_name="fw_ip_set_range", capacity=1 << 19
+)
+assert ip_set_ranges_buffer.capacity >= ip_set_max_prefixes
+ip_sets_region = FirewallMemoryRegions(
+    data_structures=[ip_sets_wrapper, ip_set_ranges_buffer]
+)
+
+# --------------------------------------------- #
+# Packet path trace ring, one per producing component. Records are indexed by
+# a free running counter so capacity must be a power of 2
+trace_ring_wrapper = FirewallDataStructure(
+    elf_name="routing.elf", c_name="fw_trace_ring"
+)
+trace_ring_buffer = FirewallDataStructure(
+    elf_name="routing.elf", c_name="fw_trace_record", capacity=1024
+)
+assert trace_ring_buffer.capacity & (trace_ring_buffer.capacity - 1) == 0
+trace_ring_region = FirewallMemoryRegions(
+    data_structures=[trace_ring_wrapper, trace_ring_buffer]
+)
+
 ### ----------------------------------------------------------------------- ###
 ### Network constants ###
 ### ----------------------------------------------------------------------- ###
@@ -5,6 +5,7 @@ from os import path
 from typing import Callable, Optional
 
 PAGE_SIZE = 0x1000
+UINT16_BYTES = 2
 UINT64_BYTES = 8
 
 
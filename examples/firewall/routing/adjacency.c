@@ -0,0 +1,118 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <lions/firewall/adjacency.h>
+#include <lions/firewall/common.h>
+#include <lions/firewall/ethernet.h>
+
+static inline uint16_t *adjacency_bucket(fw_adjacency_table_t *table, uint8_t interface, uint32_t ip)
+{
+    return table->buckets + (fw_flow_hash(ip, interface, 0, 0) & (table->capacity - 1));
+}
+
+/* Release every adjacency and route binding */
+static void adjacency_reset(fw_adjacency_table_t *table)
+{
+    memset(table->buckets, 0, table->capacity * sizeof(uint16_t));
+    memset(table->routes, 0, table->num_routes * sizeof(uint16_t));
+    for (uint16_t i = 0; i < table->capacity; i++) {
+        table->entries[i].next = (i + 1 < table->capacity) ? i + 2 : 0;
+    }
+    table->size = 0;
+    table->free = 1;
+}
+
+void fw_adjacency_table_init(fw_adjacency_table_t *table, void *vaddr, uint16_t capacity, uint16_t num_routes)
+{
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+    table->entries = (fw_adjacency_t *)vaddr;
+    table->buckets = (uint16_t *)(table->entries + capacity);
+    table->routes = table->buckets + capacity;
+    table->capacity = capacity;
+    table->num_routes = num_routes;
+    adjacency_reset(table);
+}
+
+fw_adjacency_t *fw_adjacency_find(fw_adjacency_table_t *table, uint8_t interface, uint32_t ip)
+{
+    for (uint16_t i = *adjacency_bucket(table, interface, ip); i != 0; i = table->entries[i - 1].next) {
+        fw_adjacency_t *adjacency = table->entries + i - 1;
+        if (adjacency->ip == ip && adjacency->interface == interface) {
+            return adjacency;
+        }
+    }
+
+    return NULL;
+}
+
+fw_adjacency_t *fw_adjacency_add(fw_adjacency_table_t *table, uint8_t interface, uint32_t ip, uint8_t *mac_addr,
+                                 uint8_t *src_mac_addr, uint16_t arp_entry, uint16_t route_id)
+{
+    fw_adjacency_t *adjacency = fw_adjacency_find(table, interface, ip);
+    if (adjacency == NULL) {
+        if (table->free == 0) {
+            adjacency_reset(table);
+        }
+
+        uint16_t idx = table->free;
+        adjacency = table->entries + idx - 1;
+        table->free = adjacency->next;
+
+        uint16_t *bucket = adjacency_bucket(table, interface, ip);
+        adjacency->next = *bucket;
+        *bucket = idx;
+        table->size++;
+
+        adjacency->ip = ip;
+        adjacency->interface = interface;
+        adjacency->eth_hdr.ethtype = htons(ETH_TYPE_IP);
+        adjacency->refresh_expiry = 0;
+    }
+
+    adjacency->arp_entry = arp_entry;
+    memcpy(&adjacency->eth_hdr.ethdst_addr, mac_addr, ETH_HWADDR_LEN);
+    memcpy(&adjacency->eth_hdr.ethsrc_addr, src_mac_addr, ETH_HWADDR_LEN);
+
+    if (route_id != FW_ADJACENCY_NOROUTE) {
+        assert(route_id < table->num_routes);
+        table->routes[route_id] = adjacency - table->entries + 1;
+    }
+
+    return adjacency;
+}
+
+void fw_adjacency_remove(fw_adjacency_table_t *table, uint8_t interface, uint32_t ip)
+{
+    uint16_t *link = adjacency_bucket(table, interface, ip);
+    while (*link != 0) {
+        uint16_t idx = *link;
+        fw_adjacency_t *adjacency = table->entries + idx - 1;
+        if (adjacency->ip != ip || adjacency->interface != interface) {
+            link = &adjacency->next;
+            continue;
+        }
+
+        for (uint16_t r = 0; r < table->num_routes; r++) {
+            if (table->routes[r] == idx) {
+                table->routes[r] = 0;
+            }
+        }
+
+        *link = adjacency->next;
+        adjacency->next = table->free;
+        table->free = idx;
+        table->size--;
+        return;
+    }
+}
+
+void fw_adjacency_unbind_routes(fw_adjacency_table_t *table)
+{
+    memset(table->routes, 0, table->num_routes * sizeof(uint16_t));
+}
@@ -6,18 +6,35 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include <lions/firewall/common.h>
 #include <lions/firewall/queue.h>
 #include <lions/firewall/routing.h>
 
-void pkt_waiting_init(pkts_waiting_t *pkts_waiting, void *packets, int16_t capacity)
+static inline uint16_t *pkt_waiting_bucket(pkts_waiting_t *pkts_waiting, uint32_t ip)
 {
+    return pkts_waiting->buckets + (fw_flow_hash(ip, 0, 0, 0) & (pkts_waiting->num_buckets - 1));
+}
+
+void pkt_waiting_init(pkts_waiting_t *pkts_waiting, void *packets, int16_t capacity, uint16_t dest_capacity)
+{
+    assert(capacity > 0 && dest_capacity > 0);
     pkts_waiting->packets = (pkt_waiting_node_t *)packets;
     pkts_waiting->capacity = capacity;
+    pkts_waiting->dest_capacity = dest_capacity;
     for (uint16_t i = 0; i < pkts_waiting->capacity; i++) {
         pkt_waiting_node_t *node = pkts_waiting->packets + i;
         /* Free list only maintains next pointers */
         node->next = i + 1;
     }
+
+    /* Use the largest power of 2 number of buckets that fits in the region */
+    pkts_waiting->buckets = (uint16_t *)(pkts_waiting->packets + capacity);
+    pkts_waiting->num_buckets = 1;
+    while (pkts_waiting->num_buckets <= capacity / 2) {
+        pkts_waiting->num_buckets *= 2;
+    }
+    memset(pkts_waiting->buckets, 0, pkts_waiting->num_buckets * sizeof(uint16_t));
 }
 
 bool pkt_waiting_full(pkts_waiting_t *pkts_waiting)
@@ -27,12 +44,11 @@ bool pkt_waiting_full(pkts_waiting_t *pkts_waiting)
 
 pkt_waiting_node_t *pkt_waiting_find_node(pkts_waiting_t *pkts_waiting, uint32_t ip)
 {
-    pkt_waiting_node_t *node = pkts_waiting->packets + pkts_waiting->head;
-    for (uint16_t i = 0; i < pkts_waiting->length; i++) {
+    for (uint16_t i = *pkt_waiting_bucket(pkts_waiting, ip); i != 0; i = pkts_waiting->packets[i - 1].hash_next) {
+        pkt_waiting_node_t *node = pkts_waiting->packets + i - 1;
         if (node->ip == ip) {
             return node;
         }
-        node = pkts_waiting->packets + node->next;
     }
 
     return NULL;
@@ -45,7 +61,7 @@ pkt_waiting_node_t *pkts_waiting_next_child(pkts_waiting_t *pkts_waiting, pkt_wa
 
 fw_routing_err_t pkt_waiting_push_child(pkts_waiting_t *pkts_waiting, pkt_waiting_node_t *root, fw_buff_desc_t buffer)
 {
-    if (pkt_waiting_full(pkts_waiting)) {
+    if (pkt_waiting_full(pkts_waiting) || root->num_children + 1 >= pkts_waiting->dest_capacity) {
         return ROUTING_ERR_FULL;
     }
 
@@ -97,6 +113,10 @@ fw_routing_err_t pkt_waiting_push(pkts_waiting_t *pkts_waiting, uint32_t ip, fw_
     }
     pkts_waiting->head = new_idx;
 
+    uint16_t *bucket = pkt_waiting_bucket(pkts_waiting, ip);
+    new_node->hash_next = *bucket;
+    *bucket = new_idx + 1;
+
     /* Update counts */
     pkts_waiting->length++;
     pkts_waiting->size++;
@@ -123,6 +143,13 @@ fw_routing_err_t pkts_waiting_free_parent(pkts_waiting_t *pkts_waiting, pkt_wait
 
     /* Now free parent */
     uint16_t root_idx = (uint16_t)(root - pkts_waiting->packets);
+    uint16_t *link = pkt_waiting_bucket(pkts_waiting, root->ip);
+    while (*link != root_idx + 1) {
+        assert(*link != 0);
+        link = &pkts_waiting->packets[*link - 1].hash_next;
+    }
+    *link = root->hash_next;
+
     if (root_idx == pkts_waiting->head) {
         /* Root node is head */
         pkts_waiting->head = root->next;
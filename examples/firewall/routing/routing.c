@@ -12,6 +12,9 @@
 #include <sddf/network/config.h>
 #include <sddf/serial/queue.h>
 #include <sddf/serial/config.h>
+#include <sddf/timer/client.h>
+#include <sddf/timer/config.h>
+#include <lions/firewall/adjacency.h>
 #include <lions/firewall/arp.h>
 #include <lions/firewall/checksum.h>
 #include <lions/firewall/common.h>
@@ -22,9 +25,11 @@
 #include <lions/firewall/queue.h>
 #include <lions/firewall/routing.h>
 #include <lions/firewall/tcp.h>
+#include <lions/firewall/trace.h>
 
 __attribute__((__section__(".serial_client_config"))) serial_client_config_t serial_config;
 __attribute__((__section__(".fw_router_config"))) fw_router_config_t router_config;
+__attribute__((__section__(".timer_client_config"))) timer_client_config_t timer_config;
 
 /* Port that the webserver is on. */
 #define WEBSERVER_PORT 80
@@ -49,6 +54,10 @@ pkts_waiting_t pkt_waiting_queue[FW_MAX_INTERFACES];        /* Queues holding pa
 
 /* Routing data structures */
 fw_routing_table_t *routing_table; /* Table holding next hop data for subnets */
+fw_adjacency_table_t adjacency_table; /* Ethernet headers of resolved next hops */
+
+/* Packet path event trace */
+fw_trace_t trace;
 
 /* Booleans to keep track of which components need to be notified */
 static bool tx_net[FW_MAX_INTERFACES];      /* Packet has been transmitted to the network tx virtualiser */
@@ -79,28 +88,53 @@ static bool enqueue_icmp_unreachable(fw_buff_desc_t buffer, uint32_t next_hop)
     return enqueued;
 }
 
-static void transmit_packet(fw_buff_desc_t buffer, uint8_t *mac_addr, uint8_t out_interface)
+/* Request the next hop of an adjacency in use again once its ARP cache entry
+is stale, so the ARP requester refreshes the entry before it expires rather
+than packets waiting on a new request after it expires. Requested at most once
+per expiry of the entry. */
+static inline void adjacency_refresh(fw_adjacency_t *adjacency)
+{
+    fw_arp_entry_t *entry = arp_table[adjacency->interface].entries + adjacency->arp_entry;
+    if (!entry->stale || adjacency->refresh_expiry == entry->expiry
+        || fw_queue_full(&arp_req_queue[adjacency->interface])) {
+        return;
+    }
+
+    fw_arp_request_t request = { adjacency->ip, { 0 }, ARP_STATE_INVALID };
+    int err = fw_enqueue(&arp_req_queue[adjacency->interface], &request);
+    assert(!err);
+    notify_arp[adjacency->interface] = true;
+    adjacency->refresh_expiry = entry->expiry;
+}
+
+/* Create or update the adjacency of a next hop resolved by an ARP response */
+static fw_adjacency_t *resolve_adjacency(uint8_t out_interface, uint32_t next_hop, uint8_t *mac_addr,
+                                         uint16_t route_id)
+{
+    fw_arp_table_t *table = &arp_table[out_interface];
+    fw_arp_entry_t *entry = fw_arp_table_find_entry(table, next_hop);
+    uint16_t arp_entry = (entry == NULL) ? table->capacity : entry - table->entries;
+    return fw_adjacency_add(&adjacency_table, out_interface, next_hop, mac_addr,
+                            router_config.interfaces[out_interface].mac_addr, arp_entry, route_id);
+}
+
+static void transmit_packet(fw_buff_desc_t buffer, fw_adjacency_t *adjacency)
 {
     uintptr_t pkt_vaddr = data_vaddr[buffer.interface] + buffer.offset;
-    eth_hdr_t *eth_hdr = (eth_hdr_t *)pkt_vaddr;
     ipv4_hdr_t *ip_hdr = (ipv4_hdr_t *)(pkt_vaddr + IPV4_HDR_OFFSET);
+    uint8_t out_interface = adjacency->interface;
 
-    memcpy(&eth_hdr->ethdst_addr, mac_addr, ETH_HWADDR_LEN);
-    memcpy(&eth_hdr->ethsrc_addr, router_config.interfaces[out_interface].mac_addr, ETH_HWADDR_LEN);
+    memcpy((void *)pkt_vaddr, &adjacency->eth_hdr, ETH_HDR_LEN);
 
     /* Transmit packet out the NIC */
     if (FW_DEBUG_OUTPUT) {
-        sddf_printf("ROUTING_LOG: sending packet received on interface %u out of interface %u for ip %s with buffer "
-                    "number %lu\n",
-                    buffer.interface, out_interface, ipaddr_to_string(ip_hdr->dst_ip, ip_addr_buf0),
-                    buffer.offset / NET_BUFFER_SIZE);
+        fw_trace_event(&trace, FW_TRACE_ROUTER_TRANSMIT, out_interface, ip_hdr->protocol, ip_hdr->src_ip, 0,
+                       ip_hdr->dst_ip, 0, 0, buffer.offset / NET_BUFFER_SIZE);
     }
 
-    /* Checksum needs to be re-calculated as header has been modified */
+#ifdef NETWORK_HW_HAS_CHECKSUM
+    /* Checksum is re-calculated by the hardware */
     ip_hdr->check = 0;
-#ifndef NETWORK_HW_HAS_CHECKSUM
-    /* Recalculate IP packet checksum in software */
-    ip_hdr->check = fw_internet_checksum(ip_hdr, ipv4_header_length(ip_hdr));
 #endif
 
     int err = fw_enqueue(&tx_active[out_interface], &buffer);
@@ -116,16 +150,15 @@ static void process_arp_waiting(uint8_t out_interface)
         assert(!err);
 
         if (FW_DEBUG_OUTPUT) {
-            sddf_printf("ROUTING_LOG: dequeuing response for ip %s on interface %u and MAC[0]= %x, MAC[5] = %x\n",
-                        ipaddr_to_string(response.ip, ip_addr_buf0), out_interface, response.mac_addr[0],
-                        response.mac_addr[5]);
+            fw_trace_event(&trace, FW_TRACE_ROUTER_ARP_RESPONSE, out_interface, 0, 0, 0, response.ip, 0, 0,
+                           response.state);
         }
 
         /* Check that we actually have a packet waiting. */
         pkt_waiting_node_t *root = pkt_waiting_find_node(&pkt_waiting_queue[out_interface], response.ip);
         if (!root) {
             if (FW_DEBUG_OUTPUT) {
-                sddf_printf("ROUTING_LOG: received arp response but no corresponding packet is waiting.");
+                fw_trace_event(&trace, FW_TRACE_ROUTER_ARP_NO_WAITING, out_interface, 0, 0, 0, response.ip, 0, 0, 0);
             }
             continue;
         }
@@ -133,12 +166,13 @@ static void process_arp_waiting(uint8_t out_interface)
         /* Send or drop all matching ip packets */
         if (response.state == ARP_STATE_UNREACHABLE) {
             /* Invalid response, drop packet associated with the IP address */
+            fw_adjacency_remove(&adjacency_table, out_interface, response.ip);
             pkt_waiting_node_t *node = root;
             for (uint16_t i = 0; i < root->num_children + 1; i++) {
                 bool icmp_enqueued = enqueue_icmp_unreachable(node->buffer, root->ip);
-                if (FW_DEBUG_OUTPUT && !icmp_enqueued) {
-                    sddf_dprintf("ROUTING LOG: Could not enqueue ICMP unreachable on interface %u!\n",
-                                 node->buffer.interface);
+                if (!icmp_enqueued) {
+                    fw_trace_event(&trace, FW_TRACE_ROUTER_ICMP_FAILED, node->buffer.interface, 0, 0, 0, root->ip, 0,
+                                   0, 0);
                 }
                 net_buff_desc_t net_buff = { .io_or_offset = node->buffer.offset, .len = node->buffer.len };
                 err = fw_enqueue(&rx_free[node->buffer.interface], &net_buff);
@@ -148,9 +182,11 @@ static void process_arp_waiting(uint8_t out_interface)
             }
         } else {
             /* Substitute the MAC address and send packets out of the NIC */
+            fw_adjacency_t *adjacency = resolve_adjacency(out_interface, response.ip, response.mac_addr,
+                                                          FW_ADJACENCY_NOROUTE);
             pkt_waiting_node_t *node = root;
             for (uint16_t i = 0; i < root->num_children + 1; i++) {
-                transmit_packet(node->buffer, response.mac_addr, out_interface);
+                transmit_packet(node->buffer, adjacency);
                 node = pkts_waiting_next_child(&pkt_waiting_queue[out_interface], node);
             }
         }
@@ -175,9 +211,8 @@ static void route(void)
                 ipv4_hdr_t *ip_hdr = (ipv4_hdr_t *)(pkt_vaddr + IPV4_HDR_OFFSET);
 
                 if (FW_DEBUG_OUTPUT) {
-                    sddf_printf("ROUTING_LOG: received packet on interface %u for ip %s with buffer number %lu\n",
-                                interface, ipaddr_to_string(ip_hdr->dst_ip, ip_addr_buf0),
-                                buffer.io_or_offset / NET_BUFFER_SIZE);
+                    fw_trace_event(&trace, FW_TRACE_ROUTER_RECEIVE, interface, ip_hdr->protocol, ip_hdr->src_ip, 0,
+                                   ip_hdr->dst_ip, 0, 0, buffer.io_or_offset / NET_BUFFER_SIZE);
                 }
                 /*
                  * Broadcast traffic should not be transmitted across subnets or
@@ -210,7 +245,8 @@ static void route(void)
                         tx_webserver = true;
 
                         if (FW_DEBUG_OUTPUT) {
-                            sddf_printf("ROUTING_LOG: transmitted packet from interface %u to webserver\n", interface);
+                            fw_trace_event(&trace, FW_TRACE_ROUTER_TO_WEBSERVER, interface, ip_hdr->protocol,
+                                           ip_hdr->src_ip, tcp_pkt->src_port, ip_hdr->dst_ip, tcp_pkt->dst_port, 0, 0);
                         }
 
                         continue;
@@ -237,19 +273,34 @@ static void route(void)
                     returned[interface] = true;
                     continue;
                 }
-                ip_hdr->ttl -= 1;
+                /* Checksum is updated incrementally rather than re-calculated */
+                fw_ipv4_decrement_ttl(ip_hdr);
+
+                uint32_t flow_hash = fw_routing_flow_hash(pkt_vaddr, ip_hdr);
+                uint16_t route_id;
+                fw_adjacency_t *adjacency = fw_adjacency_lookup(&adjacency_table, routing_table, ip_hdr->dst_ip,
+                                                                flow_hash, &route_id);
+                if (adjacency != NULL && fw_adjacency_current(adjacency, &arp_table[adjacency->interface])) {
+                    if (FW_DEBUG_OUTPUT) {
+                        fw_trace_event(&trace, FW_TRACE_ROUTER_NEXT_HOP, interface, ip_hdr->protocol, ip_hdr->src_ip,
+                                       0, ip_hdr->dst_ip, 0, 0, adjacency->ip);
+                    }
+                    adjacency_refresh(adjacency);
+                    transmit_packet(fw_buffer, adjacency);
+                    continue;
+                }
 
+                /* Resolve the next hop and its MAC address */
                 uint32_t next_hop = ip_hdr->dst_ip;
                 uint8_t out_interface;
-                fw_routing_err_t fw_err = fw_routing_find_route(routing_table, &next_hop, &out_interface);
+                fw_routing_err_t fw_err = fw_routing_find_route(routing_table, &next_hop, &out_interface, flow_hash);
                 assert(fw_err == ROUTING_ERR_OKAY);
 
                 if (next_hop == FW_ROUTING_NONEXTHOP || next_hop == router_config.interfaces[out_interface].ip) {
                     /* No route or destined for the firewall but received on the wrong interface, drop packet  */
                     if (FW_DEBUG_OUTPUT) {
-                        sddf_printf("ROUTING_LOG: found no route for ip %s or received on the wrong interface, "
-                                    "dropping packet\n",
-                                    ipaddr_to_string(ip_hdr->dst_ip, ip_addr_buf0));
+                        fw_trace_event(&trace, FW_TRACE_ROUTER_NO_ROUTE, interface, ip_hdr->protocol, ip_hdr->src_ip,
+                                       0, ip_hdr->dst_ip, 0, 0, next_hop);
                     }
                     fw_buff_desc_t fw_buffer = { .offset = buffer.io_or_offset,
                                                  .len = buffer.len,
@@ -261,11 +312,8 @@ static void route(void)
                     continue;
                 } else {
                     if (FW_DEBUG_OUTPUT) {
-                        sddf_printf(
-                            "ROUTING_LOG: converted ip %s to next hop ip %s arrived on interface %u, exiting on out "
-                            "interface %u\n",
-                            ipaddr_to_string(ip_hdr->dst_ip, ip_addr_buf0), ipaddr_to_string(next_hop, ip_addr_buf1),
-                            interface, out_interface);
+                        fw_trace_event(&trace, FW_TRACE_ROUTER_NEXT_HOP, interface, ip_hdr->protocol, ip_hdr->src_ip,
+                                       0, ip_hdr->dst_ip, 0, 0, next_hop);
                     }
                 }
 
@@ -278,12 +326,14 @@ static void route(void)
                     || (arp == NULL && fw_queue_full(&arp_req_queue[out_interface]))) {
 
                     if (arp != NULL && arp->state == ARP_STATE_UNREACHABLE) {
-                        int icmp_err = enqueue_icmp_unreachable(fw_buffer, next_hop);
-                        if (icmp_err) {
-                            sddf_dprintf("ROUTING LOG: Could not enqueue ICMP unreachable!\n");
+                        bool icmp_enqueued = enqueue_icmp_unreachable(fw_buffer, next_hop);
+                        if (!icmp_enqueued) {
+                            fw_trace_event(&trace, FW_TRACE_ROUTER_ICMP_FAILED, interface, ip_hdr->protocol,
+                                           ip_hdr->src_ip, 0, ip_hdr->dst_ip, 0, 0, next_hop);
                         }
                     } else {
-                        sddf_dprintf("ROUTING LOG: Waiting packet or ARP request queue full, dropping packet!\n");
+                        fw_trace_event(&trace, FW_TRACE_ROUTER_QUEUE_FULL, out_interface, ip_hdr->protocol,
+                                       ip_hdr->src_ip, 0, ip_hdr->dst_ip, 0, 0, next_hop);
                     }
 
                     err = fw_enqueue(&rx_free[interface], &buffer);
@@ -299,7 +349,15 @@ static void route(void)
                     if (root) {
                         /* ARP request already enqueued, add node as child. */
                         fw_err = pkt_waiting_push_child(&pkt_waiting_queue[out_interface], root, fw_buffer);
-                        assert(fw_err == ROUTING_ERR_OKAY);
+                        if (fw_err == ROUTING_ERR_FULL) {
+                            /* Next hop has as many packets waiting as it may
+                            hold, drop packet */
+                            fw_trace_event(&trace, FW_TRACE_ROUTER_QUEUE_FULL, out_interface, ip_hdr->protocol,
+                                           ip_hdr->src_ip, 0, ip_hdr->dst_ip, 0, 0, next_hop);
+                            err = fw_enqueue(&rx_free[interface], &buffer);
+                            assert(!err);
+                            returned[interface] = true;
+                        }
                     } else {
                         /* Generate ARP request and enqueue packet. */
                         fw_arp_request_t request = { next_hop, { 0 }, ARP_STATE_INVALID };
@@ -313,8 +371,13 @@ static void route(void)
                     continue;
                 }
 
-                /* valid arp entry found, transmit packet */
-                transmit_packet(fw_buffer, arp->mac_addr, out_interface);
+                /* valid arp entry found, bind the route to the next hop's
+                adjacency and transmit packet */
+                adjacency = fw_adjacency_add(&adjacency_table, out_interface, next_hop, arp->mac_addr,
+                                             router_config.interfaces[out_interface].mac_addr,
+                                             arp - arp_table[out_interface].entries,
+                                             fw_adjacency_bind_route_id(routing_table, route_id));
+                transmit_packet(fw_buffer, adjacency);
             }
         }
     }
@@ -354,27 +417,32 @@ void init(void)
         /* Initialise the packet waiting queue from mapped in memory */
         assert(iface->packet_queue.vaddr != 0);
         pkt_waiting_init(&pkt_waiting_queue[interface], (void *)iface->packet_queue.vaddr,
-                         iface->packet_queue_capacity);
+                         iface->packet_queue_capacity, iface->packet_queue_dest_capacity);
     }
 
     fw_queue_init(&icmp_queue, router_config.icmp_module.queue.vaddr, sizeof(icmp_req_t),
                   router_config.icmp_module.capacity);
 
-    /* Initialise routing table */
+    /* Initialise routing table and the adjacencies routes resolve to */
+    fw_adjacency_table_init(&adjacency_table, router_config.adjacency_table.vaddr, router_config.adjacency_capacity,
+                            router_config.webserver.routing_table_capacity);
     fw_routing_table_init(&routing_table, router_config.webserver.routing_table.vaddr,
-                          router_config.webserver.routing_table_capacity, router_config.initial_routes,
-                          router_config.num_initial_routes);
+                          router_config.webserver.routing_table_capacity, router_config.routing_trie_capacity,
+                          router_config.initial_routes, router_config.num_initial_routes);
 
     if (FW_DEBUG_OUTPUT) {
         sddf_printf("ROUTING_LOG: routing table initialized with %u entries:\n", routing_table->size);
         for (uint16_t i = 0; i < routing_table->size; i++) {
-            sddf_printf("  Route %u: ip=%s subnet=%u interface=%u next_hop=%s\n", i,
+            sddf_printf("  Route %u: ip=%s subnet=%u interface=%u next_hop=%s weight=%u\n", i,
                         ipaddr_to_string(routing_table->entries[i].ip, ip_addr_buf0), routing_table->entries[i].subnet,
                         routing_table->entries[i].interface,
-                        ipaddr_to_string(routing_table->entries[i].next_hop, ip_addr_buf1));
+                        ipaddr_to_string(routing_table->entries[i].next_hop, ip_addr_buf1),
+                        routing_table->entries[i].weight);
         }
     }
 
+    fw_trace_init(&trace, router_config.trace.ring.vaddr, router_config.trace.capacity, FW_TRACE_ROUTER);
+
     assert(router_config.webserver.rx_active.queue.vaddr != 0);
     fw_queue_init(&webserver, router_config.webserver.rx_active.queue.vaddr, sizeof(fw_buff_desc_t),
                   router_config.webserver.rx_active.capacity);
@@ -389,13 +457,17 @@ microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo)
         uint8_t subnet = microkit_mr_get(ROUTER_ADD_ARG_SUBNET);
         uint32_t next_hop = microkit_mr_get(ROUTER_ADD_ARG_NEXT_HOP);
         uint8_t interface = microkit_mr_get(ROUTER_ADD_ARG_INTERFACE);
+        uint8_t weight = microkit_mr_get(ROUTER_ADD_ARG_WEIGHT);
         assert(interface < router_config.num_interfaces);
 
-        fw_routing_err_t err = fw_routing_table_add_route(routing_table, interface, ip, subnet, next_hop);
+        fw_routing_err_t err = fw_routing_table_add_route(routing_table, interface, ip, subnet, next_hop, weight);
+        if (err == ROUTING_ERR_OKAY) {
+            fw_adjacency_unbind_routes(&adjacency_table);
+        }
 
         if (FW_DEBUG_OUTPUT) {
-            sddf_printf("ROUTING_LOG: add route. (ip %s, mask %u, next hop %s): %s\n",
-                        ipaddr_to_string(ip, ip_addr_buf0), subnet, ipaddr_to_string(next_hop, ip_addr_buf1),
+            sddf_printf("ROUTING_LOG: add route. (ip %s, mask %u, next hop %s, weight %u): %s\n",
+                        ipaddr_to_string(ip, ip_addr_buf0), subnet, ipaddr_to_string(next_hop, ip_addr_buf1), weight,
                         fw_routing_err_str[err]);
         }
         microkit_mr_set(ROUTER_RET_ERR, err);
@@ -404,6 +476,9 @@ microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo)
     case ROUTER_DEL_ROUTE: {
         uint16_t route_id = microkit_mr_get(ROUTER_DELETE_ARG_ROUTE_ID);
         fw_routing_err_t err = fw_routing_table_remove_route(routing_table, route_id);
+        if (err == ROUTING_ERR_OKAY) {
+            fw_adjacency_unbind_routes(&adjacency_table);
+        }
 
         if (FW_DEBUG_OUTPUT) {
             sddf_printf("ROUTING LOG: delete route %u: %s\n", route_id, fw_routing_err_str[err]);
@@ -436,6 +511,10 @@ microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo)
 
 void notified(microkit_channel ch)
 {
+    if (fw_trace_enabled(&trace)) {
+        fw_trace_set_time(&trace, sddf_timer_time_now(timer_config.driver_id));
+    }
+
     for (uint8_t interface = 0; interface < router_config.num_interfaces; interface++) {
         if (ch == router_config.interfaces[interface].arp_queue.ch) {
             /*
@@ -6,7 +6,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
-#include <lions/firewall/array_functions.h>
+#include <string.h>
 #include <lions/firewall/common.h>
 #include <lions/firewall/queue.h>
 #include <lions/firewall/routing.h>
@@ -19,25 +19,252 @@ const char *fw_routing_err_str[] = { "Ok.",
                                      "Invalid route ID.",
                                      "Invalid route values." };
 
-fw_routing_err_t fw_routing_find_route(fw_routing_table_t *table, uint32_t *ip, uint8_t *interface)
+/* Trie nodes are stored after the routing table entries */
+static inline fw_routing_trie_node_t *trie_nodes(fw_routing_table_t *table)
 {
-    uint8_t num_lookups = 0;
-    while (num_lookups < FW_ROUTING_MAX_RECURSION) {
-        fw_routing_entry_t *match = NULL;
-        for (uint16_t i = 0; i < table->size; i++) {
-            fw_routing_entry_t *entry = table->entries + i;
+    return (fw_routing_trie_node_t *)(table->entries + table->capacity);
+}
+
+/* Path links are stored after the trie nodes */
+static inline uint16_t *path_links(fw_routing_table_t *table)
+{
+    return (uint16_t *)(trie_nodes(table) + table->trie_capacity);
+}
+
+/* Find the path linking to a route, returning its index + 1 or 0 if the route
+is the first path of its subnet */
+static uint16_t path_prev(fw_routing_table_t *table, uint16_t route_id)
+{
+    uint16_t *links = path_links(table);
+    for (uint16_t i = 0; i < table->size; i++) {
+        if (links[i] == route_id + 1) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* Find the first path of a route's subnet */
+static uint16_t path_first(fw_routing_table_t *table, uint16_t route_id)
+{
+    for (uint16_t prev = path_prev(table, route_id); prev != 0; prev = path_prev(table, route_id)) {
+        route_id = prev - 1;
+    }
+    return route_id;
+}
+
+/* Slot matching an address at a level of the trie, address in host byte order */
+static inline uint8_t trie_slot(uint32_t addr, uint8_t level)
+{
+    return (addr >> (32 - FW_ROUTING_TRIE_STRIDE * (level + 1))) & (FW_ROUTING_TRIE_FANOUT - 1);
+}
+
+/* Level of the trie a prefix is expanded into */
+static inline uint8_t trie_level(uint8_t subnet)
+{
+    return (subnet == 0) ? 0 : (subnet - 1) / FW_ROUTING_TRIE_STRIDE;
+}
+
+static uint16_t trie_alloc_node(fw_routing_table_t *table)
+{
+    uint16_t node = table->trie_free;
+    fw_routing_trie_node_t *trie_node = trie_nodes(table) + node;
+    table->trie_free = trie_node->slots[0].child;
+    memset(trie_node, 0, sizeof(fw_routing_trie_node_t));
+    table->trie_size++;
+    return node;
+}
+
+static void trie_free_node(fw_routing_table_t *table, uint16_t node)
+{
+    trie_nodes(table)[node].slots[0].child = table->trie_free;
+    table->trie_free = node;
+    table->trie_size--;
+}
+
+static bool trie_node_empty(fw_routing_trie_node_t *trie_node)
+{
+    for (uint16_t i = 0; i < FW_ROUTING_TRIE_FANOUT; i++) {
+        if (trie_node->slots[i].route != 0 || trie_node->slots[i].child != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Record the node at each level of the path to a prefix, returning the deepest
+level reached */
+static uint8_t trie_path(fw_routing_table_t *table, uint32_t addr, uint8_t level, uint16_t *path)
+{
+    fw_routing_trie_node_t *nodes = trie_nodes(table);
+    uint8_t depth = 0;
+    path[0] = FW_ROUTING_TRIE_ROOT;
+    while (depth < level && nodes[path[depth]].slots[trie_slot(addr, depth)].child != 0) {
+        path[depth + 1] = nodes[path[depth]].slots[trie_slot(addr, depth)].child;
+        depth++;
+    }
+    return depth;
+}
+
+/* Find the route with the longest prefix covering an address, returning its
+index + 1 or 0 if there is none */
+static uint16_t trie_lookup(fw_routing_table_t *table, uint32_t ip)
+{
+    fw_routing_trie_node_t *nodes = trie_nodes(table);
+    uint32_t addr = htonl(ip);
+    uint16_t node = FW_ROUTING_TRIE_ROOT;
+    uint16_t match = 0;
+    for (uint8_t level = 0; level < FW_ROUTING_TRIE_LEVELS; level++) {
+        fw_routing_trie_slot_t *slot = &nodes[node].slots[trie_slot(addr, level)];
+        if (slot->route != 0) {
+            match = slot->route;
+        }
+        if (slot->child == 0) {
+            break;
+        }
+        node = slot->child;
+    }
+    return match;
+}
+
+/* Expand a route into the slots its prefix covers, except those held by longer
+prefixes */
+static fw_routing_err_t trie_insert(fw_routing_table_t *table, uint16_t route_id)
+{
+    fw_routing_trie_node_t *nodes = trie_nodes(table);
+    fw_routing_entry_t *route = table->entries + route_id;
+    uint32_t addr = htonl(route->ip);
+    uint8_t level = trie_level(route->subnet);
+
+    uint16_t path[FW_ROUTING_TRIE_LEVELS];
+    uint8_t depth = trie_path(table, addr, level, path);
+    if (level - depth > table->trie_capacity - table->trie_size) {
+        return ROUTING_ERR_FULL;
+    }
+
+    for (; depth < level; depth++) {
+        path[depth + 1] = trie_alloc_node(table);
+        nodes[path[depth]].slots[trie_slot(addr, depth)].child = path[depth + 1];
+    }
+
+    uint8_t span_bits = FW_ROUTING_TRIE_STRIDE * (level + 1) - route->subnet;
+    uint16_t first = trie_slot(addr, level) & ~((1U << span_bits) - 1);
+    for (uint16_t i = first; i < first + (1U << span_bits); i++) {
+        fw_routing_trie_slot_t *slot = &nodes[path[level]].slots[i];
+        if (slot->route == 0 || table->entries[slot->route - 1].subnet < route->subnet) {
+            slot->route = route_id + 1;
+        }
+    }
+
+    return ROUTING_ERR_OKAY;
+}
+
+/* Hand the slots held by a route to the next longest prefix ending at the same
+level, and release the nodes left empty */
+static void trie_remove(fw_routing_table_t *table, uint16_t route_id)
+{
+    fw_routing_trie_node_t *nodes = trie_nodes(table);
+    fw_routing_entry_t *route = table->entries + route_id;
+    uint32_t addr = htonl(route->ip);
+    uint8_t level = trie_level(route->subnet);
+
+    uint16_t path[FW_ROUTING_TRIE_LEVELS];
+    if (trie_path(table, addr, level, path) != level) {
+        return;
+    }
+
+    /* Any shorter prefix covering one slot of the route covers them all */
+    uint8_t min_subnet = (level == 0) ? 0 : level * FW_ROUTING_TRIE_STRIDE + 1;
+    uint16_t replacement = 0;
+    for (uint16_t i = 0; i < table->size; i++) {
+        fw_routing_entry_t *entry = table->entries + i;
+        if (i == route_id || entry->subnet < min_subnet || entry->subnet >= route->subnet
+            || (route->ip & subnet_mask(entry->subnet)) != entry->ip) {
+            continue;
+        }
+        if (replacement == 0 || entry->subnet > table->entries[replacement - 1].subnet) {
+            replacement = i + 1;
+        }
+    }
+    if (replacement != 0) {
+        replacement = path_first(table, replacement - 1) + 1;
+    }
+
+    uint8_t span_bits = FW_ROUTING_TRIE_STRIDE * (level + 1) - route->subnet;
+    uint16_t first = trie_slot(addr, level) & ~((1U << span_bits) - 1);
+    for (uint16_t i = first; i < first + (1U << span_bits); i++) {
+        fw_routing_trie_slot_t *slot = &nodes[path[level]].slots[i];
+        if (slot->route == route_id + 1) {
+            slot->route = replacement;
+        }
+    }
 
-            /* ip is part of subnet */
-            if ((subnet_mask(entry->subnet) & *ip) == entry->ip) {
+    for (uint8_t depth = level; depth > 0 && trie_node_empty(nodes + path[depth]); depth--) {
+        trie_free_node(table, path[depth]);
+        nodes[path[depth - 1]].slots[trie_slot(addr, depth - 1)].child = 0;
+    }
+}
 
-                /* Current match is stronger */
-                if (match != NULL && match->subnet > entry->subnet) {
-                    continue;
-                }
+/* Point the slots held by a route at its new index */
+static void trie_move(fw_routing_table_t *table, uint16_t from, uint16_t to)
+{
+    fw_routing_trie_node_t *nodes = trie_nodes(table);
+    fw_routing_entry_t *route = table->entries + from;
+    uint32_t addr = htonl(route->ip);
+    uint8_t level = trie_level(route->subnet);
+
+    uint16_t path[FW_ROUTING_TRIE_LEVELS];
+    if (trie_path(table, addr, level, path) != level) {
+        return;
+    }
 
-                match = entry;
-            }
+    uint8_t span_bits = FW_ROUTING_TRIE_STRIDE * (level + 1) - route->subnet;
+    uint16_t first = trie_slot(addr, level) & ~((1U << span_bits) - 1);
+    for (uint16_t i = first; i < first + (1U << span_bits); i++) {
+        fw_routing_trie_slot_t *slot = &nodes[path[level]].slots[i];
+        if (slot->route == from + 1) {
+            slot->route = to + 1;
         }
+    }
+}
+
+fw_routing_entry_t *fw_routing_find_entry(fw_routing_table_t *table, uint32_t ip)
+{
+    uint16_t route = trie_lookup(table, ip);
+    return (route == 0) ? NULL : table->entries + route - 1;
+}
+
+fw_routing_entry_t *fw_routing_select_path(fw_routing_table_t *table, fw_routing_entry_t *route, uint32_t flow_hash)
+{
+    uint16_t *links = path_links(table);
+    uint16_t first = route - table->entries + 1;
+    if (links[first - 1] == 0) {
+        return route;
+    }
+
+    uint32_t total_weight = 0;
+    for (uint16_t i = first; i != 0; i = links[i - 1]) {
+        total_weight += table->entries[i - 1].weight;
+    }
+
+    uint32_t share = flow_hash % total_weight;
+    for (uint16_t i = first; i != 0; i = links[i - 1]) {
+        fw_routing_entry_t *path = table->entries + i - 1;
+        if (share < path->weight) {
+            return path;
+        }
+        share -= path->weight;
+    }
+
+    return route;
+}
+
+fw_routing_err_t fw_routing_find_route(fw_routing_table_t *table, uint32_t *ip, uint8_t *interface,
+                                       uint32_t flow_hash)
+{
+    uint8_t num_lookups = 0;
+    while (num_lookups < FW_ROUTING_MAX_RECURSION) {
+        fw_routing_entry_t *match = fw_routing_find_entry(table, *ip);
 
         if (match == NULL) {
             /* No route found */
@@ -45,6 +272,8 @@ fw_routing_err_t fw_routing_find_route(fw_routing_table_t *table, uint32_t *ip,
             return ROUTING_ERR_OKAY;
         }
 
+        match = fw_routing_select_path(table, match, flow_hash);
+
         if (match->next_hop == FW_ROUTING_NONEXTHOP) {
             *interface = match->interface;
             return ROUTING_ERR_OKAY;
@@ -60,15 +289,19 @@ fw_routing_err_t fw_routing_find_route(fw_routing_table_t *table, uint32_t *ip,
 }
 
 fw_routing_err_t fw_routing_table_add_route(fw_routing_table_t *table, uint8_t interface, uint32_t ip, uint8_t subnet,
-                                            uint32_t next_hop)
+                                            uint32_t next_hop, uint8_t weight)
 {
     /* Default routes must specify a next hop! */
     if ((subnet == 0) && (next_hop == FW_ROUTING_NONEXTHOP)) {
         return ROUTING_ERR_INVALID_ROUTE;
+    } else if (weight == 0) {
+        return ROUTING_ERR_INVALID_ROUTE;
     } else if (table->size >= table->capacity) {
         return ROUTING_ERR_FULL;
     }
 
+    uint16_t num_paths = 0;
+    uint16_t path = 0;
     for (uint16_t i = 0; i < table->size; i++) {
         fw_routing_entry_t *entry = table->entries + i;
 
@@ -82,19 +315,43 @@ fw_routing_err_t fw_routing_table_add_route(fw_routing_table_t *table, uint8_t i
             continue;
         }
 
-        /* There is a clash! */
+        /* There is a clash! Subnets without a next hop can't be multipath */
         if ((interface == entry->interface) && (next_hop == entry->next_hop)) {
             return ROUTING_ERR_DUPLICATE;
-        } else {
+        } else if (next_hop == FW_ROUTING_NONEXTHOP || entry->next_hop == FW_ROUTING_NONEXTHOP) {
             return ROUTING_ERR_CLASH;
         }
+
+        /* Route is another path of the subnet */
+        num_paths++;
+        path = i;
+    }
+
+    if (num_paths >= FW_ROUTING_MAX_PATHS) {
+        return ROUTING_ERR_FULL;
     }
 
     fw_routing_entry_t *empty_slot = table->entries + table->size;
     empty_slot->interface = interface;
     empty_slot->ip = subnet_mask(subnet) & ip;
     empty_slot->subnet = subnet;
+    empty_slot->weight = weight;
     empty_slot->next_hop = next_hop;
+
+    /* Only the first path of a subnet is held by the trie, later paths are
+    linked in after it */
+    uint16_t *links = path_links(table);
+    if (num_paths == 0) {
+        fw_routing_err_t err = trie_insert(table, table->size);
+        if (err != ROUTING_ERR_OKAY) {
+            return err;
+        }
+        links[table->size] = 0;
+    } else {
+        uint16_t first = path_first(table, path);
+        links[table->size] = links[first];
+        links[first] = table->size + 1;
+    }
     table->size++;
 
     return ROUTING_ERR_OKAY;
@@ -106,22 +363,57 @@ fw_routing_err_t fw_routing_table_remove_route(fw_routing_table_t *table, uint16
         return ROUTING_ERR_INVALID_ID;
     }
 
-    /* Shift everything left to delete this item */
-    generic_array_shift(table->entries, sizeof(fw_routing_entry_t), table->capacity, route_id);
+    /* Unlink the route from the paths of its subnet, the next path takes its
+    place in the trie if it was the first */
+    uint16_t *links = path_links(table);
+    uint16_t prev = path_prev(table, route_id);
+    if (prev != 0) {
+        links[prev - 1] = links[route_id];
+    } else if (links[route_id] != 0) {
+        trie_move(table, route_id, links[route_id] - 1);
+    } else {
+        trie_remove(table, route_id);
+    }
+    links[route_id] = 0;
+
+    /* Fill the gap with the last route so only its trie slots and path link
+    need updating */
+    uint16_t last = table->size - 1;
+    if (route_id != last) {
+        trie_move(table, last, route_id);
+        prev = path_prev(table, last);
+        if (prev != 0) {
+            links[prev - 1] = route_id + 1;
+        }
+        table->entries[route_id] = table->entries[last];
+        links[route_id] = links[last];
+    }
     table->size--;
     return ROUTING_ERR_OKAY;
 }
 
-void fw_routing_table_init(fw_routing_table_t **table, void *table_vaddr, uint16_t capacity,
+void fw_routing_table_init(fw_routing_table_t **table, void *table_vaddr, uint16_t capacity, uint16_t trie_capacity,
                            fw_routing_entry_t *initial_routes, uint8_t num_initial_routes)
 {
     *table = (fw_routing_table_t *)table_vaddr;
     (*table)->capacity = capacity;
     (*table)->size = 0;
 
+    /* The root node is always in use, the remaining nodes start out free */
+    assert(trie_capacity >= 1);
+    fw_routing_trie_node_t *nodes = trie_nodes(*table);
+    memset(nodes + FW_ROUTING_TRIE_ROOT, 0, sizeof(fw_routing_trie_node_t));
+    for (uint16_t i = 1; i < trie_capacity; i++) {
+        nodes[i].slots[0].child = (i + 1 < trie_capacity) ? i + 1 : 0;
+    }
+    (*table)->trie_capacity = trie_capacity;
+    (*table)->trie_size = 1;
+    (*table)->trie_free = (trie_capacity > 1) ? 1 : 0;
+
     for (uint8_t r = 0; r < num_initial_routes; r++) {
         fw_routing_err_t err = fw_routing_table_add_route(*table, initial_routes[r].interface, initial_routes[r].ip,
-                                                          initial_routes[r].subnet, initial_routes[r].next_hop);
+                                                          initial_routes[r].subnet, initial_routes[r].next_hop,
+                                                          initial_routes[r].weight);
 
         assert(err == ROUTING_ERR_OKAY);
     }
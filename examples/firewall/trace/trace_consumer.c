@@ -0,0 +1,153 @@
+/*
+ * Copyright 2026, UNSW
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <os/sddf.h>
+#include <sddf/util/util.h>
+#include <sddf/util/printf.h>
+#include <sddf/serial/queue.h>
+#include <sddf/serial/config.h>
+#include <sddf/timer/client.h>
+#include <sddf/timer/config.h>
+#include <lions/firewall/common.h>
+#include <lions/firewall/config.h>
+#include <lions/firewall/ip.h>
+#include <lions/firewall/trace.h>
+
+__attribute__((__section__(".serial_client_config"))) serial_client_config_t serial_config;
+__attribute__((__section__(".timer_client_config"))) timer_client_config_t timer_config;
+__attribute__((__section__(".fw_trace_consumer_config"))) fw_trace_consumer_config_t trace_config;
+
+serial_queue_handle_t serial_tx_queue_handle;
+
+/* Read cursors of each producer's trace ring */
+fw_trace_reader_t readers[FW_MAX_TRACE_RINGS];
+
+/* Lost record counts last reported for each ring */
+static uint64_t lost_reported[FW_MAX_TRACE_RINGS];
+
+#define TRACE_POLL_INTERVAL_NS (100 * NS_IN_MS)
+/* Bound the records decoded from each ring per poll so a busy producer can't
+monopolise the serial output */
+#define TRACE_MAX_RECORDS_PER_POLL 64
+
+static const char *protocol_str(uint8_t protocol)
+{
+    switch (protocol) {
+    case IPV4_PROTO_ICMP:
+        return "icmp";
+    case IPV4_PROTO_TCP:
+        return "tcp";
+    case IPV4_PROTO_UDP:
+        return "udp";
+    default:
+        return "ip";
+    }
+}
+
+static void decode(fw_trace_record_t *record)
+{
+    const char *component = (record->component < FW_TRACE_NUM_COMPONENTS) ? fw_trace_component_str[record->component]
+                                                                           : "UNKNOWN";
+    const char *event = (record->event < FW_TRACE_NUM_EVENTS) ? fw_trace_event_str[record->event] : "unknown event";
+
+    sddf_printf("TRACE [%lu.%09lu] %s interface %u: %s", (uint64_t)(record->timestamp / NS_IN_S),
+                (uint64_t)(record->timestamp % NS_IN_S), component, record->interface, event);
+
+    switch (record->event) {
+    case FW_TRACE_FILTER_TRANSMIT:
+    case FW_TRACE_FILTER_TRANSMIT_ESTABLISHED:
+    case FW_TRACE_FILTER_CONNECT:
+    case FW_TRACE_FILTER_REJECT:
+    case FW_TRACE_FILTER_DROP:
+        sddf_printf(" %s via rule %u: (ip %s, port %u) -> (ip %s, port %u)\n", protocol_str(record->protocol),
+                    record->rule_id, ipaddr_to_string(record->src_ip, ip_addr_buf0), htons(record->src_port),
+                    ipaddr_to_string(record->dst_ip, ip_addr_buf1), htons(record->dst_port));
+        break;
+    case FW_TRACE_FILTER_CONNECT_FAILED:
+        sddf_printf(" %s for rule %u: (ip %s, port %u) -> (ip %s, port %u): ", protocol_str(record->protocol),
+                    record->rule_id, ipaddr_to_string(record->src_ip, ip_addr_buf0), htons(record->src_port),
+                    ipaddr_to_string(record->dst_ip, ip_addr_buf1), htons(record->dst_port));
+        /* Records are written by other components, so the error may not be one
+        this consumer knows */
+        if (record->arg < FILTER_NUM_ERRS) {
+            sddf_printf("%s\n", fw_filter_err_str[record->arg]);
+        } else {
+            sddf_printf("error %u\n", record->arg);
+        }
+        break;
+    case FW_TRACE_ROUTER_RECEIVE:
+    case FW_TRACE_ROUTER_TRANSMIT:
+        sddf_printf(" %s ip %s -> ip %s with buffer number %u\n", protocol_str(record->protocol),
+                    ipaddr_to_string(record->src_ip, ip_addr_buf0), ipaddr_to_string(record->dst_ip, ip_addr_buf1),
+                    record->arg);
+        break;
+    case FW_TRACE_ROUTER_TO_WEBSERVER:
+        sddf_printf(" (ip %s, port %u) -> (ip %s, port %u)\n", ipaddr_to_string(record->src_ip, ip_addr_buf0),
+                    htons(record->src_port), ipaddr_to_string(record->dst_ip, ip_addr_buf1), htons(record->dst_port));
+        break;
+    case FW_TRACE_ROUTER_NO_ROUTE:
+    case FW_TRACE_ROUTER_NEXT_HOP:
+    case FW_TRACE_ROUTER_QUEUE_FULL:
+        sddf_printf(" %s ip %s -> ip %s", protocol_str(record->protocol),
+                    ipaddr_to_string(record->src_ip, ip_addr_buf0), ipaddr_to_string(record->dst_ip, ip_addr_buf1));
+        sddf_printf(", next hop %s\n", ipaddr_to_string(record->arg, ip_addr_buf0));
+        break;
+    case FW_TRACE_ARP_REQUEST:
+    case FW_TRACE_ARP_RESPONSE:
+        sddf_printf(" for client %u, ip %s\n", record->arg, ipaddr_to_string(record->dst_ip, ip_addr_buf0));
+        break;
+    case FW_TRACE_ARP_RETRY:
+    case FW_TRACE_ARP_RESENT:
+        sddf_printf(" for ip %s, retry %u\n", ipaddr_to_string(record->dst_ip, ip_addr_buf0), record->arg);
+        break;
+    case FW_TRACE_ARP_REPLY:
+        sddf_printf(" to ip %s for ip %s\n", ipaddr_to_string(record->src_ip, ip_addr_buf0),
+                    ipaddr_to_string(record->dst_ip, ip_addr_buf1));
+        break;
+    default:
+        sddf_printf(" for ip %s, arg %u\n", ipaddr_to_string(record->dst_ip, ip_addr_buf0), record->arg);
+        break;
+    }
+}
+
+static void drain_rings(void)
+{
+    for (uint8_t ring = 0; ring < trace_config.num_rings; ring++) {
+        fw_trace_record_t record;
+        for (uint16_t i = 0; i < TRACE_MAX_RECORDS_PER_POLL && fw_trace_read(&readers[ring], &record); i++) {
+            decode(&record);
+        }
+
+        if (readers[ring].lost != lost_reported[ring]) {
+            sddf_printf("TRACE: ring %u lost %lu records\n", ring, readers[ring].lost - lost_reported[ring]);
+            lost_reported[ring] = readers[ring].lost;
+        }
+    }
+}
+
+void init(void)
+{
+    serial_queue_init(&serial_tx_queue_handle, serial_config.tx.queue.vaddr, serial_config.tx.data.size,
+                      serial_config.tx.data.vaddr);
+    serial_putchar_init(serial_config.tx.id, &serial_tx_queue_handle);
+
+    for (uint8_t ring = 0; ring < trace_config.num_rings; ring++) {
+        fw_trace_reader_init(&readers[ring], trace_config.rings[ring].ring.vaddr, trace_config.rings[ring].capacity);
+    }
+
+    sddf_timer_set_timeout(timer_config.driver_id, TRACE_POLL_INTERVAL_NS);
+}
+
+void notified(microkit_channel ch)
+{
+    if (ch == timer_config.driver_id) {
+        drain_rings();
+        sddf_timer_set_timeout(timer_config.driver_id, TRACE_POLL_INTERVAL_NS);
+    } else {
+        sddf_dprintf("TRACE: received notification on unknown channel: %d!\n", ch);
+    }
+}
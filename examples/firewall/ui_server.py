@@ -1,7 +1,7 @@
 # Copyright 2025, UNSW
 # SPDX-License-Identifier: BSD-2-Clause
 
-from microdot import Microdot, Response
+from microdot import Microdot, Request, Response
 import lions_firewall
 
 
@@ -12,6 +12,15 @@ IPAddrLen = 4
 maxIpDigit = 255
 maxPortNum = 65535
 maxSubnetMask = 32
+# Must match FW_RULE_MAX_PORT_SET in filter.h
+maxPortSetSize = 32
+# Must match FW_MAX_IP_SETS in ip_set.h
+maxIpSets = 16
+maxRate = 0xffffffff
+# Largest IP set list accepted, at most 500000 prefixes of "aaa.bbb.ccc.ddd/nn"
+maxIpSetListBytes = 500000 * 20
+# Bytes of an IP set list read from the request stream at a time
+ipSetChunkSize = 4096
 
 ############ System Constants and Errors ############
 
@@ -61,10 +70,13 @@ actionNums = {
     1: "Allow",
     2: "Drop",
     3: "Reject",
-    4: "Connect"
+    4: "Connect",
+    5: "Rate limit"
 }
+rateLimitAction = 5
 
 defaultActionRuleIdx = 0
+defaultActionRuleId = 0
 
 ############ Helper Functions ############
 
@@ -133,6 +145,9 @@ def tupleToMac(macList):
 ############ Route APIs ############
 
 app = Microdot()
+# Request bodies over microdot's max_body_length are streamed rather than
+# buffered, so only the limit on their total length needs raising
+Request.max_content_length = maxIpSetListBytes
 
 ###### Interface methods ######
 
@@ -175,6 +190,7 @@ def getRoutes(request):
                 "subnet": route[2],
                 "next_hop": intToIp(route[3]),
                 "interface": route[4],
+                "weight": route[5],
             })
         return {"routes": routes}
     except OSError as OSErr:
@@ -225,8 +241,15 @@ def addRoute(request):
         else:
           nextHop = ipToInt(nextHop)
 
-        lions_firewall.route_add(interfaceInt, ip, subnet, nextHop)
-        newRouteOut = {"interface": interfaceInt, "ip": ip, "next_hop": nextHop}
+        # Routes for the same subnet with different next hops share its flows
+        # in proportion to their weight
+        weight = newRoute.get("weight", 1)
+        if weight < 1 or weight > 255:
+            print(f"UI SERVER|ERR: Supplied route weight {weight} is invalid.")
+            raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+
+        lions_firewall.route_add(interfaceInt, ip, subnet, nextHop, weight)
+        newRouteOut = {"interface": interfaceInt, "ip": ip, "next_hop": nextHop, "weight": weight}
 
         return {"status": "ok", "route": newRouteOut}, 201
     except OSError as OSErr:
@@ -253,6 +276,10 @@ def getRules(request, protocolStr, interfaceInt):
         protocol = protocolNums[protocolStr]
 
         defaultAction = lions_firewall.filter_get_default_action(interfaceInt, protocol)
+        establishedPackets, establishedBytes, outOfState, ruleStats = lions_firewall.rule_stats(interfaceInt, protocol)
+        stats = {}
+        for ruleId, packets, numBytes, limited in ruleStats:
+            stats[ruleId] = (packets, numBytes, limited)
         rules = []
         # ignore default rule at position 0
         for i in range(defaultActionRuleIdx + 1, lions_firewall.rule_count(interfaceInt, protocol)):
@@ -267,9 +294,29 @@ def getRules(request, protocolStr, interfaceInt):
                 "dest_port_any": rule[6],
                 "src_subnet": rule[7],
                 "dest_subnet": rule[8],
-                "action": actionNums[rule[9]]
+                "action": actionNums[rule[9]],
+                "src_port_max": htons(rule[10]),
+                "dest_port_max": htons(rule[11]),
+                "dest_port_set": [htons(port) for port in rule[12]],
+                "src_ip_set": rule[13],
+                "dest_ip_set": rule[14],
+                "rate_pps": rule[15],
+                "rate_bps": rule[16],
+                "rate_per_source": rule[17],
+                "packets": stats.get(rule[0], (0, 0, 0))[0],
+                "bytes": stats.get(rule[0], (0, 0, 0))[1],
+                "limited": stats.get(rule[0], (0, 0, 0))[2]
             })
-        return {"default_action": defaultAction, "rules": rules}
+        defaultStats = stats.get(defaultActionRuleId, (0, 0, 0))
+        return {
+            "default_action": defaultAction,
+            "default_packets": defaultStats[0],
+            "default_bytes": defaultStats[1],
+            "established_packets": establishedPackets,
+            "established_bytes": establishedBytes,
+            "out_of_state": outOfState,
+            "rules": rules
+        }
     except OSError as OSErr:
         print(f"UI SERVER|ERR: OS Error: getRules: {OSErrStrings[OSErr.errno]}")
         return {"error": OSErrStrings[OSErr.errno]}, 404
@@ -324,6 +371,121 @@ def setDefaultAction(request, protocolStr, action, interfaceInt):
         return {"error": UnknownErrStr}, 404
 
 
+# Parse a single port number, which must be an integer from 0 to 65535. Returns
+# the port in host byte order
+def parsePort(port):
+    try:
+        portNum = int(port)
+    except ValueError:
+        print(f"UI SERVER|ERR: Supplied port {port} is not a number.")
+        raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+    if portNum < 0 or portNum > maxPortNum:
+        print(f"UI SERVER|ERR: Supplied port number {portNum} is not between 0 and {maxPortNum}.")
+        raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+    return portNum
+
+
+# Parse ports supplied as a single port, a range "first-last" or, if a set is
+# allowed, a set "port,port,...". Returns (port, port max, port any, port set)
+# with ports in network byte order
+def parsePorts(ports, allowSet):
+    ports = str(ports).strip() if ports is not None else ""
+    if not ports:
+        return (0, 0, True, [])
+
+    if "," in ports:
+        if not allowSet:
+            print("UI SERVER|ERR: Port sets are only supported for destination ports.")
+            raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+        portSet = [htons(parsePort(port)) for port in ports.split(",")]
+        if len(portSet) > maxPortSetSize:
+            print(f"UI SERVER|ERR: Supplied port set has more than {maxPortSetSize} ports.")
+            raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+        return (0, 0, False, portSet)
+
+    if "-" in ports:
+        first, last = ports.split("-", 1)
+        first, last = parsePort(first), parsePort(last)
+        if last < first:
+            print(f"UI SERVER|ERR: Supplied port range {ports} is empty.")
+            raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+        return (htons(first), htons(last), False, [])
+
+    return (htons(parsePort(ports)), 0, False, [])
+
+
+# Parse an optional IP set ID, 0 meaning no set
+def parseIpSet(ipSet):
+    ipSet = int(ipSet) if ipSet is not None else 0
+    if ipSet < 0 or ipSet > maxIpSets:
+        print(f"UI SERVER|ERR: Supplied IP set {ipSet} is invalid.")
+        raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+    return ipSet
+
+
+# Parse an optional rate limit in packets or bytes per second, 0 meaning no limit
+def parseRate(rate):
+    rate = int(rate) if rate else 0
+    if rate < 0 or rate > maxRate:
+        print(f"UI SERVER|ERR: Supplied rate {rate} is invalid.")
+        raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+    return rate
+
+
+# Parse a rule supplied as json into the arguments of rule_add. A side with an
+# IP set matches the addresses in the set in place of its IP and subnet
+def parseRule(newRule, protocol):
+    srcSubnet = newRule.get("src_subnet")
+    if srcSubnet < 0 or srcSubnet > maxSubnetMask:
+        print(f"UI SERVER|ERR: Supplied source subnet mask {srcSubnet} is invalid.")
+        raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+
+    # No IP needed for subnet == 0: rule matches all IP
+    if srcSubnet == 0:
+        srcIp = 0
+    else:
+        srcIp = ipToInt(newRule.get("src_ip"))
+
+    destSubnet = newRule.get("dest_subnet")
+    if destSubnet < 0 or destSubnet > maxSubnetMask:
+        print(f"UI SERVER|ERR: Supplied destination subnet mask {destSubnet} is invalid.")
+        raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+
+    # No IP needed for subnet == 0: rule matches all IP
+    if destSubnet == 0:
+        destIp = 0
+    else:
+        destIp = ipToInt(newRule.get("dest_ip"))
+
+    action = newRule.get("action")
+    if action not in actionNums.keys():
+        print(f"UI SERVER|ERR: Supplied invalid action {action}.")
+        raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+
+    if protocol == protocolNums["icmp"]:
+        srcPort, srcPortMax, srcPortAny, _ = parsePorts(None, False)
+        destPort, destPortMax, destPortAny, destPortSet = parsePorts(None, True)
+    else:
+        srcPort, srcPortMax, srcPortAny, _ = parsePorts(newRule.get("src_port"), False)
+        destPort, destPortMax, destPortAny, destPortSet = parsePorts(newRule.get("dest_port"), True)
+
+    srcIpSet = parseIpSet(newRule.get("src_ip_set"))
+    destIpSet = parseIpSet(newRule.get("dest_ip_set"))
+
+    # Rates are only used by rate limit rules, which must limit packets or bytes
+    ratePps = parseRate(newRule.get("rate_pps"))
+    rateBps = parseRate(newRule.get("rate_bps"))
+    ratePerSource = bool(newRule.get("rate_per_source"))
+    if action != rateLimitAction:
+        ratePps, rateBps, ratePerSource = 0, 0, False
+    elif ratePps == 0 and rateBps == 0:
+        print("UI SERVER|ERR: Rate limit rules must limit packets or bytes per second.")
+        raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+
+    return (srcIp, srcPort, srcPortAny, srcSubnet, destIp, destPort, destPortAny, destSubnet, action,
+            srcPortMax, destPortMax, destPortSet, srcIpSet, destIpSet, ratePps, rateBps, ratePerSource)
+
+
 # Add a new rule for an interface filter
 @app.route("/api/rules/<string:protocolStr>", methods=["POST"])
 def addRule(request, protocolStr):
@@ -339,57 +501,122 @@ def addRule(request, protocolStr):
             print(f"UI SERVER|ERR: Supplied interface integer {interfaceInt} does not match existing interfaces.")
             raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
 
-        srcSubnet = newRule.get("src_subnet")
-        if srcSubnet < 0 or srcSubnet > maxSubnetMask:
-            print(f"UI SERVER|ERR: Supplied source subnet mask {srcSubnet} is invalid.")
-            raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+        ruleArgs = parseRule(newRule, protocol)
+        ruleId = lions_firewall.rule_add(interfaceInt, protocol, *ruleArgs)
+        return {"status": "ok", "rule": {"id": ruleId}}, 201
+    except OSError as OSErr:
+        print(f"UI SERVER|ERR: OS Error: addRule: {OSErrStrings[OSErr.errno]}")
+        return {"error": OSErrStrings[OSErr.errno]}, 404
+    except Exception as exception:
+        print(f"UI SERVER|ERR: Unknown Error: addRule: {exception}.")
+        return {"error": UnknownErrStr}, 404
 
-        # No IP needed for subnet == 0: rule matches all IP
-        if srcSubnet == 0:
-            srcIp = 0
-        else:
-            srcIp = ipToInt(newRule.get("src_ip"))
 
-        destSubnet = newRule.get("dest_subnet")
-        if destSubnet < 0 or destSubnet > maxSubnetMask:
-            print(f"UI SERVER|ERR: Supplied destination subnet mask {destSubnet} is invalid.")
-            raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+# Replace all rules and the default action of an interface filter at once.
+# Either the whole rule set is applied or none of it is
+@app.route("/api/rules/<string:protocolStr>/<int:interfaceInt>", methods=["PUT"])
+def replaceRules(request, protocolStr, interfaceInt):
+    try:
+        if interfaceInt < 0 or interfaceInt >= lions_firewall.interface_count_get():
+            print(f"UI SERVER|ERR: Supplied interface integer {interfaceInt} does not match existing interfaces.")
+            raise OSError(OSErrInvalidInterface, OSErrStrings[OSErrInvalidInterface])
 
-        # No IP needed for subnet == 0: rule matches all IP
-        if destSubnet == 0:
-            destIp = 0
-        else:
-            destIp = ipToInt(newRule.get("dest_ip"))
+        if protocolStr not in protocolNums.keys():
+            print(f"UI SERVER|ERR: Supplied protocol string {protocolStr} does not match existing filters.")
+            raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+        protocol = protocolNums[protocolStr]
 
-        action = newRule.get("action")
-        if action not in actionNums.keys():
-            print(f"UI SERVER|ERR: Supplied invalid action {action}.")
+        ruleSet = request.json
+        defaultAction = ruleSet.get("default_action")
+        if defaultAction not in actionNums.keys():
+            print(f"UI SERVER|ERR: Supplied invalid default action {defaultAction}.")
             raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
 
-        srcPort = newRule.get("src_port")
-        if not srcPort or protocol == protocolNums["icmp"]:
-            srcPort = 0
-            srcPortAny = True
-        else:
-            srcPort = htons(int(srcPort))
-            srcPortAny = False
+        # Parse all rules before staging any of them
+        rulesArgs = [parseRule(newRule, protocol) for newRule in ruleSet.get("rules")]
 
-        destPort = newRule.get("dest_port")
-        if not destPort or protocol == protocolNums["icmp"]:
-            destPort = 0
-            destPortAny = True
-        else:
-            destPort = htons(int(destPort))
-            destPortAny = False
+        lions_firewall.rule_set_begin(interfaceInt, protocol)
+        for ruleArgs in rulesArgs:
+            lions_firewall.rule_set_add(interfaceInt, protocol, *ruleArgs)
+        lions_firewall.rule_set_commit(interfaceInt, protocol, defaultAction)
+        return {"status": "ok", "count": len(rulesArgs)}, 201
+    except OSError as OSErr:
+        print(f"UI SERVER|ERR: OS Error: replaceRules: {OSErrStrings[OSErr.errno]}")
+        return {"error": OSErrStrings[OSErr.errno]}, 404
+    except Exception as exception:
+        print(f"UI SERVER|ERR: Unknown Error: replaceRules: {exception}.")
+        return {"error": UnknownErrStr}, 404
 
-        ruleId = lions_firewall.rule_add(interfaceInt, protocol, srcIp, srcPort, srcPortAny,
-                                         srcSubnet, destIp, destPort, destPortAny, destSubnet, action)
-        return {"status": "ok", "rule": {"id": ruleId}}, 201
+###### IP set methods ######
+# Get the number of prefixes in each IP set and the address ranges they use
+@app.route("/api/ipsets", methods=["GET"])
+def getIpSets(request):
+    try:
+        sizes, ranges, rangeCapacity = lions_firewall.ip_set_stats()
+        return {
+            "ip_sets": [{"id": i + 1, "prefixes": size} for i, size in enumerate(sizes)],
+            "ranges": ranges,
+            "range_capacity": rangeCapacity
+        }
     except OSError as OSErr:
-        print(f"UI SERVER|ERR: OS Error: addRule: {OSErrStrings[OSErr.errno]}")
+        print(f"UI SERVER|ERR: OS Error: getIpSets: {OSErrStrings[OSErr.errno]}")
         return {"error": OSErrStrings[OSErr.errno]}, 404
     except Exception as exception:
-        print(f"UI SERVER|ERR: Unknown Error: addRule: {exception}.")
+        print(f"UI SERVER|ERR: Unknown Error: getIpSets: {exception}.")
+        return {"error": UnknownErrStr}, 404
+
+# Bulk load an IP set from a list of "a.b.c.d[/len]" lines in the request body.
+# The prefixes are added to the set, or replace its contents if the replace
+# query argument is set. Either the whole list is applied or none of it is.
+# Lists are far larger than microdot's default limit on request bodies, and are
+# read from the request stream a chunk at a time rather than buffered whole
+@app.route("/api/ipsets/<int:setId>", methods=["POST"])
+async def loadIpSet(request, setId):
+    try:
+        setId = parseIpSet(setId)
+        if setId == 0:
+            print("UI SERVER|ERR: IP set 0 cannot be loaded.")
+            raise OSError(OSErrInvalidInput, OSErrStrings[OSErrInvalidInput])
+
+        replace = request.args.get("replace", "0") not in ("0", "false")
+        lions_firewall.ip_set_load_begin(setId, replace)
+
+        # Only whole lines are passed on, the remainder is kept for the next
+        # chunk
+        count = 0
+        partial = b""
+        while True:
+            chunk = await request.stream.read(ipSetChunkSize)
+            if not chunk:
+                break
+            lines = partial + chunk
+            end = lines.rfind(b"\n") + 1
+            partial = lines[end:]
+            if end > 0:
+                count += lions_firewall.ip_set_load_lines(setId, lines[:end])
+        if partial:
+            count += lions_firewall.ip_set_load_lines(setId, partial)
+
+        lions_firewall.ip_set_load_commit(setId)
+        return {"status": "ok", "count": count}, 201
+    except OSError as OSErr:
+        print(f"UI SERVER|ERR: OS Error: loadIpSet: {OSErrStrings[OSErr.errno]}")
+        return {"error": OSErrStrings[OSErr.errno]}, 404
+    except Exception as exception:
+        print(f"UI SERVER|ERR: Unknown Error: loadIpSet: {exception}.")
+        return {"error": UnknownErrStr}, 404
+
+# Remove every prefix from an IP set
+@app.route("/api/ipsets/<int:setId>", methods=["DELETE"])
+def clearIpSet(request, setId):
+    try:
+        lions_firewall.ip_set_clear(setId)
+        return {"status": "ok"}
+    except OSError as OSErr:
+        print(f"UI SERVER|ERR: OS Error: clearIpSet: {OSErrStrings[OSErr.errno]}")
+        return {"error": OSErrStrings[OSErr.errno]}, 404
+    except Exception as exception:
+        print(f"UI SERVER|ERR: Unknown Error: clearIpSet: {exception}.")
         return {"error": UnknownErrStr}, 404
 
 ###### Ping Response methods ######
@@ -536,12 +763,13 @@ def config(request):
           <th>Subnet</th>
           <th>Next Hop</th>
           <th>Interface</th>
+          <th>Weight</th>
           <th></th>
         </tr>
       </thead>
       <tbody id="routes-body">
         <tr>
-          <td colspan="6">Loading routes...</td>
+          <td colspan="7">Loading routes...</td>
         </tr>
       </tbody>
     </table>
@@ -553,6 +781,7 @@ def config(request):
       IP: <input type="text" id="new-ip" placeholder="e.g. 10.0.0.0"><br>
       Subnet: <input type="number" id="new-subnet" placeholder="e.g. 24"><br>
       Next hop: <input type="text" id="new-next-hop" placeholder="e.g. 10.0.0.0"><br>
+      Weight: <input type="number" id="new-weight" min="1" max="255" value="1"><br>
       <button id="add-route-btn">Add Route</button>
     </p>
 
@@ -585,7 +814,7 @@ def config(request):
             .then(function(data) {
               if (data.routes.length === 0) {
                 let row = document.createElement("tr");
-                row.innerHTML = "<td colspan='6'>No routes available</td>";
+                row.innerHTML = "<td colspan='7'>No routes available</td>";
                 routesBody.appendChild(row);
               } else {
                 data.routes.forEach(function(route) {
@@ -611,6 +840,10 @@ def config(request):
                   cellInterface.textContent = interfaceMap[route.interface] ?? route.interface;
                   row.appendChild(cellInterface);
 
+                  let cellWeight = document.createElement("td");
+                  cellWeight.textContent = route.weight;
+                  row.appendChild(cellWeight);
+
                   let cellActions = document.createElement("td");
                   let delBtn = document.createElement("button");
                   delBtn.textContent = "Delete";
@@ -636,7 +869,7 @@ def config(request):
             })
             .catch(function(err) {
               let row = document.createElement("tr");
-              row.innerHTML = "<td colspan='6'>Error retrieving routes</td>";
+              row.innerHTML = "<td colspan='7'>Error retrieving routes</td>";
               routesBody.appendChild(row);
             });
         }
@@ -648,10 +881,11 @@ def config(request):
           var ip = document.getElementById("new-ip").value;
           var subnet = Number(document.getElementById("new-subnet").value);
           var next_hop = document.getElementById("new-next-hop").value;
+          var weight = Number(document.getElementById("new-weight").value);
           fetch("/api/routes", {
             method: "POST",
             headers: { "Content-Type": "application/json" },
-            body: JSON.stringify({ interface: interfaceId, ip: ip, subnet: subnet, next_hop: next_hop})
+            body: JSON.stringify({ interface: interfaceId, ip: ip, subnet: subnet, next_hop: next_hop, weight: weight})
           })
           .then(function(r) { return r.json(); })
           .then(function(d) {
@@ -707,6 +941,7 @@ def rules(request, protocol):
         </select>
         <button id="set-default-action-btn">Update Default</button>
       </div>
+      <div id="default-stats"></div>
     </div>
     <table border="1">
       <thead>
@@ -719,20 +954,22 @@ def rules(request, protocol):
           <th>Source Subnet</th>
           <th>Destination Subnet</th>
           <th>Action</th>
+          <th>Packets</th>
+          <th>Bytes</th>
           <th></th>
         </tr>
       </thead>
       <tbody id="rules-body">
-        <tr><td colspan="9">Loading rules...</td></tr>
+        <tr><td colspan="11">Loading rules...</td></tr>
       </tbody>
     </table>
 
     <h2>Add New Rule</h2>
       Source IP: <input type="text" id="new-src-ip" placeholder="e.g. 192.168.10.3"><br>
-      Source Port: <input type="number" id="new-src-port" placeholder="e.g. 24"><br>
+      Source Port: <input type="text" id="new-src-port" placeholder="e.g. 24 or 1024-2048"><br>
       Source Subnet: <input type="number" id="new-src-subnet" placeholder="e.g. 16"><br>
       Destination IP: <input type="text" id="new-dest-ip" placeholder="e.g. 192.168.10.3"><br>
-      Destination Port: <input type="number" id="new-dest-port" placeholder="e.g. 24"><br>
+      Destination Port: <input type="text" id="new-dest-port" placeholder="e.g. 24, 1024-2048 or 80,443"><br>
       Destination Subnet: <input type="number" id="new-dest-subnet" placeholder="e.g. 16"><br>
       Action
       <select name="action" id="new-action">
@@ -741,7 +978,11 @@ def rules(request, protocol):
         <option value="2">Drop</option>
         <option value="3">Reject</option>
         <option value="4">Connect</option>
-      </select>
+        <option value="5">Rate limit</option>
+      </select><br>
+      Rate limit packets/s: <input type="number" id="new-rate-pps" placeholder="e.g. 1000"><br>
+      Rate limit bytes/s: <input type="number" id="new-rate-bps" placeholder="e.g. 1000000"><br>
+      Rate limit per source IP: <input type="checkbox" id="new-rate-per-source"><br>
       <button id="add-rule-btn">Add Rule</button>
     </p>
 
@@ -763,6 +1004,16 @@ def rules(request, protocol):
             });
         }
 
+        function formatPorts(portAny, port, portMax, portSet) {
+          if (portAny) {
+            return "-";
+          }
+          if (portSet.length > 0) {
+            return portSet.join(",");
+          }
+          return portMax > port ? port + "-" + portMax : String(port);
+        }
+
         function loadRules() {
           var rulesBody = document.getElementById("rules-body");
           rulesBody.innerHTML = "";
@@ -778,9 +1029,13 @@ def rules(request, protocol):
                   defaultAction.options[i].selected = false;
                 }
               }
+              document.getElementById("default-stats").textContent =
+                "Default action: " + data.default_packets + " packets, " + data.default_bytes + " bytes. " +
+                "Established: " + data.established_packets + " packets, " + data.established_bytes + " bytes. " +
+                "Out of state: " + data.out_of_state + " packets.";
               if (data.rules.length === 0) {
                 var row = document.createElement("tr");
-                row.innerHTML = "<td colspan='9'>No rules available</td>";
+                row.innerHTML = "<td colspan='11'>No rules available</td>";
                 rulesBody.appendChild(row);
               } else {
                 data.rules.forEach(function(rule) {
@@ -788,19 +1043,31 @@ def rules(request, protocol):
                   let id = row.insertCell();
                   id.textContent = rule.id;
                   let srcIp = row.insertCell();
-                  srcIp.textContent = rule.src_subnet ? rule.src_ip : "-";
+                  srcIp.textContent = rule.src_ip_set ? "set " + rule.src_ip_set
+                                                      : (rule.src_subnet ? rule.src_ip : "-");
                   let srcPort = row.insertCell();
-                  srcPort.textContent = rule.src_port_any ? "-" : rule.src_port;
+                  srcPort.textContent = formatPorts(rule.src_port_any, rule.src_port, rule.src_port_max, []);
                   let destIp = row.insertCell();
-                  destIp.textContent = rule.dest_subnet ? rule.dest_ip : "-";
+                  destIp.textContent = rule.dest_ip_set ? "set " + rule.dest_ip_set
+                                                        : (rule.dest_subnet ? rule.dest_ip : "-");
                   let destPort = row.insertCell();
-                  destPort.textContent = rule.dest_port_any ? "-" : rule.dest_port;
+                  destPort.textContent = formatPorts(rule.dest_port_any, rule.dest_port, rule.dest_port_max,
+                                                     rule.dest_port_set);
                   let srcSubnet = row.insertCell();
                   srcSubnet.textContent = rule.src_subnet ? rule.src_subnet : "-";
                   let destSubnet = row.insertCell();
                   destSubnet.textContent = rule.dest_subnet ? rule.dest_subnet : "-";
                   let action = row.insertCell();
                   action.textContent = rule.action;
+                  if (rule.rate_pps || rule.rate_bps) {
+                    action.textContent += " (" + (rule.rate_pps ? rule.rate_pps + " packets/s " : "") +
+                                          (rule.rate_bps ? rule.rate_bps + " bytes/s " : "") +
+                                          (rule.rate_per_source ? "per source, " : "") + rule.limited + " dropped)";
+                  }
+                  let packets = row.insertCell();
+                  packets.textContent = rule.packets;
+                  let bytes = row.insertCell();
+                  bytes.textContent = rule.bytes;
                   let buttonCell = row.insertCell();
                   let button = document.createElement("button");
                   button.textContent = "Delete";
@@ -864,6 +1131,9 @@ def rules(request, protocol):
           var destPort = document.getElementById("new-dest-port").value;
           var destSubnet = Number(document.getElementById("new-dest-subnet").value);
           var action = Number(document.getElementById("new-action").value);
+          var ratePps = Number(document.getElementById("new-rate-pps").value);
+          var rateBps = Number(document.getElementById("new-rate-bps").value);
+          var ratePerSource = document.getElementById("new-rate-per-source").checked;
           var body = JSON.stringify({
             interface: interfaceId,
             src_ip: srcIp,
@@ -873,6 +1143,9 @@ def rules(request, protocol):
             dest_port: destPort,
             dest_subnet: destSubnet,
             action: action,
+            rate_pps: ratePps,
+            rate_bps: rateBps,
+            rate_per_source: ratePerSource,
           });
           fetch("/api/rules/INSERT_PROTOCOL", {
             method: "POST",
@@ -0,0 +1,205 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <lions/firewall/arp.h>
+#include <lions/firewall/ethernet.h>
+#include <lions/firewall/routing.h>
+
+/* Route ID of a directly connected destination, whose adjacency is found by
+its IP address rather than bound to its route */
+#define FW_ADJACENCY_NOROUTE 0xffff
+
+/* Next hop adjacency. Holds the ethernet header of packets forwarded to a
+resolved next hop, so forwarding only requires a route lookup and a copy of
+the header. Adjacencies are hashed on their next hop and interface, and routes
+with a next hop are bound to the adjacency of their resolved next hop. */
+typedef struct fw_adjacency {
+    /* ip address of next hop */
+    uint32_t ip;
+    /* interface next hop is reached through */
+    uint8_t interface;
+    /* index of the ARP cache entry the MAC address was resolved from */
+    uint16_t arp_entry;
+    /* next adjacency in hash bucket or free list, index + 1 or 0 if last */
+    uint16_t next;
+    /* ethernet header of packets forwarded to next hop */
+    eth_hdr_t eth_hdr;
+    /* expiry of the ARP cache entry when a refresh of it was last requested */
+    uint64_t refresh_expiry;
+} fw_adjacency_t;
+
+typedef struct fw_adjacency_table {
+    /* adjacency entries */
+    fw_adjacency_t *entries;
+    /* heads of adjacency hash buckets, index + 1 or 0 if empty */
+    uint16_t *buckets;
+    /* adjacency bound to each route ID, index + 1 or 0 if unresolved */
+    uint16_t *routes;
+    /* capacity of adjacency table, a power of 2 */
+    uint16_t capacity;
+    /* number of route IDs */
+    uint16_t num_routes;
+    /* number of adjacencies in use */
+    uint16_t size;
+    /* head of free adjacencies, index + 1 or 0 if empty */
+    uint16_t free;
+} fw_adjacency_table_t;
+
+/**
+ * Initialise the adjacency table. The region holds the adjacency entries,
+ * followed by the hash bucket heads and the route bindings.
+ *
+ * @param table address of adjacency table.
+ * @param vaddr virtual address of adjacency table region.
+ * @param capacity capacity of adjacency table, must be a power of 2.
+ * @param num_routes capacity of routing table.
+ */
+void fw_adjacency_table_init(fw_adjacency_table_t *table, void *vaddr, uint16_t capacity, uint16_t num_routes);
+
+/**
+ * Find the adjacency of a next hop.
+ *
+ * @param table address of adjacency table.
+ * @param interface interface next hop is reached through.
+ * @param ip ip address of next hop.
+ *
+ * @return address of adjacency or NULL.
+ */
+fw_adjacency_t *fw_adjacency_find(fw_adjacency_table_t *table, uint8_t interface, uint32_t ip);
+
+/**
+ * Find the adjacency a route is bound to.
+ *
+ * @param table address of adjacency table.
+ * @param route_id ID of route.
+ *
+ * @return address of adjacency or NULL if route is unresolved.
+ */
+static inline fw_adjacency_t *fw_adjacency_find_route(fw_adjacency_table_t *table, uint16_t route_id)
+{
+    uint16_t adjacency = table->routes[route_id];
+    return (adjacency == 0) ? NULL : table->entries + adjacency - 1;
+}
+
+/**
+ * Add or update the adjacency of a resolved next hop, and bind a route to it.
+ * If the table is full all adjacencies are released first, they are recreated
+ * as traffic is forwarded.
+ *
+ * @param table address of adjacency table.
+ * @param interface interface next hop is reached through.
+ * @param ip ip address of next hop.
+ * @param mac_addr MAC address of next hop.
+ * @param src_mac_addr MAC address of interface.
+ * @param arp_entry index of the ARP cache entry of next hop.
+ * @param route_id ID of route resolved to next hop, or FW_ADJACENCY_NOROUTE.
+ *
+ * @return address of adjacency.
+ */
+fw_adjacency_t *fw_adjacency_add(fw_adjacency_table_t *table, uint8_t interface, uint32_t ip, uint8_t *mac_addr,
+                                 uint8_t *src_mac_addr, uint16_t arp_entry, uint16_t route_id);
+
+/**
+ * Remove the adjacency of a next hop that is no longer reachable. Routes bound
+ * to it are unbound.
+ *
+ * @param table address of adjacency table.
+ * @param interface interface next hop is reached through.
+ * @param ip ip address of next hop.
+ */
+void fw_adjacency_remove(fw_adjacency_table_t *table, uint8_t interface, uint32_t ip);
+
+/**
+ * Unbind all routes from their adjacencies. Must be called whenever the
+ * routing table changes, as route IDs and next hop resolution may change.
+ *
+ * @param table address of adjacency table.
+ */
+void fw_adjacency_unbind_routes(fw_adjacency_table_t *table);
+
+/**
+ * Check whether an adjacency may be used to forward packets. The ARP requester
+ * owns the ARP cache and may flush or overwrite entries at any time, so an
+ * adjacency is only used while the cache entry it was resolved from still maps
+ * its next hop to the same MAC address.
+ *
+ * @param adjacency address of adjacency.
+ * @param arp_table address of the ARP table of the adjacency's interface.
+ *
+ * @return whether the adjacency is current.
+ */
+static inline bool fw_adjacency_current(fw_adjacency_t *adjacency, fw_arp_table_t *arp_table)
+{
+    if (adjacency->arp_entry >= arp_table->capacity) {
+        return false;
+    }
+
+    fw_arp_entry_t *entry = arp_table->entries + adjacency->arp_entry;
+    return entry->state == ARP_STATE_REACHABLE && entry->ip == adjacency->ip
+        && !memcmp(entry->mac_addr, adjacency->eth_hdr.ethdst_addr, ETH_HWADDR_LEN);
+}
+
+/**
+ * Find the adjacency a packet is forwarded through. Directly connected
+ * destinations have an adjacency of their own, other destinations use the
+ * adjacency the path their flow takes is bound to.
+ *
+ * @param table address of adjacency table.
+ * @param routing_table address of routing table.
+ * @param dst_ip destination ip of packet.
+ * @param flow_hash hash of the packet's flow.
+ * @param route_id address to store the ID of the path taken by the flow, or
+ * FW_ADJACENCY_NOROUTE if the destination is directly connected or unrouted.
+ *
+ * @return address of adjacency or NULL if it is unresolved.
+ */
+static inline fw_adjacency_t *fw_adjacency_lookup(fw_adjacency_table_t *table, fw_routing_table_t *routing_table,
+                                                  uint32_t dst_ip, uint32_t flow_hash, uint16_t *route_id)
+{
+    fw_routing_entry_t *route_entry = fw_routing_find_entry(routing_table, dst_ip);
+    *route_id = FW_ADJACENCY_NOROUTE;
+    if (route_entry == NULL) {
+        return NULL;
+    }
+
+    if (route_entry->next_hop == FW_ROUTING_NONEXTHOP) {
+        return fw_adjacency_find(table, route_entry->interface, dst_ip);
+    }
+
+    route_entry = fw_routing_select_path(routing_table, route_entry, flow_hash);
+    *route_id = route_entry - routing_table->entries;
+    return fw_adjacency_find_route(table, *route_id);
+}
+
+/**
+ * Find the route ID to bind to the adjacency of a next hop resolved for a
+ * path. Only next hops on a directly connected subnet are bound, next hops
+ * resolved through further routes may take a different path for each flow.
+ *
+ * @param routing_table address of routing table.
+ * @param route_id ID of the path the next hop was resolved for, or
+ * FW_ADJACENCY_NOROUTE.
+ *
+ * @return route ID to bind, or FW_ADJACENCY_NOROUTE.
+ */
+static inline uint16_t fw_adjacency_bind_route_id(fw_routing_table_t *routing_table, uint16_t route_id)
+{
+    if (route_id == FW_ADJACENCY_NOROUTE) {
+        return route_id;
+    }
+
+    fw_routing_entry_t *via = fw_routing_find_entry(routing_table, routing_table->entries[route_id].next_hop);
+    if (via == NULL || via->next_hop != FW_ROUTING_NONEXTHOP) {
+        return FW_ADJACENCY_NOROUTE;
+    }
+
+    return route_id;
+}
@@ -9,7 +9,9 @@
 #include <stdint.h>
 #include <string.h>
 #include <os/sddf.h>
+#include <sddf/util/fence.h>
 #include <sddf/util/util.h>
+#include <lions/firewall/common.h>
 #include <lions/firewall/ethernet.h>
 
 /* ----------------- ARP Protocol Definitions ---------------------------*/
@@ -75,9 +77,15 @@ typedef enum {
     /* IP is unreachable */
     ARP_STATE_UNREACHABLE,
     /* IP is reachable, MAC address is valid */
-    ARP_STATE_REACHABLE
+    ARP_STATE_REACHABLE,
+    /* entry has been removed, lookups continue past it */
+    ARP_STATE_REMOVED
 } fw_arp_entry_state_t;
 
+/* ARP entries are stored in an open addressing hash table keyed on IP address.
+Entries are never moved once added, so clients may refer to an entry by its
+index and check it still holds the same IP address. Removed entries are left
+in place until the entries following them are removed. */
 typedef struct fw_arp_entry {
     /* state of this entry */
     uint8_t state;
@@ -89,12 +97,20 @@ typedef struct fw_arp_entry {
     uint8_t client;
     /* number of arp requests sent for this IP address */
     uint8_t num_retries;
+    /* reachable entry is close to expiring, clients still using it should
+    request it again so it is refreshed before it expires */
+    uint8_t stale;
+    /* a client has requested the stale entry again, so it is probed until it
+    is refreshed */
+    uint8_t refresh;
+    /* time reachable or unreachable entry expires, in nanoseconds */
+    uint64_t expiry;
 } fw_arp_entry_t;
 
 typedef struct fw_arp_table {
     /* arp entries */
     fw_arp_entry_t *entries;
-    /* capacity of arp table */
+    /* capacity of arp table, a power of 2 */
     uint16_t capacity;
 } fw_arp_table_t;
 
@@ -112,14 +128,28 @@ typedef struct fw_arp_request {
  *
  * @param table address of arp table.
  * @param entries virtual address of arp entries.
- * @param capacity capacity of arp table.
+ * @param capacity capacity of arp table, must be a power of 2.
  */
 static inline void fw_arp_table_init(fw_arp_table_t *table, void *entries, uint16_t capacity)
 {
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
     table->entries = (fw_arp_entry_t *)entries;
     table->capacity = capacity;
 }
 
+/**
+ * Index of the first entry an ip address may be stored in.
+ *
+ * @param table address of arp table.
+ * @param ip ip address.
+ *
+ * @return index of entry.
+ */
+static inline uint16_t fw_arp_table_home(fw_arp_table_t *table, uint32_t ip)
+{
+    return fw_flow_hash(ip, 0, 0, 0) & (table->capacity - 1);
+}
+
 /**
  * Find an arp entry for an ip address.
  *
@@ -130,13 +160,15 @@ static inline void fw_arp_table_init(fw_arp_table_t *table, void *entries, uint1
  */
 static inline fw_arp_entry_t *fw_arp_table_find_entry(fw_arp_table_t *table, uint32_t ip)
 {
-    for (uint16_t i = 0; i < table->capacity; i++) {
-        fw_arp_entry_t *entry = table->entries + i;
+    uint16_t home = fw_arp_table_home(table, ip);
+    for (uint16_t probe = 0; probe < table->capacity; probe++) {
+        fw_arp_entry_t *entry = table->entries + ((home + probe) & (table->capacity - 1));
         if (entry->state == ARP_STATE_INVALID) {
-            continue;
+            /* End of probe sequence */
+            return NULL;
         }
 
-        if (entry->ip == ip) {
+        if (entry->state != ARP_STATE_REMOVED && entry->ip == ip) {
             return entry;
         }
     }
@@ -168,31 +200,36 @@ static inline fw_arp_request_t fw_arp_response_from_entry(fw_arp_entry_t *entry)
 }
 
 /**
- * Add an entry to the arp table.
+ * Add an entry to the arp table, or update the existing entry for its ip.
  *
  * @param table address of arp table.
  * @param state state of arp entry.
  * @param ip ip address of arp entry.
  * @param mac_addr mac address of arp entry or NULL.
  * @param client client that initiated arp request.
+ * @param expiry time a reachable or unreachable entry expires, in nanoseconds.
  *
  * @return error status.
  */
 static inline fw_arp_error_t fw_arp_table_add_entry(fw_arp_table_t *table, fw_arp_entry_state_t state, uint32_t ip,
-                                                    uint8_t *mac_addr, uint8_t client)
+                                                    uint8_t *mac_addr, uint8_t client, uint64_t expiry)
 {
     if (state == ARP_STATE_REACHABLE && mac_addr == NULL) {
         return ARP_ERR_INVALID;
     }
 
     fw_arp_entry_t *slot = NULL;
-    for (uint16_t i = 0; i < table->capacity; i++) {
-        fw_arp_entry_t *entry = table->entries + i;
+    uint16_t home = fw_arp_table_home(table, ip);
+    for (uint16_t probe = 0; probe < table->capacity; probe++) {
+        fw_arp_entry_t *entry = table->entries + ((home + probe) & (table->capacity - 1));
 
-        if (entry->state == ARP_STATE_INVALID) {
+        if (entry->state == ARP_STATE_INVALID || entry->state == ARP_STATE_REMOVED) {
             if (slot == NULL) {
                 slot = entry;
             }
+            if (entry->state == ARP_STATE_INVALID) {
+                break;
+            }
             continue;
         }
 
@@ -207,13 +244,43 @@ static inline fw_arp_error_t fw_arp_table_add_entry(fw_arp_table_t *table, fw_ar
         return ARP_ERR_FULL;
     }
 
-    slot->state = state;
+    /* Clients may read the entry concurrently, so a new entry is only given
+    its state once its other fields are written */
     slot->ip = ip;
     if (state == ARP_STATE_REACHABLE) {
         memcpy(&slot->mac_addr, mac_addr, ETH_HWADDR_LEN);
     }
     slot->client = BIT(client);
     slot->num_retries = 0;
+    slot->stale = false;
+    slot->refresh = false;
+    slot->expiry = expiry;
+    THREAD_MEMORY_RELEASE();
+    slot->state = state;
 
     return ARP_ERR_OKAY;
 }
+
+/**
+ * Remove an entry from the arp table. The entry is marked as removed, and is
+ * only made invalid along with any removed entries preceding it once the next
+ * entry is invalid, as lookups stop at the first invalid entry.
+ *
+ * @param table address of arp table.
+ * @param entry address of arp entry to remove.
+ */
+static inline void fw_arp_table_remove_entry(fw_arp_table_t *table, fw_arp_entry_t *entry)
+{
+    uint16_t mask = table->capacity - 1;
+    uint16_t idx = entry - table->entries;
+    entry->state = ARP_STATE_REMOVED;
+
+    if (table->entries[(idx + 1) & mask].state != ARP_STATE_INVALID) {
+        return;
+    }
+
+    for (uint16_t i = 0; i < table->capacity && table->entries[idx].state == ARP_STATE_REMOVED; i++) {
+        table->entries[idx].state = ARP_STATE_INVALID;
+        idx = (idx - 1) & mask;
+    }
+}
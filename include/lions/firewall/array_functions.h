@@ -19,10 +19,10 @@
  * @param array_len length of array including index to remove.
  * @param index_to_remove index of the array to be removed.
  */
-static void generic_array_shift(void *array,
-                                uint32_t entry_size,
-                                uint32_t array_len,
-                                uint32_t index_to_remove)
+static inline void generic_array_shift(void *array,
+                                       uint32_t entry_size,
+                                       uint32_t array_len,
+                                       uint32_t index_to_remove)
 {
     unsigned char* arr = (unsigned char *) array;
     uint32_t shift_len = (array_len - index_to_remove - 1) * entry_size;
@@ -7,21 +7,26 @@
 #pragma once
 
 #include <stdint.h>
+#include <string.h>
 #include <lions/firewall/common.h>
+#include <lions/firewall/ip.h>
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /**
- * Calculates the Internet Checksum (RFC 1071).
+ * Calculates the Internet Checksum (RFC 1071), one 16-bit word at a time.
  *
- * This function computes the 16-bit one's complement sum of all 16-bit words in
- * the provided buffer. If the buffer length is odd, the last byte is treated as
- * a 16-bit word with the high-order byte set to zero.
+ * Portable reference implementation of fw_internet_checksum, which the
+ * optimised implementation must agree with.
  *
  * @param pkt Address of the packet for which to calculate the checksum.
  * @param len Number of bytes of the packet to include in checksum calculation.
  * @return The calculated 16-bit Internet Checksum.
  */
-static inline uint16_t fw_internet_checksum(void *pkt,
-                                     uint16_t len)
+static inline uint16_t fw_internet_checksum_ref(void *pkt,
+                                                uint16_t len)
 {
     uint32_t sum = 0;
     uint16_t *buf = (uint16_t *)pkt;
@@ -47,6 +52,189 @@ static inline uint16_t fw_internet_checksum(void *pkt,
     return (uint16_t)~sum;
 }
 
+/**
+ * Adds the 16-bit words of a buffer to a partial one's complement sum.
+ *
+ * As the one's complement sum is independent of the width of the words it is
+ * accumulated over, wider words are summed into a 64-bit accumulator and the
+ * carries are folded back in once by fw_checksum_fold. On AArch64 the bulk of
+ * the buffer is summed with NEON. If the buffer length is odd, the last byte is
+ * treated as a 16-bit word with the high-order byte set to zero, so only the
+ * last buffer added to a sum may have an odd length.
+ *
+ * @param data Address of the buffer, need not be aligned.
+ * @param len Number of bytes of the buffer to add.
+ * @param sum Partial sum to add the buffer to, 0 for a new sum.
+ * @return The partial sum, unfolded.
+ */
+static inline uint64_t fw_checksum_add(const void *data,
+                                       uint16_t len,
+                                       uint64_t sum)
+{
+    const uint8_t *buf = (const uint8_t *)data;
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    if (len >= 32) {
+        /* Pairwise add 16-bit words into 32-bit lanes, which can not overflow
+        as the buffer is less than 64KiB */
+        uint32x4_t acc0 = vdupq_n_u32(0);
+        uint32x4_t acc1 = vdupq_n_u32(0);
+        while (len >= 32) {
+            acc0 = vpadalq_u16(acc0, vld1q_u16((const uint16_t *)buf));
+            acc1 = vpadalq_u16(acc1, vld1q_u16((const uint16_t *)(buf + 16)));
+            buf += 32;
+            len -= 32;
+        }
+        sum += vaddlvq_u32(acc0) + vaddlvq_u32(acc1);
+    }
+#endif
+
+    /* Sum 32-bit words with two independent accumulators */
+    uint64_t sum1 = 0;
+    while (len >= 16) {
+        uint64_t word0, word1;
+        memcpy(&word0, buf, sizeof(uint64_t));
+        memcpy(&word1, buf + 8, sizeof(uint64_t));
+        sum += (uint32_t)word0 + (word0 >> 32);
+        sum1 += (uint32_t)word1 + (word1 >> 32);
+        buf += 16;
+        len -= 16;
+    }
+    sum += sum1;
+
+    if (len >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(uint64_t));
+        sum += (uint32_t)word + (word >> 32);
+        buf += 8;
+        len -= 8;
+    }
+
+    if (len >= 4) {
+        uint32_t word;
+        memcpy(&word, buf, sizeof(uint32_t));
+        sum += word;
+        buf += 4;
+        len -= 4;
+    }
+
+    if (len >= 2) {
+        uint16_t word;
+        memcpy(&word, buf, sizeof(uint16_t));
+        sum += word;
+        buf += 2;
+        len -= 2;
+    }
+
+    /* Add the remaining byte if length is odd */
+    if (len == 1) {
+        sum += *buf;
+    }
+
+    return sum;
+}
+
+/**
+ * Folds a partial sum returned by fw_checksum_add to 16 bits.
+ *
+ * @param sum Partial sum.
+ * @return The 16-bit one's complement sum.
+ */
+static inline uint16_t fw_checksum_fold(uint64_t sum)
+{
+    /* Fold 64-bit sum to 32 bits, then to 16 bits */
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return (uint16_t)sum;
+}
+
+/**
+ * Calculates the Internet Checksum (RFC 1071).
+ *
+ * This function computes the 16-bit one's complement sum of all 16-bit words in
+ * the provided buffer. If the buffer length is odd, the last byte is treated as
+ * a 16-bit word with the high-order byte set to zero.
+ *
+ * @param pkt Address of the packet for which to calculate the checksum.
+ * @param len Number of bytes of the packet to include in checksum calculation.
+ * @return The calculated 16-bit Internet Checksum.
+ */
+static inline uint16_t fw_internet_checksum(void *pkt,
+                                            uint16_t len)
+{
+    /* Take the one's complement of the final sum */
+    return (uint16_t)~fw_checksum_fold(fw_checksum_add(pkt, len, 0));
+}
+
+/**
+ * Incrementally updates an Internet Checksum after a 16-bit word of the
+ * checksummed data has been modified (RFC 1624, equation 3).
+ *
+ * Words are in the byte order they are stored in the packet, as are the
+ * checksums. The old and new words must be aligned on a 16-bit boundary
+ * relative to the start of the checksummed data.
+ *
+ * @param check Current checksum of the data.
+ * @param old_word Value of the word before modification.
+ * @param new_word Value of the word after modification.
+ * @return The updated 16-bit Internet Checksum.
+ */
+static inline uint16_t fw_checksum_update16(uint16_t check,
+                                            uint16_t old_word,
+                                            uint16_t new_word)
+{
+    /* HC' = ~(~HC + ~m + m') */
+    uint32_t sum = (uint16_t)~check + (uint16_t)~old_word + new_word;
+
+    /* Fold 32-bit sum to 16 bits, at most two folds are needed */
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return (uint16_t)~sum;
+}
+
+/**
+ * Incrementally updates an Internet Checksum after a 32-bit field of the
+ * checksummed data, such as an IP address, has been modified (RFC 1624).
+ *
+ * @param check Current checksum of the data.
+ * @param old_field Value of the field before modification.
+ * @param new_field Value of the field after modification.
+ * @return The updated 16-bit Internet Checksum.
+ */
+static inline uint16_t fw_checksum_update32(uint16_t check,
+                                            uint32_t old_field,
+                                            uint32_t new_field)
+{
+    uint32_t sum = (uint16_t)~check;
+    sum += (uint16_t)~old_field + (uint16_t)~(old_field >> 16);
+    sum += (new_field & 0xFFFF) + (new_field >> 16);
+
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return (uint16_t)~sum;
+}
+
+/**
+ * Decrements the time to live of an IPv4 packet and incrementally updates its
+ * header checksum, rather than recalculating it over the whole header.
+ *
+ * @param ip_hdr Address of the IPv4 header. Time to live must be non-zero.
+ */
+static inline void fw_ipv4_decrement_ttl(ipv4_hdr_t *ip_hdr)
+{
+    /* Time to live shares a 16-bit word with the protocol */
+    uint16_t old_word = htons((uint16_t)(ip_hdr->ttl << 8) | ip_hdr->protocol);
+    ip_hdr->ttl -= 1;
+    uint16_t new_word = htons((uint16_t)(ip_hdr->ttl << 8) | ip_hdr->protocol);
+    ip_hdr->check = fw_checksum_update16(ip_hdr->check, old_word, new_word);
+}
+
 /* Psuedo-header used for UDP and TCP checksum calculation */
 typedef struct fw_pseudo_header {
     uint32_t src_ip;
@@ -73,41 +261,19 @@ typedef struct fw_pseudo_header {
  * @param dst_ip Destination IP address in big endian byte order.
  * @return The calculated 16-bit Internet Checksum.
  */
-uint16_t calculate_transport_checksum(void *pkt,
-                                      uint16_t len,
-                                      uint8_t protocol,
-                                      uint32_t src_ip,
-                                      uint32_t dst_ip)
+static inline uint16_t calculate_transport_checksum(void *pkt,
+                                                    uint16_t len,
+                                                    uint8_t protocol,
+                                                    uint32_t src_ip,
+                                                    uint32_t dst_ip)
 {
-    uint32_t sum = 0;
-    uint16_t *pkt_ptr = (uint16_t *)pkt;
-
     /* Create the pseudo-header */
     fw_pseudo_header_t psh = { src_ip, dst_ip, 0, protocol, htons(len) };
 
-    /* Sum up the psuedo-header */
-    uint16_t *psh_ptr = (uint16_t *)&psh;
-    for (uint8_t i = 0; i < sizeof(fw_pseudo_header_t) / sizeof(uint16_t); i++) {
-        sum += psh_ptr[i];
-    }
-
-    /* Sum up the packet */
-    while (len > 1) {
-        sum += *pkt_ptr++;
-        len -= 2;
-    }
-
-    /* Add the remaining byte if length is odd */
-    if (len == 1) {
-        /* Cast to uint8_t* to access the single byte */
-        sum += *(uint8_t *)pkt_ptr;
-    }
-
-    /* Fold 32-bit sum to 16 bits (one's complement sum) */
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
-    }
+    /* Sum up the psuedo-header, then the packet */
+    uint64_t sum = fw_checksum_add(&psh, sizeof(fw_pseudo_header_t), 0);
+    sum = fw_checksum_add(pkt, len, sum);
 
     /* Take the one's complement of the final sum */
-    return (uint16_t)(~sum);
+    return (uint16_t)~fw_checksum_fold(sum);
 }
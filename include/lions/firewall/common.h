@@ -71,14 +71,50 @@ static inline uint16_t ntohs(uint16_t n)
 #endif
 }
 
+/**
+ * Convert a 32 bit unsigned from network byte order to host byte order.
+ *
+ * @param n Integer represented in network byte order.
+ * @return Integer represented in host byte order.
+ */
+static inline uint32_t ntohl(uint32_t n)
+{
+    return htonl(n);
+}
+
 /* Subnet value of N means IPs must match on highest N bits. IP addresses are
 stored big-endian, so mask byte order must be swapped for subnet match. */
 #define subnet_mask(n) htonl((uint32_t)(0xffffffffUL << (32 - (n))))
 
+/**
+ * Hash the addressing fields of a flow. Protocol is not included since each
+ * firewall table only ever holds flows of a single protocol. Inputs may be in
+ * any byte order, as long as it is used consistently.
+ *
+ * @param src_ip source ip of flow.
+ * @param src_port source port of flow.
+ * @param dst_ip destination ip of flow.
+ * @param dst_port destination port of flow.
+ *
+ * @return 32 bit hash of flow.
+ */
+static inline uint32_t fw_flow_hash(uint32_t src_ip, uint16_t src_port, uint32_t dst_ip, uint16_t dst_port)
+{
+    uint32_t h = src_ip ^ (dst_ip * 0x9e3779b1U) ^ ((((uint32_t)src_port << 16) | dst_port) * 0x85ebca6bU);
+    h ^= h >> 16;
+    h *= 0x7feb352dU;
+    h ^= h >> 15;
+    h *= 0x846ca68bU;
+    h ^= h >> 16;
+    return h;
+}
+
 #define IPV4_ADDR_BUFLEN 16
 
-static char ip_addr_buf0[IPV4_ADDR_BUFLEN];
-static char ip_addr_buf1[IPV4_ADDR_BUFLEN];
+/* Scratch buffers for formatting ip addresses, not every user of this header
+needs them */
+static char ip_addr_buf0[IPV4_ADDR_BUFLEN] __attribute__((unused));
+static char ip_addr_buf1[IPV4_ADDR_BUFLEN] __attribute__((unused));
 
 /**
  * Convert a big-endian ip address integer to a string.
@@ -15,6 +15,7 @@
 #include <sddf/network/constants.h>
 #include <lions/firewall/filter.h>
 #include <lions/firewall/routing.h>
+#include <lions/firewall/trace.h>
 #include <lions/firewall/common.h>
 
 #define FW_MAX_INTERFACE_NAME_LEN 63
@@ -23,8 +24,24 @@
 #define FW_MAX_INITIAL_FILTER_RULES 16
 #define FW_MAX_INITIAL_ROUTES 16
 #define FW_MAX_ARP_REQUESTER_CLIENTS 2
+#define FW_MAX_TRACE_RINGS 32
 
-#define FW_FILTER_NUM_ACTIONS 4
+#define FW_FILTER_NUM_ACTIONS 5
+
+/* Idle timeouts of connection instances in seconds, per filter protocol */
+#define FW_CONNTRACK_TCP_TIMEOUT_S 3600
+#define FW_CONNTRACK_UDP_TIMEOUT_S 120
+#define FW_CONNTRACK_ICMP_TIMEOUT_S 30
+/* Idle timeout of half-open TCP connections, which have sent a SYN but not yet
+completed the handshake */
+#define FW_CONNTRACK_TCP_HALF_OPEN_TIMEOUT_S 30
+/* Idle timeout of closing TCP connections, whose initiator has sent a FIN */
+#define FW_CONNTRACK_TCP_FIN_WAIT_TIMEOUT_S 30
+
+/* Interval at which filters reap idle instances in seconds. Instance
+timestamps are taken from the clock read at each reap, so this is also the
+granularity of the idle timeouts */
+#define FW_CONNTRACK_REAP_INTERVAL_S 1
 
 #define FW_DEBUG_OUTPUT 1
 
@@ -34,6 +51,11 @@ typedef struct fw_connection_resource {
     uint8_t ch;
 } fw_connection_resource_t;
 
+typedef struct fw_trace_resource {
+    region_resource_t ring;
+    uint32_t capacity;
+} fw_trace_resource_t;
+
 typedef struct fw_data_connection_resource {
     fw_connection_resource_t conn;
     device_region_resource_t data;
@@ -49,6 +71,15 @@ typedef struct fw_net_virt_tx_config {
     uint8_t num_free_clients;
 } fw_net_virt_tx_config_t;
 
+typedef struct fw_hard_drop_resource {
+    /* hard drop summary published by the filter */
+    region_resource_t summary;
+    /* instance tables of the filter's neighbours, searched for return traffic */
+    region_resource_t external_instances[FW_MAX_INTERFACES];
+    uint8_t num_external_instances;
+    uint16_t instances_capacity;
+} fw_hard_drop_resource_t;
+
 typedef struct fw_net_virt_rx_config {
     uint8_t interface;
     /* Eth-type of traffic to be routed to each client */
@@ -57,6 +88,8 @@ typedef struct fw_net_virt_rx_config {
     field holds IPv4 protocol numbers. If ethtype == ARP, this field holds ARP
     opcodes */
     uint16_t active_client_subtypes[SDDF_NET_MAX_CLIENTS];
+    /* Hard drop summary of each client, unmapped if the client publishes none */
+    fw_hard_drop_resource_t hard_drops[SDDF_NET_MAX_CLIENTS];
     fw_connection_resource_t free_clients[FW_MAX_FW_CLIENTS];
     uint8_t num_free_clients;
 } fw_net_virt_rx_config_t;
@@ -76,12 +109,14 @@ typedef struct fw_arp_requester_config {
     uint8_t num_arp_clients;
     region_resource_t arp_cache;
     uint16_t arp_cache_capacity;
+    fw_trace_resource_t trace;
 } fw_arp_requester_config_t;
 
 typedef struct fw_arp_responder_config {
     uint8_t interface;
     uint8_t mac_addr[ETH_HWADDR_LEN];
     uint32_t ip;
+    fw_trace_resource_t trace;
 } fw_arp_responder_config_t;
 
 typedef struct fw_webserver_router_config {
@@ -105,15 +140,20 @@ typedef struct fw_router_interface {
     uint8_t num_filters;
     region_resource_t packet_queue;
     uint16_t packet_queue_capacity;
+    uint16_t packet_queue_dest_capacity;
 } fw_router_interface_t;
 
 typedef struct fw_router_config {
     fw_router_interface_t interfaces[FW_MAX_INTERFACES];
     uint8_t num_interfaces;
     fw_webserver_router_config_t webserver;
+    uint16_t routing_trie_capacity;
+    region_resource_t adjacency_table;
+    uint16_t adjacency_capacity;
     fw_routing_entry_t initial_routes[FW_MAX_INITIAL_ROUTES];
     uint8_t num_initial_routes;
     fw_connection_resource_t icmp_module;
+    fw_trace_resource_t trace;
 } fw_router_config_t;
 
 typedef struct fw_icmp_module_interface_config {
@@ -131,10 +171,18 @@ typedef struct fw_icmp_module_config {
     fw_connection_resource_t router;
 } fw_icmp_module_config_t;
 
+typedef struct fw_ip_sets_resource {
+    region_resource_t ip_sets;
+    region_resource_t shadow_ip_sets;
+    uint32_t capacity;
+} fw_ip_sets_resource_t;
+
 typedef struct fw_webserver_filter_config {
     uint16_t protocol;
     uint8_t ch;
     region_resource_t rules;
+    region_resource_t shadow_rules;
+    region_resource_t stats;
     uint16_t rules_capacity;
     uint8_t actions[FW_FILTER_NUM_ACTIONS];
 } fw_webserver_filter_config_t;
@@ -145,12 +193,29 @@ typedef struct fw_filter_config {
     region_resource_t internal_instances;
     region_resource_t external_instances[FW_MAX_INTERFACES];
     uint8_t num_external_instances;
+    /* return traffic timestamps of each external instance table's slots,
+    written by this filter */
+    region_resource_t return_seen[FW_MAX_INTERFACES];
+    uint8_t num_return_seen;
+    /* return traffic timestamps of this filter's instance table slots, written
+    by each neighbour filter */
+    region_resource_t neighbour_return_seen[FW_MAX_INTERFACES];
+    uint8_t num_neighbour_return_seen;
     uint16_t instances_capacity;
     fw_webserver_filter_config_t webserver;
     region_resource_t rule_id_bitmap;
+    region_resource_t classifier;
+    region_resource_t shadow_classifier;
+    uint32_t classifier_capacity;
+    region_resource_t rule_state;
+    /* half-open instance list links of the TCP filter, unmapped for others */
+    region_resource_t half_open_links;
+    fw_ip_sets_resource_t ip_sets;
     fw_connection_resource_t icmp_module;
+    region_resource_t hard_drop;
     fw_rule_t initial_rules[FW_MAX_INITIAL_FILTER_RULES];
     uint8_t num_initial_rules;
+    fw_trace_resource_t trace;
 } fw_filter_config_t;
 
 typedef struct fw_webserver_interface_config {
@@ -168,6 +233,12 @@ typedef struct fw_webserver_config {
     uint8_t num_interfaces;
     fw_webserver_router_config_t router;
     fw_arp_connection_t arp_queue;
+    fw_ip_sets_resource_t ip_sets;
     // TODO: Temporary work around until webserver transmits via router.
     uint8_t tx_interface;
 } fw_webserver_config_t;
+
+typedef struct fw_trace_consumer_config {
+    fw_trace_resource_t rings[FW_MAX_TRACE_RINGS];
+    uint8_t num_rings;
+} fw_trace_consumer_config_t;
@@ -10,10 +10,13 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <sddf/util/util.h>
+#include <sddf/util/fence.h>
 #include <sddf/network/util.h>
 #include <sddf/resources/common.h>
 #include <lions/firewall/common.h>
 #include <lions/firewall/array_functions.h>
+#include <lions/firewall/ip_set.h>
+#include <lions/firewall/tcp.h>
 
 /* The default action of a filter is always stored at index 0 of the rule table,
 and has a fixed rule ID of 0 */
@@ -32,12 +35,31 @@ typedef enum {
     /* rule id does not point to a valid entry, or is the default action rule id */
     FILTER_ERR_INVALID_RULE_ID,
     /* unsupported action */
-    FILTER_ERR_UNSUPPORTED_ACTION
+    FILTER_ERR_UNSUPPORTED_ACTION,
+    /* port range is empty, or port set is too large */
+    FILTER_ERR_INVALID_PORTS,
+    /* IP set id is out of range */
+    FILTER_ERR_INVALID_IP_SET,
+    /* rate limit rule limits neither packets nor bytes */
+    FILTER_ERR_INVALID_RATE_LIMIT,
+    /* source or connect rule has too many half-open TCP connections */
+    FILTER_ERR_HALF_OPEN_LIMIT,
+    /* TCP packet is not valid in the state of its connection */
+    FILTER_ERR_OUT_OF_STATE,
+    FILTER_NUM_ERRS
 } fw_filter_err_t;
 
-static const char *fw_filter_err_str[] = {
-    "Ok.", "Out of memory error.", "Duplicate entry.", "Clashing entry.", "Invalid rule ID.", "Unsupported action."
-};
+static const char *const fw_filter_err_str[] = { "Ok.",
+                                                 "Out of memory error.",
+                                                 "Duplicate entry.",
+                                                 "Clashing entry.",
+                                                 "Invalid rule ID.",
+                                                 "Unsupported action.",
+                                                 "Invalid port range or set.",
+                                                 "Invalid IP set.",
+                                                 "Invalid rate limit.",
+                                                 "Too many half-open connections.",
+                                                 "Packet out of state for its connection." };
 
 typedef enum {
     /* allow traffic */
@@ -48,12 +70,39 @@ typedef enum {
     FILTER_ACT_REJECT = 3,
     /* allow traffic, and additionally any return traffic */
     FILTER_ACT_CONNECT = 4,
+    /* allow traffic within the rule's rate limits, drop traffic exceeding them */
+    FILTER_ACT_RATE_LIMIT = 5,
     /* traffic is return traffic from a connect rule */
-    FILTER_ACT_ESTABLISHED = 5,
+    FILTER_ACT_ESTABLISHED = 6,
 } fw_action_t;
 
-static const char *fw_filter_action_str[] = { "No rule", "Allow", "Drop", "Reject", "Connect", "Established" };
+static const char *const fw_filter_action_str[] = { "No rule", "Allow", "Drop", "Reject", "Connect", "Rate limit",
+                                                    "Established" };
 
+/* Maximum number of ports in a destination port set */
+#define FW_RULE_MAX_PORT_SET 32
+/* Number of destination port sets in each rule table */
+#define FW_RULE_MAX_PORT_SETS 16
+
+/**
+ * Destination port set of a rule. Port sets are stored out of line in the rule
+ * table and referred to by ID, so that rules without a set do not carry one.
+ * Ports are stored in network byte order.
+ */
+typedef struct fw_port_set {
+    /* number of ports in set, 0 if the set is unused */
+    uint8_t size;
+    /* ports of set */
+    uint16_t ports[FW_RULE_MAX_PORT_SET];
+} fw_port_set_t;
+
+/**
+ * Filter rule. Rules may match a single port, a range of ports or any port on
+ * either side, and a set of ports on the destination side. Rules may match an
+ * IP set on either side in place of an IP and subnet. Port numbers are stored
+ * in network byte order. Rate limit rules allow up to one second's worth of
+ * their packet and byte rates in a burst.
+ */
 typedef struct fw_rule {
     /* action to be applied to traffic matching rule */
     uint8_t action;
@@ -73,17 +122,106 @@ typedef struct fw_rule {
     bool src_port_any;
     /* rule applies to any destination port */
     bool dst_port_any;
+    /* last source port of source port range, 0 if rule applies to a single
+    source port */
+    uint16_t src_port_max;
+    /* last destination port of destination port range, 0 if rule applies to a
+    single destination port */
+    uint16_t dst_port_max;
+    /* id of destination port set matched in place of destination port and
+    range, 0 if none */
+    uint8_t dst_port_set;
+    /* id of IP set matched in place of source IP and subnet, 0 if none */
+    uint8_t src_ip_set;
+    /* id of IP set matched in place of destination IP and subnet, 0 if none */
+    uint8_t dst_ip_set;
+    /* packets per second allowed by a rate limit rule, 0 if packets are not limited */
+    uint32_t rate_pps;
+    /* bytes per second allowed by a rate limit rule, 0 if bytes are not limited */
+    uint32_t rate_bps;
+    /* rate limits apply to each source IP separately rather than to all
+    traffic matching the rule */
+    bool rate_per_source;
     /* rule id assigned */
     uint16_t rule_id;
 } fw_rule_t;
 
+/* Port ICMP traffic is matched and tracked on, as ICMP has no ports */
+#define ICMP_FILTER_DUMMY_PORT 0
+
+/* Instance table slot states */
+#define FW_INSTANCE_SLOT_EMPTY 0
+#define FW_INSTANCE_SLOT_VALID 1
+#define FW_INSTANCE_SLOT_DELETED 2
+
+/* Maximum number of slots searched from an instance's home slot. Bounds the
+cost of lookups for traffic that has no instance. An instance can only be
+stored within this window, so once all of its slots are taken an instance is
+evicted even if the table has free slots elsewhere. With linear probing, runs of
+this length are vanishingly rare while at most half of the table is in use, so
+instance tables should be sized to at least twice the number of concurrent
+connections expected */
+#define FW_INSTANCE_MAX_PROBE 32
+
+/**
+ * TCP connection states of instances, as seen from the initiator's packets.
+ * Instances enter SYN_SENT on the initiator's SYN, ESTABLISHED once the
+ * initiator acknowledges the responder's SYN-ACK, FIN_WAIT on the initiator's
+ * FIN and CLOSED on a reset. Closed instances are released at the next reap,
+ * until then return traffic is dropped rather than matched against rules.
+ * Connections with no instance, such as those open before the filter started or
+ * whose instance was evicted, are picked up mid-stream by the initiator's ACKs.
+ * States are tracked from TCP flags alone, sequence and acknowledgement numbers
+ * are not checked against the connection's window yet.
+ */
+#define FW_TCP_STATE_NONE 0
+#define FW_TCP_STATE_SYN_SENT 1
+#define FW_TCP_STATE_ESTABLISHED 2
+#define FW_TCP_STATE_FIN_WAIT 3
+#define FW_TCP_STATE_CLOSED 4
+
+/* Number of hashed per-source half-open connection counters of the TCP filter,
+must be a power of 2. Sources sharing a counter share its limit */
+#define FW_TCP_HALF_OPEN_SOURCES 1024
+/* Maximum half-open connections of each source */
+#define FW_TCP_MAX_HALF_OPEN_PER_SOURCE 32
+/* A connect rule may fill at most 1 / FW_TCP_HALF_OPEN_RULE_SHARE of the
+instance table with half-open connections, leaving the remainder to
+connections which have completed their handshake. Once full, the rule's oldest
+half-open connection is evicted for each new one */
+#define FW_TCP_HALF_OPEN_RULE_SHARE 2
+
+/* Links of an instance slot in its connect rule's list of half-open instances,
+which is ordered from oldest to newest. Private to the TCP filter */
+typedef struct fw_half_open_link {
+    /* slot of the next newer half-open instance of the rule */
+    uint16_t next;
+    /* slot of the next older half-open instance of the rule */
+    uint16_t prev;
+} fw_half_open_link_t;
+
 /**
  * Instances are created by filters if traffic matches with a connect rule.
  * If this is the case, return traffic should be permitted also, thus the
  * filter will create an instance in shared memory so the matching filter
  * can search for and identify return traffic.
+ *
+ * Instance tables are open-addressed hash tables keyed on the instance's
+ * addressing fields. The owning filter is the only writer, while the
+ * neighbour filter searches the table concurrently through a read-only
+ * mapping. Each slot carries a sequence number which is odd while the owner
+ * is writing it, allowing the reader to discard torn reads. As every write to
+ * a slot advances its sequence number, readers can also tell whether an
+ * instance they found earlier is unchanged by rereading it.
  */
 typedef struct fw_instance {
+    /* sequence number, odd while slot is being updated */
+    uint32_t seq;
+    /* slot state, one of FW_INSTANCE_SLOT_* */
+    uint8_t slot_state;
+    /* TCP connection state, one of FW_TCP_STATE_*. Used by readers to check
+    return traffic */
+    uint8_t tcp_state;
     /* source ip of traffic */
     uint32_t src_ip;
     /* destination ip of traffic */
@@ -95,23 +233,311 @@ typedef struct fw_instance {
     /* ID of the rule this instance was created from. Allows instances
     to be removed upon rule removal */
     uint16_t rule_id;
+    /* number of instances created with this slot as their home slot,
+    incremented after the instance is written. Not part of the instance
+    stored in the slot, and never reset */
+    uint32_t created;
+    /* time traffic from the initiator was last seen for this instance in
+    nanoseconds. Return traffic is timestamped by the neighbour filter in its
+    own region, as the instance table is read-only to it */
+    uint64_t last_seen;
 } fw_instance_t;
 
 typedef struct fw_instances_table {
+    /* number of valid instances */
     uint16_t size;
+    /* instance slots, capacity must be a power of 2 */
     fw_instance_t instances[];
 } fw_instances_table_t;
 
 typedef struct fw_rule_table {
     uint16_t size;
+    /* destination port sets of rules, port set ID n is stored at index n-1 */
+    fw_port_set_t port_sets[FW_RULE_MAX_PORT_SETS];
     fw_rule_t rules[];
 } fw_rule_table_t;
 
+/**
+ * Rule ID allocation bitmap. The bitmap words are followed by an index mapping
+ * each allocated rule ID to the rule table slot holding the rule.
+ */
 typedef struct fw_rule_id_bitmap {
     uint16_t last_allocated_rule_id;
     uint64_t id_bitmap[];
 } fw_rule_id_bitmap_t;
 
+/* Ways in which a rule matches on a port, from most to least specific. Ranges
+are classified by the smallest aligned block of 16, 256 or 4096 ports holding
+them, and keyed on the index of that block so that ranges in different blocks
+do not share a probe sequence. Ranges spanning a 4096 port boundary are keyed
+on 0. Port sets are classified as ranges spanning their lowest to highest port */
+#define FW_PORT_MATCH_EXACT 0
+#define FW_PORT_MATCH_RANGE_16 1
+#define FW_PORT_MATCH_RANGE_256 2
+#define FW_PORT_MATCH_RANGE_4096 3
+#define FW_PORT_MATCH_RANGE 4
+#define FW_PORT_MATCH_ANY 5
+
+/* Subnet of the tuples of rules matching an IP set. Sets are keyed on an
+address of 0 and checked against each rule in the probe sequence, and take
+precedence over any subnet */
+#define FW_IP_SET_SUBNET 33
+
+/**
+ * Rules are classified using tuple space search. Rules are grouped into tuples
+ * by their source and destination subnets and how they match on source and
+ * destination ports. Within a tuple, traffic can only match a rule whose
+ * masked addresses and exactly matched ports equal those of the traffic, so
+ * each tuple can be searched with a single hash table probe. Ports matched by
+ * range are keyed on their block, and checked against each rule in the probe
+ * sequence. Rules matching an IP set are grouped into tuples of subnet
+ * FW_IP_SET_SUBNET.
+ *
+ * Tuples are kept sorted from most to least specific, matching the priority
+ * order used to select between rules: longer source subnet first, then longer
+ * destination subnet, then narrower source ports, then narrower destination
+ * ports. Port width is 1 for an exact port, the number of ports in a range or
+ * set, and 65536 for any port, with ties broken by the earlier added rule. The
+ * first tuple containing a match holds the best matching rule, unless it
+ * matches ports by range, in which case the following tuples of the same
+ * subnets which also match those ports by range may hold a narrower rule. The
+ * default rule is not stored in the classifier.
+ */
+typedef struct fw_classifier_tuple {
+    /* source subnet mask of tuple */
+    uint32_t src_mask;
+    /* destination subnet mask of tuple */
+    uint32_t dst_mask;
+    /* source subnet of tuple */
+    uint8_t src_subnet;
+    /* destination subnet of tuple */
+    uint8_t dst_subnet;
+    /* how tuple matches source port, one of FW_PORT_MATCH_* */
+    uint8_t src_port_match;
+    /* how tuple matches destination port, one of FW_PORT_MATCH_* */
+    uint8_t dst_port_match;
+    /* number of rules in tuple */
+    uint16_t rule_count;
+} fw_classifier_tuple_t;
+
+/**
+ * Classifier hash table entry. Entries are keyed on the rule's tuple, masked
+ * addresses and ports, with ports set to 0 unless the rule matches an exact
+ * port. Since the default rule is never stored in the classifier, a rule ID of
+ * 0 marks an empty entry.
+ */
+typedef struct fw_classifier_entry {
+    /* masked source ip of rule */
+    uint32_t src_ip;
+    /* masked destination ip of rule */
+    uint32_t dst_ip;
+    /* source port of rule, 0 unless rule matches an exact source port */
+    uint16_t src_port;
+    /* destination port of rule, 0 unless rule matches an exact destination port */
+    uint16_t dst_port;
+    /* lowest and highest source port matched by rule in host byte order */
+    uint16_t src_port_lo;
+    uint16_t src_port_hi;
+    /* lowest and highest destination port matched by rule in host byte order */
+    uint16_t dst_port_lo;
+    uint16_t dst_port_hi;
+    /* hash of rule's destination port set, 0 if rule has no port set */
+    uint32_t dst_port_set_hash;
+    /* order in which rules were added, used to break ties between rules of
+    the same precedence */
+    uint32_t order;
+    /* id of rule, DEFAULT_ACTION_RULE_ID if entry is empty */
+    uint16_t rule_id;
+    /* source subnet of rule */
+    uint8_t src_subnet;
+    /* destination subnet of rule */
+    uint8_t dst_subnet;
+    /* how rule matches source port, one of FW_PORT_MATCH_* */
+    uint8_t src_port_match;
+    /* how rule matches destination port, one of FW_PORT_MATCH_* */
+    uint8_t dst_port_match;
+    /* number of ports in rule's destination port set */
+    uint8_t dst_port_set_size;
+    /* id of rule's destination port set, 0 if rule has no port set */
+    uint8_t dst_port_set;
+    /* action to be applied to traffic matching rule */
+    uint8_t action;
+    /* IP set matched by rule on each side, 0 if none */
+    uint8_t src_ip_set;
+    uint8_t dst_ip_set;
+} fw_classifier_entry_t;
+
+/**
+ * Rule classifier. The hash table of rules is followed by the tuple list. Every
+ * tuple holds at least one rule, so the tuple list has the same capacity as
+ * the hash table.
+ */
+typedef struct fw_classifier {
+    /* number of tuples in use */
+    uint16_t tuple_count;
+    /* hash table of rules, capacity must be a power of 2 */
+    fw_classifier_entry_t entries[];
+} fw_classifier_t;
+
+/* Number of entries in each filter's flow verdict cache, must be a power of 2 */
+#define FW_VERDICT_CACHE_SIZE 1024
+
+/**
+ * Filters cache the actions found for recent flows in a direct-mapped cache
+ * keyed on the flow's addressing. A cached verdict is only valid while the
+ * filter's rule generation is unchanged. Changes to the neighbour filters'
+ * instance tables only invalidate the verdicts of the flows they affect:
+ * verdicts of return traffic are checked against the sequence number of their
+ * instance's slot, and other verdicts against the creation counters of the
+ * home slot a return traffic instance of the flow would have.
+ */
+typedef struct fw_verdict {
+    /* source ip of flow */
+    uint32_t src_ip;
+    /* destination ip of flow */
+    uint32_t dst_ip;
+    /* source port of flow */
+    uint16_t src_port;
+    /* destination port of flow */
+    uint16_t dst_port;
+    /* rule generation the verdict was found in */
+    uint32_t generation;
+    /* sequence number of the instance slot of established flows, otherwise
+    the instances created in the flow's home slots of the external tables */
+    uint32_t instances_seen;
+    /* id of matching rule */
+    uint16_t rule_id;
+    /* action to be applied to flow */
+    uint8_t action;
+    /* TCP state of the connection of established flows */
+    uint8_t tcp_state;
+    /* external instance table and slot of the connection of established flows */
+    uint8_t iface;
+    uint16_t slot;
+} fw_verdict_t;
+
+/**
+ * Traffic counters of a filter rule. Counters are only written by the owning
+ * filter and are naturally aligned, so readers never observe a torn counter,
+ * although a rule's packet and byte counts may be read from different updates.
+ */
+typedef struct fw_rule_stats {
+    /* number of packets matching rule */
+    uint64_t packets;
+    /* number of bytes in packets matching rule */
+    uint64_t bytes;
+    /* number of packets matching rule dropped for exceeding its rate or
+    half-open connection limits, or which evicted a half-open connection of
+    the rule */
+    uint64_t limited;
+} fw_rule_stats_t;
+
+/**
+ * Filter traffic counters, mapped read-only to the webserver. The counters of
+ * a rule ID are reset when the ID is allocated, and those of the default rule
+ * when the default action changes.
+ */
+typedef struct fw_filter_stats {
+    /* return traffic of neighbour filters' connections */
+    fw_rule_stats_t established;
+    /* number of TCP packets dropped for being out of state with their
+    connection, in either direction */
+    uint64_t out_of_state;
+    /* counters indexed by rule ID, the default rule has ID 0 */
+    fw_rule_stats_t rules[];
+} fw_filter_stats_t;
+
+/* Maximum number of source prefixes in a filter's hard drop summary */
+#define FW_HARD_DROP_MAX_PREFIXES 32
+
+/* Source prefix whose traffic is all dropped by a filter's rules. Prefixes are
+published sorted by descending length, so the first prefix matching a source
+is its longest, belonging to the rule the filter itself would have matched */
+typedef struct fw_hard_drop_prefix {
+    /* masked source ip in network byte order */
+    uint32_t ip;
+    /* source subnet mask in network byte order */
+    uint32_t mask;
+    /* id of the rule dropping the prefix's traffic */
+    uint16_t rule_id;
+} fw_hard_drop_prefix_t;
+
+/**
+ * Hard drop summary of a filter, shared with the Rx virtualiser of its
+ * interface. The filter publishes the source prefixes whose traffic its rules
+ * drop regardless of destination and ports, so the Rx virtualiser can return
+ * such traffic to the driver without waking the filter. Return traffic of
+ * neighbour filters' connections must still be forwarded to the filter, as it
+ * is permitted before rules are searched.
+ *
+ * The filter is the only writer of the prefixes, and increments the sequence
+ * number before and after rewriting them so readers can discard torn reads.
+ * The Rx virtualiser is the only writer of the counters, which the filter
+ * periodically adds to its rule counters.
+ */
+typedef struct fw_hard_drop {
+    /* sequence number, odd while prefixes are being rewritten */
+    uint32_t seq;
+    /* number of prefixes */
+    uint16_t size;
+    fw_hard_drop_prefix_t prefixes[FW_HARD_DROP_MAX_PREFIXES];
+    /* traffic dropped by the Rx virtualiser, indexed by prefix */
+    fw_rule_stats_t counters[FW_HARD_DROP_MAX_PREFIXES];
+} fw_hard_drop_t;
+
+/* Token counts are scaled by the number of nanoseconds in a second, so that
+refills need no division */
+#define FW_RATE_TOKEN_SCALE 1000000000ULL
+
+/* Number of per-source rate limit buckets of each filter, must be a power of 2 */
+#define FW_RATE_SOURCES 1024
+/* Buckets a source may be placed in, the least recently refilled is replaced */
+#define FW_RATE_SOURCE_WAYS 4
+
+/**
+ * Token bucket of a rate limit. Buckets are refilled from the filter's clock
+ * when a packet is checked against them, and hold at most one second's worth
+ * of tokens.
+ */
+typedef struct fw_rate_bucket {
+    /* packet tokens, scaled by FW_RATE_TOKEN_SCALE */
+    uint64_t packet_tokens;
+    /* byte tokens, scaled by FW_RATE_TOKEN_SCALE */
+    uint64_t byte_tokens;
+    /* time of the last refill in nanoseconds */
+    uint64_t last_refill;
+} fw_rate_bucket_t;
+
+/* State of a rule ID private to the filter */
+typedef struct fw_rule_state {
+    /* rate limit bucket shared by all traffic matching the rule */
+    fw_rate_bucket_t bucket;
+    /* incremented each time the rule ID is allocated, per-source buckets of
+    previous rules with the same ID are ignored */
+    uint32_t epoch;
+    /* number of half-open TCP connections created by the rule */
+    uint16_t half_open;
+    /* instance slots of the rule's oldest and newest half-open connections,
+    only valid while it has any */
+    uint16_t half_open_oldest;
+    uint16_t half_open_newest;
+} fw_rule_state_t;
+
+/**
+ * Per-source rate limit bucket. Buckets are kept in a set associative table
+ * private to the filter, sets are selected by the hash of the source IP and
+ * rule ID.
+ */
+typedef struct fw_rate_source {
+    fw_rate_bucket_t bucket;
+    /* source ip of traffic */
+    uint32_t src_ip;
+    /* epoch of the rule ID when the bucket was created */
+    uint32_t epoch;
+    /* id of rate limit rule, DEFAULT_ACTION_RULE_ID if entry is empty */
+    uint16_t rule_id;
+} fw_rate_source_t;
+
 typedef struct fw_filter_state {
     /* filter rules */
     fw_rule_table_t *rule_table;
@@ -119,23 +545,86 @@ typedef struct fw_filter_state {
     uint16_t rules_capacity;
     /* bitmap to track filter rule ids */
     fw_rule_id_bitmap_t *rule_id_bitmap;
+    /* rule table slot of each allocated rule id */
+    uint16_t *rule_slots;
+    /* rule classifier */
+    fw_classifier_t *classifier;
+    /* spare classifier, used to build the classifier of a new rule set */
+    fw_classifier_t *shadow_classifier;
+    /* capacity of classifier hash table */
+    uint32_t classifier_capacity;
+    /* order of the next rule added to the classifier */
+    uint32_t rule_order;
+    /* incremented whenever a rule is added, removed, the default action
+    changes or IP sets are swapped, starts at 1 so that zeroed verdicts are
+    never valid */
+    uint32_t rule_generation;
+    /* flow verdict cache, FW_VERDICT_CACHE_SIZE entries */
+    fw_verdict_t *verdict_cache;
+    /* traffic counters */
+    fw_filter_stats_t *stats;
+    /* private rule state indexed by rule ID */
+    fw_rule_state_t *rule_state;
+    /* per-source rate limit buckets, FW_RATE_SOURCES entries */
+    fw_rate_source_t *rate_sources;
+    /* number of rate limit rules */
+    uint16_t num_rate_limits;
+    /* IP sets in use, and the copy being updated by the webserver */
+    fw_ip_set_table_t ip_sets;
+    fw_ip_set_table_t shadow_ip_sets;
     /* instances created by this filter,
     to be searched by neighbour filter */
     fw_instances_table_t *internal_instances_table;
     /* instances created by neighbour filter,
     to be searched by this filter */
     fw_instances_table_t *external_instances_table[FW_MAX_INTERFACES];
+    /* time return traffic was last seen for each slot of the external
+    instance tables in nanoseconds, written by this filter */
+    uint64_t *return_seen[FW_MAX_INTERFACES];
+    /* time return traffic was last seen for each slot of this filter's
+    instance table in nanoseconds, written by each neighbour filter */
+    uint64_t *neighbour_return_seen[FW_MAX_INTERFACES];
     /* capacity of both instance tables */
     uint16_t instances_capacity;
     /* number of interfaces */
     uint8_t num_interfaces;
+    /* time after which idle instances are removed in nanoseconds */
+    uint64_t instance_timeout;
+    /* half-open TCP connection counters of hashed sources,
+    FW_TCP_HALF_OPEN_SOURCES entries. NULL outside of the TCP filter */
+    uint16_t *half_open_sources;
+    /* half-open instance list links, indexed by instance slot. NULL outside of
+    the TCP filter */
+    fw_half_open_link_t *half_open_links;
+    /* time after which idle half-open TCP connections are removed in nanoseconds */
+    uint64_t half_open_timeout;
+    /* time after which idle closing TCP connections are removed in nanoseconds */
+    uint64_t fin_wait_timeout;
+    /* time of the last clock read in nanoseconds, used to timestamp instances
+    and refill rate limit buckets. The clock is read at each instance reap, and
+    at the start of each batch of packets while rate limit rules exist */
+    uint64_t now;
+    /* hard drop summary shared with the Rx virtualiser, NULL if none */
+    fw_hard_drop_t *hard_drop;
+    /* hard drop counters already added to the rule counters, indexed by prefix */
+    fw_rule_stats_t hard_drop_counted[FW_HARD_DROP_MAX_PREFIXES];
+    /* whether prefixes were left out of the hard drop summary for lack of room */
+    bool hard_drop_partial;
+    /* whether a rule removal may have allowed more prefixes to be published */
+    bool hard_drop_stale;
 } fw_filter_state_t;
 
+/* Ports of a destination port set are packed into message registers */
+#define FW_RULE_PORTS_PER_MR 4
+#define FW_RULE_PORT_SET_MRS (FW_RULE_MAX_PORT_SET / FW_RULE_PORTS_PER_MR)
+
 /* PP call parameters for webserver to call filters and update rules */
 typedef enum fw_filter_pp_type {
     FILTER_SET_DEFAULT_ACTION = 0,
     FILTER_ADD_RULE,
     FILTER_DEL_RULE,
+    FILTER_COMMIT_RULES,
+    FILTER_SWAP_IP_SETS,
 } fw_filter_pp_type_t;
 
 typedef enum { FILTER_SET_DEFAULT_ARG_ACTION = 0, FILTER_DEFAULT_NUM_ARGS } fw_filter_default_args_t;
@@ -150,19 +639,34 @@ typedef enum {
     FILTER_ADD_ARG_DST_SUBNET,
     FILTER_ADD_ARG_DST_PORT,
     FILTER_ADD_ARG_DST_ANY_PORT,
-    FILTER_ADD_NUM_ARGS
+    FILTER_ADD_ARG_SRC_PORT_MAX,
+    FILTER_ADD_ARG_DST_PORT_MAX,
+    FILTER_ADD_ARG_SRC_IP_SET,
+    FILTER_ADD_ARG_DST_IP_SET,
+    FILTER_ADD_ARG_RATE_PPS,
+    FILTER_ADD_ARG_RATE_BPS,
+    FILTER_ADD_ARG_RATE_PER_SOURCE,
+    FILTER_ADD_ARG_DST_PORT_SET_SIZE,
+    /* destination port set, packed FW_RULE_PORTS_PER_MR ports per register */
+    FILTER_ADD_ARG_DST_PORT_SET,
+    FILTER_ADD_NUM_ARGS = FILTER_ADD_ARG_DST_PORT_SET + FW_RULE_PORT_SET_MRS
 } fw_filter_add_args_t;
 
 typedef enum { FILTER_DELETE_ARG_RULE_ID = 0, FILTER_DELETE_NUM_ARGS } fw_filter_delete_args_t;
 
+typedef enum { FILTER_COMMIT_ARG_DEFAULT_ACTION = 0, FILTER_COMMIT_NUM_ARGS } fw_filter_commit_args_t;
+
 typedef enum { FILTER_RET_ERR = 0, FILTER_RET_RULE_ID = 1 } fw_filter_ret_args_t;
 
+typedef enum { FILTER_COMMIT_RET_ERR = 0, FILTER_COMMIT_RET_RULE_IDX = 1 } fw_filter_commit_ret_args_t;
+
 /* The rule ID allocation bitmap uses blocks of 64 bits */
 #define RULE_ID_BITMAP_BLK_SIZE 64
 
 /**
  * Reserve an unused rule ID from the bitmap and mark it as allocated. Allocates
- * circularly starting from the last allocated ID position.
+ * circularly starting from the last allocated ID position, searching a block
+ * of IDs at a time.
  *
  * @param state pointer to the filter state.
  * @param rule_id pointer to return the allocated rule ID.
@@ -176,25 +680,42 @@ static fw_filter_err_t rules_reserve_id(fw_filter_state_t *state, uint16_t *rule
         return FILTER_ERR_FULL;
     }
 
-    uint16_t id_to_reserve = DEFAULT_ACTION_RULE_ID;
-    for (uint16_t i = 0; i < state->rules_capacity; i++) {
-        uint16_t id_to_check = (state->rule_id_bitmap->last_allocated_rule_id + 1 + i) % state->rules_capacity;
-
-        uint16_t block_idx = id_to_check / RULE_ID_BITMAP_BLK_SIZE;
-        uint64_t mask = 1ULL << (id_to_check % RULE_ID_BITMAP_BLK_SIZE);
+    uint64_t *id_bitmap = state->rule_id_bitmap->id_bitmap;
+    uint16_t num_blocks = (state->rules_capacity + RULE_ID_BITMAP_BLK_SIZE - 1) / RULE_ID_BITMAP_BLK_SIZE;
+    uint16_t start_id = (state->rule_id_bitmap->last_allocated_rule_id + 1) % state->rules_capacity;
+
+    /* IDs preceding the start ID in its block are only searched after all
+    other blocks, so the search visits the start block twice */
+    uint16_t block_idx = start_id / RULE_ID_BITMAP_BLK_SIZE;
+    uint64_t free_ids = ~id_bitmap[block_idx] & (~0ULL << (start_id % RULE_ID_BITMAP_BLK_SIZE));
+    for (uint16_t i = 0; i <= num_blocks; i++) {
+        /* IDs past the rules capacity are never free */
+        if (block_idx == num_blocks - 1 && state->rules_capacity % RULE_ID_BITMAP_BLK_SIZE) {
+            free_ids &= (1ULL << (state->rules_capacity % RULE_ID_BITMAP_BLK_SIZE)) - 1;
+        }
 
-        if (!(state->rule_id_bitmap->id_bitmap[block_idx] & mask)) {
-            state->rule_id_bitmap->id_bitmap[block_idx] |= mask;
-            state->rule_id_bitmap->last_allocated_rule_id = id_to_check;
-            id_to_reserve = id_to_check;
-            break;
+        if (free_ids) {
+            uint16_t id_to_reserve = block_idx * RULE_ID_BITMAP_BLK_SIZE + __builtin_ctzll(free_ids);
+            assert(id_to_reserve != DEFAULT_ACTION_RULE_ID);
+
+            id_bitmap[block_idx] |= 1ULL << (id_to_reserve % RULE_ID_BITMAP_BLK_SIZE);
+            state->rule_id_bitmap->last_allocated_rule_id = id_to_reserve;
+            state->stats->rules[id_to_reserve].packets = 0;
+            state->stats->rules[id_to_reserve].bytes = 0;
+            state->stats->rules[id_to_reserve].limited = 0;
+            state->rule_state[id_to_reserve].bucket = (fw_rate_bucket_t) { 0 };
+            state->rule_state[id_to_reserve].epoch++;
+            *rule_id = id_to_reserve;
+            return FILTER_ERR_OKAY;
         }
-    }
 
-    assert(id_to_reserve != DEFAULT_ACTION_RULE_ID);
-    *rule_id = id_to_reserve;
+        block_idx = (block_idx + 1) % num_blocks;
+        free_ids = ~id_bitmap[block_idx];
+    }
 
-    return FILTER_ERR_OKAY;
+    /* The rule table is not full, so there must be a free ID */
+    assert(false);
+    return FILTER_ERR_FULL;
 }
 
 /**
@@ -225,276 +746,2411 @@ static fw_filter_err_t rules_free_id(fw_filter_state_t *state, uint16_t rule_id)
 }
 
 /**
- * Add a filtering rule.
+ * Hash the key of a classifier entry.
  *
- * @param state address of filter state.
- * @param src_ip source ip of traffic rule applies to.
- * @param src_port source port of traffic rule applies to.
- * @param dst_ip destination ip of traffic rule applies to.
- * @param dst_port destination port of traffic rule applies to.
- * @param src_subnet subnet bits of source ip traffic rule applies to.
- * @param dst_subnet subnet bits of destination ip traffic rule applies to.
- * @param src_port_any whether rule applies to any source port.
- * @param dst_port_any whether rule applies to any destination port.
- * @param action action to be applied to traffic matching rule.
- * @param rule_id address of rule id to be set upon successful rule creation.
+ * @param key classifier entry holding the key.
  *
- * @return error status.
+ * @return 32 bit hash of key.
  */
-static inline fw_filter_err_t fw_filter_add_rule(fw_filter_state_t *state, uint32_t src_ip, uint16_t src_port,
-                                                 uint32_t dst_ip, uint16_t dst_port, uint8_t src_subnet,
-                                                 uint8_t dst_subnet, bool src_port_any, bool dst_port_any,
-                                                 fw_action_t action, uint16_t *rule_id)
+static inline uint32_t fw_classifier_hash(fw_classifier_entry_t *key)
 {
-    if (state->rule_table->size >= state->rules_capacity) {
-        return FILTER_ERR_FULL;
-    }
-
-    for (uint16_t i = 0; i < state->rule_table->size; i++) {
-        fw_rule_t *rule = (fw_rule_t *)(state->rule_table->rules + i);
+    uint32_t tuple = key->src_subnet | ((uint32_t)key->dst_subnet << 8) | ((uint32_t)key->src_port_match << 16)
+                   | ((uint32_t)key->dst_port_match << 18);
+    return fw_flow_hash(key->src_ip ^ (tuple * 0xc2b2ae35U), key->src_port, key->dst_ip, key->dst_port);
+}
 
-        /* Check that this entry won't cause clashes */
+/**
+ * Check whether two classifier entries have the same key. Entries matching
+ * ports by range may share a key while matching different ports.
+ *
+ * @param a first classifier entry.
+ * @param b second classifier entry.
+ *
+ * @return whether keys are equal.
+ */
+static inline bool fw_classifier_same_key(fw_classifier_entry_t *a, fw_classifier_entry_t *b)
+{
+    return a->src_ip == b->src_ip && a->dst_ip == b->dst_ip && a->src_port == b->src_port && a->dst_port == b->dst_port
+        && a->src_subnet == b->src_subnet && a->dst_subnet == b->dst_subnet && a->src_port_match == b->src_port_match
+        && a->dst_port_match == b->dst_port_match;
+}
 
-        /* One rule applies to any src port, one applies to a specific src port */
-        if ((src_port_any && !rule->src_port_any) || (!src_port_any && rule->src_port_any)) {
-            continue;
+/**
+ * Find a rule in a classifier hash table. Rules match if they have the same
+ * key and apply to the same ports and IP sets.
+ *
+ * @param classifier address of classifier.
+ * @param capacity capacity of classifier hash table.
+ * @param key classifier entry holding the key to search for.
+ * @param slot address to store the index of the matching entry, or of the
+ * empty entry ending the probe sequence if there is no match. Ignored if NULL.
+ *
+ * @return address of matching entry, NULL if there is none.
+ */
+static inline fw_classifier_entry_t *fw_classifier_find(fw_classifier_t *classifier, uint32_t capacity,
+                                                        fw_classifier_entry_t *key, uint32_t *slot)
+{
+    fw_classifier_entry_t *entries = classifier->entries;
+    uint32_t mask = capacity - 1;
+
+    /* The hash table always holds fewer rules than its capacity, so every
+    probe sequence ends in an empty entry */
+    uint32_t idx = fw_classifier_hash(key) & mask;
+    while (entries[idx].rule_id != DEFAULT_ACTION_RULE_ID) {
+        fw_classifier_entry_t *entry = entries + idx;
+        if (fw_classifier_same_key(entry, key) && entry->src_port_lo == key->src_port_lo
+            && entry->src_port_hi == key->src_port_hi && entry->dst_port_lo == key->dst_port_lo
+            && entry->dst_port_hi == key->dst_port_hi && entry->dst_port_set_size == key->dst_port_set_size
+            && entry->dst_port_set_hash == key->dst_port_set_hash && entry->src_ip_set == key->src_ip_set
+            && entry->dst_ip_set == key->dst_ip_set) {
+            if (slot != NULL) {
+                *slot = idx;
+            }
+            return entry;
         }
+        idx = (idx + 1) & mask;
+    }
 
-        /* One rule applies to any dst port, one applies to a specific dst port */
-        if ((dst_port_any && !rule->dst_port_any) || (!dst_port_any && rule->dst_port_any)) {
-            continue;
-        }
+    if (slot != NULL) {
+        *slot = idx;
+    }
+    return NULL;
+}
 
-        /* One rule applies to one port, one applies to another */
-        if (src_port != rule->src_port || dst_port != rule->dst_port) {
-            continue;
-        }
+/**
+ * Compare the tuple of a classifier entry with a tuple.
+ *
+ * @param key classifier entry.
+ * @param tuple tuple to compare with.
+ *
+ * @return negative if entry's tuple is more specific, 0 if tuples are equal,
+ * positive if entry's tuple is less specific.
+ */
+static inline int fw_classifier_tuple_cmp(fw_classifier_entry_t *key, fw_classifier_tuple_t *tuple)
+{
+    if (key->src_subnet != tuple->src_subnet) {
+        return key->src_subnet > tuple->src_subnet ? -1 : 1;
+    }
 
-        /* One rule applies to a larger subnet than the other */
-        if (src_subnet != rule->src_subnet || dst_subnet != rule->dst_subnet) {
-            continue;
-        }
+    if (key->dst_subnet != tuple->dst_subnet) {
+        return key->dst_subnet > tuple->dst_subnet ? -1 : 1;
+    }
 
-        /* Rules apply to different source subnets */
-        if ((subnet_mask(src_subnet) & src_ip) != (subnet_mask(rule->src_subnet) & rule->src_ip)) {
-            continue;
-        }
+    if (key->src_port_match != tuple->src_port_match) {
+        return key->src_port_match < tuple->src_port_match ? -1 : 1;
+    }
 
-        /* Rules apply to different destination subnets */
-        if ((subnet_mask(dst_subnet) & dst_ip) != (subnet_mask(rule->dst_subnet) & rule->dst_ip)) {
-            continue;
-        }
+    if (key->dst_port_match != tuple->dst_port_match) {
+        return key->dst_port_match < tuple->dst_port_match ? -1 : 1;
+    }
 
-        /* There is a clash! */
-        if (action == rule->action) {
-            return FILTER_ERR_DUPLICATE;
+    return 0;
+}
+
+/**
+ * Get the tuple list of a classifier, stored after its hash table.
+ *
+ * @param classifier address of classifier.
+ * @param capacity capacity of classifier hash table.
+ *
+ * @return address of tuple list.
+ */
+static inline fw_classifier_tuple_t *fw_classifier_tuples(fw_classifier_t *classifier, uint32_t capacity)
+{
+    return (fw_classifier_tuple_t *)(classifier->entries + capacity);
+}
+
+/**
+ * Find the position of a classifier entry's tuple in the sorted tuple list.
+ *
+ * @param classifier address of classifier.
+ * @param capacity capacity of classifier hash table.
+ * @param key classifier entry.
+ *
+ * @return index of the entry's tuple, or the index it should be inserted at if
+ * it does not exist.
+ */
+static inline uint16_t fw_classifier_tuple_idx(fw_classifier_t *classifier, uint32_t capacity,
+                                               fw_classifier_entry_t *key)
+{
+    fw_classifier_tuple_t *tuples = fw_classifier_tuples(classifier, capacity);
+    uint16_t lo = 0;
+    uint16_t hi = classifier->tuple_count;
+    while (lo < hi) {
+        uint16_t mid = lo + (hi - lo) / 2;
+        if (fw_classifier_tuple_cmp(key, tuples + mid) > 0) {
+            lo = mid + 1;
         } else {
-            return FILTER_ERR_CLASH;
+            hi = mid;
         }
     }
 
-    fw_rule_t *empty_slot = state->rule_table->rules + state->rule_table->size;
-    empty_slot->src_ip = subnet_mask(src_subnet) & src_ip;
-    empty_slot->src_port = src_port;
-    empty_slot->dst_ip = subnet_mask(dst_subnet) & dst_ip;
-    empty_slot->dst_port = dst_port;
-    empty_slot->src_subnet = src_subnet;
-    empty_slot->dst_subnet = dst_subnet;
-    empty_slot->src_port_any = src_port_any;
-    empty_slot->dst_port_any = dst_port_any;
-    empty_slot->action = action;
+    return lo;
+}
 
-    assert(rules_reserve_id(state, rule_id) == FILTER_ERR_OKAY);
+/**
+ * Get the address mask of a tuple subnet.
+ *
+ * @param subnet subnet of tuple, or FW_IP_SET_SUBNET.
+ *
+ * @return address mask in network byte order.
+ */
+static inline uint32_t fw_classifier_mask(uint8_t subnet)
+{
+    return subnet == FW_IP_SET_SUBNET ? 0 : subnet_mask(subnet);
+}
 
-    empty_slot->rule_id = *rule_id;
-    state->rule_table->size++;
-    return FILTER_ERR_OKAY;
+/**
+ * Insert a rule into a classifier, creating its tuple if required.
+ *
+ * @param classifier address of classifier.
+ * @param capacity capacity of classifier hash table.
+ * @param key classifier entry of rule.
+ * @param slot index of the empty entry returned by fw_classifier_find.
+ */
+static inline void fw_classifier_insert(fw_classifier_t *classifier, uint32_t capacity, fw_classifier_entry_t *key,
+                                        uint32_t slot)
+{
+    fw_classifier_tuple_t *tuples = fw_classifier_tuples(classifier, capacity);
+    classifier->entries[slot] = *key;
+
+    uint16_t idx = fw_classifier_tuple_idx(classifier, capacity, key);
+    if (idx == classifier->tuple_count || fw_classifier_tuple_cmp(key, tuples + idx) != 0) {
+        assert(classifier->tuple_count < capacity);
+        memmove(tuples + idx + 1, tuples + idx, (classifier->tuple_count - idx) * sizeof(fw_classifier_tuple_t));
+
+        fw_classifier_tuple_t *tuple = tuples + idx;
+        tuple->src_mask = fw_classifier_mask(key->src_subnet);
+        tuple->dst_mask = fw_classifier_mask(key->dst_subnet);
+        tuple->src_subnet = key->src_subnet;
+        tuple->dst_subnet = key->dst_subnet;
+        tuple->src_port_match = key->src_port_match;
+        tuple->dst_port_match = key->dst_port_match;
+        tuple->rule_count = 0;
+        classifier->tuple_count++;
+    }
+
+    tuples[idx].rule_count++;
 }
 
 /**
- * Initialise filter state.
+ * Remove a rule from a classifier, removing its tuple if it becomes empty.
  *
- * @param state address of filter state.
- * @param rules address of rules table.
- * @param rule_id_bitmap address of rule id allocation bitmap.
- * @param rules_capacity capacity of rules table.
- * @param internal_instances address of internal instances.
- * @param external_instances address of external instances.
- * @param instances_capacity capacity of instance tables.
- * @param initial_rules array of initial rules to insert.
- * @param num_rules number of initial rules.
- * @param num_external_instances number of external instances.
+ * @param classifier address of classifier.
+ * @param capacity capacity of classifier hash table.
+ * @param key classifier entry of rule.
  */
-static inline void fw_filter_state_init(fw_filter_state_t *state, void *rules, void *rule_id_bitmap,
-                                        uint16_t rules_capacity, void *internal_instances,
-                                        region_resource_t *external_instances, uint16_t instances_capacity,
-                                        fw_rule_t *initial_rules, uint8_t num_rules, uint8_t num_external_instances)
+static inline void fw_classifier_remove(fw_classifier_t *classifier, uint32_t capacity, fw_classifier_entry_t *key)
 {
-    state->rule_table = (fw_rule_table_t *)rules;
-    state->rules_capacity = rules_capacity;
-    state->rule_id_bitmap = (fw_rule_id_bitmap_t *)rule_id_bitmap;
-    state->instances_capacity = instances_capacity;
-    state->internal_instances_table = (fw_instances_table_t *)internal_instances;
-    state->num_interfaces = num_external_instances;
-    /* Populate the array of possible external instance tables */
-    for (size_t i = 0; i < num_external_instances; i++) {
-        state->external_instances_table[i] = (fw_instances_table_t *)external_instances[i].vaddr;
+    uint32_t mask = capacity - 1;
+    uint32_t hole;
+
+    fw_classifier_entry_t *entry = fw_classifier_find(classifier, capacity, key, &hole);
+    assert(entry != NULL);
+
+    /* Shift back the remainder of the probe sequence so that no rule is
+    stored past an empty entry. An entry may only fill the hole if the hole
+    lies between its home slot and its current slot */
+    for (uint32_t idx = (hole + 1) & mask; classifier->entries[idx].rule_id != DEFAULT_ACTION_RULE_ID;
+         idx = (idx + 1) & mask) {
+        uint32_t home = fw_classifier_hash(classifier->entries + idx) & mask;
+        if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+            classifier->entries[hole] = classifier->entries[idx];
+            hole = idx;
+        }
     }
+    classifier->entries[hole].rule_id = DEFAULT_ACTION_RULE_ID;
 
-    /* Allocate the default action rule ID for the default action */
-    uint16_t default_block_idx = DEFAULT_ACTION_RULE_ID / RULE_ID_BITMAP_BLK_SIZE;
-    uint64_t default_mask = 1ULL << (DEFAULT_ACTION_RULE_ID % RULE_ID_BITMAP_BLK_SIZE);
+    fw_classifier_tuple_t *tuples = fw_classifier_tuples(classifier, capacity);
+    uint16_t idx = fw_classifier_tuple_idx(classifier, capacity, key);
+    assert(idx < classifier->tuple_count && fw_classifier_tuple_cmp(key, tuples + idx) == 0);
 
-    /* No other rules should exist at this point */
-    assert((state->rule_id_bitmap->id_bitmap[default_block_idx] & default_mask) == 0);
-    assert(state->rule_table->size == 0);
+    tuples[idx].rule_count--;
+    if (tuples[idx].rule_count == 0) {
+        generic_array_shift(tuples, sizeof(fw_classifier_tuple_t), classifier->tuple_count, idx);
+        classifier->tuple_count--;
+    }
+}
 
-    /* First rule must be the default rule */
-    assert(num_rules >= 1);
-    assert(initial_rules[DEFAULT_ACTION_IDX].src_subnet == 0 && initial_rules[DEFAULT_ACTION_IDX].src_port_any);
-    assert(initial_rules[DEFAULT_ACTION_IDX].dst_subnet == 0 && initial_rules[DEFAULT_ACTION_IDX].dst_port_any);
-    assert(initial_rules[DEFAULT_ACTION_IDX].rule_id == DEFAULT_ACTION_RULE_ID);
+/**
+ * Check whether a port match is by range.
+ *
+ * @param match how a rule matches a port, one of FW_PORT_MATCH_*.
+ *
+ * @return whether ports are matched by range.
+ */
+static inline bool fw_port_match_is_range(uint8_t match)
+{
+    return match >= FW_PORT_MATCH_RANGE_16 && match <= FW_PORT_MATCH_RANGE;
+}
 
-    state->rule_id_bitmap->id_bitmap[default_block_idx] |= default_mask;
-    state->rule_id_bitmap->last_allocated_rule_id = DEFAULT_ACTION_RULE_ID;
+/**
+ * Get the port a tuple is keyed on for a port of traffic.
+ *
+ * @param match how tuple matches port, one of FW_PORT_MATCH_*.
+ * @param port port of traffic in network byte order.
+ * @param port_host port of traffic in host byte order.
+ *
+ * @return the port itself for an exact match, the index of the port's block
+ * for a range match, and 0 for any port.
+ */
+static inline uint16_t fw_classifier_key_port(uint8_t match, uint16_t port, uint16_t port_host)
+{
+    if (match == FW_PORT_MATCH_EXACT) {
+        return port;
+    } else if (match == FW_PORT_MATCH_ANY) {
+        return 0;
+    }
 
-    state->rule_table->rules[DEFAULT_ACTION_IDX] = initial_rules[DEFAULT_ACTION_IDX];
-    state->rule_table->size++;
+    /* Ranges not held by a block of 4096 ports are keyed on 0 */
+    return (uint32_t)port_host >> (match == FW_PORT_MATCH_RANGE ? 16 : 4 * match);
+}
 
-    for (uint8_t r = 1; r < num_rules; r++) {
-        fw_filter_err_t err = fw_filter_add_rule(state, initial_rules[r].src_ip, initial_rules[r].src_port,
-                                                 initial_rules[r].dst_ip, initial_rules[r].dst_port,
-                                                 initial_rules[r].src_subnet, initial_rules[r].dst_subnet,
-                                                 initial_rules[r].src_port_any, initial_rules[r].dst_port_any,
-                                                 initial_rules[r].action, &initial_rules[r].rule_id);
-        assert(err == FILTER_ERR_OKAY);
+/**
+ * Classify a range of ports by the smallest aligned block holding it.
+ *
+ * @param lo lowest port of range in host byte order.
+ * @param hi highest port of range in host byte order, greater than lo.
+ * @param match address to store how the range is matched.
+ * @param key_port address to store port the range is keyed on.
+ */
+static inline void fw_classifier_range_key(uint16_t lo, uint16_t hi, uint8_t *match, uint16_t *key_port)
+{
+    *match = FW_PORT_MATCH_RANGE_16;
+    while (*match < FW_PORT_MATCH_RANGE && (lo >> (4 * *match)) != (hi >> (4 * *match))) {
+        (*match)++;
     }
+    *key_port = fw_classifier_key_port(*match, htons(lo), lo);
 }
 
 /**
- * Create an instance. To be used after traffic matches with a connect rule,
- * allowing neighbour filter to permit return traffic.
+ * Classify how a rule matches on one of its ports.
  *
- * @param state address of filter state.
- * @param src_ip source ip of instance traffic.
- * @param src_port source port of instance traffic.
- * @param dst_ip destination ip of instance traffic.
- * @param dst_port destination port of instance traffic.
- * @param default_action whether connect rule was matched via filter's default action.
- * @param rule_id id of connect rule.
+ * @param port_any whether rule applies to any port.
+ * @param port first port of rule in network byte order.
+ * @param port_max last port of rule in network byte order, 0 if rule applies to
+ * a single port.
+ * @param match address to store how rule matches port.
+ * @param key_port address to store port the rule is keyed on.
+ * @param lo address to store lowest port matched in host byte order.
+ * @param hi address to store highest port matched in host byte order.
  *
- * @return error status.
+ * @return FILTER_ERR_OKAY, or FILTER_ERR_INVALID_PORTS if port range is empty.
  */
-static inline fw_filter_err_t fw_filter_add_instance(fw_filter_state_t *state, uint32_t src_ip, uint16_t src_port,
-                                                     uint32_t dst_ip, uint16_t dst_port, uint16_t rule_id)
+static inline fw_filter_err_t fw_classifier_port_key(bool port_any, uint16_t port, uint16_t port_max, uint8_t *match,
+                                                     uint16_t *key_port, uint16_t *lo, uint16_t *hi)
 {
-    if (state->internal_instances_table->size >= state->instances_capacity) {
-        return FILTER_ERR_FULL;
+    *lo = port_any ? 0 : ntohs(port);
+    *hi = port_any ? UINT16_MAX : (port_max ? ntohs(port_max) : *lo);
+    if (*hi < *lo) {
+        return FILTER_ERR_INVALID_PORTS;
     }
 
-    for (uint16_t i = 0; i < state->internal_instances_table->size; i++) {
-        fw_instance_t *instance = state->internal_instances_table->instances + i;
-
-        /* Connection has already been established */
-        if (instance->rule_id == rule_id && instance->src_ip == src_ip && instance->src_port == src_port
-            && instance->dst_ip == dst_ip && instance->dst_port == dst_port) {
-            return FILTER_ERR_DUPLICATE;
-        }
+    /* A range covering every port is the same as any port */
+    if (*lo == 0 && *hi == UINT16_MAX) {
+        *match = FW_PORT_MATCH_ANY;
+        *key_port = 0;
+    } else if (*lo == *hi) {
+        *match = FW_PORT_MATCH_EXACT;
+        *key_port = port;
+    } else {
+        fw_classifier_range_key(*lo, *hi, match, key_port);
     }
 
-    fw_instance_t *empty_slot = state->internal_instances_table->instances + state->internal_instances_table->size;
-    empty_slot->rule_id = rule_id;
-    empty_slot->src_ip = src_ip;
-    empty_slot->src_port = src_port;
-    empty_slot->dst_ip = dst_ip;
-    empty_slot->dst_port = dst_port;
-    state->internal_instances_table->size++;
-
     return FILTER_ERR_OKAY;
 }
 
 /**
- * Find the filter action to be applied for a given source and destination ip
- * and port number. First external instances are checked so that return traffic
- * may be permitted. If traffic is not return traffic from a neighbour filter's
- * connection, the most specific matching filter rule is returned.
+ * Sort and remove duplicates from a destination port set.
  *
- * @param state address of filter state.
- * @param src_ip source ip to match.
- * @param src_port source port to match.
- * @param dst_ip destination ip to match.
- * @param dst_port destination port to match.
- * @param rule_id id of matching rule. Unmodified if no match.
+ * @param set address of port set.
  *
- * @return filter action to be applied. None is returned if no match is found.
+ * @return FILTER_ERR_OKAY, or FILTER_ERR_INVALID_PORTS if the set is empty or
+ * too large.
  */
-static inline fw_action_t fw_filter_find_action(fw_filter_state_t *state, uint32_t src_ip, uint16_t src_port,
-                                                uint32_t dst_ip, uint16_t dst_port, uint16_t *rule_id)
+static inline fw_filter_err_t fw_port_set_normalise(fw_port_set_t *set)
 {
-    /* First check external instances */
-    for (size_t iface = 0; iface < state->num_interfaces; iface++) {
-        for (uint16_t i = 0; i < state->external_instances_table[iface]->size; i++) {
-            fw_instance_t *instance = state->external_instances_table[iface]->instances + i;
-
-            if (instance->src_port != dst_port || instance->dst_port != src_port) {
-                continue;
-            }
-
-            if (instance->src_ip != dst_ip || instance->dst_ip != src_ip) {
-                continue;
-            }
-
-            *rule_id = instance->rule_id;
-            return FILTER_ACT_ESTABLISHED;
-        }
+    if (set->size == 0 || set->size > FW_RULE_MAX_PORT_SET) {
+        return FILTER_ERR_INVALID_PORTS;
     }
 
-    /* Check rules for best match otherwise we match with the default rule */
-    fw_rule_t *match = &state->rule_table->rules[DEFAULT_ACTION_IDX];
-    for (uint16_t i = DEFAULT_ACTION_IDX + 1; i < state->rule_table->size; i++) {
-        fw_rule_t *rule = state->rule_table->rules + i;
-
-        /* Check port numbers first */
-        if ((!rule->src_port_any && rule->src_port != src_port)
-            || (!rule->dst_port_any && rule->dst_port != dst_port)) {
-            continue;
+    uint16_t *ports = set->ports;
+    uint8_t size = 0;
+    for (uint8_t i = 0; i < set->size; i++) {
+        uint16_t port = ports[i];
+        uint8_t j = size;
+        while (j > 0 && ntohs(ports[j - 1]) > ntohs(port)) {
+            j--;
         }
 
-        /* Match on src addr first */
-        if ((subnet_mask(rule->src_subnet) & src_ip) != (subnet_mask(rule->src_subnet) & rule->src_ip)) {
+        if (j > 0 && ports[j - 1] == port) {
             continue;
         }
 
-        /* Match on src addr first */
-        if ((subnet_mask(rule->dst_subnet) & dst_ip) != (subnet_mask(rule->dst_subnet) & rule->dst_ip)) {
-            continue;
-        }
+        memmove(ports + j + 1, ports + j, (size - j) * sizeof(uint16_t));
+        ports[j] = port;
+        size++;
+    }
+    set->size = size;
 
-        /* This if the first match we've found */
-        if (match == NULL) {
-            match = rule;
-        }
+    return FILTER_ERR_OKAY;
+}
+
+/**
+ * Check whether a port is in a destination port set.
+ *
+ * @param set address of port set.
+ * @param port port in network byte order.
+ *
+ * @return whether port is in the set.
+ */
+static inline bool fw_port_set_contains(fw_port_set_t *set, uint16_t port)
+{
+    for (uint8_t i = 0; i < set->size; i++) {
+        if (set->ports[i] == port) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Get the destination port set of a rule.
+ *
+ * @param table address of rule table holding the rule's port set.
+ * @param rule address of rule.
+ *
+ * @return address of port set, or NULL if rule has no valid port set.
+ */
+static inline fw_port_set_t *fw_rule_port_set(fw_rule_table_t *table, fw_rule_t *rule)
+{
+    if (rule->dst_port_set == 0 || rule->dst_port_set > FW_RULE_MAX_PORT_SETS) {
+        return NULL;
+    }
+    return table->port_sets + rule->dst_port_set - 1;
+}
+
+/**
+ * Find an unused destination port set of a rule table.
+ *
+ * @param table address of rule table.
+ *
+ * @return ID of unused port set, 0 if all are in use.
+ */
+static inline uint8_t fw_rule_table_free_port_set(fw_rule_table_t *table)
+{
+    for (uint8_t i = 0; i < FW_RULE_MAX_PORT_SETS; i++) {
+        if (table->port_sets[i].size == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Create the classifier entry of a rule. A port set holding a single port is
+ * classified as that port.
+ *
+ * @param rule address of rule.
+ * @param set address of rule's normalised destination port set, NULL if rule
+ * has no port set.
+ * @param key address of classifier entry to fill.
+ *
+ * @return FILTER_ERR_OKAY, FILTER_ERR_INVALID_PORTS if the rule's ports are
+ * invalid, FILTER_ERR_INVALID_IP_SET if the rule's IP sets are invalid, or
+ * FILTER_ERR_INVALID_RATE_LIMIT if the rule is a rate limit without rates.
+ */
+static inline fw_filter_err_t fw_classifier_rule_key(fw_rule_t *rule, fw_port_set_t *set,
+                                                     fw_classifier_entry_t *key)
+{
+    fw_filter_err_t err = fw_classifier_port_key(rule->src_port_any, rule->src_port, rule->src_port_max,
+                                                 &key->src_port_match, &key->src_port, &key->src_port_lo,
+                                                 &key->src_port_hi);
+    if (err != FILTER_ERR_OKAY) {
+        return err;
+    }
+
+    if ((rule->dst_port_set != 0) != (set != NULL)) {
+        return FILTER_ERR_INVALID_PORTS;
+    }
+
+    key->dst_port_set = 0;
+    key->dst_port_set_size = 0;
+    key->dst_port_set_hash = 0;
+    if (set != NULL) {
+        if (set->size == 0 || set->size > FW_RULE_MAX_PORT_SET || rule->dst_port_any) {
+            return FILTER_ERR_INVALID_PORTS;
+        }
+
+        key->dst_port_lo = ntohs(set->ports[0]);
+        key->dst_port_hi = ntohs(set->ports[set->size - 1]);
+        if (set->size == 1) {
+            key->dst_port_match = FW_PORT_MATCH_EXACT;
+            key->dst_port = set->ports[0];
+        } else {
+            /* Sets are searched as a range spanning the set, and told apart
+            from other sets sharing the range by their hash */
+            fw_classifier_range_key(key->dst_port_lo, key->dst_port_hi, &key->dst_port_match, &key->dst_port);
+            key->dst_port_set = rule->dst_port_set;
+            key->dst_port_set_size = set->size;
+            for (uint8_t i = 0; i < set->size; i++) {
+                key->dst_port_set_hash = fw_flow_hash(key->dst_port_set_hash, 0, 0, set->ports[i]);
+            }
+        }
+    } else {
+        err = fw_classifier_port_key(rule->dst_port_any, rule->dst_port, rule->dst_port_max, &key->dst_port_match,
+                                     &key->dst_port, &key->dst_port_lo, &key->dst_port_hi);
+        if (err != FILTER_ERR_OKAY) {
+            return err;
+        }
+    }
+
+    if (rule->src_ip_set > FW_MAX_IP_SETS || rule->dst_ip_set > FW_MAX_IP_SETS) {
+        return FILTER_ERR_INVALID_IP_SET;
+    }
+
+    if (rule->action == FILTER_ACT_RATE_LIMIT && rule->rate_pps == 0 && rule->rate_bps == 0) {
+        return FILTER_ERR_INVALID_RATE_LIMIT;
+    }
+
+    /* The IP and subnet of a side matching an IP set are ignored */
+    key->src_subnet = rule->src_ip_set ? FW_IP_SET_SUBNET : rule->src_subnet;
+    key->dst_subnet = rule->dst_ip_set ? FW_IP_SET_SUBNET : rule->dst_subnet;
+    key->src_ip = fw_classifier_mask(key->src_subnet) & rule->src_ip;
+    key->dst_ip = fw_classifier_mask(key->dst_subnet) & rule->dst_ip;
+    key->src_ip_set = rule->src_ip_set;
+    key->dst_ip_set = rule->dst_ip_set;
+    key->rule_id = rule->rule_id;
+    key->action = rule->action;
+    key->order = 0;
+    return FILTER_ERR_OKAY;
+}
+
+/**
+ * Check whether a classifier entry matches any port. Rules matching any port
+ * on both sides with no subnet clash with the default rule.
+ *
+ * @param key classifier entry.
+ *
+ * @return whether entry has the same match as the default rule.
+ */
+static inline bool fw_classifier_is_default(fw_classifier_entry_t *key)
+{
+    return key->src_subnet == 0 && key->dst_subnet == 0 && key->src_port_match == FW_PORT_MATCH_ANY
+        && key->dst_port_match == FW_PORT_MATCH_ANY;
+}
+
+/**
+ * Get the number of ports matched on one side of a classifier entry.
+ *
+ * @param lo lowest port matched.
+ * @param hi highest port matched.
+ * @param set_size number of ports in port set, 0 if there is none.
+ *
+ * @return number of ports matched.
+ */
+static inline uint32_t fw_classifier_port_width(uint16_t lo, uint16_t hi, uint8_t set_size)
+{
+    return set_size ? set_size : (uint32_t)hi - lo + 1;
+}
+
+/**
+ * Check whether a matching classifier entry takes precedence over another
+ * matching entry of the same subnets. Narrower source ports take precedence,
+ * then narrower destination ports, then the earlier added rule. Rule IDs are
+ * allocated circularly, so do not reflect the order rules were added in.
+ *
+ * @param a classifier entry.
+ * @param b classifier entry to compare with.
+ *
+ * @return whether a takes precedence over b.
+ */
+static inline bool fw_classifier_precedes(fw_classifier_entry_t *a, fw_classifier_entry_t *b)
+{
+    uint32_t a_width = fw_classifier_port_width(a->src_port_lo, a->src_port_hi, 0);
+    uint32_t b_width = fw_classifier_port_width(b->src_port_lo, b->src_port_hi, 0);
+    if (a_width != b_width) {
+        return a_width < b_width;
+    }
+
+    a_width = fw_classifier_port_width(a->dst_port_lo, a->dst_port_hi, a->dst_port_set_size);
+    b_width = fw_classifier_port_width(b->dst_port_lo, b->dst_port_hi, b->dst_port_set_size);
+    if (a_width != b_width) {
+        return a_width < b_width;
+    }
+
+    return a->order < b->order;
+}
+
+/**
+ * Check whether a tuple following the tuple of a match may hold a rule taking
+ * precedence over the match. Within the same subnets, tuples are sorted by
+ * their port match classes rather than port widths, so a later tuple may hold
+ * narrower ports if both it and the match use a range on the side that decides
+ * precedence.
+ *
+ * @param tuple tuple following the match's tuple.
+ * @param match classifier entry of match.
+ *
+ * @return whether tuple must be searched.
+ */
+static inline bool fw_classifier_may_precede(fw_classifier_tuple_t *tuple, fw_classifier_entry_t *match)
+{
+    if (tuple->src_subnet != match->src_subnet || tuple->dst_subnet != match->dst_subnet) {
+        return false;
+    }
+
+    if (fw_port_match_is_range(tuple->src_port_match) && fw_port_match_is_range(match->src_port_match)) {
+        return true;
+    }
+
+    return tuple->src_port_match == match->src_port_match && fw_port_match_is_range(tuple->dst_port_match)
+        && fw_port_match_is_range(match->dst_port_match);
+}
+
+/**
+ * Find the longest hard drop prefix matching a source ip, which is the first
+ * as prefixes are sorted by descending length. Called by the Rx virtualiser
+ * while the filter may be rewriting the summary, in which case no prefix is
+ * matched.
+ *
+ * @param hard_drop address of hard drop summary.
+ * @param src_ip source ip of traffic.
+ *
+ * @return index of matching prefix, or -1 if traffic must be forwarded to the
+ * filter.
+ */
+static inline int fw_hard_drop_match(fw_hard_drop_t *hard_drop, uint32_t src_ip)
+{
+    uint32_t seq = hard_drop->seq;
+    THREAD_MEMORY_ACQUIRE();
+    if (seq & 1) {
+        return -1;
+    }
+
+    int match = -1;
+    uint16_t size = hard_drop->size;
+    for (uint16_t i = 0; i < size && i < FW_HARD_DROP_MAX_PREFIXES; i++) {
+        if ((src_ip & hard_drop->prefixes[i].mask) == hard_drop->prefixes[i].ip) {
+            match = i;
+            break;
+        }
+    }
+
+    THREAD_MEMORY_ACQUIRE();
+    return (hard_drop->seq == seq) ? match : -1;
+}
+
+/**
+ * Count a packet dropped by the Rx virtualiser against its hard drop prefix.
+ *
+ * @param hard_drop address of hard drop summary.
+ * @param prefix index of matching prefix.
+ * @param len length of packet in bytes.
+ */
+static inline void fw_hard_drop_count(fw_hard_drop_t *hard_drop, int prefix, uint16_t len)
+{
+    hard_drop->counters[prefix].packets++;
+    hard_drop->counters[prefix].bytes += len;
+}
+
+/**
+ * Check whether a rule drops all traffic from its source prefix. Rules matching
+ * a source IP set are not summarised, as a set may hold far more prefixes than
+ * the summary, so their traffic is always left to the filter.
+ *
+ * @param rule address of rule.
+ *
+ * @return whether rule drops all traffic from its source prefix.
+ */
+static inline bool fw_rule_drops_source(fw_rule_t *rule)
+{
+    return (fw_action_t)rule->action == FILTER_ACT_DROP && rule->src_ip_set == 0 && rule->dst_ip_set == 0
+        && rule->dst_subnet == 0 && rule->src_port_any && rule->dst_port_any && rule->dst_port_set == 0;
+}
+
+/**
+ * Check whether a rule may take precedence over a rule dropping all traffic
+ * from a source prefix, for some of the prefix's traffic. Rules matching an IP
+ * set are the most specific and may match any address, so always may.
+ *
+ * @param rule address of rule.
+ * @param ip masked source ip of prefix.
+ * @param subnet source subnet of prefix.
+ *
+ * @return whether rule may take precedence with an action other than drop.
+ */
+static inline bool fw_rule_overrides_source(fw_rule_t *rule, uint32_t ip, uint8_t subnet)
+{
+    if ((fw_action_t)rule->action == FILTER_ACT_DROP) {
+        return false;
+    }
+
+    if (rule->src_ip_set != 0) {
+        return true;
+    }
+
+    return rule->src_subnet >= subnet && (rule->src_ip & subnet_mask(subnet)) == ip;
+}
+
+/**
+ * Add the traffic dropped by the Rx virtualiser to the counters of the rules
+ * that dropped it. Packets dropped while the summary is being republished may
+ * be counted against the rule of the new prefix.
+ *
+ * @param state address of filter state.
+ */
+static inline void fw_filter_count_hard_drops(fw_filter_state_t *state)
+{
+    fw_hard_drop_t *hard_drop = state->hard_drop;
+    if (hard_drop == NULL) {
+        return;
+    }
+
+    for (uint16_t i = 0; i < hard_drop->size; i++) {
+        uint64_t packets = hard_drop->counters[i].packets;
+        uint64_t bytes = hard_drop->counters[i].bytes;
+        fw_rule_stats_t *counted = state->hard_drop_counted + i;
+        fw_rule_stats_t *stats = state->stats->rules + hard_drop->prefixes[i].rule_id;
+
+        stats->packets += packets - counted->packets;
+        stats->bytes += bytes - counted->bytes;
+        counted->packets = packets;
+        counted->bytes = bytes;
+    }
+}
+
+/**
+ * Check whether any of the filter's rules may take precedence over a rule
+ * dropping all traffic from a source prefix, for some of the prefix's traffic.
+ *
+ * @param state address of filter state.
+ * @param ip masked source ip of prefix.
+ * @param subnet source subnet of prefix.
+ *
+ * @return whether a rule may take precedence with an action other than drop.
+ */
+static inline bool fw_filter_source_overridden(fw_filter_state_t *state, uint32_t ip, uint8_t subnet)
+{
+    fw_rule_t *rules = state->rule_table->rules;
+    for (uint16_t i = 0; i < state->rule_table->size; i++) {
+        if (fw_rule_overrides_source(rules + i, ip, subnet)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Insert a prefix into a hard drop summary after the prefixes at least as long.
+ * If the summary is full, the shortest prefix is left out.
+ *
+ * @param hard_drop address of hard drop summary.
+ * @param ip masked source ip of prefix.
+ * @param mask source subnet mask of prefix.
+ * @param rule_id id of the rule dropping the prefix's traffic.
+ *
+ * @return whether a prefix was left out.
+ */
+static inline bool fw_hard_drop_insert(fw_hard_drop_t *hard_drop, uint32_t ip, uint32_t mask, uint16_t rule_id)
+{
+    /* Longer masks are greater in host byte order */
+    uint16_t lo = 0;
+    uint16_t hi = hard_drop->size;
+    while (lo < hi) {
+        uint16_t mid = (lo + hi) / 2;
+        if (ntohl(hard_drop->prefixes[mid].mask) >= ntohl(mask)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    bool full = hard_drop->size == FW_HARD_DROP_MAX_PREFIXES;
+    if (full && lo == hard_drop->size) {
+        return true;
+    }
+
+    uint16_t last = full ? hard_drop->size - 1 : hard_drop->size++;
+    memmove(hard_drop->prefixes + lo + 1, hard_drop->prefixes + lo, (last - lo) * sizeof(fw_hard_drop_prefix_t));
+    hard_drop->prefixes[lo].ip = ip;
+    hard_drop->prefixes[lo].mask = mask;
+    hard_drop->prefixes[lo].rule_id = rule_id;
+    return full;
+}
+
+/**
+ * Remove a prefix from a hard drop summary.
+ *
+ * @param hard_drop address of hard drop summary.
+ * @param idx index of prefix.
+ */
+static inline void fw_hard_drop_remove(fw_hard_drop_t *hard_drop, uint16_t idx)
+{
+    memmove(hard_drop->prefixes + idx, hard_drop->prefixes + idx + 1,
+            (hard_drop->size - idx - 1) * sizeof(fw_hard_drop_prefix_t));
+    hard_drop->size--;
+}
+
+/**
+ * Start rewriting the hard drop summary. The traffic dropped so far is counted
+ * first, as rewriting moves prefixes between counters.
+ *
+ * @param state address of filter state.
+ */
+static inline void fw_filter_hard_drop_write_begin(fw_filter_state_t *state)
+{
+    fw_filter_count_hard_drops(state);
+    state->hard_drop->seq++;
+    THREAD_MEMORY_RELEASE();
+}
+
+/**
+ * Finish rewriting the hard drop summary.
+ *
+ * @param state address of filter state.
+ */
+static inline void fw_filter_hard_drop_write_end(fw_filter_state_t *state)
+{
+    fw_hard_drop_t *hard_drop = state->hard_drop;
+
+    /* Counters are indexed by prefix, so restart counting from their values */
+    for (uint16_t i = 0; i < hard_drop->size; i++) {
+        state->hard_drop_counted[i].packets = hard_drop->counters[i].packets;
+        state->hard_drop_counted[i].bytes = hard_drop->counters[i].bytes;
+    }
+
+    THREAD_MEMORY_RELEASE();
+    hard_drop->seq++;
+}
+
+/**
+ * Republish the hard drop summary from the filter's rules. A source prefix is
+ * published if a rule drops all of its traffic, and no rule taking precedence
+ * for any of its traffic has an action other than drop. Prefixes are kept
+ * sorted by descending length, and if there are more than
+ * FW_HARD_DROP_MAX_PREFIXES the shortest are left to the filter. Searches the
+ * rules once for each rule, so is only used when the rule set is replaced.
+ *
+ * @param state address of filter state.
+ */
+static inline void fw_filter_publish_hard_drops(fw_filter_state_t *state)
+{
+    fw_hard_drop_t *hard_drop = state->hard_drop;
+    if (hard_drop == NULL) {
+        return;
+    }
+
+    fw_filter_hard_drop_write_begin(state);
+
+    fw_rule_t *rules = state->rule_table->rules;
+    bool partial = false;
+    hard_drop->size = 0;
+    for (uint16_t i = 0; i < state->rule_table->size; i++) {
+        if (!fw_rule_drops_source(rules + i)) {
+            continue;
+        }
+
+        uint32_t mask = subnet_mask(rules[i].src_subnet);
+        uint32_t ip = rules[i].src_ip & mask;
+        if (!fw_filter_source_overridden(state, ip, rules[i].src_subnet)) {
+            partial |= fw_hard_drop_insert(hard_drop, ip, mask, rules[i].rule_id);
+        }
+    }
+
+    fw_filter_hard_drop_write_end(state);
+    state->hard_drop_partial = partial;
+    state->hard_drop_stale = false;
+}
+
+/**
+ * Update the hard drop summary for a rule that has been added. A rule dropping
+ * all traffic from its source prefix is published unless another rule takes
+ * precedence, while other rules withdraw the prefixes they take precedence
+ * over for some traffic.
+ *
+ * @param state address of filter state.
+ * @param rule address of added rule.
+ */
+static inline void fw_filter_hard_drop_rule_added(fw_filter_state_t *state, fw_rule_t *rule)
+{
+    fw_hard_drop_t *hard_drop = state->hard_drop;
+    if (hard_drop == NULL) {
+        return;
+    }
+
+    if (fw_rule_drops_source(rule)) {
+        uint32_t mask = subnet_mask(rule->src_subnet);
+        uint32_t ip = rule->src_ip & mask;
+        if (!fw_filter_source_overridden(state, ip, rule->src_subnet)) {
+            fw_filter_hard_drop_write_begin(state);
+            state->hard_drop_partial |= fw_hard_drop_insert(hard_drop, ip, mask, rule->rule_id);
+            fw_filter_hard_drop_write_end(state);
+        }
+        return;
+    }
+
+    bool withdraw = false;
+    for (uint16_t i = 0; i < hard_drop->size && !withdraw; i++) {
+        withdraw = fw_rule_overrides_source(rule, hard_drop->prefixes[i].ip,
+                                            __builtin_popcount(hard_drop->prefixes[i].mask));
+    }
+
+    if (!withdraw) {
+        return;
+    }
+
+    fw_filter_hard_drop_write_begin(state);
+    for (uint16_t i = 0; i < hard_drop->size;) {
+        if (fw_rule_overrides_source(rule, hard_drop->prefixes[i].ip,
+                                     __builtin_popcount(hard_drop->prefixes[i].mask))) {
+            fw_hard_drop_remove(hard_drop, i);
+        } else {
+            i++;
+        }
+    }
+    fw_filter_hard_drop_write_end(state);
+
+    /* A prefix left out for lack of room may now fit */
+    state->hard_drop_stale |= state->hard_drop_partial;
+}
+
+/**
+ * Update the hard drop summary for a rule that has been removed from the rule
+ * table. A rule's published prefix is withdrawn. Prefixes that the removal may
+ * allow to be published are left to fw_filter_republish_hard_drops, as finding
+ * them searches the rules once for each rule.
+ *
+ * @param state address of filter state.
+ * @param rule copy of removed rule.
+ */
+static inline void fw_filter_hard_drop_rule_removed(fw_filter_state_t *state, fw_rule_t *rule)
+{
+    fw_hard_drop_t *hard_drop = state->hard_drop;
+    if (hard_drop == NULL) {
+        return;
+    }
+
+    if (fw_rule_drops_source(rule)) {
+        for (uint16_t i = 0; i < hard_drop->size; i++) {
+            if (hard_drop->prefixes[i].rule_id == rule->rule_id) {
+                fw_filter_hard_drop_write_begin(state);
+                fw_hard_drop_remove(hard_drop, i);
+                fw_filter_hard_drop_write_end(state);
+
+                /* A prefix left out for lack of room may now fit */
+                state->hard_drop_stale |= state->hard_drop_partial;
+                break;
+            }
+        }
+        return;
+    }
+
+    /* Rules the removed rule took precedence over may now be published */
+    fw_rule_t *rules = state->rule_table->rules;
+    for (uint16_t i = 0; i < state->rule_table->size && !state->hard_drop_stale; i++) {
+        state->hard_drop_stale = fw_rule_drops_source(rules + i)
+                              && fw_rule_overrides_source(rule, rules[i].src_ip & subnet_mask(rules[i].src_subnet),
+                                                          rules[i].src_subnet);
+    }
+}
+
+/**
+ * Republish the hard drop summary if rule removals may have allowed more
+ * prefixes to be published. Called periodically, so that any number of rule
+ * removals cost at most one republish.
+ *
+ * @param state address of filter state.
+ */
+static inline void fw_filter_republish_hard_drops(fw_filter_state_t *state)
+{
+    if (state->hard_drop_stale) {
+        fw_filter_publish_hard_drops(state);
+    }
+}
+
+/**
+ * Start a new rule generation after the filter's rule set is replaced,
+ * invalidating cached verdicts and republishing the hard drop summary. Single
+ * rule changes update the summary incrementally instead.
+ *
+ * @param state address of filter state.
+ */
+static inline void fw_filter_rules_changed(fw_filter_state_t *state)
+{
+    state->rule_generation++;
+    fw_filter_publish_hard_drops(state);
+}
+
+/**
+ * Add a filtering rule.
+ *
+ * @param state address of filter state.
+ * @param rule address of rule to add.
+ * @param dst_port_set address of rule's destination port set, NULL if rule has
+ * no port set. The set is copied into the rule table.
+ * @param rule_id address of rule id to be set upon successful rule creation.
+ *
+ * @return error status.
+ */
+static inline fw_filter_err_t fw_filter_add_rule(fw_filter_state_t *state, fw_rule_t *rule,
+                                                 fw_port_set_t *dst_port_set, uint16_t *rule_id)
+{
+    if (state->rule_table->size >= state->rules_capacity) {
+        return FILTER_ERR_FULL;
+    }
+
+    /* The port set is normalised before allocating it a slot in the rule
+    table, which is only claimed once the rule is added */
+    fw_rule_t new_rule = *rule;
+    fw_port_set_t set;
+    new_rule.dst_port_set = 0;
+    if (dst_port_set != NULL) {
+        set = *dst_port_set;
+        fw_filter_err_t err = fw_port_set_normalise(&set);
+        if (err != FILTER_ERR_OKAY) {
+            return err;
+        }
+
+        new_rule.dst_port_set = fw_rule_table_free_port_set(state->rule_table);
+        if (new_rule.dst_port_set == 0) {
+            return FILTER_ERR_FULL;
+        }
+    }
+
+    /* Rules are keyed on their block unless they match an exact port, so only
+    the ports that are matched on can cause clashes */
+    fw_classifier_entry_t key;
+    fw_filter_err_t err = fw_classifier_rule_key(&new_rule, dst_port_set ? &set : NULL, &key);
+    if (err != FILTER_ERR_OKAY) {
+        return err;
+    }
+
+    /* Check that this entry won't clash with the default rule, which is not
+    stored in the classifier */
+    uint8_t clash_action = 0;
+    uint32_t slot = 0;
+    if (fw_classifier_is_default(&key)) {
+        clash_action = state->rule_table->rules[DEFAULT_ACTION_IDX].action;
+    } else {
+        fw_classifier_entry_t *clash = fw_classifier_find(state->classifier, state->classifier_capacity, &key, &slot);
+        if (clash != NULL) {
+            clash_action = clash->action;
+        }
+    }
+
+    /* There is a clash! */
+    if (clash_action != 0) {
+        if (new_rule.action == clash_action) {
+            return FILTER_ERR_DUPLICATE;
+        } else {
+            return FILTER_ERR_CLASH;
+        }
+    }
+
+    fw_rule_t *empty_slot = state->rule_table->rules + state->rule_table->size;
+    *empty_slot = new_rule;
+    empty_slot->src_ip = key.src_ip;
+    empty_slot->dst_ip = key.dst_ip;
+    if (new_rule.dst_port_set != 0) {
+        state->rule_table->port_sets[new_rule.dst_port_set - 1] = set;
+    }
+
+    assert(rules_reserve_id(state, rule_id) == FILTER_ERR_OKAY);
+
+    empty_slot->rule_id = *rule_id;
+    state->rule_slots[*rule_id] = state->rule_table->size;
+    key.rule_id = *rule_id;
+    key.order = state->rule_order++;
+    fw_classifier_insert(state->classifier, state->classifier_capacity, &key, slot);
+
+    if ((fw_action_t)new_rule.action == FILTER_ACT_RATE_LIMIT) {
+        state->num_rate_limits++;
+    }
+
+    state->rule_table->size++;
+    state->rule_generation++;
+    fw_filter_hard_drop_rule_added(state, empty_slot);
+    return FILTER_ERR_OKAY;
+}
+
+/**
+ * Initialise filter state.
+ *
+ * @param state address of filter state.
+ * @param rules address of rules table.
+ * @param rule_id_bitmap address of rule id allocation bitmap, followed by the
+ * rule id to rule table slot index.
+ * @param rules_capacity capacity of rules table.
+ * @param classifier address of rule classifier.
+ * @param shadow_classifier address of spare rule classifier.
+ * @param classifier_capacity capacity of classifier hash table.
+ * @param verdict_cache address of verdict cache of FW_VERDICT_CACHE_SIZE entries.
+ * @param stats address of traffic counters.
+ * @param rule_state address of private rule state indexed by rule ID.
+ * @param rate_sources address of per-source rate limit buckets of
+ * FW_RATE_SOURCES entries.
+ * @param internal_instances address of internal instances.
+ * @param external_instances address of external instances.
+ * @param instances_capacity capacity of instance tables.
+ * @param instance_timeout time after which idle instances are removed in nanoseconds.
+ * @param initial_rules array of initial rules to insert. Initial rules do not
+ * have destination port sets.
+ * @param num_rules number of initial rules.
+ * @param num_external_instances number of external instances.
+ */
+static inline void fw_filter_state_init(fw_filter_state_t *state, void *rules, void *rule_id_bitmap,
+                                        uint16_t rules_capacity, void *classifier, void *shadow_classifier,
+                                        uint32_t classifier_capacity,
+                                        fw_verdict_t *verdict_cache, void *stats, void *rule_state,
+                                        fw_rate_source_t *rate_sources, void *internal_instances,
+                                        region_resource_t *external_instances, uint16_t instances_capacity,
+                                        uint64_t instance_timeout, fw_rule_t *initial_rules, uint8_t num_rules,
+                                        uint8_t num_external_instances)
+{
+    state->rule_table = (fw_rule_table_t *)rules;
+    state->rules_capacity = rules_capacity;
+    state->rule_id_bitmap = (fw_rule_id_bitmap_t *)rule_id_bitmap;
+    state->rule_slots = (uint16_t *)(state->rule_id_bitmap->id_bitmap
+                                     + (rules_capacity + RULE_ID_BITMAP_BLK_SIZE - 1) / RULE_ID_BITMAP_BLK_SIZE);
+    state->classifier = (fw_classifier_t *)classifier;
+    state->shadow_classifier = (fw_classifier_t *)shadow_classifier;
+    state->classifier_capacity = classifier_capacity;
+    state->rule_order = 0;
+    state->rule_generation = 1;
+    state->verdict_cache = verdict_cache;
+    state->stats = (fw_filter_stats_t *)stats;
+    state->rule_state = (fw_rule_state_t *)rule_state;
+    state->rate_sources = rate_sources;
+    state->num_rate_limits = 0;
+    state->instances_capacity = instances_capacity;
+    state->instance_timeout = instance_timeout;
+    state->half_open_sources = NULL;
+    state->half_open_links = NULL;
+    state->hard_drop = NULL;
+    state->hard_drop_partial = false;
+    state->hard_drop_stale = false;
+    state->half_open_timeout = instance_timeout;
+    state->fin_wait_timeout = instance_timeout;
+    state->now = 0;
+    state->internal_instances_table = (fw_instances_table_t *)internal_instances;
+    state->num_interfaces = num_external_instances;
+    /* Populate the array of possible external instance tables */
+    for (size_t i = 0; i < num_external_instances; i++) {
+        state->external_instances_table[i] = (fw_instances_table_t *)external_instances[i].vaddr;
+    }
+
+    /* Allocate the default action rule ID for the default action */
+    uint16_t default_block_idx = DEFAULT_ACTION_RULE_ID / RULE_ID_BITMAP_BLK_SIZE;
+    uint64_t default_mask = 1ULL << (DEFAULT_ACTION_RULE_ID % RULE_ID_BITMAP_BLK_SIZE);
+
+    /* No other rules should exist at this point */
+    assert((state->rule_id_bitmap->id_bitmap[default_block_idx] & default_mask) == 0);
+    assert(state->rule_table->size == 0);
+    assert(state->classifier->tuple_count == 0);
+
+    /* Instance tables are hash tables indexed by masking */
+    assert((instances_capacity & (instances_capacity - 1)) == 0);
+
+    /* Classifier hash table must be a power of 2 with room for every rule */
+    assert((classifier_capacity & (classifier_capacity - 1)) == 0 && classifier_capacity > rules_capacity);
+
+    /* First rule must be the default rule */
+    assert(num_rules >= 1);
+    assert(initial_rules[DEFAULT_ACTION_IDX].src_subnet == 0 && initial_rules[DEFAULT_ACTION_IDX].src_port_any);
+    assert(initial_rules[DEFAULT_ACTION_IDX].dst_subnet == 0 && initial_rules[DEFAULT_ACTION_IDX].dst_port_any);
+    assert(initial_rules[DEFAULT_ACTION_IDX].rule_id == DEFAULT_ACTION_RULE_ID);
+
+    state->rule_id_bitmap->id_bitmap[default_block_idx] |= default_mask;
+    state->rule_id_bitmap->last_allocated_rule_id = DEFAULT_ACTION_RULE_ID;
+
+    state->rule_table->rules[DEFAULT_ACTION_IDX] = initial_rules[DEFAULT_ACTION_IDX];
+    state->rule_slots[DEFAULT_ACTION_RULE_ID] = DEFAULT_ACTION_IDX;
+    state->rule_table->size++;
+
+    for (uint8_t r = 1; r < num_rules; r++) {
+        fw_filter_err_t err = fw_filter_add_rule(state, initial_rules + r, NULL, &initial_rules[r].rule_id);
+        assert(err == FILTER_ERR_OKAY);
+    }
+}
+
+/**
+ * Initialise the IP sets of a filter. Must be called before traffic is
+ * filtered.
+ *
+ * @param state address of filter state.
+ * @param ip_sets address of IP set region in use.
+ * @param shadow_ip_sets address of IP set region being updated by the webserver.
+ * @param capacity capacity of IP set range pools.
+ */
+static inline void fw_filter_ip_sets_init(fw_filter_state_t *state, void *ip_sets, void *shadow_ip_sets,
+                                          uint32_t capacity)
+{
+    fw_ip_set_table_init(&state->ip_sets, ip_sets, capacity);
+    fw_ip_set_table_init(&state->shadow_ip_sets, shadow_ip_sets, capacity);
+}
+
+/**
+ * Initialise the connection tracking of the TCP filter. Must be called before
+ * traffic is filtered.
+ *
+ * @param state address of filter state.
+ * @param half_open_sources address of FW_TCP_HALF_OPEN_SOURCES zeroed counters.
+ * @param half_open_links address of half-open instance list links, one for
+ * each instance slot.
+ * @param half_open_timeout time after which idle half-open connections are
+ * removed in nanoseconds.
+ * @param fin_wait_timeout time after which idle closing connections are
+ * removed in nanoseconds.
+ */
+static inline void fw_filter_tcp_init(fw_filter_state_t *state, uint16_t *half_open_sources,
+                                      fw_half_open_link_t *half_open_links, uint64_t half_open_timeout,
+                                      uint64_t fin_wait_timeout)
+{
+    state->half_open_sources = half_open_sources;
+    state->half_open_links = half_open_links;
+    state->half_open_timeout = half_open_timeout;
+    state->fin_wait_timeout = fin_wait_timeout;
+}
+
+/**
+ * Initialise the return traffic timestamps of a filter. Instances are only
+ * written by the filter which created them, so the neighbour filter records
+ * when return traffic was last seen in a region it shares read-only with the
+ * instance's owner. Must be called before traffic is filtered.
+ *
+ * @param state address of filter state.
+ * @param return_seen regions of return traffic timestamps written by this
+ * filter, one for each external instance table in the same order.
+ * @param neighbour_return_seen regions of return traffic timestamps of this
+ * filter's instances written by each neighbour filter.
+ */
+static inline void fw_filter_return_seen_init(fw_filter_state_t *state, region_resource_t *return_seen,
+                                              region_resource_t *neighbour_return_seen)
+{
+    for (uint8_t iface = 0; iface < state->num_interfaces; iface++) {
+        state->return_seen[iface] = (uint64_t *)return_seen[iface].vaddr;
+        state->neighbour_return_seen[iface] = (uint64_t *)neighbour_return_seen[iface].vaddr;
+    }
+}
+
+/**
+ * Share a hard drop summary of the filter's rules with the Rx virtualiser. The
+ * summary is republished whenever the rules change.
+ *
+ * @param state address of filter state.
+ * @param hard_drop address of zeroed hard drop summary region.
+ */
+static inline void fw_filter_hard_drop_init(fw_filter_state_t *state, void *hard_drop)
+{
+    state->hard_drop = (fw_hard_drop_t *)hard_drop;
+    fw_filter_publish_hard_drops(state);
+}
+
+/**
+ * Switch to the copy of the IP set region updated by the webserver. The filter
+ * stops reading the old copy, so the webserver may update it once every filter
+ * has switched.
+ *
+ * @param state address of filter state.
+ */
+static inline void fw_filter_swap_ip_sets(fw_filter_state_t *state)
+{
+    fw_ip_set_table_t ip_sets = state->ip_sets;
+    state->ip_sets = state->shadow_ip_sets;
+    state->shadow_ip_sets = ip_sets;
+
+    /* Rules matching IP sets are never summarised as hard drops, and always
+    withdraw the prefixes they may take precedence over, so the summary does
+    not depend on the sets' contents */
+    state->rule_generation++;
+}
+
+/**
+ * Get the home slot of an instance in an instance table.
+ *
+ * @param capacity capacity of the instance table.
+ * @param src_ip source ip of instance traffic.
+ * @param src_port source port of instance traffic.
+ * @param dst_ip destination ip of instance traffic.
+ * @param dst_port destination port of instance traffic.
+ *
+ * @return index of the first slot to be probed.
+ */
+static inline uint16_t fw_instance_home_slot(uint16_t capacity, uint32_t src_ip, uint16_t src_port, uint32_t dst_ip,
+                                             uint16_t dst_port)
+{
+    return fw_flow_hash(src_ip, src_port, dst_ip, dst_port) & (capacity - 1);
+}
+
+/**
+ * Mark the start of an update to an instance slot. Readers will discard any
+ * copy of the slot taken until the update is ended.
+ *
+ * @param instance instance slot to be updated.
+ */
+static inline void fw_instance_write_begin(fw_instance_t *instance)
+{
+    instance->seq++;
+    THREAD_MEMORY_RELEASE();
+}
+
+/**
+ * Mark the end of an update to an instance slot.
+ *
+ * @param instance instance slot that was updated.
+ */
+static inline void fw_instance_write_end(fw_instance_t *instance)
+{
+    THREAD_MEMORY_RELEASE();
+    instance->seq++;
+}
+
+/**
+ * Search an instance table owned by another filter. The owning filter may be
+ * updating the table concurrently, so slots are copied out and only used if
+ * their sequence number shows they were not modified during the copy.
+ *
+ * @param table address of instance table.
+ * @param capacity capacity of the instance table.
+ * @param src_ip source ip of instance traffic.
+ * @param src_port source port of instance traffic.
+ * @param dst_ip destination ip of instance traffic.
+ * @param dst_port destination port of instance traffic.
+ * @param instance address to copy matching instance into.
+ * @param slot address to store the index of the matching instance's slot.
+ * Ignored if NULL.
+ * @param torn address of flag set if a slot being updated was skipped, in which
+ * case the instance may exist even if it was not found. Ignored if NULL.
+ *
+ * @return whether a matching instance was found.
+ */
+static inline bool fw_instances_table_search(fw_instances_table_t *table, uint16_t capacity, uint32_t src_ip,
+                                             uint16_t src_port, uint32_t dst_ip, uint16_t dst_port,
+                                             fw_instance_t *instance, uint16_t *slot, bool *torn)
+{
+    uint16_t home = fw_instance_home_slot(capacity, src_ip, src_port, dst_ip, dst_port);
+    for (uint16_t probe = 0; probe < FW_INSTANCE_MAX_PROBE && probe < capacity; probe++) {
+        uint16_t idx = (home + probe) & (capacity - 1);
+        fw_instance_t *entry = table->instances + idx;
+
+        uint32_t seq = entry->seq;
+        THREAD_MEMORY_ACQUIRE();
+        *instance = *entry;
+        THREAD_MEMORY_ACQUIRE();
+
+        /* Slot is being updated by its owner */
+        if ((seq & 1) || entry->seq != seq) {
+            if (torn != NULL) {
+                *torn = true;
+            }
+            continue;
+        }
+
+        /* No instance is stored past an empty slot */
+        if (instance->slot_state == FW_INSTANCE_SLOT_EMPTY) {
+            break;
+        }
+
+        if (instance->slot_state == FW_INSTANCE_SLOT_VALID && instance->src_ip == src_ip
+            && instance->dst_ip == dst_ip && instance->src_port == src_port && instance->dst_port == dst_port) {
+            if (slot != NULL) {
+                *slot = idx;
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Find an instance in this filter's instance table.
+ *
+ * @param state address of filter state.
+ * @param src_ip source ip of instance traffic.
+ * @param src_port source port of instance traffic.
+ * @param dst_ip destination ip of instance traffic.
+ * @param dst_port destination port of instance traffic.
+ * @param free_slot address to store the first free slot in the instance's
+ * probe sequence. Set to NULL if there are none. Ignored if NULL.
+ *
+ * @return address of matching instance, NULL if there is none.
+ */
+static inline fw_instance_t *fw_filter_find_instance(fw_filter_state_t *state, uint32_t src_ip, uint16_t src_port,
+                                                     uint32_t dst_ip, uint16_t dst_port, fw_instance_t **free_slot)
+{
+    fw_instances_table_t *table = state->internal_instances_table;
+    uint16_t capacity = state->instances_capacity;
+    fw_instance_t *first_free = NULL;
+
+    uint16_t home = fw_instance_home_slot(capacity, src_ip, src_port, dst_ip, dst_port);
+    for (uint16_t probe = 0; probe < FW_INSTANCE_MAX_PROBE && probe < capacity; probe++) {
+        fw_instance_t *instance = table->instances + ((home + probe) & (capacity - 1));
+
+        if (instance->slot_state != FW_INSTANCE_SLOT_VALID) {
+            if (first_free == NULL) {
+                first_free = instance;
+            }
+
+            if (instance->slot_state == FW_INSTANCE_SLOT_EMPTY) {
+                break;
+            }
+            continue;
+        }
+
+        if (instance->src_ip == src_ip && instance->dst_ip == dst_ip && instance->src_port == src_port
+            && instance->dst_port == dst_port) {
+            if (free_slot != NULL) {
+                *free_slot = NULL;
+            }
+            return instance;
+        }
+    }
+
+    if (free_slot != NULL) {
+        *free_slot = first_free;
+    }
+    return NULL;
+}
+
+/**
+ * Notify readers of this filter's instance table that an instance has been
+ * created, so cached verdicts of its return traffic are discarded. To be
+ * called after the instance has been written.
+ *
+ * @param state address of filter state.
+ * @param instance address of created instance.
+ */
+static inline void fw_filter_instance_created(fw_filter_state_t *state, fw_instance_t *instance)
+{
+    uint16_t home = fw_instance_home_slot(state->instances_capacity, instance->src_ip, instance->src_port,
+                                          instance->dst_ip, instance->dst_port);
+    THREAD_MEMORY_RELEASE();
+    state->internal_instances_table->instances[home].created++;
+}
+
+/**
+ * Get the half-open connection counter of a source.
+ *
+ * @param state address of filter state.
+ * @param src_ip source ip of connections.
+ *
+ * @return address of counter.
+ */
+static inline uint16_t *fw_filter_half_open_source(fw_filter_state_t *state, uint32_t src_ip)
+{
+    return state->half_open_sources + (fw_flow_hash(src_ip, 0, 0, 0) & (FW_TCP_HALF_OPEN_SOURCES - 1));
+}
+
+/**
+ * Count a valid instance towards the half-open connection limits of its source
+ * and rule, if it is half-open, appending it to its rule's half-open list as
+ * the newest.
+ *
+ * @param state address of filter state.
+ * @param instance address of instance.
+ */
+static inline void fw_filter_half_open_begin(fw_filter_state_t *state, fw_instance_t *instance)
+{
+    if (instance->tcp_state != FW_TCP_STATE_SYN_SENT) {
+        return;
+    }
+
+    fw_rule_state_t *rule_state = state->rule_state + instance->rule_id;
+    uint16_t idx = instance - state->internal_instances_table->instances;
+    if (rule_state->half_open == 0) {
+        rule_state->half_open_oldest = idx;
+    } else {
+        state->half_open_links[rule_state->half_open_newest].next = idx;
+    }
+    state->half_open_links[idx].prev = rule_state->half_open_newest;
+    rule_state->half_open_newest = idx;
+
+    (*fw_filter_half_open_source(state, instance->src_ip))++;
+    rule_state->half_open++;
+}
+
+/**
+ * Stop counting a valid instance towards the half-open connection limits,
+ * unlinking it from its rule's half-open list. To be called before a half-open
+ * instance is released, overwritten, changes rule or completes its handshake.
+ *
+ * @param state address of filter state.
+ * @param instance address of instance.
+ */
+static inline void fw_filter_half_open_end(fw_filter_state_t *state, fw_instance_t *instance)
+{
+    if (instance->tcp_state != FW_TCP_STATE_SYN_SENT) {
+        return;
+    }
+
+    fw_rule_state_t *rule_state = state->rule_state + instance->rule_id;
+    uint16_t idx = instance - state->internal_instances_table->instances;
+    fw_half_open_link_t *link = state->half_open_links + idx;
+    if (idx == rule_state->half_open_oldest) {
+        rule_state->half_open_oldest = link->next;
+    } else {
+        state->half_open_links[link->prev].next = link->next;
+    }
+
+    if (idx == rule_state->half_open_newest) {
+        rule_state->half_open_newest = link->prev;
+    } else {
+        state->half_open_links[link->next].prev = link->prev;
+    }
+
+    (*fw_filter_half_open_source(state, instance->src_ip))--;
+    rule_state->half_open--;
+}
+
+/**
+ * Release an instance from this filter's instance table.
+ *
+ * @param state address of filter state.
+ * @param instance address of instance to release.
+ */
+static inline void fw_filter_release_instance(fw_filter_state_t *state, fw_instance_t *instance)
+{
+    fw_instances_table_t *table = state->internal_instances_table;
+    uint16_t mask = state->instances_capacity - 1;
+    uint16_t idx = instance - table->instances;
+
+    assert(instance->slot_state == FW_INSTANCE_SLOT_VALID);
+    fw_filter_half_open_end(state, instance);
+
+    /* If the next slot is empty no probe sequence continues past this slot, so
+    it may be emptied rather than marked as deleted */
+    uint8_t new_state = FW_INSTANCE_SLOT_DELETED;
+    if (table->instances[(idx + 1) & mask].slot_state == FW_INSTANCE_SLOT_EMPTY) {
+        new_state = FW_INSTANCE_SLOT_EMPTY;
+    }
+
+    fw_instance_write_begin(instance);
+    instance->slot_state = new_state;
+    fw_instance_write_end(instance);
+    table->size--;
+
+    if (new_state != FW_INSTANCE_SLOT_EMPTY) {
+        return;
+    }
+
+    /* The same then holds for any deleted slots directly preceding this one */
+    for (uint16_t i = 1; i < state->instances_capacity; i++) {
+        fw_instance_t *prev = table->instances + ((idx - i) & mask);
+        if (prev->slot_state != FW_INSTANCE_SLOT_DELETED) {
+            break;
+        }
+
+        fw_instance_write_begin(prev);
+        prev->slot_state = FW_INSTANCE_SLOT_EMPTY;
+        fw_instance_write_end(prev);
+    }
+}
+
+/**
+ * Get the time traffic was last seen for an instance in either direction.
+ *
+ * @param state address of filter state.
+ * @param instance address of instance.
+ *
+ * @return time traffic was last seen in nanoseconds.
+ */
+static inline uint64_t fw_filter_instance_last_seen(fw_filter_state_t *state, fw_instance_t *instance)
+{
+    uint16_t idx = instance - state->internal_instances_table->instances;
+    uint64_t last_seen = instance->last_seen;
+
+    /* Timestamps left by return traffic of a slot's previous instance are
+    older than the current instance, so need not be cleared */
+    for (uint8_t iface = 0; iface < state->num_interfaces; iface++) {
+        last_seen = MAX(last_seen, state->neighbour_return_seen[iface][idx]);
+    }
+
+    return last_seen;
+}
+
+/**
+ * Get the time after which an idle instance is removed.
+ *
+ * @param state address of filter state.
+ * @param instance address of instance.
+ *
+ * @return idle timeout in nanoseconds.
+ */
+static inline uint64_t fw_filter_instance_timeout(fw_filter_state_t *state, fw_instance_t *instance)
+{
+    switch (instance->tcp_state) {
+    case FW_TCP_STATE_SYN_SENT:
+        return state->half_open_timeout;
+    case FW_TCP_STATE_FIN_WAIT:
+        return state->fin_wait_timeout;
+    case FW_TCP_STATE_CLOSED:
+        return 0;
+    default:
+        return state->instance_timeout;
+    }
+}
+
+/**
+ * Get the eviction priority of an instance, instances of lower priority are
+ * evicted first. Instances which have outlived their idle timeout but are yet
+ * to be reaped are evicted before any live instance. Closed TCP connections are
+ * evicted before half-open ones, so that a SYN flood displaces its own
+ * instances before established connections.
+ *
+ * @param state address of filter state.
+ * @param instance address of instance.
+ *
+ * @return eviction priority.
+ */
+static inline uint8_t fw_instance_eviction_priority(fw_filter_state_t *state, fw_instance_t *instance)
+{
+    if (instance->tcp_state == FW_TCP_STATE_CLOSED
+        || state->now - fw_filter_instance_last_seen(state, instance) > fw_filter_instance_timeout(state, instance)) {
+        return 0;
+    }
+
+    return (instance->tcp_state == FW_TCP_STATE_SYN_SENT) ? 1 : 2;
+}
+
+/**
+ * Find the instance to evict from an instance's probe sequence. To be used
+ * when there are no free slots left in the probe sequence. The least recently
+ * seen instance of the lowest eviction priority is chosen.
+ *
+ * @param state address of filter state.
+ * @param src_ip source ip of instance traffic.
+ * @param src_port source port of instance traffic.
+ * @param dst_ip destination ip of instance traffic.
+ * @param dst_port destination port of instance traffic.
+ *
+ * @return address of instance to evict.
+ */
+static inline fw_instance_t *fw_filter_oldest_instance(fw_filter_state_t *state, uint32_t src_ip, uint16_t src_port,
+                                                       uint32_t dst_ip, uint16_t dst_port)
+{
+    fw_instances_table_t *table = state->internal_instances_table;
+    uint16_t capacity = state->instances_capacity;
+    fw_instance_t *oldest = NULL;
+
+    uint16_t home = fw_instance_home_slot(capacity, src_ip, src_port, dst_ip, dst_port);
+    for (uint16_t probe = 0; probe < FW_INSTANCE_MAX_PROBE && probe < capacity; probe++) {
+        fw_instance_t *instance = table->instances + ((home + probe) & (capacity - 1));
+        if (oldest == NULL) {
+            oldest = instance;
+            continue;
+        }
+
+        uint8_t priority = fw_instance_eviction_priority(state, instance);
+        uint8_t oldest_priority = fw_instance_eviction_priority(state, oldest);
+        if (priority < oldest_priority
+            || (priority == oldest_priority
+                && fw_filter_instance_last_seen(state, instance) < fw_filter_instance_last_seen(state, oldest))) {
+            oldest = instance;
+        }
+    }
+
+    return oldest;
+}
+
+/**
+ * Refresh an existing instance, attributing it to the rule its traffic
+ * currently matches so it is removed along with that rule.
+ *
+ * @param state address of filter state.
+ * @param instance address of instance.
+ * @param rule_id id of connect rule.
+ */
+static inline void fw_filter_refresh_instance(fw_filter_state_t *state, fw_instance_t *instance, uint16_t rule_id)
+{
+    if (instance->rule_id != rule_id) {
+        fw_filter_half_open_end(state, instance);
+        fw_instance_write_begin(instance);
+        instance->rule_id = rule_id;
+        fw_instance_write_end(instance);
+        fw_filter_half_open_begin(state, instance);
+    }
+
+    /* The timestamp is not used by readers, so needs no sequence update */
+    instance->last_seen = state->now;
+}
+
+/**
+ * Create an instance in a free slot of its probe sequence. If there is no free
+ * slot, an instance sharing its probe sequence is evicted.
+ *
+ * @param state address of filter state.
+ * @param free_slot first free slot of the instance's probe sequence, or NULL.
+ * @param src_ip source ip of instance traffic.
+ * @param src_port source port of instance traffic.
+ * @param dst_ip destination ip of instance traffic.
+ * @param dst_port destination port of instance traffic.
+ * @param rule_id id of connect rule.
+ * @param tcp_state TCP connection state of the instance.
+ */
+static inline void fw_filter_create_instance(fw_filter_state_t *state, fw_instance_t *free_slot, uint32_t src_ip,
+                                             uint16_t src_port, uint32_t dst_ip, uint16_t dst_port, uint16_t rule_id,
+                                             uint8_t tcp_state)
+{
+    if (free_slot == NULL) {
+        free_slot = fw_filter_oldest_instance(state, src_ip, src_port, dst_ip, dst_port);
+        fw_filter_half_open_end(state, free_slot);
+    } else {
+        state->internal_instances_table->size++;
+    }
+
+    fw_instance_write_begin(free_slot);
+    free_slot->rule_id = rule_id;
+    free_slot->src_ip = src_ip;
+    free_slot->src_port = src_port;
+    free_slot->dst_ip = dst_ip;
+    free_slot->dst_port = dst_port;
+    free_slot->last_seen = state->now;
+    free_slot->tcp_state = tcp_state;
+    free_slot->slot_state = FW_INSTANCE_SLOT_VALID;
+    fw_instance_write_end(free_slot);
+    fw_filter_instance_created(state, free_slot);
+    fw_filter_half_open_begin(state, free_slot);
+}
+
+/**
+ * Create an instance, or refresh it if it already exists. To be used after
+ * traffic matches with a connect rule, allowing neighbour filter to permit
+ * return traffic. If there is no room for the instance, the least recently
+ * seen instance sharing its probe sequence is evicted.
+ *
+ * @param state address of filter state.
+ * @param src_ip source ip of instance traffic.
+ * @param src_port source port of instance traffic.
+ * @param dst_ip destination ip of instance traffic.
+ * @param dst_port destination port of instance traffic.
+ * @param rule_id id of connect rule.
+ *
+ * @return FILTER_ERR_OKAY if the instance was created, FILTER_ERR_DUPLICATE if
+ * it already existed. Adding an instance cannot fail.
+ */
+static inline fw_filter_err_t fw_filter_add_instance(fw_filter_state_t *state, uint32_t src_ip, uint16_t src_port,
+                                                     uint32_t dst_ip, uint16_t dst_port, uint16_t rule_id)
+{
+    fw_instance_t *free_slot = NULL;
+    fw_instance_t *instance = fw_filter_find_instance(state, src_ip, src_port, dst_ip, dst_port, &free_slot);
+
+    if (instance != NULL) {
+        fw_filter_refresh_instance(state, instance, rule_id);
+        return FILTER_ERR_DUPLICATE;
+    }
+
+    fw_filter_create_instance(state, free_slot, src_ip, src_port, dst_ip, dst_port, rule_id, FW_TCP_STATE_NONE);
+    return FILTER_ERR_OKAY;
+}
+
+/**
+ * Find the state a TCP connection moves to on a packet from its initiator.
+ *
+ * @param tcp_state current state of the connection, FW_TCP_STATE_CLOSED if it
+ * has no instance.
+ * @param flags TCP flags of the packet.
+ * @param next address to store the next state.
+ *
+ * @return whether the packet is valid in the current state.
+ */
+static inline bool fw_tcp_transition(uint8_t tcp_state, uint8_t flags, uint8_t *next)
+{
+    bool syn = flags & TCP_FLAG_SYN;
+    bool ack = flags & TCP_FLAG_ACK;
+
+    /* A reset closes the connection in any state it could be received in */
+    if (flags & TCP_FLAG_RST) {
+        *next = FW_TCP_STATE_CLOSED;
+        return tcp_state != FW_TCP_STATE_CLOSED;
+    }
+
+    switch (tcp_state) {
+    case FW_TCP_STATE_CLOSED:
+        *next = FW_TCP_STATE_SYN_SENT;
+        return syn && !ack;
+    case FW_TCP_STATE_SYN_SENT:
+        if (syn) {
+            *next = FW_TCP_STATE_SYN_SENT;
+            return !ack;
+        }
+        *next = (flags & TCP_FLAG_FIN) ? FW_TCP_STATE_FIN_WAIT : FW_TCP_STATE_ESTABLISHED;
+        return ack;
+    case FW_TCP_STATE_ESTABLISHED:
+        *next = (flags & TCP_FLAG_FIN) ? FW_TCP_STATE_FIN_WAIT : FW_TCP_STATE_ESTABLISHED;
+        return ack && !syn;
+    case FW_TCP_STATE_FIN_WAIT:
+        /* The initiator may reuse the addressing of a closing connection */
+        if (syn) {
+            *next = FW_TCP_STATE_SYN_SENT;
+            return !ack;
+        }
+        *next = FW_TCP_STATE_FIN_WAIT;
+        return ack;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Check whether a packet from the responder of a TCP connection is valid in
+ * the connection's state. To be used by the neighbour filter on return traffic.
+ *
+ * @param tcp_state state of the connection.
+ * @param flags TCP flags of the packet.
+ *
+ * @return whether the packet is valid.
+ */
+static inline bool fw_tcp_return_valid(uint8_t tcp_state, uint8_t flags)
+{
+    if (flags & TCP_FLAG_RST) {
+        return tcp_state != FW_TCP_STATE_CLOSED;
+    }
+
+    switch (tcp_state) {
+    case FW_TCP_STATE_SYN_SENT:
+        return (flags & (TCP_FLAG_SYN | TCP_FLAG_ACK)) == (TCP_FLAG_SYN | TCP_FLAG_ACK);
+    case FW_TCP_STATE_ESTABLISHED:
+    case FW_TCP_STATE_FIN_WAIT:
+        return flags & TCP_FLAG_ACK;
+    case FW_TCP_STATE_CLOSED:
+        return false;
+    default:
+        return true;
+    }
+}
+
+/**
+ * Find the state of a TCP connection with no instance picked up mid-stream from
+ * a packet of its initiator. Only ACKs without a SYN or reset are picked up.
+ *
+ * @param flags TCP flags of the packet.
+ * @param next address to store the state of the connection.
+ *
+ * @return whether the packet may be picked up.
+ */
+static inline bool fw_tcp_pickup(uint8_t flags, uint8_t *next)
+{
+    *next = (flags & TCP_FLAG_FIN) ? FW_TCP_STATE_FIN_WAIT : FW_TCP_STATE_ESTABLISHED;
+    return (flags & (TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_FLAG_RST)) == TCP_FLAG_ACK;
+}
+
+/**
+ * Change the TCP state of an instance. The state is updated in place under the
+ * slot's sequence lock without counting a new instance in its home slot, so
+ * only cached verdicts of this connection's return traffic, which record the
+ * slot's sequence number, are rechecked against the new state.
+ *
+ * @param state address of filter state.
+ * @param instance address of instance.
+ * @param tcp_state new TCP state.
+ */
+static inline void fw_filter_set_tcp_state(fw_filter_state_t *state, fw_instance_t *instance, uint8_t tcp_state)
+{
+    fw_filter_half_open_end(state, instance);
+    fw_instance_write_begin(instance);
+    instance->tcp_state = tcp_state;
+    fw_instance_write_end(instance);
+    fw_filter_half_open_begin(state, instance);
+}
+
+/**
+ * Find the oldest half-open instance created by a connect rule, the head of
+ * the rule's half-open list.
+ *
+ * @param state address of filter state.
+ * @param rule_id id of connect rule.
+ *
+ * @return address of instance, NULL if the rule has no half-open instances.
+ */
+static inline fw_instance_t *fw_filter_oldest_half_open(fw_filter_state_t *state, uint16_t rule_id)
+{
+    fw_rule_state_t *rule_state = state->rule_state + rule_id;
+    if (rule_state->half_open == 0) {
+        return NULL;
+    }
+
+    return state->internal_instances_table->instances + rule_state->half_open_oldest;
+}
+
+/**
+ * Create or update the instance of a TCP connection from a packet sent by its
+ * initiator. Packets which are not valid in the state of their connection are
+ * counted and should be dropped. A connection with no instance is created by a
+ * SYN, or picked up mid-stream by an ACK. A SYN creates a half-open instance,
+ * which is limited per source and per connect rule. A SYN exceeding its rule's
+ * limit evicts the rule's oldest half-open instance.
+ *
+ * @param state address of filter state.
+ * @param src_ip source ip of instance traffic.
+ * @param src_port source port of instance traffic.
+ * @param dst_ip destination ip of instance traffic.
+ * @param dst_port destination port of instance traffic.
+ * @param rule_id id of connect rule.
+ * @param flags TCP flags of the packet.
+ *
+ * @return error status, FILTER_ERR_HALF_OPEN_LIMIT or FILTER_ERR_OUT_OF_STATE
+ * if the packet should be dropped.
+ */
+static inline fw_filter_err_t fw_filter_add_tcp_instance(fw_filter_state_t *state, uint32_t src_ip,
+                                                         uint16_t src_port, uint32_t dst_ip, uint16_t dst_port,
+                                                         uint16_t rule_id, uint8_t flags)
+{
+    fw_instance_t *free_slot = NULL;
+    fw_instance_t *instance = fw_filter_find_instance(state, src_ip, src_port, dst_ip, dst_port, &free_slot);
+    uint8_t tcp_state = (instance != NULL) ? instance->tcp_state : FW_TCP_STATE_CLOSED;
+
+    uint8_t next = FW_TCP_STATE_NONE;
+    if (!fw_tcp_transition(tcp_state, flags, &next) && (instance != NULL || !fw_tcp_pickup(flags, &next))) {
+        state->stats->out_of_state++;
+        return FILTER_ERR_OUT_OF_STATE;
+    }
+
+    if (next == FW_TCP_STATE_SYN_SENT && tcp_state != FW_TCP_STATE_SYN_SENT) {
+        if (*fw_filter_half_open_source(state, src_ip) >= FW_TCP_MAX_HALF_OPEN_PER_SOURCE) {
+            state->stats->rules[rule_id].limited++;
+            return FILTER_ERR_HALF_OPEN_LIMIT;
+        }
+
+        /* Refusing SYNs once a rule is full would let spoofed SYNs lock
+        legitimate connections out until they time out, so the oldest half-open
+        connection makes way instead */
+        if (state->rule_state[rule_id].half_open >= state->instances_capacity / FW_TCP_HALF_OPEN_RULE_SHARE) {
+            fw_instance_t *oldest = fw_filter_oldest_half_open(state, rule_id);
+            state->stats->rules[rule_id].limited++;
+            if (oldest == NULL) {
+                return FILTER_ERR_HALF_OPEN_LIMIT;
+            }
+
+            fw_filter_release_instance(state, oldest);
+            if (instance == NULL) {
+                /* Releasing may have freed a slot in this instance's probe sequence */
+                free_slot = NULL;
+                fw_filter_find_instance(state, src_ip, src_port, dst_ip, dst_port, &free_slot);
+            }
+        }
+    }
+
+    if (instance == NULL) {
+        fw_filter_create_instance(state, free_slot, src_ip, src_port, dst_ip, dst_port, rule_id, next);
+        return FILTER_ERR_OKAY;
+    }
+
+    fw_filter_refresh_instance(state, instance, rule_id);
+    if (next != tcp_state) {
+        fw_filter_set_tcp_state(state, instance, next);
+    }
+    return FILTER_ERR_DUPLICATE;
+}
+
+/**
+ * Check return traffic of a neighbour filter's TCP connection against the
+ * state of the connection. Packets which are not valid in the state are
+ * counted.
+ *
+ * @param state address of filter state.
+ * @param tcp_state state of the connection, as found with the traffic's action.
+ * @param flags TCP flags of the packet.
+ *
+ * @return FILTER_ACT_ESTABLISHED if the packet is valid, FILTER_ACT_DROP
+ * otherwise.
+ */
+static inline fw_action_t fw_filter_tcp_return(fw_filter_state_t *state, uint8_t tcp_state, uint8_t flags)
+{
+    if (fw_tcp_return_valid(tcp_state, flags)) {
+        return FILTER_ACT_ESTABLISHED;
+    }
+
+    state->stats->out_of_state++;
+    return FILTER_ACT_DROP;
+}
+
+/**
+ * Remove instances which have been idle for longer than their timeout, and
+ * closed TCP connections. To be called periodically, the time passed is also
+ * used to timestamp instances until the next call.
+ *
+ * @param state address of filter state.
+ * @param now current time in nanoseconds.
+ *
+ * @return number of instances removed.
+ */
+static inline uint16_t fw_filter_reap_instances(fw_filter_state_t *state, uint64_t now)
+{
+    uint16_t reaped = 0;
+    state->now = now;
+
+    for (uint16_t i = 0; i < state->instances_capacity && state->internal_instances_table->size; i++) {
+        fw_instance_t *instance = state->internal_instances_table->instances + i;
+
+        if (instance->slot_state != FW_INSTANCE_SLOT_VALID) {
+            continue;
+        }
+
+        if (now - fw_filter_instance_last_seen(state, instance) <= fw_filter_instance_timeout(state, instance)) {
+            continue;
+        }
+
+        fw_filter_release_instance(state, instance);
+        reaped++;
+    }
+
+    return reaped;
+}
+
+/**
+ * Count the instances created by neighbour filters which could hold return
+ * traffic of a flow. Any such instance is stored in the probe sequence of the
+ * same home slot in each external table, so the count only changes when an
+ * instance is created in one of those probe sequences.
+ *
+ * @param state address of filter state.
+ * @param src_ip source ip of flow.
+ * @param src_port source port of flow.
+ * @param dst_ip destination ip of flow.
+ * @param dst_port destination port of flow.
+ *
+ * @return sum of the creation counters of the flow's home slots.
+ */
+static inline uint32_t fw_filter_instances_created(fw_filter_state_t *state, uint32_t src_ip, uint16_t src_port,
+                                                   uint32_t dst_ip, uint16_t dst_port)
+{
+    /* Return traffic has its addressing reversed with respect to the instance */
+    uint16_t home = fw_instance_home_slot(state->instances_capacity, dst_ip, dst_port, src_ip, src_port);
+    uint32_t created = 0;
+    for (uint8_t iface = 0; iface < state->num_interfaces; iface++) {
+        created += state->external_instances_table[iface]->instances[home].created;
+    }
+
+    /* Tables must be searched after the counters are read, so that a verdict
+    found during a concurrent creation is tagged with the old count */
+    THREAD_MEMORY_ACQUIRE();
+    return created;
+}
+
+/**
+ * Check whether a cached verdict of a flow is unaffected by changes to the
+ * external instance tables since it was found.
+ *
+ * @param state address of filter state.
+ * @param verdict address of verdict matching the flow.
+ *
+ * @return whether the verdict is still valid.
+ */
+static inline bool fw_filter_verdict_current(fw_filter_state_t *state, fw_verdict_t *verdict)
+{
+    if (verdict->action == FILTER_ACT_ESTABLISHED) {
+        fw_instance_t *instance = state->external_instances_table[verdict->iface]->instances + verdict->slot;
+        return instance->seq == verdict->instances_seen;
+    }
+
+    return fw_filter_instances_created(state, verdict->src_ip, verdict->src_port, verdict->dst_ip,
+                                       verdict->dst_port)
+        == verdict->instances_seen;
+}
+
+/**
+ * Search external instances and filter rules for the action to be applied for
+ * a given source and destination ip and port number. First external instances
+ * are checked so that return traffic may be permitted. If traffic is not
+ * return traffic from a neighbour filter's connection, the most specific
+ * matching filter rule is returned.
+ *
+ * @param state address of filter state.
+ * @param src_ip source ip to match.
+ * @param src_port source port to match.
+ * @param dst_ip destination ip to match.
+ * @param dst_port destination port to match.
+ * @param verdict address of verdict to store the matching rule id and action
+ * in. For return traffic, the TCP state, location and sequence number of the
+ * connection's instance are also stored.
+ * @param torn address of flag set if an external instance slot being updated
+ * was skipped, so traffic may be return traffic even if a rule was matched.
+ * Ignored if NULL.
+ *
+ * @return filter action to be applied.
+ */
+static inline fw_action_t fw_filter_search_action(fw_filter_state_t *state, uint32_t src_ip, uint16_t src_port,
+                                                  uint32_t dst_ip, uint16_t dst_port, fw_verdict_t *verdict,
+                                                  bool *torn)
+{
+    /* First check external instances. Return traffic has its addressing
+    reversed with respect to the instance */
+    fw_instance_t instance;
+    for (uint8_t iface = 0; iface < state->num_interfaces; iface++) {
+        if (fw_instances_table_search(state->external_instances_table[iface], state->instances_capacity, dst_ip,
+                                      dst_port, src_ip, src_port, &instance, &verdict->slot, torn)) {
+            verdict->rule_id = instance.rule_id;
+            verdict->action = FILTER_ACT_ESTABLISHED;
+            verdict->tcp_state = instance.tcp_state;
+            verdict->iface = iface;
+            verdict->instances_seen = instance.seq;
+            return FILTER_ACT_ESTABLISHED;
+        }
+    }
+
+    /* Search tuples from most to least specific. Otherwise we match with the
+    default rule */
+    fw_classifier_t *classifier = state->classifier;
+    fw_classifier_entry_t *entries = classifier->entries;
+    fw_classifier_tuple_t *tuples = fw_classifier_tuples(classifier, state->classifier_capacity);
+    uint32_t mask = state->classifier_capacity - 1;
+    uint16_t src_port_host = ntohs(src_port);
+    uint16_t dst_port_host = ntohs(dst_port);
+    fw_classifier_entry_t *match = NULL;
+    for (uint16_t i = 0; i < classifier->tuple_count; i++) {
+        fw_classifier_tuple_t *tuple = tuples + i;
+
+        /* Only tuples following a match which share its subnets and port
+        ranges may hold a narrower rule */
+        if (match != NULL && !fw_classifier_may_precede(tuple, match)) {
+            break;
+        }
+
+        fw_classifier_entry_t key = {
+            .src_ip = tuple->src_mask & src_ip,
+            .dst_ip = tuple->dst_mask & dst_ip,
+            .src_port = fw_classifier_key_port(tuple->src_port_match, src_port, src_port_host),
+            .dst_port = fw_classifier_key_port(tuple->dst_port_match, dst_port, dst_port_host),
+            .src_subnet = tuple->src_subnet,
+            .dst_subnet = tuple->dst_subnet,
+            .src_port_match = tuple->src_port_match,
+            .dst_port_match = tuple->dst_port_match,
+        };
+
+        /* Without port ranges or IP sets a tuple holds at most one rule per key */
+        bool unique = !fw_port_match_is_range(tuple->src_port_match) && !fw_port_match_is_range(tuple->dst_port_match)
+                   && tuple->src_subnet != FW_IP_SET_SUBNET && tuple->dst_subnet != FW_IP_SET_SUBNET;
+        for (uint32_t idx = fw_classifier_hash(&key) & mask; entries[idx].rule_id != DEFAULT_ACTION_RULE_ID;
+             idx = (idx + 1) & mask) {
+            fw_classifier_entry_t *entry = entries + idx;
+            if (!fw_classifier_same_key(entry, &key)) {
+                continue;
+            }
+
+            if (src_port_host >= entry->src_port_lo && src_port_host <= entry->src_port_hi
+                && dst_port_host >= entry->dst_port_lo && dst_port_host <= entry->dst_port_hi
+                && (entry->dst_port_set == 0
+                    || fw_port_set_contains(state->rule_table->port_sets + entry->dst_port_set - 1, dst_port))
+                && (match == NULL || fw_classifier_precedes(entry, match))
+                && (entry->src_ip_set == 0 || fw_ip_set_contains(&state->ip_sets, entry->src_ip_set, src_ip))
+                && (entry->dst_ip_set == 0 || fw_ip_set_contains(&state->ip_sets, entry->dst_ip_set, dst_ip))) {
+                match = entry;
+            }
 
-        /* We give priority to source matches over destination matches */
-        if (rule->src_subnet == match->src_subnet) {
-            if (rule->dst_subnet == match->dst_subnet) {
-                if (rule->src_port_any == match->src_port_any) {
-                    if (!rule->dst_port_any && match->dst_port_any) {
-                        match = rule; /* destination port number is a stronger match */
-                    }
-                } else if (!rule->src_port_any && match->src_port_any) {
-                    match = rule; /* source port number is a stronger match */
-                }
-            } else if (rule->dst_subnet > match->dst_subnet) { /* destination subnet is a longer match */
-                match = rule;
+            if (unique) {
+                break;
             }
-        } else if (rule->src_subnet > match->src_subnet) {
-            match = rule; /* source subnet is a longer match */
         }
     }
 
-    *rule_id = match->rule_id;
-    return (fw_action_t)match->action;
+    verdict->tcp_state = FW_TCP_STATE_NONE;
+    if (match != NULL) {
+        verdict->rule_id = match->rule_id;
+        verdict->action = match->action;
+        return (fw_action_t)match->action;
+    }
+
+    fw_rule_t *default_rule = &state->rule_table->rules[DEFAULT_ACTION_IDX];
+    verdict->rule_id = default_rule->rule_id;
+    verdict->action = default_rule->action;
+    return (fw_action_t)default_rule->action;
+}
+
+/**
+ * Find the filter action to be applied for a given source and destination ip
+ * and port number. The flow's cached verdict is used if it is still valid,
+ * otherwise external instances and filter rules are searched and the result
+ * is cached. Return traffic refreshes the idle time of its connection.
+ *
+ * @param state address of filter state.
+ * @param src_ip source ip to match.
+ * @param src_port source port to match.
+ * @param dst_ip destination ip to match.
+ * @param dst_port destination port to match.
+ * @param rule_id id of matching rule. Unmodified if no match.
+ * @param tcp_state address to store the TCP state of the connection of return
+ * traffic, FW_TCP_STATE_NONE for other traffic. May be NULL.
+ *
+ * @return filter action to be applied. None is returned if no match is found.
+ */
+static inline fw_action_t fw_filter_find_action(fw_filter_state_t *state, uint32_t src_ip, uint16_t src_port,
+                                                uint32_t dst_ip, uint16_t dst_port, uint16_t *rule_id,
+                                                uint8_t *tcp_state)
+{
+    fw_verdict_t *verdict = state->verdict_cache
+                          + (fw_flow_hash(src_ip, src_port, dst_ip, dst_port) & (FW_VERDICT_CACHE_SIZE - 1));
+
+    if (verdict->generation != state->rule_generation || verdict->src_ip != src_ip || verdict->dst_ip != dst_ip
+        || verdict->src_port != src_port || verdict->dst_port != dst_port
+        || !fw_filter_verdict_current(state, verdict)) {
+        uint32_t created = fw_filter_instances_created(state, src_ip, src_port, dst_ip, dst_port);
+        bool torn = false;
+        if (fw_filter_search_action(state, src_ip, src_port, dst_ip, dst_port, verdict, &torn)
+            != FILTER_ACT_ESTABLISHED) {
+            verdict->instances_seen = created;
+        }
+        verdict->src_ip = src_ip;
+        verdict->dst_ip = dst_ip;
+        verdict->src_port = src_port;
+        verdict->dst_port = dst_port;
+
+        /* A neighbour updating a slot does not create an instance, so a rule
+        verdict reached while skipping the slot must not outlive this packet */
+        verdict->generation = (torn && verdict->action != FILTER_ACT_ESTABLISHED) ? state->rule_generation - 1
+                                                                                    : state->rule_generation;
+    }
+
+    if (verdict->action == FILTER_ACT_ESTABLISHED) {
+        state->return_seen[verdict->iface][verdict->slot] = state->now;
+    }
+
+    *rule_id = verdict->rule_id;
+    if (tcp_state != NULL) {
+        *tcp_state = verdict->tcp_state;
+    }
+    return (fw_action_t)verdict->action;
+}
+
+/**
+ * Count a packet against the rule it matched. Established traffic is counted
+ * separately, as its rule ID belongs to the neighbour filter.
+ *
+ * @param state address of filter state.
+ * @param action action applied to packet.
+ * @param rule_id id of matching rule.
+ * @param len length of packet in bytes.
+ */
+static inline void fw_filter_count(fw_filter_state_t *state, fw_action_t action, uint16_t rule_id, uint16_t len)
+{
+    fw_rule_stats_t *stats = state->stats->rules + rule_id;
+    if (action == FILTER_ACT_ESTABLISHED) {
+        stats = &state->stats->established;
+    }
+
+    stats->packets++;
+    stats->bytes += len;
+}
+
+/**
+ * Check whether any rate limit rules exist, in which case the filter's clock
+ * must be kept current while filtering.
+ *
+ * @param state address of filter state.
+ *
+ * @return whether the filter has rate limit rules.
+ */
+static inline bool fw_filter_rate_limited(fw_filter_state_t *state)
+{
+    return state->num_rate_limits > 0;
+}
+
+/**
+ * Set the filter's clock. Sampled once per batch of packets rather than per
+ * packet to keep clock reads off the packet path.
+ *
+ * @param state address of filter state.
+ * @param now current time in nanoseconds.
+ */
+static inline void fw_filter_set_time(fw_filter_state_t *state, uint64_t now)
+{
+    state->now = now;
+}
+
+/**
+ * Refill a token bucket and take the tokens for a packet from it.
+ *
+ * @param bucket address of bucket.
+ * @param rule address of rate limit rule.
+ * @param now current time in nanoseconds.
+ * @param len length of packet in bytes.
+ *
+ * @return whether the packet is within the rule's rate limits.
+ */
+static inline bool fw_rate_bucket_take(fw_rate_bucket_t *bucket, fw_rule_t *rule, uint64_t now, uint16_t len)
+{
+    /* Buckets hold at most one second's worth of tokens, so longer idle times
+    fill them. New buckets have no refill time and start full */
+    uint64_t elapsed = now - bucket->last_refill;
+    if (elapsed > FW_RATE_TOKEN_SCALE || bucket->last_refill == 0) {
+        elapsed = FW_RATE_TOKEN_SCALE;
+    }
+    bucket->last_refill = now;
+
+    uint64_t packet_limit = (uint64_t)rule->rate_pps * FW_RATE_TOKEN_SCALE;
+    uint64_t byte_limit = (uint64_t)rule->rate_bps * FW_RATE_TOKEN_SCALE;
+    bucket->packet_tokens = MIN(bucket->packet_tokens + elapsed * rule->rate_pps, packet_limit);
+    bucket->byte_tokens = MIN(bucket->byte_tokens + elapsed * rule->rate_bps, byte_limit);
+
+    /* A rate of 0 leaves that dimension unlimited */
+    uint64_t packet_cost = rule->rate_pps ? FW_RATE_TOKEN_SCALE : 0;
+    uint64_t byte_cost = rule->rate_bps ? (uint64_t)len * FW_RATE_TOKEN_SCALE : 0;
+    if (bucket->packet_tokens < packet_cost || bucket->byte_tokens < byte_cost) {
+        return false;
+    }
+
+    bucket->packet_tokens -= packet_cost;
+    bucket->byte_tokens -= byte_cost;
+    return true;
+}
+
+/**
+ * Find the per-source bucket of a rate limit rule, replacing the least
+ * recently refilled bucket of the source's set if it has none.
+ *
+ * @param state address of filter state.
+ * @param rule_id id of rate limit rule.
+ * @param src_ip source ip of traffic.
+ *
+ * @return address of bucket.
+ */
+static inline fw_rate_bucket_t *fw_filter_rate_source(fw_filter_state_t *state, uint16_t rule_id, uint32_t src_ip)
+{
+    /* Sets are FW_RATE_SOURCE_WAYS consecutive entries */
+    uint32_t set = fw_flow_hash(src_ip, rule_id, 0, 0) & (FW_RATE_SOURCES - FW_RATE_SOURCE_WAYS);
+    fw_rate_source_t *sources = state->rate_sources + set;
+
+    fw_rate_source_t *victim = NULL;
+    bool victim_valid = true;
+    for (uint8_t way = 0; way < FW_RATE_SOURCE_WAYS; way++) {
+        fw_rate_source_t *source = sources + way;
+        bool valid = source->rule_id != DEFAULT_ACTION_RULE_ID
+                  && state->rule_state[source->rule_id].epoch == source->epoch;
+        if (valid && source->rule_id == rule_id && source->src_ip == src_ip) {
+            return &source->bucket;
+        }
+
+        /* Prefer empty or stale entries, otherwise the least recently refilled */
+        if (victim == NULL || (victim_valid && (!valid || source->bucket.last_refill < victim->bucket.last_refill))) {
+            victim = source;
+            victim_valid = valid;
+        }
+    }
+
+    victim->bucket = (fw_rate_bucket_t) { 0 };
+    victim->src_ip = src_ip;
+    victim->epoch = state->rule_state[rule_id].epoch;
+    victim->rule_id = rule_id;
+    return &victim->bucket;
+}
+
+/**
+ * Apply the rate limits of a rate limit rule to a packet. Packets exceeding the
+ * limits are counted against the rule. The filter's clock must have been set
+ * for the current batch of packets.
+ *
+ * @param state address of filter state.
+ * @param rule_id id of matching rate limit rule.
+ * @param src_ip source ip of packet.
+ * @param len length of packet in bytes.
+ *
+ * @return FILTER_ACT_ALLOW if the packet is within the limits, FILTER_ACT_DROP
+ * otherwise.
+ */
+static inline fw_action_t fw_filter_rate_limit(fw_filter_state_t *state, uint16_t rule_id, uint32_t src_ip,
+                                               uint16_t len)
+{
+    fw_rule_t *rule = state->rule_table->rules + state->rule_slots[rule_id];
+    fw_rate_bucket_t *bucket = rule->rate_per_source ? fw_filter_rate_source(state, rule_id, src_ip)
+                                                     : &state->rule_state[rule_id].bucket;
+
+    if (fw_rate_bucket_take(bucket, rule, state->now, len)) {
+        return FILTER_ACT_ALLOW;
+    }
+
+    state->stats->rules[rule_id].limited++;
+    return FILTER_ACT_DROP;
+}
+
+/**
+ * Find the action to be applied to a packet by a filter without connection
+ * state. The packet is counted against its rule, rate limits are applied and
+ * traffic matching a connect rule creates or refreshes its instance. The
+ * filter's clock must have been set for the current batch of packets.
+ *
+ * @param state address of filter state.
+ * @param src_ip source ip of packet.
+ * @param src_port source port of packet.
+ * @param dst_ip destination ip of packet.
+ * @param dst_port destination port of packet.
+ * @param len length of packet in bytes.
+ * @param rule_id address to store the id of the matching rule.
+ * @param err address to store the error status of adding the instance of
+ * connect traffic, FILTER_ERR_OKAY for other traffic.
+ *
+ * @return filter action to be applied, FILTER_ACT_DROP if the packet exceeds
+ * its rate limits.
+ */
+static inline fw_action_t fw_filter_action(fw_filter_state_t *state, uint32_t src_ip, uint16_t src_port,
+                                           uint32_t dst_ip, uint16_t dst_port, uint16_t len, uint16_t *rule_id,
+                                           fw_filter_err_t *err)
+{
+    fw_action_t action = fw_filter_find_action(state, src_ip, src_port, dst_ip, dst_port, rule_id, NULL);
+    fw_filter_count(state, action, *rule_id, len);
+    *err = FILTER_ERR_OKAY;
+
+    /* Traffic exceeding its rate limits is dropped before reaching the router */
+    if (action == FILTER_ACT_RATE_LIMIT) {
+        return fw_filter_rate_limit(state, *rule_id, src_ip, len);
+    }
+
+    if (action == FILTER_ACT_CONNECT) {
+        *err = fw_filter_add_instance(state, src_ip, src_port, dst_ip, dst_port, *rule_id);
+    }
+
+    return action;
+}
+
+/**
+ * Find the action to be applied to a TCP packet. As for fw_filter_action, and
+ * additionally return traffic must be valid in the state of its connection,
+ * and connect traffic must be valid in the state of its instance and within
+ * the half-open connection limits.
+ *
+ * @param state address of filter state.
+ * @param src_ip source ip of packet.
+ * @param src_port source port of packet.
+ * @param dst_ip destination ip of packet.
+ * @param dst_port destination port of packet.
+ * @param flags TCP flags of packet.
+ * @param len length of packet in bytes.
+ * @param rule_id address to store the id of the matching rule.
+ * @param err address to store the error status of updating the instance of
+ * connect traffic, FILTER_ERR_OKAY for other traffic.
+ *
+ * @return filter action to be applied, FILTER_ACT_DROP if the packet exceeds
+ * its rate limits or is not valid in the state of its connection.
+ */
+static inline fw_action_t fw_filter_tcp_action(fw_filter_state_t *state, uint32_t src_ip, uint16_t src_port,
+                                               uint32_t dst_ip, uint16_t dst_port, uint8_t flags, uint16_t len,
+                                               uint16_t *rule_id, fw_filter_err_t *err)
+{
+    uint8_t tcp_state = FW_TCP_STATE_NONE;
+    fw_action_t action = fw_filter_find_action(state, src_ip, src_port, dst_ip, dst_port, rule_id, &tcp_state);
+    fw_filter_count(state, action, *rule_id, len);
+    *err = FILTER_ERR_OKAY;
+
+    if (action == FILTER_ACT_ESTABLISHED) {
+        return fw_filter_tcp_return(state, tcp_state, flags);
+    }
+
+    /* Traffic exceeding its rate limits is dropped before reaching the router */
+    if (action == FILTER_ACT_RATE_LIMIT) {
+        return fw_filter_rate_limit(state, *rule_id, src_ip, len);
+    }
+
+    if (action == FILTER_ACT_CONNECT) {
+        *err = fw_filter_add_tcp_instance(state, src_ip, src_port, dst_ip, dst_port, *rule_id, flags);
+        /* SYNs exceeding the half-open connection limits and packets out of
+        state with their connection are dropped */
+        if (*err == FILTER_ERR_HALF_OPEN_LIMIT || *err == FILTER_ERR_OUT_OF_STATE) {
+            return FILTER_ACT_DROP;
+        }
+    }
+
+    return action;
 }
 
 /**
@@ -508,18 +3164,14 @@ static inline fw_action_t fw_filter_find_action(fw_filter_state_t *state, uint32
  */
 static fw_filter_err_t fw_filter_remove_instances(fw_filter_state_t *state, uint16_t rule_id)
 {
-    uint16_t i = 0;
-    while (i < state->internal_instances_table->size) {
+    for (uint16_t i = 0; i < state->instances_capacity && state->internal_instances_table->size; i++) {
         fw_instance_t *instance = state->internal_instances_table->instances + i;
 
-        if (rule_id != instance->rule_id) {
-            i++;
+        if (instance->slot_state != FW_INSTANCE_SLOT_VALID || rule_id != instance->rule_id) {
             continue;
         }
 
-        state->internal_instances_table->instances[i] =
-            state->internal_instances_table->instances[state->internal_instances_table->size - 1];
-        state->internal_instances_table->size--;
+        fw_filter_release_instance(state, instance);
     }
 
     return FILTER_ERR_OKAY;
@@ -535,6 +3187,11 @@ static fw_filter_err_t fw_filter_remove_instances(fw_filter_state_t *state, uint
  */
 static inline fw_filter_err_t fw_filter_update_default_action(fw_filter_state_t *state, fw_action_t new_action)
 {
+    /* The default rule has no rates to limit traffic to */
+    if (new_action == FILTER_ACT_RATE_LIMIT) {
+        return FILTER_ERR_UNSUPPORTED_ACTION;
+    }
+
     fw_action_t old_action = state->rule_table->rules[DEFAULT_ACTION_IDX].action;
     if (new_action == old_action) {
         return FILTER_ERR_OKAY;
@@ -545,7 +3202,17 @@ static inline fw_filter_err_t fw_filter_update_default_action(fw_filter_state_t
         assert(err == FILTER_ERR_OKAY);
     }
 
+    /* Traffic dropped by the Rx virtualiser belongs to the old default action */
+    fw_filter_count_hard_drops(state);
+
     state->rule_table->rules[DEFAULT_ACTION_IDX].action = new_action;
+    state->stats->rules[DEFAULT_ACTION_RULE_ID].packets = 0;
+    state->stats->rules[DEFAULT_ACTION_RULE_ID].bytes = 0;
+    state->stats->rules[DEFAULT_ACTION_RULE_ID].limited = 0;
+
+    /* The default rule matches every source, so never takes precedence over a
+    rule dropping a source prefix and does not change the hard drop summary */
+    state->rule_generation++;
 
     return FILTER_ERR_OKAY;
 }
@@ -565,22 +3232,213 @@ static inline fw_filter_err_t fw_filter_remove_rule(fw_filter_state_t *state, ui
         return err;
     }
 
-    fw_rule_t *rule = NULL;
-    for (uint16_t i = DEFAULT_ACTION_IDX + 1; i < state->rule_table->size; i++) {
-        if (state->rule_table->rules[i].rule_id == rule_id) {
-            rule = state->rule_table->rules + i;
-            break;
-        }
-    }
-
-    assert(rule != NULL);
+    fw_rule_t *rule = state->rule_table->rules + state->rule_slots[rule_id];
+    assert(rule->rule_id == rule_id);
 
     if ((fw_action_t)rule->action == FILTER_ACT_CONNECT) {
         assert(fw_filter_remove_instances(state, rule_id) == FILTER_ERR_OKAY);
+    } else if ((fw_action_t)rule->action == FILTER_ACT_RATE_LIMIT) {
+        state->num_rate_limits--;
+    }
+
+    fw_port_set_t *set = fw_rule_port_set(state->rule_table, rule);
+    fw_classifier_entry_t key;
+    err = fw_classifier_rule_key(rule, set, &key);
+    assert(err == FILTER_ERR_OKAY);
+    fw_classifier_remove(state->classifier, state->classifier_capacity, &key);
+    if (set != NULL) {
+        set->size = 0;
     }
 
-    generic_array_shift(state->rule_table->rules, sizeof(fw_rule_t), state->rule_table->size,
-                        rule - state->rule_table->rules);
+    /* Move the last rule into the removed rule's slot */
+    fw_rule_t removed = *rule;
+    fw_rule_t *last = state->rule_table->rules + state->rule_table->size - 1;
+    if (rule != last) {
+        *rule = *last;
+        state->rule_slots[rule->rule_id] = rule - state->rule_table->rules;
+    }
     state->rule_table->size--;
+    state->rule_generation++;
+    fw_filter_hard_drop_rule_removed(state, &removed);
     return FILTER_ERR_OKAY;
 }
+
+/* Rule ID of classifier entries whose rule is yet to be allocated an ID */
+#define FW_RULE_ID_PENDING 0xffff
+
+/**
+ * Check whether a filter supports an action.
+ *
+ * @param actions actions supported by filter, action n is supported if index
+ * n-1 is set.
+ * @param num_actions number of actions.
+ * @param action action to check.
+ *
+ * @return whether action is supported.
+ */
+static inline bool fw_filter_action_supported(uint8_t *actions, uint8_t num_actions, uint8_t action)
+{
+    return action != 0 && action <= num_actions && actions[action - 1];
+}
+
+/**
+ * Replace all filter rules and the default action with a new rule set. The new
+ * rule set is validated and classified in the shadow classifier before any
+ * change is made, so either the whole rule set is applied or none of it is.
+ * Rules present in both the old and new rule sets keep their rule IDs and
+ * instances. Ties between new rules of the same precedence are broken by their
+ * order in the new rule set.
+ *
+ * @param state address of filter state.
+ * @param rules table of new rules, excluding the default rule, and their
+ * destination port sets. Each port set may be used by at most one rule.
+ * @param default_action new default action.
+ * @param actions actions supported by filter, action n is supported if index
+ * n-1 is set.
+ * @param num_actions number of actions.
+ * @param err_idx address to store the index of the rule causing an error. Set
+ * to the number of new rules if the default action caused the error.
+ *
+ * @return error status.
+ */
+static inline fw_filter_err_t fw_filter_commit_rules(fw_filter_state_t *state, fw_rule_table_t *rules,
+                                                     fw_action_t default_action, uint8_t *actions,
+                                                     uint8_t num_actions, uint16_t *err_idx)
+{
+    fw_classifier_t *shadow = state->shadow_classifier;
+    uint32_t capacity = state->classifier_capacity;
+    uint16_t num_rules = rules->size;
+    fw_classifier_entry_t key;
+
+    if (!fw_filter_action_supported(actions, num_actions, default_action) || default_action == FILTER_ACT_RATE_LIMIT) {
+        *err_idx = num_rules;
+        return FILTER_ERR_UNSUPPORTED_ACTION;
+    }
+
+    /* New rules must fit in the rule table along with the default rule */
+    if (num_rules >= state->rules_capacity) {
+        *err_idx = state->rules_capacity - 1;
+        return FILTER_ERR_FULL;
+    }
+
+    /* Build the classifier of the new rule set, checking new rules do not
+    clash with each other or the new default action */
+    shadow->tuple_count = 0;
+    memset(shadow->entries, 0, capacity * sizeof(fw_classifier_entry_t));
+    uint32_t port_sets_used = 0;
+    for (uint16_t i = 0; i < num_rules; i++) {
+        fw_rule_t *rule = rules->rules + i;
+        uint8_t clash_action = 0;
+        uint32_t slot = 0;
+
+        /* Port sets are normalised when they are copied into the rule table,
+        so are validated on a copy */
+        fw_filter_err_t err = FILTER_ERR_OKAY;
+        fw_port_set_t set;
+        fw_port_set_t *rule_set = fw_rule_port_set(rules, rule);
+        if (rule_set != NULL) {
+            set = *rule_set;
+            err = fw_port_set_normalise(&set);
+            if (port_sets_used & (1U << (rule->dst_port_set - 1))) {
+                err = FILTER_ERR_INVALID_PORTS;
+            }
+            port_sets_used |= 1U << (rule->dst_port_set - 1);
+            rule_set = &set;
+        }
+
+        if (err == FILTER_ERR_OKAY) {
+            err = fw_classifier_rule_key(rule, rule_set, &key);
+        }
+
+        if (err == FILTER_ERR_OKAY && !fw_filter_action_supported(actions, num_actions, rule->action)) {
+            err = FILTER_ERR_UNSUPPORTED_ACTION;
+        }
+
+        if (err == FILTER_ERR_OKAY && fw_classifier_is_default(&key)) {
+            clash_action = default_action;
+        } else if (err == FILTER_ERR_OKAY) {
+            fw_classifier_entry_t *clash = fw_classifier_find(shadow, capacity, &key, &slot);
+            if (clash != NULL) {
+                clash_action = clash->action;
+            }
+        }
+
+        if (clash_action != 0) {
+            err = (rule->action == clash_action) ? FILTER_ERR_DUPLICATE : FILTER_ERR_CLASH;
+        }
+
+        if (err != FILTER_ERR_OKAY) {
+            *err_idx = i;
+            return err;
+        }
+
+        key.rule_id = FW_RULE_ID_PENDING;
+        key.order = state->rule_order++;
+        fw_classifier_insert(shadow, capacity, &key, slot);
+    }
+
+    /* The new rule set is valid. Old rules which are kept retain their rule
+    ID, the remaining old rules are released */
+    for (uint16_t i = DEFAULT_ACTION_IDX + 1; i < state->rule_table->size; i++) {
+        fw_rule_t *rule = state->rule_table->rules + i;
+
+        fw_filter_err_t err = fw_classifier_rule_key(rule, fw_rule_port_set(state->rule_table, rule), &key);
+        assert(err == FILTER_ERR_OKAY);
+        fw_classifier_entry_t *entry = fw_classifier_find(shadow, capacity, &key, NULL);
+        if (entry != NULL && entry->action == rule->action) {
+            entry->rule_id = rule->rule_id;
+            continue;
+        }
+
+        if ((fw_action_t)rule->action == FILTER_ACT_CONNECT) {
+            err = fw_filter_remove_instances(state, rule->rule_id);
+            assert(err == FILTER_ERR_OKAY);
+        }
+
+        err = rules_free_id(state, rule->rule_id);
+        assert(err == FILTER_ERR_OKAY);
+    }
+
+    /* Copy new rules and their port sets into the rule table, allocating IDs
+    to new rules. Port sets keep their IDs */
+    state->rule_table->size = DEFAULT_ACTION_IDX + 1;
+    state->num_rate_limits = 0;
+    memset(state->rule_table->port_sets, 0, sizeof(state->rule_table->port_sets));
+    for (uint16_t i = 0; i < num_rules; i++) {
+        fw_rule_t *rule = state->rule_table->rules + state->rule_table->size;
+        *rule = rules->rules[i];
+        if ((fw_action_t)rule->action == FILTER_ACT_RATE_LIMIT) {
+            state->num_rate_limits++;
+        }
+
+        fw_port_set_t *set = fw_rule_port_set(state->rule_table, rule);
+        if (set != NULL) {
+            *set = *fw_rule_port_set(rules, rule);
+            fw_filter_err_t err = fw_port_set_normalise(set);
+            assert(err == FILTER_ERR_OKAY);
+        }
+
+        fw_filter_err_t err = fw_classifier_rule_key(rule, set, &key);
+        assert(err == FILTER_ERR_OKAY);
+        rule->src_ip = key.src_ip;
+        rule->dst_ip = key.dst_ip;
+
+        fw_classifier_entry_t *entry = fw_classifier_find(shadow, capacity, &key, NULL);
+        assert(entry != NULL);
+        if (entry->rule_id == FW_RULE_ID_PENDING) {
+            err = rules_reserve_id(state, &entry->rule_id);
+            assert(err == FILTER_ERR_OKAY);
+        }
+
+        rule->rule_id = entry->rule_id;
+        state->rule_slots[rule->rule_id] = state->rule_table->size;
+        state->rule_table->size++;
+    }
+
+    /* Swap in the new classifier */
+    state->shadow_classifier = state->classifier;
+    state->classifier = shadow;
+    fw_filter_rules_changed(state);
+
+    return fw_filter_update_default_action(state, default_action);
+}
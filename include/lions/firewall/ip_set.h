@@ -0,0 +1,338 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <lions/firewall/common.h>
+
+/* Maximum number of IP sets, sets are identified by 1 to FW_MAX_IP_SETS */
+#define FW_MAX_IP_SETS 16
+
+typedef enum {
+    /* no error */
+    IP_SET_ERR_OKAY = 0,
+    /* range pool is full */
+    IP_SET_ERR_FULL,
+    /* set id is out of range */
+    IP_SET_ERR_INVALID_SET,
+    /* prefix length is greater than 32 */
+    IP_SET_ERR_INVALID_PREFIX
+} fw_ip_set_err_t;
+
+static const char *const fw_ip_set_err_str[] = { "Ok.", "Out of memory error.", "Invalid IP set.", "Invalid prefix." };
+
+/**
+ * IP sets hold large numbers of IPv4 addresses and prefixes, such as threat
+ * intelligence blocklists, and are referenced by filter rules in place of a
+ * subnet. Each set is a sorted array of disjoint address ranges, searched by
+ * binary search. Every prefix costs at most one range however its addresses
+ * are scattered, and adjacent or overlapping prefixes are merged into a single
+ * range, so a set of n prefixes is searched in O(log n) reads of 8 bytes.
+ *
+ * All sets share a pool of ranges in a single memory region, written by the
+ * webserver and mapped read-only into every filter. The ranges of each set are
+ * contiguous in the pool. Prefixes are appended to a set unsorted, and the set
+ * is sorted and merged once all of a list has been added. The webserver keeps
+ * two copies of the region: changes are made to the copy not in use by
+ * filters, which are then switched over to it one at a time. Once every filter
+ * has switched, the old copy is no longer read and may be updated in turn.
+ */
+
+/* Range of addresses in host byte order, from lo to hi inclusive */
+typedef struct fw_ip_set_range {
+    uint32_t lo;
+    uint32_t hi;
+} fw_ip_set_range_t;
+
+typedef struct fw_ip_sets {
+    /* index of the first range of each set */
+    uint32_t starts[FW_MAX_IP_SETS];
+    /* number of ranges of each set */
+    uint32_t counts[FW_MAX_IP_SETS];
+    /* number of prefixes added to each set */
+    uint32_t sizes[FW_MAX_IP_SETS];
+    /* number of ranges in use across all sets */
+    uint32_t num_ranges;
+    /* range pool */
+    fw_ip_set_range_t ranges[];
+} fw_ip_sets_t;
+
+/* Handle of one copy of the IP set region */
+typedef struct fw_ip_set_table {
+    fw_ip_sets_t *sets;
+    uint32_t capacity;
+} fw_ip_set_table_t;
+
+/**
+ * Initialise a handle of an IP set region.
+ *
+ * @param table address of IP set table handle.
+ * @param region virtual address of IP set region.
+ * @param capacity capacity of range pool.
+ */
+static inline void fw_ip_set_table_init(fw_ip_set_table_t *table, void *region, uint32_t capacity)
+{
+    table->sets = (fw_ip_sets_t *)region;
+    table->capacity = capacity;
+}
+
+/**
+ * Check whether an IP address is in a set.
+ *
+ * @param table address of IP set table handle.
+ * @param set id of set, between 1 and FW_MAX_IP_SETS.
+ * @param ip ip address in network byte order.
+ *
+ * @return whether ip is in the set.
+ */
+static inline bool fw_ip_set_contains(fw_ip_set_table_t *table, uint8_t set, uint32_t ip)
+{
+    fw_ip_set_range_t *ranges = table->sets->ranges + table->sets->starts[set - 1];
+    uint32_t addr = ntohl(ip);
+
+    /* Find the last range starting at or below the address */
+    uint32_t lo = 0;
+    uint32_t hi = table->sets->counts[set - 1];
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ranges[mid].lo <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo > 0 && addr <= ranges[lo - 1].hi;
+}
+
+/**
+ * Reverse a run of ranges in place.
+ *
+ * @param ranges address of first range.
+ * @param count number of ranges.
+ */
+static inline void fw_ip_set_reverse(fw_ip_set_range_t *ranges, uint32_t count)
+{
+    for (uint32_t i = 0; i < count / 2; i++) {
+        fw_ip_set_range_t tmp = ranges[i];
+        ranges[i] = ranges[count - 1 - i];
+        ranges[count - 1 - i] = tmp;
+    }
+}
+
+/**
+ * Update the first range of the sets following a run of ranges which has been
+ * removed from the pool. The first range of an empty set is never read.
+ *
+ * @param sets address of IP sets.
+ * @param start index of the removed run of ranges.
+ * @param removed number of ranges removed.
+ */
+static inline void fw_ip_set_shift_starts(fw_ip_sets_t *sets, uint32_t start, uint32_t removed)
+{
+    for (uint8_t i = 0; i < FW_MAX_IP_SETS; i++) {
+        if (sets->counts[i] != 0 && sets->starts[i] > start) {
+            sets->starts[i] -= removed;
+        }
+    }
+}
+
+/**
+ * Move the ranges of a set to the end of the pool, so that prefixes can be
+ * appended to it.
+ *
+ * @param table address of IP set table handle.
+ * @param set id of set, between 1 and FW_MAX_IP_SETS.
+ */
+static inline void fw_ip_set_move_to_end(fw_ip_set_table_t *table, uint8_t set)
+{
+    fw_ip_sets_t *sets = table->sets;
+    uint32_t start = sets->starts[set - 1];
+    uint32_t count = sets->counts[set - 1];
+    uint32_t tail = sets->num_ranges - start;
+    if (count == 0 || start + count == sets->num_ranges) {
+        sets->starts[set - 1] = sets->num_ranges - count;
+        return;
+    }
+
+    /* Rotate the set's ranges past the ranges following them */
+    fw_ip_set_reverse(sets->ranges + start, count);
+    fw_ip_set_reverse(sets->ranges + start + count, tail - count);
+    fw_ip_set_reverse(sets->ranges + start, tail);
+
+    fw_ip_set_shift_starts(sets, start, count);
+    sets->starts[set - 1] = sets->num_ranges - count;
+}
+
+/**
+ * Add a prefix to a set. Must only be called on the copy of the region not in
+ * use by filters, and followed by fw_ip_set_finish once all prefixes have been
+ * added.
+ *
+ * @param table address of IP set table handle.
+ * @param set id of set, between 1 and FW_MAX_IP_SETS.
+ * @param ip ip address of prefix in network byte order.
+ * @param prefix_len length of prefix, 32 for a single address.
+ *
+ * @return error status.
+ */
+static inline fw_ip_set_err_t fw_ip_set_add(fw_ip_set_table_t *table, uint8_t set, uint32_t ip, uint8_t prefix_len)
+{
+    if (set == 0 || set > FW_MAX_IP_SETS) {
+        return IP_SET_ERR_INVALID_SET;
+    }
+
+    if (prefix_len > 32) {
+        return IP_SET_ERR_INVALID_PREFIX;
+    }
+
+    fw_ip_sets_t *sets = table->sets;
+    if (sets->num_ranges >= table->capacity) {
+        return IP_SET_ERR_FULL;
+    }
+
+    if (sets->starts[set - 1] + sets->counts[set - 1] != sets->num_ranges) {
+        fw_ip_set_move_to_end(table, set);
+    }
+
+    uint32_t mask = ntohl(subnet_mask(prefix_len));
+    fw_ip_set_range_t *range = sets->ranges + sets->num_ranges;
+    range->lo = ntohl(ip) & mask;
+    range->hi = range->lo | ~mask;
+    sets->num_ranges++;
+    sets->counts[set - 1]++;
+    sets->sizes[set - 1]++;
+    return IP_SET_ERR_OKAY;
+}
+
+/**
+ * Restore the heap order of a run of ranges below a position, ordering ranges
+ * by their first address.
+ *
+ * @param ranges address of first range.
+ * @param count number of ranges in heap.
+ * @param idx position to sift down from.
+ */
+static inline void fw_ip_set_sift_down(fw_ip_set_range_t *ranges, uint32_t count, uint32_t idx)
+{
+    fw_ip_set_range_t range = ranges[idx];
+    while (2 * idx + 1 < count) {
+        uint32_t child = 2 * idx + 1;
+        if (child + 1 < count && ranges[child + 1].lo > ranges[child].lo) {
+            child++;
+        }
+
+        if (ranges[child].lo <= range.lo) {
+            break;
+        }
+
+        ranges[idx] = ranges[child];
+        idx = child;
+    }
+    ranges[idx] = range;
+}
+
+/**
+ * Sort the ranges of a set and merge those that overlap or are adjacent, so
+ * that the set can be searched. Must be called after prefixes are added to a
+ * set, before filters are switched to the copy of the region. Sorting is done
+ * in place, as lists may hold hundreds of thousands of prefixes.
+ *
+ * @param table address of IP set table handle.
+ * @param set id of set, between 1 and FW_MAX_IP_SETS.
+ *
+ * @return error status.
+ */
+static inline fw_ip_set_err_t fw_ip_set_finish(fw_ip_set_table_t *table, uint8_t set)
+{
+    if (set == 0 || set > FW_MAX_IP_SETS) {
+        return IP_SET_ERR_INVALID_SET;
+    }
+
+    fw_ip_sets_t *sets = table->sets;
+    fw_ip_set_range_t *ranges = sets->ranges + sets->starts[set - 1];
+    uint32_t count = sets->counts[set - 1];
+    if (count == 0) {
+        return IP_SET_ERR_OKAY;
+    }
+
+    /* Heap sort by first address */
+    for (uint32_t i = count / 2; i > 0; i--) {
+        fw_ip_set_sift_down(ranges, count, i - 1);
+    }
+    for (uint32_t i = count - 1; i > 0; i--) {
+        fw_ip_set_range_t tmp = ranges[0];
+        ranges[0] = ranges[i];
+        ranges[i] = tmp;
+        fw_ip_set_sift_down(ranges, i, 0);
+    }
+
+    uint32_t merged = 0;
+    for (uint32_t i = 1; i < count; i++) {
+        if (ranges[merged].hi == UINT32_MAX || ranges[i].lo <= ranges[merged].hi + 1) {
+            if (ranges[i].hi > ranges[merged].hi) {
+                ranges[merged].hi = ranges[i].hi;
+            }
+        } else {
+            ranges[++merged] = ranges[i];
+        }
+    }
+    merged++;
+
+    /* Return the ranges freed by merging to the pool */
+    uint32_t start = sets->starts[set - 1];
+    memmove(ranges + merged, ranges + count, (sets->num_ranges - start - count) * sizeof(fw_ip_set_range_t));
+    fw_ip_set_shift_starts(sets, start, count - merged);
+    sets->num_ranges -= count - merged;
+    sets->counts[set - 1] = merged;
+    return IP_SET_ERR_OKAY;
+}
+
+/**
+ * Remove every prefix from a set. Must only be called on the copy of the
+ * region not in use by filters.
+ *
+ * @param table address of IP set table handle.
+ * @param set id of set, between 1 and FW_MAX_IP_SETS.
+ *
+ * @return error status.
+ */
+static inline fw_ip_set_err_t fw_ip_set_clear(fw_ip_set_table_t *table, uint8_t set)
+{
+    if (set == 0 || set > FW_MAX_IP_SETS) {
+        return IP_SET_ERR_INVALID_SET;
+    }
+
+    fw_ip_sets_t *sets = table->sets;
+    uint32_t start = sets->starts[set - 1];
+    uint32_t count = sets->counts[set - 1];
+    if (count != 0) {
+        memmove(sets->ranges + start, sets->ranges + start + count,
+                (sets->num_ranges - start - count) * sizeof(fw_ip_set_range_t));
+        sets->counts[set - 1] = 0;
+        fw_ip_set_shift_starts(sets, start, count);
+        sets->num_ranges -= count;
+    }
+
+    sets->starts[set - 1] = sets->num_ranges;
+    sets->sizes[set - 1] = 0;
+    return IP_SET_ERR_OKAY;
+}
+
+/**
+ * Copy the contents of one copy of the IP set region into the other. Only the
+ * part of the pool which is in use is copied.
+ *
+ * @param dst address of IP set table handle to copy to.
+ * @param src address of IP set table handle to copy from.
+ */
+static inline void fw_ip_set_copy(fw_ip_set_table_t *dst, fw_ip_set_table_t *src)
+{
+    memcpy(dst->sets, src->sets, sizeof(fw_ip_sets_t) + src->sets->num_ranges * sizeof(fw_ip_set_range_t));
+}
@@ -11,6 +11,7 @@
 #include <lions/firewall/array_functions.h>
 #include <lions/firewall/common.h>
 #include <lions/firewall/queue.h>
+#include <lions/firewall/tcp.h>
 
 /* IP of no next hop */
 #define FW_ROUTING_NONEXTHOP 0
@@ -19,6 +20,10 @@
 a route for an ip address */
 #define FW_ROUTING_MAX_RECURSION 3
 
+/* maximum number of paths, routes with the same prefix and different next hops,
+that traffic to a prefix is spread across */
+#define FW_ROUTING_MAX_PATHS 8
+
 typedef enum {
     /* no error */
     ROUTING_ERR_OKAY = 0,
@@ -48,6 +53,7 @@ typedef enum {
     ROUTER_ADD_ARG_SUBNET,
     ROUTER_ADD_ARG_NEXT_HOP,
     ROUTER_ADD_ARG_INTERFACE,
+    ROUTER_ADD_ARG_WEIGHT,
     ROUTER_ADD_NUM_ARGS,
 } fw_router_add_args_t;
 
@@ -64,15 +70,49 @@ typedef struct fw_routing_entry {
     uint8_t subnet;
     /* interface subnet traffic should be transmitted through */
     uint8_t interface;
+    /* share of flows to the subnet taking this route, relative to the weights
+    of other routes with the same subnet */
+    uint8_t weight;
     /* ip address of next hop */
     uint32_t next_hop;
 } fw_routing_entry_t;
 
+/* Longest prefix match trie of the routing table. Each level of the trie
+matches the next octet of the address, with prefixes expanded into the slots
+of the node at the level their last bit falls in. Lookups visit at most one node
+per octet, keeping the longest prefix seen. */
+#define FW_ROUTING_TRIE_STRIDE 8
+#define FW_ROUTING_TRIE_FANOUT 256
+#define FW_ROUTING_TRIE_LEVELS 4
+#define FW_ROUTING_TRIE_ROOT 0
+
+typedef struct fw_routing_trie_slot {
+    /* index + 1 of the route with the longest prefix covering the slot and
+    ending at this level, 0 if none */
+    uint16_t route;
+    /* node of the next level, 0 if none as the root is never a child */
+    uint16_t child;
+} fw_routing_trie_slot_t;
+
+typedef struct fw_routing_trie_node {
+    fw_routing_trie_slot_t slots[FW_ROUTING_TRIE_FANOUT];
+} fw_routing_trie_node_t;
+
+/* Routes with the same subnet and different next hops are the paths of a
+multipath route. The trie holds the first path, and each path links to the next
+in an array of route index + 1, stored after the trie nodes. */
 typedef struct fw_routing_table {
     /* capacity of table */
     uint16_t capacity;
     /* number of valid entries in table */
     uint16_t size;
+    /* capacity of trie node pool, stored after the routing table entries */
+    uint16_t trie_capacity;
+    /* number of trie nodes in use, including the root */
+    uint16_t trie_size;
+    /* head of the trie node free list, 0 if empty. Free nodes hold the next
+    free node in the child of their first slot */
+    uint16_t trie_free;
     /* routing table entries stored consecutively */
     fw_routing_entry_t entries[];
 } fw_routing_table_t;
@@ -90,6 +130,9 @@ typedef struct pkt_waiting_node {
     uint16_t num_children;
     /* tail node, only maintained for root node */
     uint16_t tail;
+    /* next root node in hash bucket, index + 1 or 0 if last, only maintained
+    for root node */
+    uint16_t hash_next;
     /* destination ip for this packet and child packets, only maintained for
     root node */
     uint32_t ip;
@@ -112,16 +155,26 @@ typedef struct pkts_waiting {
     uint16_t tail;
     /* head of free nodes */
     uint16_t free;
+    /* heads of root node hash buckets, index + 1 or 0 if empty */
+    uint16_t *buckets;
+    /* number of hash buckets, a power of 2 */
+    uint16_t num_buckets;
+    /* maximum number of nodes with the same destination ip */
+    uint16_t dest_capacity;
 } pkts_waiting_t;
 
 /**
- * Initialise packet waiting structure.
+ * Initialise packet waiting structure. The packets region holds the packet
+ * waiting nodes followed by capacity hash bucket heads, which index root nodes
+ * by destination ip.
  *
  * @param pkts_waiting address of packets waiting structure.
  * @param packets virtual address of packets.
  * @param capacity number of available packet waiting nodes.
+ * @param dest_capacity maximum number of packets waiting for the same
+ * destination ip, so a single unresolved destination can not exhaust the nodes.
  */
-void pkt_waiting_init(pkts_waiting_t *pkts_waiting, void *packets, int16_t capacity);
+void pkt_waiting_init(pkts_waiting_t *pkts_waiting, void *packets, int16_t capacity, uint16_t dest_capacity);
 
 /**
  * Check if the packet waiting queue is full.
@@ -159,7 +212,8 @@ pkt_waiting_node_t *pkts_waiting_next_child(pkts_waiting_t *pkts_waiting, pkt_wa
  * @param root root node.
  * @param buffer buffer holding outgoing packet to be stored in new node.
  *
- * @return error status of operation.
+ * @return error status of operation. ROUTING_ERR_FULL if there are no free
+ * nodes, or the destination already has dest_capacity packets waiting.
  */
 fw_routing_err_t pkt_waiting_push_child(pkts_waiting_t *pkts_waiting, pkt_waiting_node_t *root, fw_buff_desc_t buffer);
 
@@ -185,34 +239,90 @@ fw_routing_err_t pkt_waiting_push(pkts_waiting_t *pkts_waiting, uint32_t ip, fw_
 fw_routing_err_t pkts_waiting_free_parent(pkts_waiting_t *pkts_waiting, pkt_waiting_node_t *root);
 
 /**
- * Find next hop for destination IP. Maximum recursion limit to prevent infinite
- * looping.
+ * Hash of a packet's 5-tuple, keeping each flow on one path of multipath
+ * routes. Fragments are hashed without ports so that all fragments of a
+ * datagram take the same path.
+ *
+ * @param pkt_vaddr address of packet.
+ * @param ip_hdr address of IP header of packet.
+ *
+ * @return hash of the packet's flow.
+ */
+static inline uint32_t fw_routing_flow_hash(uintptr_t pkt_vaddr, ipv4_hdr_t *ip_hdr)
+{
+    uint16_t src_port = 0;
+    uint16_t dst_port = 0;
+    bool fragment = ip_hdr->more_frag || ip_hdr->frag_offset1 || ip_hdr->frag_offset2;
+    if (!fragment && (ip_hdr->protocol == IPV4_PROTO_TCP || ip_hdr->protocol == IPV4_PROTO_UDP)) {
+        /* TCP and UDP headers both start with the source and destination port */
+        tcp_hdr_t *tcp_hdr = (tcp_hdr_t *)(pkt_vaddr + transport_layer_offset(ip_hdr));
+        src_port = tcp_hdr->src_port;
+        dst_port = tcp_hdr->dst_port;
+    }
+
+    return fw_flow_hash(ip_hdr->src_ip ^ ip_hdr->protocol, src_port, ip_hdr->dst_ip, dst_port);
+}
+
+/**
+ * Find the route with the longest prefix matching an IP address, without
+ * resolving its next hop. For multipath routes this is the first path.
+ *
+ * @param table address of routing table.
+ * @param ip IP address to match.
+ *
+ * @return address of matching route or NULL if no match.
+ */
+fw_routing_entry_t *fw_routing_find_entry(fw_routing_table_t *table, uint32_t ip);
+
+/**
+ * Select the path of a multipath route taken by a flow. Flows are spread across
+ * paths in proportion to their weight, and always take the same path while the
+ * paths of the route are unchanged.
+ *
+ * @param table address of routing table.
+ * @param route address of first path of route.
+ * @param flow_hash hash of the flow's 5-tuple.
+ *
+ * @return address of selected path, route itself if it has a single path.
+ */
+fw_routing_entry_t *fw_routing_select_path(fw_routing_table_t *table, fw_routing_entry_t *route, uint32_t flow_hash);
+
+/**
+ * Find next hop for destination IP using the longest prefix match trie. Maximum
+ * recursion limit to prevent infinite looping.
  *
  * @param table address of routing table.
  * @param ip address of destination IP, modified to hold the IP of the next hop,
  * or FW_ROUTING_NONEXTHOP if it is unreachable.
  * @param interface address of the interface traffic should be routed out.
+ * @param flow_hash hash of the flow's 5-tuple, selects the path of multipath
+ * routes.
  *
  * @return error status of operation.
  */
-fw_routing_err_t fw_routing_find_route(fw_routing_table_t *table, uint32_t *ip, uint8_t *interface);
+fw_routing_err_t fw_routing_find_route(fw_routing_table_t *table, uint32_t *ip, uint8_t *interface,
+                                       uint32_t flow_hash);
 
 /**
- * Add a route to the routing table.
+ * Add a route to the routing table. A route for a subnet that already has a
+ * route with a different next hop is added as another path of the subnet, up
+ * to FW_ROUTING_MAX_PATHS. Subnets without a next hop have a single path.
  *
  * @param table address of routing table.
  * @param interface interface route should be routed out.
  * @param ip IP address of route.
  * @param subnet subnet bits of route.
  * @param next_hop next hop IP adress of route.
+ * @param weight share of flows to the subnet taking this route, non-zero.
  *
  * @return error status of operation.
  */
 fw_routing_err_t fw_routing_table_add_route(fw_routing_table_t *table, uint8_t interface, uint32_t ip, uint8_t subnet,
-                                            uint32_t next_hop);
+                                            uint32_t next_hop, uint8_t weight);
 
 /**
- * Remove a route from the routing table.
+ * Remove a route from the routing table. The last route in the table takes the
+ * ID of the removed route.
  *
  * @param table address of routing table.
  * @param route_id ID of route to remove.
@@ -225,10 +335,12 @@ fw_routing_err_t fw_routing_table_remove_route(fw_routing_table_t *table, uint16
  * Initialise the routing table.
  *
  * @param table address of routing table.
- * @param table_vaddr address of routing entries.
+ * @param table_vaddr address of routing entries, followed by the trie nodes and
+ * path links.
  * @param capacity capacity of routing table.
+ * @param trie_capacity capacity of trie node pool.
  * @param initial_routes address of initial route table.
  * @param num_initial_routes number of initial routes.
  */
-void fw_routing_table_init(fw_routing_table_t **table, void *table_vaddr, uint16_t capacity,
+void fw_routing_table_init(fw_routing_table_t **table, void *table_vaddr, uint16_t capacity, uint16_t trie_capacity,
                            fw_routing_entry_t *initial_routes, uint8_t num_initial_routes);
@@ -49,3 +49,24 @@ typedef struct __attribute__((__packed__)) tcp_hdr
     uint16_t urg_ptr;
     /* optional fields excluded */
 } tcp_hdr_t;
+
+/* Offset of the flags byte within the TCP header */
+#define TCP_FLAGS_OFFSET 13
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_RST 0x04
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_ACK 0x10
+
+/**
+ * Get the flags of a TCP header as a single byte.
+ *
+ * @param hdr address of TCP header.
+ *
+ * @return flags byte, a combination of TCP_FLAG_*.
+ */
+static inline uint8_t tcp_flags(tcp_hdr_t *hdr)
+{
+    return ((uint8_t *)hdr)[TCP_FLAGS_OFFSET];
+}
@@ -0,0 +1,267 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sddf/util/fence.h>
+
+/**
+ * Binary trace of packet path events. Each component owns a single producer
+ * ring of fixed size records in a memory region mapped read-only into the trace
+ * consumer. The producer never waits on the consumer: once the ring is full the
+ * oldest records are overwritten, and the consumer detects and reports the
+ * records it lost. Records are only decoded into text by the consumer, so
+ * tracing costs the producer a record copy rather than a formatted print.
+ */
+
+typedef enum {
+    FW_TRACE_FILTER = 0,
+    FW_TRACE_ROUTER,
+    FW_TRACE_ARP_REQUESTER,
+    FW_TRACE_ARP_RESPONDER,
+    FW_TRACE_NUM_COMPONENTS
+} fw_trace_component_t;
+
+static const char *const fw_trace_component_str[] = {
+    "FILTER",
+    "ROUTER",
+    "ARP REQUESTER",
+    "ARP RESPONDER",
+};
+
+typedef enum {
+    /* filter events, arg holds the action */
+    FW_TRACE_FILTER_TRANSMIT = 0,
+    FW_TRACE_FILTER_TRANSMIT_ESTABLISHED,
+    FW_TRACE_FILTER_CONNECT,
+    FW_TRACE_FILTER_CONNECT_FAILED,
+    FW_TRACE_FILTER_REJECT,
+    FW_TRACE_FILTER_DROP,
+    /* router events, arg holds the next hop where one has been resolved */
+    FW_TRACE_ROUTER_RECEIVE,
+    FW_TRACE_ROUTER_TO_WEBSERVER,
+    FW_TRACE_ROUTER_NO_ROUTE,
+    FW_TRACE_ROUTER_NEXT_HOP,
+    FW_TRACE_ROUTER_TRANSMIT,
+    FW_TRACE_ROUTER_ARP_RESPONSE,
+    FW_TRACE_ROUTER_ARP_NO_WAITING,
+    FW_TRACE_ROUTER_ICMP_FAILED,
+    FW_TRACE_ROUTER_QUEUE_FULL,
+    /* ARP events, dst ip holds the address being resolved */
+    FW_TRACE_ARP_REQUEST,
+    FW_TRACE_ARP_RESPONSE,
+    FW_TRACE_ARP_RETRY,
+    FW_TRACE_ARP_RESENT,
+    FW_TRACE_ARP_REPLY,
+    FW_TRACE_NUM_EVENTS
+} fw_trace_event_t;
+
+static const char *const fw_trace_event_str[] = {
+    "transmitting",
+    "transmitting established",
+    "establishing connection",
+    "could not establish connection",
+    "rejecting",
+    "dropping",
+    "received packet",
+    "transmitting to webserver",
+    "no route",
+    "next hop",
+    "transmitting",
+    "ARP response",
+    "ARP response with no waiting packets",
+    "could not enqueue ICMP request",
+    "waiting packet or ARP request queue full",
+    "ARP request",
+    "ARP response",
+    "ARP request retried",
+    "ARP request resent",
+    "ARP reply",
+};
+
+/* A single trace event. Addresses and ports are in network byte order */
+typedef struct fw_trace_record {
+    /* time of the producer's packet batch in nanoseconds */
+    uint64_t timestamp;
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    /* event specific argument */
+    uint32_t arg;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t rule_id;
+    uint8_t component;
+    uint8_t event;
+    uint8_t protocol;
+    uint8_t interface;
+} fw_trace_record_t;
+
+typedef struct fw_trace_ring {
+    /* total number of records ever written, written only by the producer */
+    uint64_t head;
+    fw_trace_record_t records[];
+} fw_trace_ring_t;
+
+/* Producer side handle of a trace ring */
+typedef struct fw_trace {
+    fw_trace_ring_t *ring;
+    /* capacity - 1, capacity must be a power of 2 */
+    uint64_t mask;
+    fw_trace_component_t component;
+    /* timestamp given to records, set once per batch by the producer */
+    uint64_t now;
+} fw_trace_t;
+
+/**
+ * Initialise a trace ring producer handle. A producer with no ring configured
+ * silently discards its events.
+ *
+ * @param trace address of trace handle.
+ * @param ring virtual address of trace ring, or NULL.
+ * @param capacity capacity of the trace ring, must be a power of 2.
+ * @param component component producing the trace.
+ */
+static inline void fw_trace_init(fw_trace_t *trace, void *ring, uint32_t capacity, fw_trace_component_t component)
+{
+    trace->ring = (capacity > 0) ? (fw_trace_ring_t *)ring : NULL;
+    trace->mask = (capacity > 0) ? capacity - 1 : 0;
+    trace->component = component;
+    trace->now = 0;
+}
+
+/**
+ * Check whether a trace ring has been configured for the producer.
+ *
+ * @param trace address of trace handle.
+ *
+ * @return whether events are being recorded.
+ */
+static inline bool fw_trace_enabled(fw_trace_t *trace)
+{
+    return trace->ring != NULL;
+}
+
+/**
+ * Set the timestamp of subsequent records. Sampled once per batch of work
+ * rather than per record to keep clock reads off the packet path.
+ *
+ * @param trace address of trace handle.
+ * @param now current time in nanoseconds.
+ */
+static inline void fw_trace_set_time(fw_trace_t *trace, uint64_t now)
+{
+    trace->now = now;
+}
+
+/**
+ * Append an event to the trace ring, overwriting the oldest record if the
+ * ring is full.
+ *
+ * @param trace address of trace handle.
+ * @param event event being traced.
+ * @param interface interface the event occurred on.
+ * @param protocol IP protocol of the packet, or 0.
+ * @param src_ip source ip of packet.
+ * @param src_port source port of packet.
+ * @param dst_ip destination ip of packet.
+ * @param dst_port destination port of packet.
+ * @param rule_id filter rule ID applied to the packet, or 0.
+ * @param arg event specific argument.
+ */
+static inline void fw_trace_event(fw_trace_t *trace, fw_trace_event_t event, uint8_t interface, uint8_t protocol,
+                                  uint32_t src_ip, uint16_t src_port, uint32_t dst_ip, uint16_t dst_port,
+                                  uint16_t rule_id, uint32_t arg)
+{
+    fw_trace_ring_t *ring = trace->ring;
+    if (ring == NULL) {
+        return;
+    }
+
+    uint64_t head = ring->head;
+    fw_trace_record_t *record = &ring->records[head & trace->mask];
+    record->timestamp = trace->now;
+    record->src_ip = src_ip;
+    record->dst_ip = dst_ip;
+    record->arg = arg;
+    record->src_port = src_port;
+    record->dst_port = dst_port;
+    record->rule_id = rule_id;
+    record->component = trace->component;
+    record->event = event;
+    record->protocol = protocol;
+    record->interface = interface;
+
+    /* Record must be visible before the head advances over it */
+    THREAD_MEMORY_RELEASE();
+    ring->head = head + 1;
+}
+
+/* Consumer side cursor of a trace ring */
+typedef struct fw_trace_reader {
+    fw_trace_ring_t *ring;
+    uint64_t capacity;
+    /* index of the next record to be read */
+    uint64_t tail;
+    /* records overwritten before they could be read */
+    uint64_t lost;
+} fw_trace_reader_t;
+
+/**
+ * Initialise a trace ring consumer cursor.
+ *
+ * @param reader address of reader.
+ * @param ring virtual address of trace ring.
+ * @param capacity capacity of the trace ring, must be a power of 2.
+ */
+static inline void fw_trace_reader_init(fw_trace_reader_t *reader, void *ring, uint32_t capacity)
+{
+    reader->ring = (fw_trace_ring_t *)ring;
+    reader->capacity = capacity;
+    reader->tail = 0;
+    reader->lost = 0;
+}
+
+/**
+ * Read the next record from a trace ring. Records the producer has lapped are
+ * skipped and counted as lost. A record is copied out before being checked, so
+ * one overwritten while it was being copied is discarded rather than returned
+ * torn.
+ *
+ * @param reader address of reader.
+ * @param record address the record is copied to.
+ *
+ * @return true if a record was read, false if the ring is empty.
+ */
+static inline bool fw_trace_read(fw_trace_reader_t *reader, fw_trace_record_t *record)
+{
+    while (true) {
+        uint64_t head = reader->ring->head;
+        if (reader->tail == head) {
+            return false;
+        }
+        THREAD_MEMORY_ACQUIRE();
+
+        if (head - reader->tail > reader->capacity) {
+            reader->lost += head - reader->tail - reader->capacity;
+            reader->tail = head - reader->capacity;
+        }
+
+        *record = reader->ring->records[reader->tail & (reader->capacity - 1)];
+        THREAD_MEMORY_ACQUIRE();
+
+        /* Producer may have overwritten the slot during the copy */
+        if (reader->ring->head - reader->tail > reader->capacity - 1) {
+            reader->lost++;
+            reader->tail++;
+            continue;
+        }
+
+        reader->tail++;
+        return true;
+    }
+}